@@ -13,7 +13,7 @@ class medipix(_ADBase):
     """Creates a medipix areaDetector driver"""
     _SpecificTemplate = _medipix
     def __init__(self, LABVIEW_CMD = "localhost:14000", LABVIEW_DATA = "localhost:14001", XSIZE = 256, YSIZE = 256,
-            DETECTOR_TYPE = 0, TRACING = 0x1, BUFFERS = 50, MEMORY = -1, **args):
+            DETECTOR_TYPE = 0, TRACING = 0x1, BUFFERS = 50, MEMORY = -1, DECODE_THREADS = 2, **args):
                 
         # Make an asyn IP ports to talk to lab view
         self.LABVIEW_CMD_PORT = args["PORT"] + "cmd"
@@ -36,6 +36,7 @@ class medipix(_ADBase):
         self.MEMORY = MEMORY
         self.DETECTOR_TYPE = DETECTOR_TYPE
         self.TRACING = TRACING
+        self.DECODE_THREADS = DECODE_THREADS
 
     # __init__ arguments
     ArgInfo = _ADBase.ArgInfo + _NDFile.ArgInfo + \
@@ -50,7 +51,8 @@ class medipix(_ADBase):
         BUFFERS = Simple('Maximum number of NDArray buffers to be created for '
             'plugin callbacks', int),
         MEMORY = Simple('Max memory to allocate, should be maxw*maxh*nbuffer '
-            'for driver and all attached plugins', int))
+            'for driver and all attached plugins', int),
+        DECODE_THREADS = Simple('Number of threads decoding data frames', int))
 
     # Device attributes
 #    LibFileList = ['medipixDetector', 'cbfad']
@@ -59,10 +61,10 @@ class medipix(_ADBase):
 
     def Initialise(self):
         print '# medipixDetectorConfig(portName, commandPort, dataPort, maxSizeX, ' \
-            'maxSizeY, ,detectorType maxBuffers, maxMemory)' \
+            'maxSizeY, ,detectorType maxBuffers, maxMemory, priority, stackSize, decodeThreads)' \
             'detectorType: 0 = Merlin, 1 = Medipix_XBPM, 2 = UoM_BPM, 3 = Quad Merlin'
         print 'medipixDetectorConfig("%(PORT)s", "%(LABVIEW_CMD_PORT)s", "%(LABVIEW_DATA_PORT)s", ' \
-            '%(XSIZE)d, %(YSIZE)d, %(DETECTOR_TYPE)d, %(BUFFERS)d, %(MEMORY)d)' % self.__dict__
+            '%(XSIZE)d, %(YSIZE)d, %(DETECTOR_TYPE)d, %(BUFFERS)d, %(MEMORY)d, 0, 0, %(DECODE_THREADS)d)' % self.__dict__
         
         print '# driver specific TRACING '
         print '#  0x101 = less verbose, 0x301 = most verbose, 0x01 = errors only'
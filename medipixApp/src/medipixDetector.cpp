@@ -21,6 +21,7 @@
 #include <math.h>
 #include <time.h>
 #include <stdint.h>
+#include <limits.h>
 
 // #include <epicsTime.h>
 #include <epicsThread.h>
@@ -43,29 +44,33 @@
 #define MAX(a,b) a>b ? a : b
 #define MIN(a,b) a<b ? a : b
 
-/** This thread controls acquisition, reads image files to get the image data, and
- * does the callbacks to send it to higher layers
+/** This thread receives frames from the data channel and passes them on to
+ * the decode threads.
  * It is totally decoupled from the command thread and simply waits for data
  * frames to be sent on the data channel (TCP) regardless of the state in the command
- * thread and TCP channel */
+ * thread and TCP channel
+ *
+ * Image frames are received in two parts: the frame header is read first, then
+ * the pixel payload is read directly into an NDArray from the pool so that each
+ * frame is only touched once. This thread does no other processing so that it
+ * can keep the TCP receive window drained */
 void medipixDetector::medipixTask()
 {
-    int status = asynSuccess;
-    int imageCounter;      // number of ndarrays sent to plugins
-    int numImagesCounter;  // number of images received
-    int counterDepth;
-    int imagSize;
-    NDArray * pImage;
-    epicsTimeStamp startTime;
+    asynStatus status = asynSuccess;
     const char *functionName = "medipixTask";
-    size_t dims[2], dummy;
+    mpxFrame *pFrame;
     int arrayCallbacks;
-    int dummy2;
-    int nread;
-    char *bigBuff;
-    char aquisitionHeader[MPX_ACQUISITION_HEADER_LEN + 1];
-    int triggerMode;
-    NDAttributeList *imageAttr = new NDAttributeList();
+    int payloadSize;
+    char *pRaw;
+    bool rawOnly;
+    int stackFrames;
+    int stackDepth;
+    int sumFrames;
+    int flatMode;
+    int projections;
+    int fitMethod;
+    epicsUInt32 sequence = 0;
+    uint64_t stageStart, stageEnd;
 
     // do not enter this thread until the IOC is initialised. This is because we are getting blocks of
     // data on the data channel at startup after we have had a buffer overrun
@@ -74,330 +79,1518 @@ void medipixDetector::medipixTask()
         epicsThreadSleep(.5);
     }
 
-    this->lock();
+    /* Loop forever */
+    while (1)
+    {
+        // get a free frame - this only blocks if the decode or publish
+        // threads have fallen MPX_PIPELINE_DEPTH frames behind
+        epicsMessageQueueReceive(this->freeQueue, &pFrame, sizeof(pFrame));
+        pFrame->pImage = NULL;
+        pFrame->pPixels = NULL;
+        pFrame->stackPlane = -1;
+        pFrame->pSum = NULL;
+        pFrame->sumLast = false;
+        pFrame->pFlatGain = NULL;
+        pFrame->flatCollect = false;
+        pFrame->pBadPixels = NULL;
+        pFrame->pGeometry = NULL;
+        pFrame->pRemapped = NULL;
+        pFrame->projectImage = false;
+        pFrame->projectionDims[0] = 0;
+        pFrame->projectionDims[1] = 0;
+        pFrame->fit[0].valid = false;
+        pFrame->fit[1].valid = false;
+        pFrame->pBody = NULL;
+        pFrame->pAcquisition = NULL;
+        pFrame->pAttr->clear();
+        pFrame->attributeNs = 0;
+
+        // wait for the next data frame header - this function spends most of its time here
+        stageStart = mpxLatencyNow();
+        status = readFrameHeader(pFrame->frameHeader, &pFrame->header,
+                &pFrame->headerSize, &pFrame->bodySize);
 
-    // allocate a buffer for reading in images from labview over network
-    switch (detType)
+        // Get the current time
+        epicsTimeGetCurrent(&pFrame->startTime);
+        pFrame->receivedNs = mpxLatencyNow();
+
+        /* If there was an error go round again */
+        if (status)
+        {
+            epicsMessageQueueSend(this->freeQueue, &pFrame, sizeof(pFrame));
+            if (status != asynTimeout)   // timeouts are expected
+            {
+                asynPrint(this->pasynLabViewData, ASYN_TRACE_ERROR,
+                        "%s:%s: error in Labview data channel response, status=%d\n",
+                        driverName, functionName, status);
+                this->lock();
+                setStringParam(ADStatusMessage,
+                        "Error in Labview data channel response");
+                callParamCallbacks();
+                this->unlock();
+                // wait before trying again - otherwise socket error creates a tight loop
+                epicsThreadSleep(5);
+            }
+            continue;
+        }
+
+        latency[mpxStageSocketWait].record(pFrame->receivedNs - stageStart);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
+                "\nReceived frame of %d bytes\n", pFrame->bodySize);
+
+        // parse the data header now, the geometry is needed to allocate the
+        // NDArray and the decode threads use the rest
+        if (pFrame->header != MPXAcquisitionHeader
+                && pFrame->header != MPXUnknownHeader)
+        {
+            stageStart = mpxLatencyNow();
+            dataConnection->parseDataFrame(&pFrame->fields,
+                    pFrame->frameHeader, pFrame->headerSize, pFrame->header);
+            latency[mpxStageHeaderParse].record(mpxLatencyNow() - stageStart);
+        }
+
+        payloadSize = pFrame->bodySize - pFrame->headerSize;
+
+        this->lock();
+        getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+        pFrame->arrayCallbacks = arrayCallbacks;
+        getIntegerParam(medipixProfileFit, &fitMethod);
+        pFrame->fitMethod = (mpxFitMethod) fitMethod;
+        getDoubleParam(medipixProfileFitThreshold, &pFrame->fitThreshold);
+        pFrame->pDecoders = pImageDecoders;
+
+        // for image frames get an NDArray of the size and type described
+        // by the header from the pool, or a plane of the stacked NDArray of
+        // the exposure, unless the frame only goes to the raw file
+        getIntegerParam(medipixStackFrames, &stackFrames);
+        getIntegerParam(medipixSumFrames, &sumFrames);
+        stackDepth = stackFrames ? framesPerAcquire : 1;
+        if (pStackImage != NULL
+                && (int) pStackImage->dims[2].size != stackDepth)
+            finishStack();
+        rawOnly = isRawOnly(pFrame->header, stackDepth);
+        if (arrayCallbacks && !rawOnly && isImageHeader(pFrame->header))
+        {
+            pFrame->pixelBytes = mpxHeaderPixelSize(&pFrame->fields) / 8;
+            flatMode = flatFieldMode(pFrame, stackDepth > 1 || sumFrames > 1);
+            if (stackDepth > 1)
+                allocateStackPlane(pFrame, stackDepth);
+            else
+                pFrame->pImage = allocateImage(&pFrame->fields, 1,
+                        flatMode == MPXFlatFieldFloat32);
+            if (pFrame->pImage != NULL && pFrame->pPixels == NULL)
+                pFrame->pPixels = pFrame->pImage->pData;
+            if (pFrame->pImage != NULL)
+                attachBadPixels(pFrame);
+            getIntegerParam(medipixProjections, &projections);
+            pFrame->projectImage = pFrame->pImage != NULL && projections;
+            if (pFrame->pImage != NULL && stackDepth == 1 && sumFrames > 1)
+                attachSum(pFrame, sumFrames);
+            if (pFrame->pImage != NULL && flatMode != MPXFlatFieldOff)
+            {
+                pFlatGain->reserve();
+                pFrame->pFlatGain = pFlatGain;
+            }
+
+            // flat field frames are collected uncorrected
+            if (pFrame->pImage != NULL && flatFramesToTake > 0
+                    && stackDepth == 1)
+            {
+                pFrame->flatCollect = true;
+                flatFramesToTake--;
+            }
+
+            // single frames are published in the true geometry, stacks,
+            // sums and the flat field stay in the layout of the chips
+            if (pFrame->pImage != NULL && stackDepth == 1 && sumFrames <= 1
+                    && !pFrame->flatCollect)
+                attachGeometry(pFrame);
+        }
+        if (pSumImage != NULL && (sumFrames <= 1 || stackDepth > 1))
+            finishSum();
+        this->unlock();
+
+        // while a raw file is open every frame is written to it
+        pRaw = rawWriter.reserve(pFrame->bodySize);
+
+        // read in the body of the frame - image pixels go straight into the
+        // NDArray, any other frame is read into a buffer of its own
+        stageStart = mpxLatencyNow();
+        if (pFrame->pImage != NULL)
+        {
+            status = readImagePayload(pFrame, payloadSize);
+        }
+        else if ((arrayCallbacks || pFrame->header == MPXAcquisitionHeader)
+                && !isImageHeader(pFrame->header)
+                && pFrame->bodySize < maxBodySize
+                && reserveBody(pFrame))
+        {
+            memcpy(pFrame->pBody, pFrame->frameHeader, pFrame->headerSize);
+            status = dataConnection->mpxReadBody(this->pasynLabViewData,
+                    pFrame->pBody + pFrame->headerSize, payloadSize,
+                    Labview_DEFAULT_TIMEOUT);
+            pFrame->pBody[pFrame->bodySize] = 0;
+        }
+        else if (pRaw != NULL)
+        {
+            // nothing else wants the frame - receive it straight into the file
+            memcpy(pRaw, pFrame->frameHeader, pFrame->headerSize);
+            status = dataConnection->mpxReadBody(this->pasynLabViewData,
+                    pRaw + pFrame->headerSize, payloadSize,
+                    Labview_DEFAULT_TIMEOUT);
+        }
+        else
+        {
+            if (arrayCallbacks && pFrame->bodySize >= maxBodySize)
+            {
+                asynPrint(this->pasynLabViewData, ASYN_TRACE_ERROR,
+                        "%s:%s: frame of %d bytes too large for buffer, discarded\n",
+                        driverName, functionName, pFrame->bodySize);
+                pFrame->header = MPXUnknownHeader;
+            }
+            status = dataConnection->mpxDiscardBody(this->pasynLabViewData,
+                    payloadSize, Labview_DEFAULT_TIMEOUT);
+        }
+
+        if (pRaw != NULL)
+        {
+            if (status != asynSuccess)
+                rawWriter.cancel();
+            else
+                commitRawFrame(pFrame, pRaw, payloadSize);
+        }
+
+        if (status != asynSuccess)
+        {
+            asynPrint(this->pasynLabViewData, ASYN_TRACE_ERROR,
+                    "%s:%s: error reading Labview data frame body, status=%d\n",
+                    driverName, functionName, status);
+            this->lock();
+            setStringParam(ADStatusMessage,
+                    "Error in Labview data channel response");
+            callParamCallbacks();
+            this->unlock();
+            releaseFrame(pFrame);
+            continue;
+        }
+        stageEnd = mpxLatencyNow();
+        if (pFrame->pImage != NULL || pFrame->pBody != NULL)
+            latency[mpxStagePixelCopy].record(stageEnd - stageStart);
+
+        if (pasynTrace->getTraceMask((pasynUserSelf))
+                & (ASYN_TRACE_MPX_VERBOSE))
+        {
+            if (pFrame->pImage != NULL)
+                dataConnection->dumpData((char*) pFrame->pPixels,
+                        payloadSize < frameImageBytes(pFrame) ?
+                                payloadSize : frameImageBytes(pFrame));
+            else if (pFrame->pBody != NULL)
+                dataConnection->dumpData(pFrame->pBody, pFrame->bodySize);
+        }
+
+        // an acquisition header starts a new acquisition context, every
+        // frame holds a reference to the context it belongs to
+        if (pFrame->header == MPXAcquisitionHeader && pFrame->pBody != NULL)
+        {
+            if (pAcquisition != NULL)
+                pAcquisition->release();
+            pAcquisition = new mpxAcquisition(++acquisitionCount,
+                    pFrame->pBody, pFrame->bodySize);
+        }
+        if (pAcquisition != NULL)
+        {
+            pAcquisition->reserve();
+            pFrame->pAcquisition = pAcquisition;
+        }
+
+        // hand the frame on to the decode threads
+        pFrame->sequence = sequence++;
+        epicsMessageQueueSend(this->decodeQueue, &pFrame, sizeof(pFrame));
+    }
+}
+
+/** The decode threads take received frames, parse their headers into
+ * NDAttributes and convert the pixel data. A number of these run in parallel
+ * and so frames may complete in any order.
+ */
+void medipixDetector::medipixDecodeTask()
+{
+    mpxFrame *pFrame;
+
+    while (1)
     {
-    case UomXBPM:
-        imagSize = MAX_BUFF_UOM;
+        epicsMessageQueueReceive(this->decodeQueue, &pFrame, sizeof(pFrame));
+        decodeFrame(pFrame);
+        epicsMessageQueueSend(this->publishQueue, &pFrame, sizeof(pFrame));
+    }
+}
+
+/** Parse the header and convert the data of a single frame
+ * Called without the driver lock held.
+ */
+void medipixDetector::decodeFrame(mpxFrame *pFrame)
+{
+    const char *functionName = "decodeFrame";
+    size_t dims[2];
+    int profileMask = 0;
+
+    if (!pFrame->arrayCallbacks)
+        return;
+
+    switch (pFrame->header)
+    {
+    case MPXDataHeader12:
+    case MPXDataHeader24:
+    case MPXGenericImageHeader:
+        if (pFrame->pImage == NULL)
+            break;
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
+                "Decoding an Image NDArray\n");
+        addHeaderAttributes(pFrame);
+        decodeImage(pFrame);
         break;
-    case Merlin:
-    case MedipixXBPM: imagSize = MPX_IMG_FRAME_LEN24;
+
+    case MPXQuadDataHeader:
+        if (pFrame->pImage == NULL)
+            break;
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
+                "Decoding a Quad Merlin Image NDArray\n");
+        addHeaderAttributes(pFrame);
+        decodeImage(pFrame);
         break;
-    case MerlinQuad:
-        imagSize = MAX_BUFF_MERLIN_QUAD;
+
+    case MPXProfileHeader12:
+    case MPXProfileHeader24:
+    case MPXGenericProfileHeader:
+        if (pFrame->pBody == NULL)
+            break;
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
+                "Creating a Profile NDArray\n");
+
+        dims[0] = maxSize[0];
+        dims[1] = maxSize[1];
+        if (pFrame->header == MPXGenericProfileHeader)
+        {
+            if (MPXHDR_PRESENT(&pFrame->fields, MPXHDR_X_SIZE))
+                dims[0] = pFrame->fields.xSize;
+            if (MPXHDR_PRESENT(&pFrame->fields, MPXHDR_Y_SIZE))
+                dims[1] = pFrame->fields.ySize;
+        }
+        profileMask = pFrame->fields.profileMask;
+        addHeaderAttributes(pFrame);
+
+        if (profileMask
+                != (MPXPROFILES_XPROFILE | MPXPROFILES_YPROFILE
+                        | MPXPROFILES_SUM))
+        {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: unsupported PROFILES mode %d\n", driverName,
+                    functionName, profileMask);
+        }
+        else
+        {
+            uint64_t stageStart = mpxLatencyNow();
+
+            pFrame->profileDims[0] = dims[0];
+            pFrame->profileDims[1] = dims[1];
+            pFrame->pImage = copyProfileToNDArray32(dims, pFrame->pBody,
+                    pFrame->pDecoders);
+
+            // the beam position is found here so that it is ready for the
+            // publish thread and the NDArray carries it
+            if (pFrame->pImage != NULL && pFrame->fitMethod != mpxFitOff)
+            {
+                const epicsUInt32 *pData =
+                        (const epicsUInt32 *) pFrame->pImage->pData;
+
+                mpxFitProfile(pData, dims[0], pFrame->fitMethod,
+                        pFrame->fitThreshold, &pFrame->fit[0]);
+                mpxFitProfile(pData + dims[0], dims[1], pFrame->fitMethod,
+                        pFrame->fitThreshold, &pFrame->fit[1]);
+                addFitAttributes(pFrame);
+            }
+            latency[mpxStageDecode].record(mpxLatencyNow() - stageStart);
+        }
         break;
+
     default:
-        imagSize = MAX_BUFF_UOM;
         break;
     }
+}
+
+/** The publish thread takes decoded frames, puts them back into the order in
+ * which they were received and passes them on to the plugins.
+ */
+void medipixDetector::medipixPublishTask()
+{
+    mpxFrame *pFrame;
+    mpxFrame *pending[MPX_PIPELINE_DEPTH];
+    epicsUInt32 nextSequence = 0;
+    int i;
+
+    for (i = 0; i < MPX_PIPELINE_DEPTH; i++)
+        pending[i] = NULL;
+
+    while (1)
+    {
+        epicsMessageQueueReceive(this->publishQueue, &pFrame, sizeof(pFrame));
+
+        // there can be no more than MPX_PIPELINE_DEPTH frames in flight so
+        // the sequence number gives a unique slot in the reorder buffer
+        pending[pFrame->sequence % MPX_PIPELINE_DEPTH] = pFrame;
+
+        // publish every frame that is now in order
+        while ((pFrame = pending[nextSequence % MPX_PIPELINE_DEPTH]) != NULL
+                && pFrame->sequence == nextSequence)
+        {
+            pending[nextSequence % MPX_PIPELINE_DEPTH] = NULL;
+            nextSequence++;
+
+            this->lock();
+            publishFrame(pFrame);
+            this->unlock();
+
+            releaseFrame(pFrame);
+        }
+    }
+}
+
+/** Update the counters for a decoded frame and do the NDArray callbacks.
+ * The frames of a stacked or summed NDArray are collected until the last
+ * one arrives, a frame of another NDArray shows that the rest were lost or
+ * the acquisition completes.
+ * Called with the driver lock held.
+ */
+void medipixDetector::publishFrame(mpxFrame *pFrame)
+{
+    int imageCounter;      // number of ndarrays sent to plugins
+    int numImagesCounter;  // number of images received
+    int triggerMode;
+    NDArray *pImage = pFrame->pSum != NULL ? pFrame->pSum : pFrame->pImage;
+    medipixDataHeader header = pFrame->header;
+    bool collected = pFrame->pSum != NULL || pFrame->stackPlane >= 0;
+    bool newArray = pImage == NULL || pImage != pPendingArray;
+    uint64_t stageStart;
+
+    // an incomplete NDArray is passed on when an image of another NDArray
+    // arrives, by then the receive thread has stopped filling it
+    if (pPendingArray != NULL && pImage != NULL && newArray
+            && isImageHeader(header))
+        publishPending();
+
+    if (pFrame->flatCollect)
+        addFlatFieldFrame(pFrame);
+
+    // every image has its projections published, even the frames of a
+    // stack or sum
+    if (pFrame->projectionDims[0] > 0)
+        publishProjections(pFrame);
+
+    if (header != MPXAcquisitionHeader)
+    {
+        checkFrameNumber(pFrame);
+
+        getIntegerParam(ADNumImagesCounter, &numImagesCounter);
+        numImagesCounter++;
+        setIntegerParam(ADNumImagesCounter, numImagesCounter);
+        if (imagesRemaining > 0)
+            imagesRemaining--;
+
+        if (newArray)
+        {
+            getIntegerParam(NDArrayCounter, &imageCounter);
+            imageCounter++;
+            setIntegerParam(NDArrayCounter, imageCounter);
+        }
+    }
+
+    if (header == MPXAcquisitionHeader && pFrame->pAcquisition != NULL)
+    {
+        // this is an acquisition header
+        setIntegerParam(medipixAcquisitionId, pFrame->pAcquisition->getId());
+    }
+    else if (header == MPXUnknownHeader)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "Unknown header type %d\n", header);
+    }
+
+    // for Data frames - complete the NDAttributes, pass the NDArray on. A
+    // stacked NDArray takes the attributes of the first of its frames
+    if (pImage != NULL && newArray)
+    {
+        stageStart = mpxLatencyNow();
+        pFrame->pAttr->copy(pImage->pAttributeList);
+
+        // the number of frames lost since the previous NDArray
+        pImage->pAttributeList->add("Missing Frames", "", NDAttrInt32,
+                &missingFrames);
+        missingFrames = 0;
+
+        // Put the frame number and time stamp into the buffer
+        getIntegerParam(NDArrayCounter, &imageCounter);
+        pImage->uniqueId = imageCounter;
+        pImage->timeStamp = pFrame->startTime.secPastEpoch
+                + pFrame->startTime.nsec / 1.e9;
+
+        // the full acquisition header is attached to the first frame of each
+        // acquisition (string attributes are global in the HDF5 plugin) or
+        // to every frame if requested. All frames carry the acquisition ID
+        if (pFrame->pAcquisition != NULL)
+        {
+            int acquisitionId = pFrame->pAcquisition->getId();
+            int headerMode;
+
+            getIntegerParam(medipixAcqHeaderMode, &headerMode);
+            pImage->pAttributeList->add("Acquisition ID", "", NDAttrInt32,
+                    &acquisitionId);
+            if (acquisitionId != publishedAcquisitionId
+                    || headerMode == MPXAcqHeaderEveryFrame)
+                pFrame->pAcquisition->addAttributes(pImage->pAttributeList);
+            publishedAcquisitionId = acquisitionId;
+        }
+
+        /* Get any attributes that have been defined for this driver */
+        this->getAttributes(pImage->pAttributeList);
+        latency[mpxStageAttributes].record(
+                pFrame->attributeNs + mpxLatencyNow() - stageStart);
+
+        if (header == MPXProfileHeader12 || header == MPXProfileHeader24
+                || header == MPXGenericProfileHeader)
+        {
+            publishProfiles(pFrame);
+        }
+
+        if (collected)
+        {
+            pImage->reserve();
+            pPendingArray = pImage;
+            pendingSum = pFrame->pSum != NULL;
+            pendingFrames = 0;
+        }
+    }
+
+    if (pImage != NULL && !collected)
+    {
+        doArrayCallbacks(pImage, pFrame->receivedNs);
+    }
+    else if (pImage != NULL)
+    {
+        pendingNs = pFrame->receivedNs;
+        pendingFrames++;
+        if (pFrame->pSum != NULL ? pFrame->sumLast
+                : pFrame->stackPlane == (int) pImage->dims[2].size - 1)
+            publishPending();
+    }
+
+    // If we are using SW triggers then reset the trigger to 0 when an image is
+    // received
+    getIntegerParam(ADTriggerMode, &triggerMode);
+    if (triggerMode == TMSoftwareTrigger)
+    {
+        // software trigger resets  when image received
+        setIntegerParam(medipixSoftwareTrigger, 0);
+    }
+
+    // If all the expected images have been received then the driver can
+    // complete the acquisition and return to waiting for acquisition state
+    if (imagesRemaining == 0)
+    {
+        setIntegerParam(ADAcquire, 0);
+        setIntegerParam(ADStatus, ADStatusIdle);
+
+        // pass on a partial sum or stack at the end of the acquisition
+        if (pPendingArray != NULL)
+        {
+            if (pPendingArray == pSumImage)
+                finishSum();
+            if (pPendingArray == pStackImage)
+                finishStack();
+            publishPending();
+        }
+    }
+
+    /* Call the callbacks to update any changes */
+    callParamCallbacks();
+}
+
+/** Passes an NDArray on to the plugins.
+ * Called with the driver lock held, which is released during the callbacks.
+ */
+void medipixDetector::doArrayCallbacks(NDArray *pImage, uint64_t receivedNs)
+{
+    uint64_t stageStart, stageEnd;
+
+    // Call the NDArray callback
+    // Must release the lock here, to avoid a deadlock: we can
+    // block on the plugin lock, and the plugin can be calling us
+    this->unlock();
+    // address 1 on the port is intended for profiles
+    // TODO use of port 1 is not working in NDPluginBase so
+    // currently reverting to use the same address
+    // (i.e. setting Medipix1:ROI:NDArrayAddress has no effect
+    stageStart = mpxLatencyNow();
+    doCallbacksGenericPointer(pImage, NDArrayData, 0);
+    stageEnd = mpxLatencyNow();
+    latency[mpxStageCallback].record(stageEnd - stageStart);
+    latency[mpxStageTotal].record(stageEnd - receivedNs);
+    this->lock();
+}
+
+/** Passes the stacked or summed NDArray that is being collected on to the
+ * plugins and drops the reference the publish thread holds on it.
+ * Called with the driver lock held.
+ */
+void medipixDetector::publishPending()
+{
+    NDArray *pImage = pPendingArray;
+
+    // sums carry the number of frames in them
+    if (pendingSum)
+        pImage->pAttributeList->add("Frames Summed", "", NDAttrInt32,
+                &pendingFrames);
+    pPendingArray = NULL;
+    doArrayCallbacks(pImage, pendingNs);
+    pImage->release();
+}
+
+/** Checks the frame number in the header of a data frame against the one
+ * expected, the first frame of each acquisition sets the expectation. Gaps,
+ * repeats of the previous frame and frames older than that are counted and
+ * the frames lost are attached to the next NDArray.
+ * Called with the driver lock held.
+ */
+void medipixDetector::checkFrameNumber(mpxFrame *pFrame)
+{
+    int frameNumber = pFrame->fields.frameNumber;
+    int acquisitionId = 0;
+    int count;
+
+    if (!MPXHDR_PRESENT(&pFrame->fields, MPXHDR_FRAME_NUMBER))
+        return;
+
+    if (pFrame->pAcquisition != NULL)
+        acquisitionId = pFrame->pAcquisition->getId();
+    if (acquisitionId != frameNumberAcquisitionId)
+    {
+        frameNumberAcquisitionId = acquisitionId;
+        expectedFrameNumber = -1;
+    }
+
+    if (expectedFrameNumber < 0 || frameNumber == expectedFrameNumber)
+    {
+        expectedFrameNumber = frameNumber + 1;
+    }
+    else if (frameNumber > expectedFrameNumber)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: frames %d to %d are missing\n", driverName,
+                "checkFrameNumber", expectedFrameNumber, frameNumber - 1);
+        missingFrames += frameNumber - expectedFrameNumber;
+        getIntegerParam(medipixFramesMissing, &count);
+        setIntegerParam(medipixFramesMissing,
+                count + frameNumber - expectedFrameNumber);
+        expectedFrameNumber = frameNumber + 1;
+    }
+    else if (frameNumber == expectedFrameNumber - 1)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: frame %d repeated\n", driverName, "checkFrameNumber",
+                frameNumber);
+        getIntegerParam(medipixFramesDuplicate, &count);
+        setIntegerParam(medipixFramesDuplicate, count + 1);
+    }
+    else
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: frame %d arrived after frame %d\n", driverName,
+                "checkFrameNumber", frameNumber, expectedFrameNumber - 1);
+        getIntegerParam(medipixFramesOutOfOrder, &count);
+        setIntegerParam(medipixFramesOutOfOrder, count + 1);
+    }
+}
+
+/** Copy the X and Y profiles out of a profile NDArray into the profile
+ * waveforms
+ * Called with the driver lock held.
+ */
+void medipixDetector::publishProfiles(mpxFrame *pFrame)
+{
+    epicsUInt32 *pData = (epicsUInt32 *) pFrame->pImage->pData;
+    size_t xsize = MIN(pFrame->profileDims[0], maxSize[0]);
+    size_t ysize = MIN(pFrame->profileDims[1], maxSize[1]);
+
+    memcpy(profileX, pData, xsize * sizeof(epicsUInt32));
+    memcpy(profileY, pData + pFrame->profileDims[0],
+            ysize * sizeof(epicsUInt32));
+    if (pFrame->fitMethod != mpxFitOff)
+        publishFit(pFrame);
+
+    doCallbacksInt32Array(profileY, ysize, medipixProfileY, 0);
+    doCallbacksInt32Array(profileX, xsize, medipixProfileX, 0);
+}
+
+/** Computes the X and Y projections, total counts and centroid of a decoded
+ * image in a single pass, while its pixels are still in the cache.
+ * Called by the decode threads without the driver lock.
+ */
+void medipixDetector::projectImage(mpxFrame *pFrame)
+{
+    NDArray *pImage = pFrame->pImage;
+    size_t xsize = pImage->dims[0].size;
+    size_t ysize = pImage->dims[1].size;
+    bool isFloat = pImage->dataType == NDFloat32;
+    mpxProjector project = mpxGetProjector(isFloat ? 4 : pFrame->pixelBytes,
+            isFloat);
+    epicsFloat64 *pX, *pY;
+    epicsFloat64 total = 0, sumX = 0, sumY = 0;
+    size_t i;
+
+    if (project == NULL)
+        return;
+
+    // the buffer stays with the frame and grows to the largest image
+    if (pFrame->projectionSize < xsize + ysize)
+    {
+        free(pFrame->pProjection);
+        pFrame->pProjection = (epicsFloat64*) malloc(
+                (xsize + ysize) * sizeof(epicsFloat64));
+        pFrame->projectionSize = xsize + ysize;
+    }
+    pX = pFrame->pProjection;
+    pY = pFrame->pProjection + xsize;
+    project(pFrame->pPixels, xsize, ysize, pX, pY);
+
+    for (i = 0; i < xsize; i++)
+    {
+        total += pX[i];
+        sumX += i * pX[i];
+    }
+    for (i = 0; i < ysize; i++)
+        sumY += i * pY[i];
+
+    pFrame->projectionDims[0] = xsize;
+    pFrame->projectionDims[1] = ysize;
+    pFrame->projectionTotal = total;
+    pFrame->centroid[0] = total > 0 ? sumX / total : 0;
+    pFrame->centroid[1] = total > 0 ? sumY / total : 0;
+
+    if (pFrame->fitMethod != mpxFitOff)
+    {
+        mpxFitProfile(pX, xsize, pFrame->fitMethod, pFrame->fitThreshold,
+                &pFrame->fit[0]);
+        mpxFitProfile(pY, ysize, pFrame->fitMethod, pFrame->fitThreshold,
+                &pFrame->fit[1]);
+        addFitAttributes(pFrame);
+    }
+}
+
+/** Adds the beam position fitted to the profiles of a frame to its
+ * attributes. They are added whether or not the fit worked so that every
+ * NDArray has the same attributes.
+ * Called by the decode threads without the driver lock.
+ */
+void medipixDetector::addFitAttributes(mpxFrame *pFrame)
+{
+    int valid = pFrame->fit[0].valid && pFrame->fit[1].valid;
+
+    pFrame->pAttr->add("Fit Valid", "", NDAttrInt32, &valid);
+    pFrame->pAttr->add("Fit X Position", "", NDAttrFloat64,
+            &pFrame->fit[0].position);
+    pFrame->pAttr->add("Fit X Width", "", NDAttrFloat64,
+            &pFrame->fit[0].width);
+    pFrame->pAttr->add("Fit X Intensity", "", NDAttrFloat64,
+            &pFrame->fit[0].intensity);
+    pFrame->pAttr->add("Fit Y Position", "", NDAttrFloat64,
+            &pFrame->fit[1].position);
+    pFrame->pAttr->add("Fit Y Width", "", NDAttrFloat64,
+            &pFrame->fit[1].width);
+    pFrame->pAttr->add("Fit Y Intensity", "", NDAttrFloat64,
+            &pFrame->fit[1].intensity);
+}
+
+/** Updates the fitted beam position parameters, they keep their last good
+ * values while FIT_VALID is 0.
+ * Called with the driver lock held.
+ */
+void medipixDetector::publishFit(mpxFrame *pFrame)
+{
+    int valid = pFrame->fit[0].valid && pFrame->fit[1].valid;
+    int spectrum, every;
+    double x, y;
+
+    setIntegerParam(medipixFitValid, valid);
+    if (pFrame->fit[0].valid)
+    {
+        setDoubleParam(medipixFitXPosition, pFrame->fit[0].position);
+        setDoubleParam(medipixFitXWidth, pFrame->fit[0].width);
+        setDoubleParam(medipixFitXIntensity, pFrame->fit[0].intensity);
+    }
+    if (pFrame->fit[1].valid)
+    {
+        setDoubleParam(medipixFitYPosition, pFrame->fit[1].position);
+        setDoubleParam(medipixFitYWidth, pFrame->fit[1].width);
+        setDoubleParam(medipixFitYIntensity, pFrame->fit[1].intensity);
+    }
+
+    // a frame without a fit repeats the last position so that the history
+    // stays evenly sampled
+    getIntegerParam(medipixSpectrum, &spectrum);
+    if (spectrum)
+    {
+        getDoubleParam(medipixFitXPosition, &x);
+        getDoubleParam(medipixFitYPosition, &y);
+        positionHistory.add(x, y, pFrame->receivedNs);
+        getIntegerParam(medipixSpectrumEvery, &every);
+        if (every > 0 && positionHistory.getTotal() % every == 0)
+            epicsEventSignal(spectrumEvent);
+    }
+}
+
+/** Copy the projections of an image into the profile waveforms and update
+ * the total counts and centroid.
+ * Called with the driver lock held.
+ */
+void medipixDetector::publishProjections(mpxFrame *pFrame)
+{
+    const epicsFloat64 *pX = pFrame->pProjection;
+    const epicsFloat64 *pY = pFrame->pProjection + pFrame->projectionDims[0];
+    size_t xsize = MIN(pFrame->projectionDims[0], maxSize[0]);
+    size_t ysize = MIN(pFrame->projectionDims[1], maxSize[1]);
+    size_t i;
+
+    // the waveforms are Int32 so large sums are clipped
+    for (i = 0; i < xsize; i++)
+        profileX[i] = pX[i] < INT_MAX ? (int) pX[i] : INT_MAX;
+    for (i = 0; i < ysize; i++)
+        profileY[i] = pY[i] < INT_MAX ? (int) pY[i] : INT_MAX;
+
+    setDoubleParam(medipixTotalCounts, pFrame->projectionTotal);
+    setDoubleParam(medipixCentroidX, pFrame->centroid[0]);
+    setDoubleParam(medipixCentroidY, pFrame->centroid[1]);
+    if (pFrame->fitMethod != mpxFitOff)
+        publishFit(pFrame);
+    doCallbacksInt32Array(profileY, ysize, medipixProfileY, 0);
+    doCallbacksInt32Array(profileX, xsize, medipixProfileX, 0);
+}
+
+/** Return a frame and any buffers it holds to the free list
+ */
+void medipixDetector::releaseFrame(mpxFrame *pFrame)
+{
+    if (pFrame->pImage != NULL)
+        pFrame->pImage->release();
+    pFrame->pImage = NULL;
+    if (pFrame->pSum != NULL)
+        pFrame->pSum->release();
+    pFrame->pSum = NULL;
+    if (pFrame->pFlatGain != NULL)
+        pFrame->pFlatGain->release();
+    pFrame->pFlatGain = NULL;
+    if (pFrame->pBadPixels != NULL)
+        pFrame->pBadPixels->release();
+    pFrame->pBadPixels = NULL;
+    if (pFrame->pRemapped != NULL)
+        pFrame->pRemapped->release();
+    pFrame->pRemapped = NULL;
+    if (pFrame->pGeometry != NULL)
+        pFrame->pGeometry->release();
+    pFrame->pGeometry = NULL;
+    pFrame->pBody = NULL;
+    if (pFrame->pAcquisition != NULL)
+        pFrame->pAcquisition->release();
+    pFrame->pAcquisition = NULL;
+    epicsMessageQueueSend(this->freeQueue, &pFrame, sizeof(pFrame));
+}
+
+/** Returns true for frames whose pixel payload is read into an NDArray */
+bool medipixDetector::isImageHeader(medipixDataHeader header)
+{
+    return header == MPXDataHeader12 || header == MPXDataHeader24
+            || header == MPXGenericImageHeader || header == MPXQuadDataHeader;
+}
+
+/** Reads the MPX header and the data header of the next frame on the data
+ * channel into frameHeader. On return headerSize holds the number of bytes of
+ * the frame body that have been read (i.e. the offset of the pixel data) and
+ * bodySize holds the total size of the frame body.
+ * Called without the driver lock held.
+ */
+asynStatus medipixDetector::readFrameHeader(char *frameHeader,
+        medipixDataHeader *header, int *headerSize, int *bodySize)
+{
+    asynStatus status;
+    const char *functionName = "readFrameHeader";
+    int mqHeaderSize;
+
+    *headerSize = 0;
+    status = dataConnection->mpxReadHeader(this->pasynLabViewData, bodySize,
+            10);
+    if (status != asynSuccess)
+        return status;
+
+    // read the frame type and the fixed size part of the data header
+    *headerSize = MIN(*bodySize, MPX_IMG_HDR_LEN);
+    status = dataConnection->mpxReadBody(this->pasynLabViewData, frameHeader,
+            *headerSize, Labview_DEFAULT_TIMEOUT);
+    if (status != asynSuccess)
+        return status;
+    frameHeader[*headerSize] = 0;
+
+    *header = dataConnection->parseDataHeader(frameHeader);
+
+    // Quad Merlin headers are variable length - read in the remainder
+    if (*header == MPXQuadDataHeader)
+    {
+        mqHeaderSize = dataConnection->parseMqHeaderLength(frameHeader);
+        if (mqHeaderSize < *headerSize || mqHeaderSize > MPX_MAX_DATA_HDR_LEN
+                || mqHeaderSize > *bodySize)
+        {
+            asynPrint(this->pasynLabViewData, ASYN_TRACE_ERROR,
+                    "%s:%s: invalid MQ1 header length %d\n", driverName,
+                    functionName, mqHeaderSize);
+            return asynError;
+        }
+
+        status = dataConnection->mpxReadBody(this->pasynLabViewData,
+                frameHeader + *headerSize, mqHeaderSize - *headerSize,
+                Labview_DEFAULT_TIMEOUT);
+        if (status != asynSuccess)
+            return status;
+        *headerSize = mqHeaderSize;
+        frameHeader[*headerSize] = 0;
+    }
+
+    return asynSuccess;
+}
+
+/** The X and Y size of an image frame from its parsed header */
+void medipixDetector::frameDims(const mpxFrameHeader *pHdr, size_t *dims)
+{
+    // 12B and 24B frames are always the full detector size
+    dims[0] = maxSize[0];
+    dims[1] = maxSize[1];
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_X_SIZE))
+        dims[0] = pHdr->xSize;
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_Y_SIZE))
+        dims[1] = pHdr->ySize;
+}
+
+/** Allocates an NDArray of the size and type described by the parsed header
+ * of an image frame, with depth planes of that size if depth is more than 1.
+ * asFloat allocates Float32 pixels for flat field correction instead.
+ * Called with the driver lock held.
+ */
+NDArray* medipixDetector::allocateImage(const mpxFrameHeader *pHdr, int depth,
+        bool asFloat)
+{
+    size_t dims[3];
+    int ndims = depth > 1 ? 3 : 2;
+    int pixelSize = mpxHeaderPixelSize(pHdr);
+    NDArray* pImage = NULL;
+
+    frameDims(pHdr, dims);
+    dims[2] = depth;
+
+    if (asFloat && (pixelSize == 8 || pixelSize == 16 || pixelSize == 32))
+    {
+        pImage = this->pNDArrayPool->alloc(ndims, dims, NDFloat32, 0, NULL);
+    }
+    else if (pixelSize == 8)
+    {
+        pImage = this->pNDArrayPool->alloc(ndims, dims, NDUInt8, 0, NULL);
+    }
+    else if (pixelSize == 16)
+    {
+        pImage = this->pNDArrayPool->alloc(ndims, dims, NDUInt16, 0, NULL);
+    }
+    else if (pixelSize == 32)
+    {
+        pImage = this->pNDArrayPool->alloc(ndims, dims, NDUInt32, 0, NULL);
+    }
+    else
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "Unsupported bit depth %d\n", pixelSize);
+        setStringParam(ADStatusMessage, "Error: Unsupported bit depth");
+        return NULL;
+    }
+
+    if (pImage == NULL)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: unable to allocate NDArray from pool\n", driverName,
+                "allocateImage");
+        setStringParam(ADStatusMessage,
+                "Error: run out of buffers in detector driver");
+    }
+    return pImage;
+}
+
+/** Returns the number of bytes of pixels in an image frame as received */
+int medipixDetector::frameImageBytes(const mpxFrame *pFrame)
+{
+    return (int) (pFrame->pImage->dims[0].size * pFrame->pImage->dims[1].size
+            * pFrame->pixelBytes);
+}
+
+/** Returns the number of bytes in one 2-D image of an NDArray */
+int medipixDetector::planeBytes(NDArray *pImage)
+{
+    NDArrayInfo_t arrayInfo;
+
+    pImage->getInfo(&arrayInfo);
+    return (int) (pImage->dims[0].size * pImage->dims[1].size
+            * arrayInfo.bytesPerElement);
+}
+
+/** Gives an image frame its plane of the stacked NDArray that collects the
+ * stackDepth frames of one exposure, allocating the NDArray for the first
+ * frame. The plane comes from the frame number so that a lost frame leaves
+ * a zeroed plane rather than shifting the rest. Each frame holds a reference
+ * to the NDArray.
+ * Called with the driver lock held.
+ */
+void medipixDetector::allocateStackPlane(mpxFrame *pFrame, int stackDepth)
+{
+    const mpxFrameHeader *pHdr = &pFrame->fields;
+    int plane = stackNext;
+    int bytes;
+
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_FRAME_NUMBER) && pHdr->frameNumber > 0)
+        plane = (pHdr->frameNumber - 1) % stackDepth;
+
+    // a plane that is not after the last one belongs to the next exposure
+    if (pStackImage != NULL && plane < stackNext)
+        finishStack();
+
+    if (pStackImage == NULL)
+    {
+        pStackImage = allocateImage(pHdr, stackDepth, false);
+        if (pStackImage == NULL)
+            return;
+        stackNext = 0;
+    }
+
+    bytes = planeBytes(pStackImage);
+    memset((char*) pStackImage->pData + stackNext * bytes, 0,
+            (plane - stackNext) * bytes);
+
+    pStackImage->reserve();
+    pFrame->pImage = pStackImage;
+    pFrame->pPixels = (char*) pStackImage->pData + plane * bytes;
+    pFrame->stackPlane = plane;
+
+    stackNext = plane + 1;
+    if (stackNext == stackDepth)
+    {
+        pStackImage->release();
+        pStackImage = NULL;
+    }
+}
+
+/** Stops collecting frames into the current stacked NDArray, zeroing the
+ * planes that did not arrive.
+ * Called with the driver lock held.
+ */
+void medipixDetector::finishStack()
+{
+    int bytes;
+
+    if (pStackImage == NULL)
+        return;
+
+    bytes = planeBytes(pStackImage);
+    memset((char*) pStackImage->pData + stackNext * bytes, 0,
+            ((int) pStackImage->dims[2].size - stackNext) * bytes);
+    pStackImage->release();
+    pStackImage = NULL;
+}
+
+/** Adds an image frame to the NDArray that sums SUM_FRAMES frames, binned
+ * by SUM_BINNING, allocating the NDArray for the first frame. The decode
+ * thread adds the frame into the sum once it is decoded and the frame holds
+ * a reference to the sum until then.
+ * Called with the driver lock held.
+ */
+void medipixDetector::attachSum(mpxFrame *pFrame, int sumFrames)
+{
+    NDArray *pImage = pFrame->pImage;
+    NDArrayInfo_t arrayInfo;
+    NDDataType_t dataType;
+    mpxAccumulator accumulate;
+    size_t dims[2];
+    int binning, sumDataType, bin;
+
+    getIntegerParam(medipixSumBinning, &binning);
+    getIntegerParam(medipixSumDataType, &sumDataType);
+    bin = 1 << binning;
+    dataType = sumDataType == MPXSumFloat64 ? NDFloat64 : NDUInt32;
+    dims[0] = pImage->dims[0].size / bin;
+    dims[1] = pImage->dims[1].size / bin;
+
+    pImage->getInfo(&arrayInfo);
+    accumulate = mpxGetAccumulator(arrayInfo.bytesPerElement,
+            dataType == NDFloat64, bin);
+    if (accumulate == NULL || dims[0] == 0 || dims[1] == 0)
+        return;
+
+    // the settings or the image size changed part way through a sum
+    if (pSumImage != NULL
+            && (pSumImage->dims[0].size != dims[0]
+                    || pSumImage->dims[1].size != dims[1]
+                    || pSumImage->dataType != dataType))
+        finishSum();
+
+    if (pSumImage == NULL)
+    {
+        pSumImage = this->pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
+        if (pSumImage == NULL)
+        {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: unable to allocate NDArray from pool\n",
+                    driverName, "attachSum");
+            setStringParam(ADStatusMessage,
+                    "Error: run out of buffers in detector driver");
+            return;
+        }
+        memset(pSumImage->pData, 0, pSumImage->dataSize);
+        sumCount = 0;
+    }
+
+    pSumImage->reserve();
+    pFrame->pSum = pSumImage;
+    pFrame->accumulate = accumulate;
+    sumCount++;
+    pFrame->sumLast = sumCount >= sumFrames;
+    if (pFrame->sumLast)
+        finishSum();
+}
+
+/** Stops adding frames to the current sum.
+ * Called with the driver lock held.
+ */
+void medipixDetector::finishSum()
+{
+    if (pSumImage == NULL)
+        return;
+
+    pSumImage->release();
+    pSumImage = NULL;
+}
+
+/** Decides how an image frame is flat field corrected and sets its
+ * corrector. Frames are not corrected while a flat field is being taken, or
+ * if there is no flat field of their size. Frames that are stacked or summed
+ * are corrected as scaled integers in place of Float32.
+ * Called with the driver lock held.
+ */
+int medipixDetector::flatFieldMode(mpxFrame *pFrame, bool collected)
+{
+    size_t dims[2];
+    int mode;
+
+    getIntegerParam(medipixFlatFieldCorrect, &mode);
+    if (mode == MPXFlatFieldOff || pFlatGain == NULL || flatFramesToTake > 0)
+        return MPXFlatFieldOff;
+
+    frameDims(&pFrame->fields, dims);
+    if (pFlatGain->dims[0].size != dims[0]
+            || pFlatGain->dims[1].size != dims[1])
+        return MPXFlatFieldOff;
+
+    if (collected)
+        mode = MPXFlatFieldScaled;
+    pFrame->flatCorrect = mpxGetFlatCorrector(pFrame->pixelBytes,
+            mode == MPXFlatFieldFloat32);
+    if (pFrame->flatCorrect == NULL)
+        return MPXFlatFieldOff;
+    return mode;
+}
+
+/** Starts taking a flat field from the next FLAT_FIELD_FRAMES image frames,
+ * or abandons one.
+ * Called with the driver lock held.
+ */
+asynStatus medipixDetector::setFlatFieldCollect(int enable)
+{
+    int frames;
+
+    if (!enable)
+    {
+        flatFramesToTake = 0;
+        return asynSuccess;
+    }
+
+    if (pFlatField == NULL)
+    {
+        setStringParam(ADStatusMessage, "No flat field buffer");
+        setIntegerParam(medipixFlatFieldCollect, 0);
+        return asynError;
+    }
+
+    getIntegerParam(medipixFlatFieldFrames, &frames);
+    if (frames < 1)
+        frames = 1;
+    memset(pFlatField->pData, 0, pFlatField->dataSize);
+    flatFramesToTake = frames;
+    flatFramesWanted = frames;
+    flatFramesTaken = 0;
+    setStringParam(ADStatusMessage, "Taking flat field");
+    return asynSuccess;
+}
+
+/** Adds a decoded frame to the flat field being taken, which is complete
+ * once FLAT_FIELD_FRAMES have been added.
+ * Called with the driver lock held.
+ */
+void medipixDetector::addFlatFieldFrame(mpxFrame *pFrame)
+{
+    size_t xsize = pFrame->pImage->dims[0].size;
+    size_t ysize = pFrame->pImage->dims[1].size;
+    mpxAccumulator accumulate = mpxGetAccumulator(pFrame->pixelBytes, false,
+            1);
+
+    if (flatFramesTaken == 0)
+    {
+        flatFieldDims[0] = xsize;
+        flatFieldDims[1] = ysize;
+    }
+
+    if (accumulate == NULL || xsize != flatFieldDims[0]
+            || ysize != flatFieldDims[1]
+            || xsize * ysize > pFlatField->dims[0].size
+                    * pFlatField->dims[1].size)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: frame of %dx%d not used for the flat field\n",
+                driverName, "addFlatFieldFrame", (int) xsize, (int) ysize);
+        return;
+    }
+
+    accumulate(pFlatField->pData, pFrame->pPixels, xsize, ysize);
+    flatFramesTaken++;
+    if (flatFramesTaken == flatFramesWanted)
+        computeFlatField();
+}
+
+/** Turns the sum of the flat field frames into the gain of each pixel, the
+ * mean of the sum over the pixel's sum so that a corrected image keeps the
+ * average intensity. Dead pixels have a gain of 0.
+ * Called with the driver lock held.
+ */
+void medipixDetector::computeFlatField()
+{
+    const epicsUInt32 *pSum = (const epicsUInt32 *) pFlatField->pData;
+    size_t n = flatFieldDims[0] * flatFieldDims[1];
+    epicsFloat32 *pGain;
+    NDArray *pNewGain;
+    double total = 0;
+    double mean;
+    size_t i;
+
+    setIntegerParam(medipixFlatFieldCollect, 0);
+
+    for (i = 0; i < n; i++)
+        total += pSum[i];
+    mean = total / n;
+    if (mean <= 0)
+    {
+        setStringParam(ADStatusMessage, "Flat field has no counts");
+        return;
+    }
+
+    pNewGain = this->pNDArrayPool->alloc(2, flatFieldDims, NDFloat32, 0,
+            NULL);
+    if (pNewGain == NULL)
+    {
+        setStringParam(ADStatusMessage,
+                "Error: run out of buffers in detector driver");
+        return;
+    }
+
+    pGain = (epicsFloat32 *) pNewGain->pData;
+    for (i = 0; i < n; i++)
+        pGain[i] = pSum[i] ? (epicsFloat32) (mean / pSum[i]) : 0;
+
+    // frames being corrected keep a reference to the gain they started with
+    if (pFlatGain != NULL)
+        pFlatGain->release();
+    pFlatGain = pNewGain;
 
-    bigBuff = (char*) calloc(imagSize, 1);
+    averageFlatField = mean / flatFramesTaken;
+    setIntegerParam(medipixFlatFieldValid, 1);
+    setDoubleParam(medipixFlatFieldAverage, averageFlatField);
+    setStringParam(ADStatusMessage, "Flat field taken");
+}
 
-    /* Loop forever */
-    while (1)
+/** Replaces the bad pixels with those listed in a file, in the format of
+ * mpxParseBadPixels. An empty file name clears the list.
+ * Called with the lock held.
+ */
+asynStatus medipixDetector::loadBadPixelFile(const char *fileName)
+{
+    const char *functionName = "loadBadPixelFile";
+    asynStatus status;
+    FILE *file;
+    char *text;
+    long length;
+
+    if (fileName[0] == 0)
+        return setBadPixels("");
+
+    file = fopen(fileName, "r");
+    if (file == NULL)
     {
-        // Get the current time
-        epicsTimeGetCurrent(&startTime);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: cannot open bad pixel file %s\n", driverName,
+                functionName, fileName);
+        setStringParam(ADStatusMessage, "Cannot open bad pixel file");
+        return asynError;
+    }
 
-        // Acquire an image from the data channel
-        memset(bigBuff, 0, MPX_IMG_FRAME_LEN);
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    rewind(file);
+    text = (char*) malloc(length + 1);
+    length = (long) fread(text, 1, length, file);
+    text[length] = 0;
+    fclose(file);
 
-        /* We release the mutex when waiting because this takes a long time and
-         * we need to allow abort operations to get through */
-        this->unlock();
+    status = setBadPixels(text);
+    free(text);
+    return status;
+}
 
-        // wait for the next data frame packet - this function spends most of its time here
-        status = cmdConnection->mpxRead(this->pasynLabViewData, bigBuff,
-                imagSize, &nread, 10);
+/** Replaces the bad pixels with a list of "x,y" pairs. The list is left as
+ * it was if the text is not valid.
+ * Called with the lock held.
+ */
+asynStatus medipixDetector::setBadPixels(const char *text)
+{
+    const char *functionName = "setBadPixels";
+    mpxBadPixel *newPixels;
+    int count;
 
-        /* If there was an error jump to bottom of loop */
-        if (status)
-        {
-            if (status == asynTimeout)
-                status = asynSuccess;   // timeouts are expected
-            else
-            {
-                asynPrint(this->pasynLabViewData, ASYN_TRACE_ERROR,
-                        "%s:%s: error in Labview data channel response, status=%d\n",
-                        driverName, functionName, status);
-                setStringParam(ADStatusMessage,
-                        "Error in Labview data channel response");
-                // wait before trying again - otherwise socket error creates a tight loop
-                epicsThreadSleep(5);
-            }
-            this->lock();
-            continue;
-        }
-        this->lock();
+    newPixels = (mpxBadPixel*) malloc(MAX_BAD_PIXELS * sizeof(mpxBadPixel));
+    count = mpxParseBadPixels(text, newPixels, MAX_BAD_PIXELS);
+    if (count < 0)
+    {
+        free(newPixels);
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: bad pixel list is not valid or has more than %d "
+                "pixels\n", driverName, functionName, MAX_BAD_PIXELS);
+        setStringParam(ADStatusMessage, "Bad pixel list is not valid");
+        return asynError;
+    }
 
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
-                "\nReceived image frame of %d bytes\n", nread);
+    free(badPixels);
+    badPixels = newPixels;
+    numBadPixels = count;
+    invalidateBadPixelMap();
+    setIntegerParam(medipixBadPixelCount, numBadPixels);
+    return asynSuccess;
+}
 
-        if (pasynTrace->getTraceMask((pasynUserSelf))
-                & (ASYN_TRACE_MPX_VERBOSE))
-        {
-            dataConnection->dumpData(bigBuff, nread);
-        }
+/** Gives an image frame the bad pixel map for its size, compiling it if the
+ * list or the size of the frames has changed.
+ * Called with the lock held.
+ */
+void medipixDetector::attachBadPixels(mpxFrame *pFrame)
+{
+    size_t dims[2];
+    int mode, gaps;
 
-        medipixDataHeader header = dataConnection->parseDataHeader(bigBuff);
-        if (header != MPXAcquisitionHeader)
-        {
-            getIntegerParam(ADNumImagesCounter, &numImagesCounter);
-            numImagesCounter++;
-            setIntegerParam(ADNumImagesCounter, numImagesCounter);
-            if (imagesRemaining > 0)
-                imagesRemaining--;
+    getIntegerParam(medipixBadPixelMode, &mode);
+    getIntegerParam(medipixBadPixelGaps, &gaps);
+    if (mode == mpxBadPixelOff || (numBadPixels == 0 && !gaps))
+        return;
 
-            getIntegerParam(NDArrayCounter, &imageCounter);
-            imageCounter++;
-            setIntegerParam(NDArrayCounter, imageCounter);
-        }
+    frameDims(&pFrame->fields, dims);
+    if (pBadPixelMap != NULL && (pBadPixelMap->getXSize() != dims[0]
+            || pBadPixelMap->getYSize() != dims[1]))
+        invalidateBadPixelMap();
+    if (pBadPixelMap == NULL)
+        pBadPixelMap = new mpxBadPixelMap(badPixels, numBadPixels, dims[0],
+                dims[1], gaps ? MPX_CHIP_SIZE : 0);
+
+    pBadPixelMap->reserve();
+    pFrame->pBadPixels = pBadPixelMap;
+    pFrame->badPixelMode = (mpxBadPixelMode) mode;
+}
 
-        getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+/** Gives an image frame of a Merlin Quad the geometry of its sensor layout
+ * and an NDArray to remap it into. The geometry is compiled when the layout
+ * or the settings change, normally once for each acquisition.
+ * Called with the lock held.
+ */
+void medipixDetector::attachGeometry(mpxFrame *pFrame)
+{
+    const mpxFrameHeader *pHdr = &pFrame->fields;
+    size_t dims[2];
+    int remap, edgeWidth, gap, rotate, chipSelect;
 
-        if (arrayCallbacks)
-        {
-            getIntegerParam(medipixCounterDepth, &counterDepth);
+    getIntegerParam(medipixGeometryRemap, &remap);
+    if (!remap || !MPXHDR_PRESENT(pHdr, MPXHDR_SENSOR_LAYOUT))
+        return;
 
-            int idim;
-            /* Get an image buffer from the pool */
-            getIntegerParam(ADMaxSizeX, &idim);
-            dims[0] = idim;
-            getIntegerParam(ADMaxSizeY, &idim);
-            dims[1] = idim;
+    frameDims(pHdr, dims);
+    chipSelect = -1;
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_CHIP_SELECT))
+        chipSelect = pHdr->chipSelect;
+    if (pGeometry != NULL && !pGeometry->matches(pHdr->sensorLayout,
+            dims[0], dims[1], chipSelect))
+        invalidateGeometry();
+    if (pGeometry == NULL)
+    {
+        getIntegerParam(medipixGeometryEdgeWidth, &edgeWidth);
+        getIntegerParam(medipixGeometryGap, &gap);
+        getIntegerParam(medipixGeometryRotate, &rotate);
+        pGeometry = mpxGeometry::create(pHdr->sensorLayout, dims[0], dims[1],
+                MPX_CHIP_SIZE, chipSelect, rotate, edgeWidth, gap);
+        // the layout has no chips to move
+        if (pGeometry == NULL)
+            return;
+    }
 
-            if (header == MPXAcquisitionHeader)
-            {
-                // this is an acquisition header
-                strncpy(aquisitionHeader, bigBuff, MPX_ACQUISITION_HEADER_LEN);
-                aquisitionHeader[MPX_ACQUISITION_HEADER_LEN] = 0;
-            }
-            else if (header == MPXDataHeader12)
-            {
-                asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
-                        "Creating a 12bit Array\n");
-
-                pImage = copyToNDArray16(dims, bigBuff, MPX_IMG_HDR_LEN);
-                if (pImage == NULL)
-                    continue;
-                dataConnection->parseDataFrame(pImage->pAttributeList, bigBuff,
-                        header, &dummy, &dummy, &dummy2, &dummy2);
-            }
-            else if (header == MPXDataHeader24)
-            {
-                asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
-                        "Creating a 24bit Array\n");
-
-                pImage = copyToNDArray32(dims, bigBuff, MPX_IMG_HDR_LEN);
-                if (pImage == NULL)
-                    continue;
-                dataConnection->parseDataFrame(pImage->pAttributeList, bigBuff,
-                        header, &dummy, &dummy, &dummy2, &dummy2);
-            }
-            else if (header == MPXGenericImageHeader)
-            {
-                int pixelSize;
-                asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
-                        "Creating a generic Image NDArray\n");
-
-                // Parse the header and use the information to determine the
-                // size of the NDArray
-                imageAttr->clear();
-                dataConnection->parseDataFrame(imageAttr, bigBuff, header,
-                        &(dims[0]), &(dims[1]), &pixelSize, &dummy2);
-                pImage = NULL;
-                if (pixelSize == 16)
-                {
-                    pImage = copyToNDArray16(dims, bigBuff, MPX_IMG_HDR_LEN);
-                }
-                else if (pixelSize == 32)
-                {
-                    pImage = copyToNDArray32(dims, bigBuff, MPX_IMG_HDR_LEN);
-                }
-                if (pImage == NULL)
-                    continue;
-                imageAttr->copy(pImage->pAttributeList);
-            }
-            else if (header == MPXQuadDataHeader)
-            {
-                int pixelSize;
-                int offset;
-                asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
-                        "Creating a Quad Merlin Image NDArray\n");
-
-                // Parse the header and use the information to determine the
-                // size of the NDArray
-                imageAttr->clear();
-                dataConnection->parseMqDataFrame(imageAttr, bigBuff, &(dims[0]),
-                        &(dims[1]), &pixelSize, &offset);
-                pImage = NULL;
-                if (pixelSize == 16)
-                {
-                    pImage = copyToNDArray16(dims, bigBuff, offset);
-                }
-                else if (pixelSize == 32)
-                {
-                    pImage = copyToNDArray32(dims, bigBuff, offset);
-                }
-                else
-                {
-                    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                        "Unsupported bit depth %d\n", header);
-                    setStringParam(ADStatusMessage,
-                            "Error: Unsupported bit depth");
-                }
-
-                if (pImage == NULL)
-                {
-                    continue;
-                }
-                imageAttr->copy(pImage->pAttributeList);
-            }
-            else if (header == MPXProfileHeader12
-                    || header == MPXProfileHeader24
-                    || header == MPXGenericProfileHeader)
-            {
-                int profileMask = 0;
-                asynPrint(this->pasynUserSelf, ASYN_TRACE_MPX,
-                        "Creating a Profile NDArray\n");
-
-                imageAttr->clear();
-                pImage = NULL;
-
-                if (header == MPXGenericProfileHeader)
-                    dataConnection->parseDataFrame(imageAttr, bigBuff, header,
-                            &(dims[0]), &(dims[1]), &dummy2, &profileMask);
-                else
-                    dataConnection->parseDataFrame(imageAttr, bigBuff, header,
-                            &dummy, &dummy, &dummy2, &profileMask);
-
-                if (profileMask
-                        != (MPXPROFILES_XPROFILE | MPXPROFILES_YPROFILE
-                                | MPXPROFILES_SUM))
-                {
-                    asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                            "%s:%s: unsupported PROFILES mode %d\n", driverName,
-                            functionName, profileMask);
-                }
-                else
-                {
-                    pImage = copyProfileToNDArray32(dims, bigBuff, profileMask);
-                }
-                if (pImage == NULL)
-                    continue;
-                imageAttr->copy(pImage->pAttributeList);
-            }
-            else
-            {
-                asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                        "Unknown header type %d\n", header);
-            }
+    dims[0] = pGeometry->getXSize();
+    dims[1] = pGeometry->getYSize();
+    pFrame->pRemapped = this->pNDArrayPool->alloc(2, dims,
+            pFrame->pImage->dataType, 0, NULL);
+    if (pFrame->pRemapped == NULL)
+        return;
+    pGeometry->reserve();
+    pFrame->pGeometry = pGeometry;
+}
 
-            // for Data frames - complete the NDAttributes, pass the NDArray on
-            if (header == MPXDataHeader12 || header == MPXDataHeader24
-                    || header == MPXProfileHeader12
-                    || header == MPXProfileHeader24
-                    || header == MPXGenericImageHeader
-                    || header == MPXGenericProfileHeader
-                    || header == MPXQuadDataHeader)
-            {
-                // Put the frame number and time stamp into the buffer
-                pImage->uniqueId = imageCounter;
-                pImage->timeStamp = startTime.secPastEpoch
-                        + startTime.nsec / 1.e9;
-
-                // string attributes are global in HDF5 plugin so the most recent
-                // acquisition header is applied to all files
-                pImage->pAttributeList->add("Acquisition Header", "",
-                        NDAttrString, aquisitionHeader);
-
-                /* Get any attributes that have been defined for this driver */
-                this->getAttributes(pImage->pAttributeList);
-
-                // Call the NDArray callback
-                // Must release the lock here, to avoid a deadlock: we can
-                // block on the plugin lock, and the plugin can be calling us
-                this->unlock();
-                if (header == MPXDataHeader12 || header == MPXDataHeader24
-                    || header == MPXGenericImageHeader || header == MPXQuadDataHeader)
-                {
-                    doCallbacksGenericPointer(pImage, NDArrayData, 0);
-                }
-                else
-                {
-                    // address 1 on the port is used for profiles
-                    // TODO use of port 1 is not working in NDPluginBase so
-                    // currently reverting to use the same address
-                    // (i.e. setting Medipix1:ROI:NDArrayAddress has no effect
-                    doCallbacksGenericPointer(pImage, NDArrayData, 0);
-                }
-                this->lock();
+/** Drops the compiled geometry, frames in flight keep the one they started
+ * with. Called with the lock held.
+ */
+void medipixDetector::invalidateGeometry()
+{
+    if (pGeometry != NULL)
+        pGeometry->release();
+    pGeometry = NULL;
+}
 
-                /* Free the image buffer */
-                pImage->release();
-            }
-        }
+/** Drops the compiled bad pixel map so that the next image frame compiles
+ * a new one, frames in flight keep the map they started with.
+ * Called with the lock held.
+ */
+void medipixDetector::invalidateBadPixelMap()
+{
+    if (pBadPixelMap != NULL)
+        pBadPixelMap->release();
+    pBadPixelMap = NULL;
+}
 
-        // If we are using SW triggers then reset the trigger to 0 when an image is
-        // received
-        status = getIntegerParam(ADTriggerMode, &triggerMode);
-        if (triggerMode == TMSoftwareTrigger)
-        {
-            // software trigger resets  when image received
-            setIntegerParam(medipixSoftwareTrigger, 0);
-        }
+/** Reads the pixel payload of an image frame directly into its NDArray, or
+ * its plane of a stacked NDArray.
+ * Any payload beyond the size of the image is discarded and a short payload
+ * leaves the remaining pixels zeroed.
+ * Called without the driver lock held.
+ */
+asynStatus medipixDetector::readImagePayload(mpxFrame *pFrame, int payloadSize)
+{
+    asynStatus status;
+    int imageBytes = frameImageBytes(pFrame);
 
-        // If all the expected images have been received then the driver can
-        // complete the acquisition and return to waiting for acquisition state
-        if (imagesRemaining == 0)
-        {
-            setIntegerParam(ADAcquire, 0);
-            setIntegerParam(ADStatus, ADStatusIdle);
-        }
+    if (payloadSize < imageBytes)
+    {
+        asynPrint(this->pasynLabViewData, ASYN_TRACE_ERROR,
+                "%s:%s: image payload of %d bytes is short, expected %d\n",
+                driverName, "readImagePayload", payloadSize, imageBytes);
+        memset((char*) pFrame->pPixels + payloadSize, 0,
+                imageBytes - payloadSize);
+        imageBytes = payloadSize;
+    }
 
-        /* Call the callbacks to update any changes */
-        callParamCallbacks();
+    status = dataConnection->mpxReadBody(this->pasynLabViewData,
+            (char*) pFrame->pPixels, imageBytes, Labview_DEFAULT_TIMEOUT);
+
+    if (status == asynSuccess && payloadSize > imageBytes)
+    {
+        status = dataConnection->mpxDiscardBody(this->pasynLabViewData,
+                payloadSize - imageBytes, Labview_DEFAULT_TIMEOUT);
     }
-    // release the image buffer (in reality this does not get called
-    // We need a thread shutdown signal)
-    free(bigBuff);
+
+    return status;
 }
 
-/** helper functions for endian conversion
- *
+/** Decides whether an image frame only goes to the raw file. While a raw
+ * file is being written one image in RAW_LIVE_EVERY is still passed on to
+ * the plugins for live view, with 0 none are. When the frames are stacked
+ * the choice is made for the stackDepth frames of an exposure together.
+ * Called with the driver lock held.
  */
-inline void medipixDetector::endian_swap(unsigned short& x)
+bool medipixDetector::isRawOnly(medipixDataHeader header, int stackDepth)
 {
-    if (detType == Merlin || detType == MerlinQuad)
-    {
-        x = (x >> 8) | (x << 8);
-    }
+    int liveEvery;
+    bool live;
+
+    if (!isImageHeader(header) || !rawWriter.isOpen())
+        return false;
+
+    getIntegerParam(medipixRawLiveEvery, &liveEvery);
+    live = liveEvery > 0 && (rawImageCount / stackDepth) % liveEvery == 0;
+    rawImageCount++;
+    return !live;
 }
 
-inline void medipixDetector::endian_swap(unsigned int& x)
+/** Completes a frame in the raw file. Frames that were read into an NDArray
+ * or a buffer of their own are copied to the file, before the decode threads
+ * have touched them.
+ * Called without the driver lock held.
+ */
+void medipixDetector::commitRawFrame(mpxFrame *pFrame, char *pRaw,
+        int payloadSize)
 {
-    if (detType == Merlin || detType == MerlinQuad)
+    int imageBytes;
+
+    if (pFrame->pImage != NULL)
     {
-        x = (x >> 24) | ((x << 8) & 0x00FF0000) | ((x >> 8) & 0x0000FF00)
-                | (x << 24);
+        imageBytes = MIN(frameImageBytes(pFrame), payloadSize);
+        memcpy(pRaw, pFrame->frameHeader, pFrame->headerSize);
+        memcpy(pRaw + pFrame->headerSize, pFrame->pPixels, imageBytes);
+        rawWriter.commit(pFrame->headerSize + imageBytes);
+    }
+    else if (pFrame->pBody != NULL)
+    {
+        memcpy(pRaw, pFrame->pBody, pFrame->bodySize);
+        rawWriter.commit(pFrame->bodySize);
+    }
+    else
+    {
+        rawWriter.commit(pFrame->bodySize);
     }
 }
 
-inline void medipixDetector::endian_swap(uint64_t& x)
+/** Points pBody of a frame that is not an image at the body buffer of the
+ * frame. The buffer stays with the pooled frame and grows to the largest
+ * body received, so the receive thread only allocates while it grows.
+ * Returns false, and the frame is dropped, if the buffer can not grow.
+ */
+bool medipixDetector::reserveBody(mpxFrame *pFrame)
 {
-    if (detType == Merlin || detType == MerlinQuad)
+    const char *functionName = "reserveBody";
+    size_t needed = pFrame->bodySize + 1;
+    char *pBuff;
+
+    if (pFrame->bodyBuffSize < needed)
     {
-        x = ((((x) & 0x00000000000000FFLL) << 0x38)
-                | (((x) & 0x000000000000FF00LL) << 0x28)
-                | (((x) & 0x0000000000FF0000LL) << 0x18)
-                | (((x) & 0x00000000FF000000LL) << 0x08)
-                | (((x) & 0x000000FF00000000LL) >> 0x08)
-                | (((x) & 0x0000FF0000000000LL) >> 0x18)
-                | (((x) & 0x00FF000000000000LL) >> 0x28)
-                | (((x) & 0xFF00000000000000LL) >> 0x38));
+        pBuff = (char*) realloc(pFrame->pBodyBuff, needed);
+        if (pBuff == NULL)
+        {
+            asynPrint(this->pasynLabViewData, ASYN_TRACE_ERROR,
+                    "%s:%s: no memory for a frame of %d bytes, discarded\n",
+                    driverName, functionName, pFrame->bodySize);
+            return false;
+        }
+        pFrame->pBodyBuff = pBuff;
+        pFrame->bodyBuffSize = needed;
     }
+    pFrame->pBody = pFrame->pBodyBuff;
+    return true;
 }
 
 void medipixDetector::fromLabViewStr(const char *str)
@@ -411,19 +1604,13 @@ void medipixDetector::toLabViewStr(const char *str)
 }
 
 /** Helper function to copy a 64bit profile buffer into a 32Bit NDArray
- *
- *
+ * The X profile is followed by the (inverted) Y profile in the NDArray
+ * Called without the driver lock held.
  */
 
 NDArray* medipixDetector::copyProfileToNDArray32(size_t *dims, char *buffer,
-        int profileMask)
+        const mpxImageDecoders *pDecoders)
 {
-    epicsUInt32 *pData;
-    epicsUInt32 *pWaveForm;
-    uint64_t *pSrc;
-    size_t x;
-    int y;
-
     size_t profileDims[2];
     profileDims[0] = MAX(dims[0], dims[1]);
     profileDims[1] = 2;
@@ -442,115 +1629,125 @@ NDArray* medipixDetector::copyProfileToNDArray32(size_t *dims, char *buffer,
         asynPrint(this->pasynLabViewData, ASYN_TRACE_ERROR,
                 "%s:%s: unable to allocate NDArray from pool\n", driverName,
                 "copyProfileToNDArray32");
+        this->lock();
         setStringParam(ADStatusMessage,
                 "Error: run out of buffers in detector driver");
+        this->unlock();
     }
     else
     {
         // Copy the X,Y profile data into the (size * 2) NDArray
-        // and into the X,Y waveforms
-        pData = (epicsUInt32*) pImage->pData;
-        for (x = 0, pWaveForm = (epicsUInt32 *) profileX, pSrc =
-                (uint64_t *) ((buffer + MPX_IMG_HDR_LEN)); x < dims[0];
-                x++, pWaveForm++, pSrc++, pData++)
-        {
-            endian_swap(*pSrc);
-            *pWaveForm = (epicsUInt32) *pSrc;
-            *pData = (epicsUInt32) *pSrc;
-        }
-
-        // Invert the Y profile (medipix origin is at bottom left)
-        for (y = dims[1] - 1, pWaveForm = (epicsUInt32 *) profileY; y >= 0;
-                y--, pWaveForm++, pSrc++, pData++)
-        {
-            endian_swap(*pSrc);
-            *pWaveForm = (epicsUInt32) *pSrc;
-            *pData = (epicsUInt32) *pSrc;
-        }
-
-        doCallbacksInt32Array(profileY, dims[1], medipixProfileY, 0);
-        doCallbacksInt32Array(profileX, dims[0], medipixProfileX, 0);
+        // The Y profile follows the X profile
+        pDecoders->decodeProfile((epicsUInt32*) pImage->pData,
+                buffer + MPX_IMG_HDR_LEN, dims[0] + dims[1]);
     }
     return pImage;
 }
 
-/** Helper function to copy a 16 bit buffer into an NDArray
- *
+/** Helper function to convert an image NDArray in place, switching to little
+ * endian and Inverting in the Y axis (medipix origin is at bottom left)
  */
-NDArray* medipixDetector::copyToNDArray16(size_t *dims, char *buffer, int offset)
+void medipixDetector::decodeImage(mpxFrame *pFrame)
 {
-    // copy the data into NDArray, switching to little endien and
-    // Inverting in the Y axis (medipix origin is at bottom left)
-    epicsUInt16 *pData, *pSrc;
-    size_t x, y;
+    NDArray *pImage = pFrame->pImage;
+    size_t xsize = pImage->dims[0].size;
+    size_t ysize = pImage->dims[1].size;
+    uint64_t stageStart = mpxLatencyNow();
+
+    // the pixels are converted as received, a Float32 NDArray for flat
+    // field correction holds them in its first half until it is corrected
+    switch (pFrame->pixelBytes)
+    {
+    case 1:
+        pFrame->pDecoders->decode8(pFrame->pPixels, xsize, ysize);
+        break;
+    case 2:
+        pFrame->pDecoders->decode16(pFrame->pPixels, xsize, ysize);
+        break;
+    case 4:
+        pFrame->pDecoders->decode32(pFrame->pPixels, xsize, ysize);
+        break;
+    default:
+        break;
+    }
 
-    NDArray* pImage = this->pNDArrayPool->alloc(2, dims, NDUInt16, 0, NULL);
+    // before the flat field so that its gain is not applied to them
+    if (pFrame->pBadPixels != NULL)
+        pFrame->pBadPixels->apply(pFrame->pPixels, pFrame->pixelBytes,
+                pFrame->badPixelMode);
 
-    if (pImage == NULL)
+    if (pFrame->pFlatGain != NULL)
     {
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                "%s:%s: unable to allocate NDArray from pool\n", driverName,
-                "copyToNDArray16");
-        setStringParam(ADStatusMessage,
-                "Error: run out of buffers in detector driver");
+        pFrame->flatCorrect(pFrame->pPixels,
+                (const epicsFloat32 *) pFrame->pFlatGain->pData,
+                xsize * ysize);
     }
-    else
+
+    // the remapped NDArray takes the place of the one received
+    if (pFrame->pGeometry != NULL)
     {
-        for (y = 0; y < dims[1]; y++)
-        {
-            for (x = 0, pData = (epicsUInt16 *) pImage->pData + y * dims[0], pSrc =
-                    (epicsUInt16 *) (buffer + offset)
-                            + (dims[1] - y) * dims[0]; x < dims[0];
-                    x++, pData++, pSrc++)
-            {
-                *pData = *pSrc;
-                endian_swap(*pData);
-            }
-        }
+        pFrame->pGeometry->remap(pImage->pData, pFrame->pRemapped->pData,
+                pImage->dataType == NDFloat32 ? 4 : pFrame->pixelBytes,
+                pImage->dataType == NDFloat32);
+        pImage->release();
+        pFrame->pImage = pFrame->pRemapped;
+        pFrame->pPixels = pFrame->pImage->pData;
+        pFrame->pRemapped = NULL;
     }
-    return pImage;
+
+    if (pFrame->projectImage)
+        projectImage(pFrame);
+
+    // the decode threads add their frames into a sum in any order
+    if (pFrame->pSum != NULL)
+    {
+        epicsMutexLock(sumLock);
+        pFrame->accumulate(pFrame->pSum->pData, pFrame->pPixels, xsize, ysize);
+        epicsMutexUnlock(sumLock);
+    }
+    latency[mpxStageDecode].record(mpxLatencyNow() - stageStart);
 }
 
-/** Helper function to copy a 32 bit buffer into an NDArray
- *
+/** Helper function to add the attributes parsed from the data header of a
+ * frame. The time taken is added to the attribute stage when the frame is
+ * published.
  */
-NDArray* medipixDetector::copyToNDArray32(size_t* dims, char* buffer, int offset)
+void medipixDetector::addHeaderAttributes(mpxFrame *pFrame)
 {
-    epicsUInt32 *pData, *pSrc;
-    size_t x, y;
+    uint64_t stageStart = mpxLatencyNow();
 
-    NDArray* pImage = this->pNDArrayPool->alloc(2, dims, NDUInt32, 0, NULL);
+    dataConnection->addHeaderAttributes(pFrame->pAttr, &pFrame->fields);
+    pFrame->attributeNs += mpxLatencyNow() - stageStart;
+}
 
-    if (pImage == NULL)
-    {
-        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
-                "%s:%s: unable to allocate NDArray from pool\n", driverName,
-                "copyToNDArray32");
-        setStringParam(ADStatusMessage,
-                "Error: run out of buffers in detector driver");
-    }
-    else
+/** Choose the frame decoders for this detector. Merlin and MerlinQuad send
+ * big endian pixels, all detectors send images with the origin at the bottom
+ * left.
+ */
+void medipixDetector::selectDecoders()
+{
+    switch (detType)
     {
-        for (y = 0; y < dims[1]; y++)
-        {
-            for (x = 0, pData = (epicsUInt32 *) pImage->pData + y * dims[0], pSrc =
-                    (epicsUInt32 *) (buffer + offset)
-                            + (dims[1] - y) * dims[0]; x < dims[0];
-                    x++, pData++, pSrc++)
-            {
-                *pData = *pSrc;
-                endian_swap(*pData);
-            }
-        }
+    case Merlin:
+    case MerlinQuad:
+        pImageDecoders = mpxGetImageDecoders(true, true);
+        break;
+    case MedipixXBPM:
+    case UomXBPM:
+    default:
+        pImageDecoders = mpxGetImageDecoders(false, true);
+        break;
     }
-    return pImage;
 }
+
 asynStatus medipixDetector::setModeCommands(int function)
 {
     asynStatus status;
     char value[MPX_MAXLINE];
     int counter1Enabled, continuousEnabled;
+    const mpxBatchItem *pResult;
 
+    cmdConnection->mpxBatchBegin();
     if (function == medipixEnableCounter1)
     {
         status = getIntegerParam(medipixEnableCounter1, &counter1Enabled);
@@ -561,8 +1758,7 @@ asynStatus medipixDetector::setModeCommands(int function)
             setIntegerParam(medipixEnableCounter1, counter1Enabled);
         }
         epicsSnprintf(value, MPX_MAXLINE, "%d", counter1Enabled);
-        cmdConnection->mpxSet(MPXVAR_ENABLECOUNTER1, value,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_ENABLECOUNTER1, value);
     }
 
     if (function == medipixContinuousRW)
@@ -575,25 +1771,25 @@ asynStatus medipixDetector::setModeCommands(int function)
             setIntegerParam(medipixContinuousRW, continuousEnabled);
         }
         epicsSnprintf(value, MPX_MAXLINE, "%d", continuousEnabled);
-        cmdConnection->mpxSet(MPXVAR_CONTINUOUSRW, value,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_CONTINUOUSRW, value);
     }
+    runCommandBatch();
 
     epicsThreadSleep(.01);
 
     // now get the values again from the device -- it may reset them to consistent values
     // (presently only one of medipixContinuousRW or medipixEnableCounter1 can be set at a time)
-    status = cmdConnection->mpxGet(MPXVAR_ENABLECOUNTER1,
-            Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setIntegerParam(medipixEnableCounter1,
-                atoi(cmdConnection->fromLabviewValue));
-
-    status = cmdConnection->mpxGet(MPXVAR_CONTINUOUSRW,
-            Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setIntegerParam(medipixContinuousRW,
-                atoi(cmdConnection->fromLabviewValue));
+    cmdConnection->mpxBatchBegin();
+    cmdConnection->mpxBatchGet(MPXVAR_ENABLECOUNTER1);
+    cmdConnection->mpxBatchGet(MPXVAR_CONTINUOUSRW);
+    runCommandBatch();
+
+    pResult = cmdConnection->mpxBatchResult(0);
+    if (pResult != NULL && pResult->status == asynSuccess)
+        setIntegerParam(medipixEnableCounter1, atoi(pResult->value));
+    pResult = cmdConnection->mpxBatchResult(1);
+    if (pResult != NULL && pResult->status == asynSuccess)
+        setIntegerParam(medipixContinuousRW, atoi(pResult->value));
 
     return (asynSuccess);
 }
@@ -654,7 +1850,9 @@ asynStatus medipixDetector::setROI()
 
         epicsSnprintf(value, MPX_MAXLINE, "%lu %lu %lu %lu", arrayDims[0].offset,
                 arrayDims[1].offset, arrayDims[0].size, arrayDims[1].size);
-        cmdConnection->mpxSet(MPXVAR_ROI, value, Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchBegin();
+        cmdConnection->mpxBatchSet(MPXVAR_ROI, value);
+        runCommandBatch();
     }
     return asynSuccess;
 }
@@ -664,6 +1862,9 @@ asynStatus medipixDetector::setAcquireParams()
     int triggerMode;
     char value[MPX_MAXLINE];
     asynStatus status;
+    int periodIndex;
+    const mpxBatchItem *pResult;
+    const char *functionName = "setAcquireParams";
 //	char *substr = NULL;
 //	int pixelCutOff = 0;
 
@@ -671,24 +1872,24 @@ asynStatus medipixDetector::setAcquireParams()
     if (startingUp)
         return asynSuccess;
 
+    // all of the settings are sent in one batch
+    cmdConnection->mpxBatchBegin();
+
     if (detType == MedipixXBPM || detType == UomXBPM)
     {
         int exposures, val;
 
         getIntegerParam(ADNumExposures, &exposures);
         epicsSnprintf(value, MPX_MAXLINE, "%d", exposures);
-        cmdConnection->mpxSet(MPXVAR_IMAGESTOSUM, value,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_IMAGESTOSUM, value);
 
         getIntegerParam(medipixEnableBackgroundCorr, &val);
         epicsSnprintf(value, MPX_MAXLINE, "%d", val);
-        cmdConnection->mpxSet(MPXVAR_ENABLEBACKROUNDCORR, value,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_ENABLEBACKROUNDCORR, value);
 
         getIntegerParam(medipixEnableImageSum, &val);
         epicsSnprintf(value, MPX_MAXLINE, "%d", val);
-        cmdConnection->mpxSet(MPXVAR_ENABLEIMAGEAVERAGE, value,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_ENABLEIMAGEAVERAGE, value);
     }
 
     int numImages;
@@ -732,18 +1933,14 @@ asynStatus medipixDetector::setAcquireParams()
     }
     callParamCallbacks();
 
-    // set the values enmasse - an attempt to fix the strange GUI updates caused by slow comms (failed)
     epicsSnprintf(value, MPX_MAXLINE, "%d", numExposures);
-    cmdConnection->mpxSet(MPXVAR_NUMFRAMESPERTRIGGER, value,
-            Labview_DEFAULT_TIMEOUT);
+    cmdConnection->mpxBatchSet(MPXVAR_NUMFRAMESPERTRIGGER, value);
     epicsSnprintf(value, MPX_MAXLINE, "%d", counterDepth);
-    cmdConnection->mpxSet(MPXVAR_COUNTERDEPTH, value, Labview_DEFAULT_TIMEOUT);
+    cmdConnection->mpxBatchSet(MPXVAR_COUNTERDEPTH, value);
     epicsSnprintf(value, MPX_MAXLINE, "%f", acquireTime * 1000); // translated into millisec
-    cmdConnection->mpxSet(MPXVAR_ACQUISITIONTIME, value,
-            Labview_DEFAULT_TIMEOUT);
+    cmdConnection->mpxBatchSet(MPXVAR_ACQUISITIONTIME, value);
     epicsSnprintf(value, MPX_MAXLINE, "%f", acquirePeriod * 1000); // translated into millisec
-    cmdConnection->mpxSet(MPXVAR_ACQUISITIONPERIOD, value,
-            Labview_DEFAULT_TIMEOUT);
+    cmdConnection->mpxBatchSet(MPXVAR_ACQUISITIONPERIOD, value);
 
     status = getIntegerParam(ADTriggerMode, &triggerMode);
     if (status != asynSuccess)
@@ -754,47 +1951,43 @@ asynStatus medipixDetector::setAcquireParams()
     switch (triggerMode)
     {
     case TMInternal:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigInternal,
-                Labview_DEFAULT_TIMEOUT);
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTOP, TMTrigInternal,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_TRIGGERSTART, TMTrigInternal);
+        cmdConnection->mpxBatchSet(MPXVAR_TRIGGERSTOP, TMTrigInternal);
         break;
     case TMExternalEnable:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigRising,
-                Labview_DEFAULT_TIMEOUT);
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTOP, TMTrigFalling,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_TRIGGERSTART, TMTrigRising);
+        cmdConnection->mpxBatchSet(MPXVAR_TRIGGERSTOP, TMTrigFalling);
         break;
     case TMExternalTriggerLow:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigFalling,
-                Labview_DEFAULT_TIMEOUT);
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTOP, TMTrigInternal,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_TRIGGERSTART, TMTrigFalling);
+        cmdConnection->mpxBatchSet(MPXVAR_TRIGGERSTOP, TMTrigInternal);
         break;
     case TMExternalTriggerHigh:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigRising,
-                Labview_DEFAULT_TIMEOUT);
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTOP, TMTrigInternal,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_TRIGGERSTART, TMTrigRising);
+        cmdConnection->mpxBatchSet(MPXVAR_TRIGGERSTOP, TMTrigInternal);
         break;
     case TMExternalTriggerRising:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigRising,
-                Labview_DEFAULT_TIMEOUT);
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTOP, TMTrigRising,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_TRIGGERSTART, TMTrigRising);
+        cmdConnection->mpxBatchSet(MPXVAR_TRIGGERSTOP, TMTrigRising);
         break;
     case TMSoftwareTrigger:
-        cmdConnection->mpxSet(MPXVAR_TRIGGERSTART, TMTrigSoftware,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchSet(MPXVAR_TRIGGERSTART, TMTrigSoftware);
         break;
     }
 
     // read the acquire period back from the server so that it can insert
     // the readback time if necessary
-    cmdConnection->mpxGet(MPXVAR_ACQUISITIONPERIOD, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(ADAcquirePeriod,
-                atof(cmdConnection->fromLabviewValue) / 1000); // translated into secs
+    periodIndex = cmdConnection->mpxBatchGet(MPXVAR_ACQUISITIONPERIOD);
+
+    status = runCommandBatch();
+    if (status != asynSuccess)
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: error %d setting acquisition parameters\n",
+                driverName, functionName, cmdConnection->fromLabviewError);
+
+    pResult = cmdConnection->mpxBatchResult(periodIndex);
+    if (pResult != NULL && pResult->status == asynSuccess)
+        setDoubleParam(ADAcquirePeriod, atof(pResult->value) / 1000); // translated into secs
 
     return (asynSuccess);
 
@@ -802,50 +1995,34 @@ asynStatus medipixDetector::setAcquireParams()
 
 asynStatus medipixDetector::getThreshold()
 {
-    int status;
+    char *thresholdVars[8] = { MPXVAR_THRESHOLD0, MPXVAR_THRESHOLD1,
+            MPXVAR_THRESHOLD2, MPXVAR_THRESHOLD3, MPXVAR_THRESHOLD4,
+            MPXVAR_THRESHOLD5, MPXVAR_THRESHOLD6, MPXVAR_THRESHOLD7 };
+    int thresholdParams[8] = { medipixThreshold0, medipixThreshold1,
+            medipixThreshold2, medipixThreshold3, medipixThreshold4,
+            medipixThreshold5, medipixThreshold6, medipixThreshold7 };
+    const mpxBatchItem *pResult;
+    int i;
 
     if (startingUp)
         return asynSuccess;
 
     /* Read back the actual setting, in case we are out of bounds.*/
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD0, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixThreshold0,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD1, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixThreshold1,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD2, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixThreshold2,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD3, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixThreshold3,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD4, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixThreshold4,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD5, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixThreshold5,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD6, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixThreshold6,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THRESHOLD7, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixThreshold7,
-                atof(cmdConnection->fromLabviewValue));
-
-    status = cmdConnection->mpxGet(MPXVAR_OPERATINGENERGY,
-            Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixOperatingEnergy,
-                atof(cmdConnection->fromLabviewValue));
+    cmdConnection->mpxBatchBegin();
+    for (i = 0; i < 8; i++)
+        cmdConnection->mpxBatchGet(thresholdVars[i]);
+    cmdConnection->mpxBatchGet(MPXVAR_OPERATINGENERGY);
+    runCommandBatch();
+
+    for (i = 0; i < 8; i++)
+    {
+        pResult = cmdConnection->mpxBatchResult(i);
+        if (pResult != NULL && pResult->status == asynSuccess)
+            setDoubleParam(thresholdParams[i], atof(pResult->value));
+    }
+    pResult = cmdConnection->mpxBatchResult(8);
+    if (pResult != NULL && pResult->status == asynSuccess)
+        setDoubleParam(medipixOperatingEnergy, atof(pResult->value));
 
     callParamCallbacks();
 
@@ -858,6 +2035,7 @@ asynStatus medipixDetector::updateThresholdScanParms()
     char valueStr[MPX_MAXLINE];
     int thresholdScan;
     double start, stop, step;
+    const mpxBatchItem *pResult;
 
     if (startingUp)
         return asynSuccess;
@@ -867,71 +2045,145 @@ asynStatus medipixDetector::updateThresholdScanParms()
     getDoubleParam(medipixStepThresholdScan, &step);
     getIntegerParam(medipixThresholdScan, &thresholdScan);
 
+    cmdConnection->mpxBatchBegin();
     epicsSnprintf(valueStr, MPX_MAXLINE, "%f", start);
-    status = cmdConnection->mpxSet(MPXVAR_THSTART, valueStr,
-            Labview_DEFAULT_TIMEOUT);
-
-    if (status == asynSuccess)
-    {
-        epicsSnprintf(valueStr, MPX_MAXLINE, "%f", stop);
-        status = cmdConnection->mpxSet(MPXVAR_THSTOP, valueStr,
-                Labview_DEFAULT_TIMEOUT);
-    }
-    if (status == asynSuccess)
-    {
-        epicsSnprintf(valueStr, MPX_MAXLINE, "%f", step);
-        status = cmdConnection->mpxSet(MPXVAR_THSTEP, valueStr,
-                Labview_DEFAULT_TIMEOUT);
-    }
-    if (status == asynSuccess)
-    {
-        epicsSnprintf(valueStr, MPX_MAXLINE, "%d", thresholdScan);
-        status = cmdConnection->mpxSet(MPXVAR_THSSCAN, valueStr,
-                Labview_DEFAULT_TIMEOUT);
-    }
+    cmdConnection->mpxBatchSet(MPXVAR_THSTART, valueStr);
+    epicsSnprintf(valueStr, MPX_MAXLINE, "%f", stop);
+    cmdConnection->mpxBatchSet(MPXVAR_THSTOP, valueStr);
+    epicsSnprintf(valueStr, MPX_MAXLINE, "%f", step);
+    cmdConnection->mpxBatchSet(MPXVAR_THSTEP, valueStr);
+    epicsSnprintf(valueStr, MPX_MAXLINE, "%d", thresholdScan);
+    cmdConnection->mpxBatchSet(MPXVAR_THSSCAN, valueStr);
 
     /* Read back the actual setting, in case we are out of bounds.*/
-    status = cmdConnection->mpxGet(MPXVAR_THSTART, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixStartThresholdScan,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THSTEP, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixStepThresholdScan,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THSTOP, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setDoubleParam(medipixStopThresholdScan,
-                atof(cmdConnection->fromLabviewValue));
-    status = cmdConnection->mpxGet(MPXVAR_THSSCAN, Labview_DEFAULT_TIMEOUT);
-    if (status == asynSuccess)
-        setIntegerParam(medipixThresholdScan,
-                atoi(cmdConnection->fromLabviewValue));
+    cmdConnection->mpxBatchGet(MPXVAR_THSTART);
+    cmdConnection->mpxBatchGet(MPXVAR_THSTEP);
+    cmdConnection->mpxBatchGet(MPXVAR_THSTOP);
+    cmdConnection->mpxBatchGet(MPXVAR_THSSCAN);
+    status = runCommandBatch();
+
+    pResult = cmdConnection->mpxBatchResult(4);
+    if (pResult != NULL && pResult->status == asynSuccess)
+        setDoubleParam(medipixStartThresholdScan, atof(pResult->value));
+    pResult = cmdConnection->mpxBatchResult(5);
+    if (pResult != NULL && pResult->status == asynSuccess)
+        setDoubleParam(medipixStepThresholdScan, atof(pResult->value));
+    pResult = cmdConnection->mpxBatchResult(6);
+    if (pResult != NULL && pResult->status == asynSuccess)
+        setDoubleParam(medipixStopThresholdScan, atof(pResult->value));
+    pResult = cmdConnection->mpxBatchResult(7);
+    if (pResult != NULL && pResult->status == asynSuccess)
+        setIntegerParam(medipixThresholdScan, atoi(pResult->value));
 
     return status;
 }
 
-static void medipixTaskC(void *drvPvt)
-{
-    medipixDetector *pPvt = (medipixDetector *) drvPvt;
+static void medipixTaskC(void *drvPvt)
+{
+    medipixDetector *pPvt = (medipixDetector *) drvPvt;
+
+    pPvt->medipixTask();
+}
+
+static void medipixStatusC(void *drvPvt)
+{
+    medipixDetector *pPvt = (medipixDetector *) drvPvt;
+
+    pPvt->medipixStatus();
+}
+
+static void medipixDecodeTaskC(void *drvPvt)
+{
+    medipixDetector *pPvt = (medipixDetector *) drvPvt;
+
+    pPvt->medipixDecodeTask();
+}
+
+static void medipixPublishTaskC(void *drvPvt)
+{
+    medipixDetector *pPvt = (medipixDetector *) drvPvt;
+
+    pPvt->medipixPublishTask();
+}
+
+static void medipixCommandTaskC(void *drvPvt)
+{
+    medipixDetector *pPvt = (medipixDetector *) drvPvt;
+
+    pPvt->medipixCommandTask();
+}
+
+static void medipixSpectrumTaskC(void *drvPvt)
+{
+    medipixDetector *pPvt = (medipixDetector *) drvPvt;
+
+    pPvt->medipixSpectrumTask();
+}
+
+/** This thread computes the power spectral density of the beam position
+ * history by Welch's method when the publish thread wakes it, and publishes
+ * the spectra and the history. The history is copied out under the lock
+ * and the spectra are computed without it.
+ */
+void medipixDetector::medipixSpectrumTask()
+{
+    double *pX = (double*) malloc(MPX_HISTORY_LEN * sizeof(double));
+    double *pY = (double*) malloc(MPX_HISTORY_LEN * sizeof(double));
+    double *pPsdX = (double*) malloc(
+            (MPX_MAX_SEGMENT_LEN / 2 + 1) * sizeof(double));
+    double *pPsdY = (double*) malloc(
+            (MPX_MAX_SEGMENT_LEN / 2 + 1) * sizeof(double));
+    double *pFreq = (double*) malloc(
+            (MPX_MAX_SEGMENT_LEN / 2 + 1) * sizeof(double));
+    double *pWork = (double*) malloc(
+            2 * MPX_MAX_SEGMENT_LEN * sizeof(double));
+    double rate;
+    size_t n, segment, bins, i;
+    int segmentParam, segments;
+
+    while (1)
+    {
+        epicsEventWait(spectrumEvent);
+
+        this->lock();
+        n = positionHistory.copy(pX, pY, &rate);
+        getIntegerParam(medipixSpectrumSegment, &segmentParam);
+        this->unlock();
 
-    pPvt->medipixTask();
-}
+        // the largest power of 2 that fits the setting and the history
+        segment = MPX_MAX_SEGMENT_LEN;
+        while (segment > MPX_MIN_SEGMENT_LEN
+                && (segment > (size_t) segmentParam || segment > n))
+            segment >>= 1;
+        bins = segment / 2 + 1;
 
-static void medipixStatusC(void *drvPvt)
-{
-    medipixDetector *pPvt = (medipixDetector *) drvPvt;
+        segments = mpxWelchPSD(pX, n, segment, rate, pPsdX, pWork);
+        if (segments > 0)
+            mpxWelchPSD(pY, n, segment, rate, pPsdY, pWork);
+        for (i = 0; i < bins; i++)
+            pFreq[i] = i * rate / segment;
 
-    pPvt->medipixStatus();
+        this->lock();
+        setDoubleParam(medipixSpectrumRate, rate);
+        doCallbacksFloat64Array(pX, n, medipixHistoryX, 0);
+        doCallbacksFloat64Array(pY, n, medipixHistoryY, 0);
+        if (segments > 0)
+        {
+            doCallbacksFloat64Array(pFreq, bins, medipixSpectrumFreq, 0);
+            doCallbacksFloat64Array(pPsdX, bins, medipixSpectrumX, 0);
+            doCallbacksFloat64Array(pPsdY, bins, medipixSpectrumY, 0);
+        }
+        callParamCallbacks();
+        this->unlock();
+    }
 }
 
 /** This thread periodically read the detector status (temperature, humidity, etc.)
  It does not run if we are acquiring data, to avoid polling Labview when taking data.*/
 void medipixDetector::medipixStatus()
 {
-    int result = asynSuccess;
     int status = 0;
-    int statusCode;
+    mpxCommandRequest request;
 
 // let the startup script complete before attempting I/O
     epicsThreadSleep(4);
@@ -941,14 +2193,9 @@ void medipixDetector::medipixStatus()
 
 // make sure important grouped variables are set to agree with
 // IOCs auto saved values
-    setAcquireParams();
-    setROI();
-    updateThresholdScanParms();
-    getThreshold();
-
-    result = cmdConnection->mpxGet(MPXVAR_GETSOFTWAREVERSION,
-            Labview_DEFAULT_TIMEOUT);
-    statusCode = atoi(cmdConnection->fromLabviewValue);
+    memset(&request, 0, sizeof(request));
+    request.type = MPXCmdStartup;
+    queueCommand(&request);
 
 // initial status
     setIntegerParam(ADStatus, ADStatusIdle);
@@ -964,13 +2211,33 @@ void medipixDetector::medipixStatus()
         if (status == ADStatusIdle)
         {
             setStringParam(ADStatusMessage, "Waiting for acquire command");
-            callParamCallbacks();
         }
+        updateStreamCounts();
+        updateLatency();
+        callParamCallbacks();
         this->unlock();
     }
 
 }
 
+/** the number of frames that each acquisition returns in a Quad Merlin
+ * mode, one for each counter read
+ *
+ * \param[in] mode the mode number
+ */
+static int quadModeFrames(int mode)
+{
+    switch (mode)
+    {
+    case MPXQuadMode2Threshold:
+        return 2;
+    case MPXQuadModeColour:
+        return 8;
+    default:
+        return 1;
+    }
+}
+
 /** sets one of the 6 modes for Merlin versions since Quad Merlin
  * these modes combine sensible combinations of 5 individual settings
  * on the device
@@ -987,8 +2254,6 @@ asynStatus medipixDetector::SetQuadMode(int mode)
     int continuousRW = 0;
     int chargeSumming = 0;
 
-    this->framesPerAcquire = 1;
-
     switch(mode)
     {
     case MPXQuadMode12Bit:
@@ -998,7 +2263,6 @@ asynStatus medipixDetector::SetQuadMode(int mode)
         break;
     case MPXQuadMode2Threshold:
         enableCounter1 = 1;
-        this->framesPerAcquire = 2;
         enableCounter1 = 2;
         break;
     case MPXQuadModeContinuousRW:
@@ -1007,7 +2271,6 @@ asynStatus medipixDetector::SetQuadMode(int mode)
     case MPXQuadModeColour:
         colourMode = 1;
         enableCounter1 = 2;
-        this->framesPerAcquire = 8;
         break;
     case MPXQuadModeSumming:
         chargeSumming = 1;
@@ -1020,21 +2283,19 @@ asynStatus medipixDetector::SetQuadMode(int mode)
 
     setIntegerParam(medipixCounterDepth, bits);
 
+    cmdConnection->mpxBatchBegin();
     epicsSnprintf(value, MPX_MAXLINE, "%d", bits);
-    cmdConnection->mpxSet(MPXVAR_COUNTERDEPTH, value,
-            Labview_DEFAULT_TIMEOUT);
+    cmdConnection->mpxBatchSet(MPXVAR_COUNTERDEPTH, value);
     epicsSnprintf(value, MPX_MAXLINE, "%d", enableCounter1);
-    cmdConnection->mpxSet(MPXVAR_ENABLECOUNTER1, value,
-            Labview_DEFAULT_TIMEOUT);
+    cmdConnection->mpxBatchSet(MPXVAR_ENABLECOUNTER1, value);
     epicsSnprintf(value, MPX_MAXLINE, "%d", continuousRW);
-    cmdConnection->mpxSet(MPXVAR_CONTINUOUSRW, value,
-            Labview_DEFAULT_TIMEOUT);
+    cmdConnection->mpxBatchSet(MPXVAR_CONTINUOUSRW, value);
     epicsSnprintf(value, MPX_MAXLINE, "%d", colourMode);
-    cmdConnection->mpxSet(MPXVAR_COLOURMODE, value,
-            Labview_DEFAULT_TIMEOUT);
+    cmdConnection->mpxBatchSet(MPXVAR_COLOURMODE, value);
     epicsSnprintf(value, MPX_MAXLINE, "%d", chargeSumming);
-    cmdConnection->mpxSet(MPXVAR_CHARGESUMMING, value,
-            Labview_DEFAULT_TIMEOUT);
+    cmdConnection->mpxBatchSet(MPXVAR_CHARGESUMMING, value);
+    if (runCommandBatch() != asynSuccess)
+        result = asynError;
 
     return result;
 }
@@ -1046,111 +2307,458 @@ asynStatus medipixDetector::SetQuadMode(int mode)
  * \param[in] value Value to write. */
 asynStatus medipixDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
 {
-    char strVal[MPX_MAXLINE];
     int function = pasynUser->reason;
     int adstatus;
     int imageMode, imagesToAcquire, profileMaskParm;
     asynStatus status = asynSuccess;
     const char *functionName = "writeInt32";
+    mpxCommandRequest request;
+    bool queue = false;
 
     status = setIntegerParam(function, value);
 
+    // anything that talks to labview is passed to the command thread so that
+    // a slow reply does not hold up the port
+    memset(&request, 0, sizeof(request));
+    request.type = MPXCmdWriteInt32;
+    request.function = function;
+    request.iValue = value;
+
+    if (function == ADAcquire)
+    {
+        getIntegerParam(ADStatus, &adstatus);
+        if (value && (adstatus == ADStatusIdle || adstatus == ADStatusError))
+        {
+            selectDecoders();
+            setIntegerParam(ADStatus, ADStatusAcquire);
+            setStringParam(ADStatusMessage, "Acquiring...");
+            // reset the image count - this is then used to determine when acquisition is complete
+            setIntegerParam(ADNumImagesCounter, 0);
+            setIntegerParam(medipixFramesMissing, 0);
+            setIntegerParam(medipixFramesDuplicate, 0);
+            setIntegerParam(medipixFramesOutOfOrder, 0);
+            expectedFrameNumber = -1;
+            missingFrames = 0;
+            positionHistory.reset();
+            // sums and stacks do not carry over from an aborted acquisition
+            finishSum();
+            finishStack();
+            getIntegerParam(ADNumImages, &imagesToAcquire);
+            // set number of images to acquire based on the capture mode
+            getIntegerParam(ADImageMode, &imageMode);
+            getIntegerParam(medipixProfileControl, &profileMaskParm);
+
+            switch (imageMode)
+            {
+            case MPXImageSingle:
+                imagesRemaining = framesPerAcquire;
+                break;
+            case MPXImageMultiple:
+                imagesRemaining = imagesToAcquire * framesPerAcquire;
+                break;
+            case MPXImageContinuous:
+                imagesToAcquire = 0;
+                imagesRemaining = -1;
+                break;
+            case MPXThresholdScan:
+                double start, stop, step;
+                getDoubleParam(medipixStartThresholdScan, &start);
+                getDoubleParam(medipixStopThresholdScan, &stop);
+                getDoubleParam(medipixStepThresholdScan, &step);
+                imagesRemaining = (int) ((stop - start) / step);
+                setStringParam(ADStatusMessage, "Performing Threshold Scan...");
+                setIntegerParam(ADNumImages, 1); // internally Merlin does this so we set EPICS PV to match
+                break;
+            case MPXBackgroundCalibrate:
+                // we only get a single image back from the server for all the
+                // background images we take
+                imagesRemaining = 1;
+                break;
+            }
+
+            request.imageMode = imageMode;
+            request.imagesToAcquire = imagesToAcquire;
+            request.profileMask = profileMaskParm;
+            queue = true;
+        }
+        if (!value && (adstatus == ADStatusAcquire))
+        {
+            setIntegerParam(ADStatus, ADStatusIdle);
+            queue = true;
+        }
+    }
+    else if (function == medipixCapture)
+    {
+        status = setCapture(value);
+    }
+    else if (function == medipixReplay)
+    {
+        status = setReplay(value);
+    }
+    else if (function == medipixRawWrite)
+    {
+        status = setRawWrite(value);
+    }
+    else if (function == medipixFlatFieldCollect)
+    {
+        status = setFlatFieldCollect(value);
+    }
+    else if (function == medipixBadPixelGaps)
+    {
+        invalidateBadPixelMap();
+    }
+    else if ((function == medipixGeometryEdgeWidth)
+            || (function == medipixGeometryGap)
+            || (function == medipixGeometryRotate))
+    {
+        invalidateGeometry();
+    }
+    else if (function == medipixSpectrumReset)
+    {
+        positionHistory.reset();
+        setIntegerParam(medipixSpectrumReset, 0);
+    }
+    else if (function == medipixLatencyReset)
+    {
+        for (int stage = 0; stage < mpxStageCount; stage++)
+            latency[stage].reset();
+        setIntegerParam(medipixLatencyReset, 0);
+        updateLatency();
+    }
+    else if (function == medipixQuadMerlinMode)
+    {
+        // the frames per acquisition are needed by an Acquire written
+        // before the command thread has sent the mode to labview
+        framesPerAcquire = quadModeFrames(value);
+        queue = true;
+    }
+    else if ((function == medipixReset)
+            || (function == medipixSoftwareTrigger)
+            || (function == ADTriggerMode) || (function == ADNumImages)
+            || (function == ADNumExposures) || (function == medipixCounterDepth)
+            || (function == medipixEnableBackgroundCorr)
+            || (function == medipixEnableImageSum)
+            || (function == ADSizeX) || (function == ADSizeY)
+            || (function == ADMinX) || (function == ADMinY)
+            || (function == medipixEnableCounter1)
+            || (function == medipixContinuousRW)
+            || (function == medipixThresholdApply)
+            || (function == medipixProfileControl))
+    {
+        queue = true;
+    }
+    else
+    {
+// function numbers are assigned sequentially via createParam in the constructor and hence
+// any function numbers lower than our first function is handled by a (the) super class
+        if (function < FIRST_medipix_PARAM)
+            status = ADDriver::writeInt32(pasynUser, value);
+    }
+
+    if (queue)
+        status = queueCommand(&request);
+
+    /* Do callbacks so higher layers see any changes */
+    callParamCallbacks();
+
+    if (status)
+        asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                "%s:%s: error, status=%d, reason=%d value=%d\n",
+                driverName, functionName, status, function, value);
+    else
+        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+                "%s:%s: reason=%d, value=%d\n", driverName, functionName,
+                function, value);
+    return status;
+}
+
+/** Called when asyn clients call pasynFloat64->write().
+ * This function performs actions for some parameters, including ADAcquireTime, ADGain, etc.
+ * For all parameters it sets the value in the parameter library and calls any registered callbacks..
+ * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+ * \param[in] value Value to write. */
+asynStatus medipixDetector::writeFloat64(asynUser *pasynUser,
+        epicsFloat64 value)
+{
+    int function = pasynUser->reason;
+    asynStatus status = asynSuccess;
+    const char *functionName = "writeFloat64";
+    mpxCommandRequest request;
+    double oldValue;
+
+    /* Set the parameter and readback in the parameter library.  This may be overwritten when we read back the
+     * status at the end, but that's OK */
+    getDoubleParam(function, &oldValue);
+    status = setDoubleParam(function, value);
+
+    /* Anything that talks to labview is passed to the command thread */
+    if ((function == medipixThreshold0) || (function == medipixThreshold1)
+            || (function == medipixThreshold2)
+            || (function == medipixThreshold3)
+            || (function == medipixThreshold4)
+            || (function == medipixThreshold5)
+            || (function == medipixThreshold6)
+            || (function == medipixThreshold7)
+            || (function == medipixOperatingEnergy)
+            || (function == ADAcquireTime) || (function == ADAcquirePeriod)
+            || (function == medipixStartThresholdScan)
+            || (function == medipixStopThresholdScan)
+            || (function == medipixStepThresholdScan))
+    {
+        memset(&request, 0, sizeof(request));
+        request.type = MPXCmdWriteFloat64;
+        request.function = function;
+        request.dValue = value;
+        request.dOldValue = oldValue;
+        status = queueCommand(&request);
+    }
+    else
+    {
+        /* If this parameter belongs to a base class call its method */
+        if (function < FIRST_medipix_PARAM)
+            status = ADDriver::writeFloat64(pasynUser, value);
+    }
+
+    if (status)
+    {
+        /* Something went wrong so we set the old value back */
+        setDoubleParam(function, oldValue);
+        asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                "%s:%s error, status=%d function=%d, value=%f\n", driverName,
+                functionName, status, function, value);
+    }
+    else
+        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+                "%s:%s: function=%d, value=%f\n", driverName, functionName,
+                function, value);
+
+    /* Do callbacks so higher layers see any changes */
+    callParamCallbacks();
+    return status;
+}
+
+/** Called when asyn clients call pasynOctet->write().
+ * This function loads bad pixels from BAD_PIXEL_FILE or replaces them with
+ * the list written to BAD_PIXELS. Other parameters are passed to ADDriver.
+ * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+ * \param[in] value Address of the string to write.
+ * \param[in] nChars Number of characters to write.
+ * \param[out] nActual Number of characters actually written. */
+asynStatus medipixDetector::writeOctet(asynUser *pasynUser, const char *value,
+        size_t nChars, size_t *nActual)
+{
+    int function = pasynUser->reason;
+    asynStatus status = asynSuccess;
+    const char *functionName = "writeOctet";
+    char *text;
+
+    if (function == medipixBadPixelFile || function == medipixBadPixels)
+    {
+        // the value is not terminated
+        text = (char*) malloc(nChars + 1);
+        memcpy(text, value, nChars);
+        text[nChars] = 0;
+        setStringParam(function, text);
+        if (function == medipixBadPixelFile)
+            status = loadBadPixelFile(text);
+        else
+            status = setBadPixels(text);
+        free(text);
+        *nActual = nChars;
+    }
+    else
+    {
+        /* If this parameter belongs to a base class call its method */
+        status = ADDriver::writeOctet(pasynUser, value, nChars, nActual);
+    }
+
+    /* Do callbacks so higher layers see any changes */
+    callParamCallbacks();
+
+    if (status)
+        asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                "%s:%s: error, status=%d function=%d\n", driverName,
+                functionName, status, function);
+    else
+        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
+                "%s:%s: function=%d, length=%d\n", driverName, functionName,
+                function, (int) nChars);
+    return status;
+}
+
+/** Queues a request for the command thread. Called with the lock held.
+ * Returns straight away unless the CMD_WAIT parameter is set, in which case
+ * the lock is released until the command thread has completed the request
+ * and its status is returned.
+ */
+asynStatus medipixDetector::queueCommand(mpxCommandRequest *pRequest)
+{
+    const char *functionName = "queueCommand";
+    asynStatus status = asynSuccess;
+    int wait, pending;
+
+    getIntegerParam(medipixCommandWait, &wait);
+    pRequest->pStatus = NULL;
+    if (wait && pRequest->type != MPXCmdStartup)
+        pRequest->pStatus = &status;
+
+    if (epicsMessageQueueTrySend(this->commandQueue, pRequest,
+            sizeof(*pRequest)) != 0)
+    {
+        asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s:%s: command queue full, request for reason %d dropped\n",
+                driverName, functionName, pRequest->function);
+        setStringParam(ADStatusMessage, "Labview command queue full");
+        return asynError;
+    }
+
+    getIntegerParam(medipixCommandsPending, &pending);
+    setIntegerParam(medipixCommandsPending, pending + 1);
+
+    if (pRequest->pStatus != NULL)
+    {
+        this->unlock();
+        epicsEventMustWait(this->commandDone);
+        this->lock();
+    }
+    return status;
+}
+
+/** Sends the batch of requests built up on the command connection. Called
+ * from the command thread with the lock held, the lock is released while
+ * waiting for labview.
+ */
+asynStatus medipixDetector::runCommandBatch()
+{
+    asynStatus status;
+
+    this->unlock();
+    status = cmdConnection->mpxBatchRun(Labview_DEFAULT_TIMEOUT);
+    this->lock();
+
+    toLabViewStr(cmdConnection->toLabview);
+    fromLabViewStr(cmdConnection->fromLabview);
+    return status;
+}
+
+/** This thread sends the requests queued by writeInt32 and writeFloat64 to
+ * labview one at a time, in the order they were written, and updates the
+ * readback parameters when each completes.
+ */
+void medipixDetector::medipixCommandTask()
+{
+    const char *functionName = "medipixCommandTask";
+    mpxCommandRequest request;
+    asynStatus status = asynSuccess;
+    int pending;
+
+    while (1)
+    {
+        epicsMessageQueueReceive(this->commandQueue, &request,
+                sizeof(request));
+
+        this->lock();
+        switch (request.type)
+        {
+        case MPXCmdWriteInt32:
+            status = executeInt32(&request);
+            break;
+        case MPXCmdWriteFloat64:
+            status = executeFloat64(&request);
+            break;
+        case MPXCmdStartup:
+            status = executeStartup();
+            break;
+        }
+
+        if (status != asynSuccess)
+        {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: error, status=%d, reason=%d, labview error %d\n",
+                    driverName, functionName, status, request.function,
+                    cmdConnection->fromLabviewError);
+            setStringParam(ADStatusMessage, "Labview command failed");
+        }
+
+        getIntegerParam(medipixCommandsPending, &pending);
+        setIntegerParam(medipixCommandsPending, pending - 1);
+        callParamCallbacks();
+
+        if (request.pStatus != NULL)
+        {
+            *request.pStatus = status;
+            epicsEventSignal(this->commandDone);
+        }
+        this->unlock();
+    }
+}
+
+/** Sends the labview commands for a write to an integer parameter.
+ * Called from the command thread with the lock held.
+ */
+asynStatus medipixDetector::executeInt32(const mpxCommandRequest *pRequest)
+{
+    char strVal[MPX_MAXLINE];
+    int function = pRequest->function;
+    int value = pRequest->iValue;
+    asynStatus status = asynSuccess;
+
     if (function == medipixReset)
     {
-        cmdConnection->mpxCommand(MPXCMD_RESET, Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchBegin();
+        cmdConnection->mpxBatchCommand(MPXCMD_RESET);
+        runCommandBatch();
 // I cannot successfully reconnect to the server after a reset
 // the only solution found so far is to restart the ioc
         exit(0);
     }
     else if (function == medipixQuadMerlinMode)
     {
-        this->SetQuadMode(value);
+        status = this->SetQuadMode(value);
     }
     else if (function == medipixSoftwareTrigger)
     {
-        cmdConnection->mpxCommand(MPXCMD_SOFTWARETRIGGER,
-                Labview_DEFAULT_TIMEOUT);
+        cmdConnection->mpxBatchBegin();
+        cmdConnection->mpxBatchCommand(MPXCMD_SOFTWARETRIGGER);
+        status = runCommandBatch();
     }
-    else if (function == ADAcquire)
+    else if (function == ADAcquire && value)
     {
-        getIntegerParam(ADStatus, &adstatus);
-        if (value && (adstatus == ADStatusIdle || adstatus == ADStatusError))
+        cmdConnection->mpxBatchBegin();
+        if (pRequest->imageMode == MPXThresholdScan)
         {
-            setIntegerParam(ADStatus, ADStatusAcquire);
-            setStringParam(ADStatusMessage, "Acquiring...");
-            // reset the image count - this is then used to determine when acquisition is complete
-            setIntegerParam(ADNumImagesCounter, 0);
-            getIntegerParam(ADNumImages, &imagesToAcquire);
-            // set number of images to acquire based on the capture mode
-            getIntegerParam(ADImageMode, &imageMode);
-            getIntegerParam(medipixProfileControl, &profileMaskParm);
-
-            switch (imageMode)
-            {
-            case MPXImageSingle:
-                imagesRemaining = framesPerAcquire;
-                break;
-            case MPXImageMultiple:
-                imagesRemaining = imagesToAcquire * framesPerAcquire;
-                break;
-            case MPXImageContinuous:
-                imagesToAcquire = 0;
-                imagesRemaining = -1;
-                break;
-            case MPXThresholdScan:
-                double start, stop, step;
-                getDoubleParam(medipixStartThresholdScan, &start);
-                getDoubleParam(medipixStopThresholdScan, &stop);
-                getDoubleParam(medipixStepThresholdScan, &step);
-                imagesRemaining = (int) ((stop - start) / step);
-                setStringParam(ADStatusMessage, "Performing Threshold Scan...");
-                setIntegerParam(ADNumImages, 1); // internally Merlin does this so we set EPICS PV to match
-                break;
-            case MPXBackgroundCalibrate:
-                // we only get a single image back from the server for all the
-                // background images we take
-                imagesRemaining = 1;
-                break;
-            }
+            cmdConnection->mpxBatchCommand(MPXCMD_THSCAN);
+        }
+        else if (pRequest->imageMode == MPXBackgroundCalibrate)
+        {
+            epicsSnprintf(strVal, MPX_MAXLINE, "%d", pRequest->imagesToAcquire);
+            cmdConnection->mpxBatchSet(MPXVAR_BACKGROUNDCOUNT, strVal);
+            cmdConnection->mpxBatchCommand(MPXCMD_BACKGROUNDACQUIRE);
+        }
+        else // a standard image acquisition (or profile acquisition)
+        {
+            epicsSnprintf(strVal, MPX_MAXLINE, "%d", pRequest->imagesToAcquire);
+            cmdConnection->mpxBatchSet(MPXVAR_NUMFRAMESTOACQUIRE, strVal);
 
-            if (imageMode == MPXThresholdScan)
-            {
-                status = cmdConnection->mpxCommand(MPXCMD_THSCAN,
-                        Labview_DEFAULT_TIMEOUT);
-            }
-            else if (imageMode == MPXBackgroundCalibrate)
-            {
-                epicsSnprintf(strVal, MPX_MAXLINE, "%d", imagesToAcquire);
-                cmdConnection->mpxSet(MPXVAR_BACKGROUNDCOUNT, strVal,
-                        Labview_DEFAULT_TIMEOUT);
-                status = cmdConnection->mpxCommand(MPXCMD_BACKGROUNDACQUIRE,
-                        Labview_DEFAULT_TIMEOUT);
-            }
-            else // a standard image acquisition (or profile acquisition)
-            {
-                epicsSnprintf(strVal, MPX_MAXLINE, "%d", imagesToAcquire);
-                cmdConnection->mpxSet(MPXVAR_NUMFRAMESTOACQUIRE, strVal,
-                        Labview_DEFAULT_TIMEOUT);
-
-                if (profileMaskParm & (MPXPROFILES_IMAGE == MPXPROFILES_IMAGE))
-                {
-                    cmdConnection->mpxCommand(MPXCMD_STARTACQUISITION,
-                            Labview_DEFAULT_TIMEOUT);
-                }
-                else
-                {
-                    cmdConnection->mpxCommand(MPXCMD_PROFILES,
-                            Labview_DEFAULT_TIMEOUT);
-                }
-            }
+            if (pRequest->profileMask
+                    & (MPXPROFILES_IMAGE == MPXPROFILES_IMAGE))
+                cmdConnection->mpxBatchCommand(MPXCMD_STARTACQUISITION);
+            else
+                cmdConnection->mpxBatchCommand(MPXCMD_PROFILES);
         }
-        if (!value && (adstatus == ADStatusAcquire))
+        status = runCommandBatch();
+        if (status != asynSuccess)
         {
-            setIntegerParam(ADStatus, ADStatusIdle);
-            cmdConnection->mpxCommand(MPXCMD_STOPACQUISITION,
-                    Labview_DEFAULT_TIMEOUT);
+            setIntegerParam(ADStatus, ADStatusError);
+            setIntegerParam(ADAcquire, 0);
         }
     }
+    else if (function == ADAcquire)
+    {
+        cmdConnection->mpxBatchBegin();
+        cmdConnection->mpxBatchCommand(MPXCMD_STOPACQUISITION);
+        status = runCommandBatch();
+    }
     else if ((function == ADTriggerMode) || (function == ADNumImages)
             || (function == ADNumExposures) || (function == medipixCounterDepth)
             || (function == medipixEnableBackgroundCorr)
@@ -1175,113 +2783,50 @@ asynStatus medipixDetector::writeInt32(asynUser *pasynUser, epicsInt32 value)
     else if (function == medipixProfileControl)
     {
         epicsSnprintf(strVal, MPX_MAXLINE, "%d", value);
-        cmdConnection->mpxSet(MPXCMD_PROFILECONTROL, strVal,
-                Labview_DEFAULT_TIMEOUT);
-        setIntegerParam(medipixProfileControl, value);
-    }
-    else
-    {
-// function numbers are assigned sequentially via createParam in the constructor and hence
-// any function numbers lower than our first function is handled by a (the) super class
-        if (function < FIRST_medipix_PARAM)
-            status = ADDriver::writeInt32(pasynUser, value);
+        cmdConnection->mpxBatchBegin();
+        cmdConnection->mpxBatchSet(MPXCMD_PROFILECONTROL, strVal);
+        status = runCommandBatch();
     }
 
-    /* Do callbacks so higher layers see any changes */
-    callParamCallbacks();
-
-    if (status)
-        asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                "%s:%s: error, status=%d, reason=%d value=%d\n",
-                driverName, functionName, status, function, value);
-    else
-        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
-                "%s:%s: reason=%d, value=%d\n", driverName, functionName,
-                function, value);
     return status;
 }
 
-/** Called when asyn clients call pasynFloat64->write().
- * This function performs actions for some parameters, including ADAcquireTime, ADGain, etc.
- * For all parameters it sets the value in the parameter library and calls any registered callbacks..
- * \param[in] pasynUser pasynUser structure that encodes the reason and address.
- * \param[in] value Value to write. */
-asynStatus medipixDetector::writeFloat64(asynUser *pasynUser,
-        epicsFloat64 value)
+/** Sends the labview commands for a write to a double parameter.
+ * Called from the command thread with the lock held.
+ */
+asynStatus medipixDetector::executeFloat64(const mpxCommandRequest *pRequest)
 {
-    int function = pasynUser->reason;
-    asynStatus status = asynSuccess;
-    const char *functionName = "writeFloat64";
     char value_str[MPX_MAXLINE];
-    double oldValue;
-
-    /* Set the parameter and readback in the parameter library.  This may be overwritten when we read back the
-     * status at the end, but that's OK */
-    getDoubleParam(function, &oldValue);
-    status = setDoubleParam(function, value);
+    int function = pRequest->function;
+    asynStatus status = asynSuccess;
+    char *variable = NULL;
 
-    /* Changing any of the following parameters requires recomputing the base image */
     if (function == medipixThreshold0)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD0, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
+        variable = MPXVAR_THRESHOLD0;
     else if (function == medipixThreshold1)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD1, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
+        variable = MPXVAR_THRESHOLD1;
     else if (function == medipixThreshold2)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD2, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
+        variable = MPXVAR_THRESHOLD2;
     else if (function == medipixThreshold3)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD3, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
+        variable = MPXVAR_THRESHOLD3;
     else if (function == medipixThreshold4)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD4, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
+        variable = MPXVAR_THRESHOLD4;
     else if (function == medipixThreshold5)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD5, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
+        variable = MPXVAR_THRESHOLD5;
     else if (function == medipixThreshold6)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD6, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
+        variable = MPXVAR_THRESHOLD6;
     else if (function == medipixThreshold7)
-    {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_THRESHOLD7, value_str,
-                Labview_DEFAULT_TIMEOUT);
-        getThreshold();
-    }
+        variable = MPXVAR_THRESHOLD7;
     else if (function == medipixOperatingEnergy)
+        variable = MPXVAR_OPERATINGENERGY;
+
+    if (variable != NULL)
     {
-        epicsSnprintf(value_str, MPX_MAXLINE, "%f", value);
-        status = cmdConnection->mpxSet(MPXVAR_OPERATINGENERGY, value_str,
-                Labview_DEFAULT_TIMEOUT);
+        // read back all of the thresholds as labview may adjust them
+        epicsSnprintf(value_str, MPX_MAXLINE, "%f", pRequest->dValue);
+        cmdConnection->mpxBatchBegin();
+        cmdConnection->mpxBatchSet(variable, value_str);
+        status = runCommandBatch();
         getThreshold();
     }
     else if ((function == ADAcquireTime) || (function == ADAcquirePeriod))
@@ -1294,31 +2839,191 @@ asynStatus medipixDetector::writeFloat64(asynUser *pasynUser,
     {
         updateThresholdScanParms();
     }
+
+    if (status != asynSuccess)
+    {
+        /* labview did not take the value so we set the old value back */
+        setDoubleParam(function, pRequest->dOldValue);
+    }
+
+    return status;
+}
+
+/** Makes sure that labview agrees with the IOC's autosaved settings once
+ * the startup script has completed. Called from the command thread with the
+ * lock held.
+ */
+asynStatus medipixDetector::executeStartup()
+{
+    setAcquireParams();
+    setROI();
+    updateThresholdScanParms();
+    getThreshold();
+
+    cmdConnection->mpxBatchBegin();
+    cmdConnection->mpxBatchGet(MPXVAR_GETSOFTWAREVERSION);
+    return runCommandBatch();
+}
+
+/** Starts or stops capturing the data channel to the file in CAPTURE_FILE.
+ * Called with the lock held.
+ */
+asynStatus medipixDetector::setCapture(int enable)
+{
+    char fileName[MAX_FILENAME_LEN];
+    asynStatus status = asynSuccess;
+
+    if (enable)
+    {
+        getStringParam(medipixCaptureFile, sizeof(fileName), fileName);
+        status = dataConnection->mpxStartCapture(fileName);
+        if (status != asynSuccess)
+        {
+            setStringParam(ADStatusMessage, "Cannot create capture file");
+            setIntegerParam(medipixCapture, 0);
+        }
+    }
     else
     {
-        /* If this parameter belongs to a base class call its method */
-        if (function < FIRST_medipix_PARAM)
-            status = ADDriver::writeFloat64(pasynUser, value);
+        dataConnection->mpxStopCapture();
     }
+    updateStreamCounts();
+    return status;
+}
 
-    if (status)
+/** Starts replaying the capture in REPLAY_FILE through the data pipeline in
+ * place of the data channel, or stops it. Called with the lock held.
+ */
+asynStatus medipixDetector::setReplay(int mode)
+{
+    char fileName[MAX_FILENAME_LEN];
+    asynStatus status = asynSuccess;
+
+    if (mode == mpxReplayRecordedTiming || mode == mpxReplayFast)
     {
-        /* Something went wrong so we set the old value back */
-        setDoubleParam(function, oldValue);
-        asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                "%s:%s error, status=%d function=%d, value=%f\n", driverName,
-                functionName, status, function, value);
+        getStringParam(medipixReplayFile, sizeof(fileName), fileName);
+        status = dataConnection->mpxStartReplay(fileName,
+                (mpxReplayMode) mode);
+        if (status != asynSuccess)
+        {
+            setStringParam(ADStatusMessage, "Cannot open capture file");
+            setIntegerParam(medipixReplay, mpxReplayOff);
+        }
+        else
+        {
+            setStringParam(ADStatusMessage, "Replaying capture");
+        }
     }
     else
-        asynPrint(pasynUser, ASYN_TRACEIO_DRIVER,
-                "%s:%s: function=%d, value=%f\n", driverName, functionName,
-                function, value);
+    {
+        dataConnection->mpxStopReplay();
+    }
+    updateStreamCounts();
+    return status;
+}
 
-    /* Do callbacks so higher layers see any changes */
-    callParamCallbacks();
+/** Opens the raw file in RAW_FILE, preallocated to RAW_FILE_SIZE MB, and
+ * starts writing every frame of the data channel to it, or closes it.
+ * Called with the lock held, which is released while the file is
+ * preallocated.
+ */
+asynStatus medipixDetector::setRawWrite(int enable)
+{
+    char fileName[MAX_FILENAME_LEN];
+    int fileSizeMB;
+    bool opened;
+    asynStatus status = asynSuccess;
+
+    if (enable)
+    {
+        getStringParam(medipixRawFile, sizeof(fileName), fileName);
+        getIntegerParam(medipixRawFileSize, &fileSizeMB);
+        if (fileSizeMB < 0)
+            fileSizeMB = 0;
+        rawImageCount = 0;
+        this->unlock();
+        opened = rawWriter.open(fileName, (uint64_t) fileSizeMB * 1024 * 1024);
+        this->lock();
+        if (!opened)
+        {
+            asynPrint(this->pasynUserSelf, ASYN_TRACE_ERROR,
+                    "%s:%s: cannot create raw file %s of %d MB\n", driverName,
+                    "setRawWrite", fileName, fileSizeMB);
+            setStringParam(ADStatusMessage, "Cannot create raw file");
+            setIntegerParam(medipixRawWrite, 0);
+            status = asynError;
+        }
+    }
+    else if (rawWriter.isOpen())
+    {
+        if (!rawWriter.close())
+        {
+            setStringParam(ADStatusMessage, "Error writing raw file index");
+            status = asynError;
+        }
+    }
+    updateStreamCounts();
     return status;
 }
 
+/** Updates the capture, replay and raw file counts, ends a replay that has
+ * reached the end of its capture and closes a raw file that is full.
+ * Called with the lock held.
+ */
+void medipixDetector::updateStreamCounts()
+{
+    double captureBytes, replayBytes;
+    int replay;
+
+    dataConnection->mpxStreamCounts(&captureBytes, &replayBytes);
+    setDoubleParam(medipixCaptureBytes, captureBytes);
+    setDoubleParam(medipixReplayBytes, replayBytes);
+    setIntegerParam(medipixRawFrames, (int) rawWriter.getFrames());
+    setDoubleParam(medipixRawBytes, (double) rawWriter.getBytes());
+
+    if (rawWriter.isOpen() && rawWriter.isFull())
+    {
+        setIntegerParam(medipixRawWrite, 0);
+        if (rawWriter.close())
+            setStringParam(ADStatusMessage, "Raw file full");
+        else
+            setStringParam(ADStatusMessage, "Error writing raw file index");
+    }
+
+    getIntegerParam(medipixReplay, &replay);
+    if (replay != mpxReplayOff && dataConnection->mpxReplayFinished())
+    {
+        dataConnection->mpxStopReplay();
+        setIntegerParam(medipixReplay, mpxReplayOff);
+        setStringParam(ADStatusMessage, "Replay complete");
+    }
+}
+
+/** Publishes the p50, p99 and max of each stage of the data path in us. The
+ * LATENCY waveform holds the p50 of every stage followed by the p99s and the
+ * maxima. Called with the lock held.
+ */
+void medipixDetector::updateLatency()
+{
+    int stage;
+
+    for (stage = 0; stage < mpxStageCount; stage++)
+    {
+        latencySummary[stage] = latency[stage].getPercentile(0.5) / 1000;
+        latencySummary[mpxStageCount + stage] =
+                latency[stage].getPercentile(0.99) / 1000;
+        latencySummary[2 * mpxStageCount + stage] =
+                latency[stage].getMax() / 1000;
+
+        setDoubleParam(medipixLatencyP50[stage], latencySummary[stage]);
+        setDoubleParam(medipixLatencyP99[stage],
+                latencySummary[mpxStageCount + stage]);
+        setDoubleParam(medipixLatencyMax[stage],
+                latencySummary[2 * mpxStageCount + stage]);
+    }
+    doCallbacksFloat64Array(latencySummary, mpxStageCount * 3, medipixLatency,
+            0);
+}
 
 /** Report status of the driver.
  * Prints details about the driver if details>0.
@@ -1338,6 +3043,13 @@ void medipixDetector::report(FILE *fp, int details)
         getIntegerParam(NDDataType, &dataType);
         fprintf(fp, "  NX, NY:            %d  %d\n", nx, ny);
         fprintf(fp, "  Data type:         %d\n", dataType);
+        fprintf(fp, "  Latency (us)       p50       p99       max     count\n");
+        for (int stage = 0; stage < mpxStageCount; stage++)
+            fprintf(fp, "    %-12s %9.1f %9.1f %9.1f %9u\n",
+                    mpxLatencyStageNames[stage],
+                    latency[stage].getPercentile(0.5) / 1000,
+                    latency[stage].getPercentile(0.99) / 1000,
+                    latency[stage].getMax() / 1000, latency[stage].getCount());
     }
     /* Invoke the base class method */
     ADDriver::report(fp, details);
@@ -1346,10 +3058,11 @@ void medipixDetector::report(FILE *fp, int details)
 extern "C" int medipixDetectorConfig(const char *portName,
         const char *LabviewCommandPort, const char *LabviewDataPort,
         int maxSizeX, int maxSizeY, int detectorType, int maxBuffers,
-        size_t maxMemory, int priority, int stackSize)
+        size_t maxMemory, int priority, int stackSize, int decodeThreads)
 {
     new medipixDetector(portName, LabviewCommandPort, LabviewDataPort, maxSizeX,
-            maxSizeY, detectorType, maxBuffers, maxMemory, priority, stackSize);
+            maxSizeY, detectorType, maxBuffers, maxMemory, priority, stackSize,
+            decodeThreads);
     return (asynSuccess);
 }
 
@@ -1368,11 +3081,13 @@ extern "C" int medipixDetectorConfig(const char *portName,
  *            allowed to allocate. Set this to -1 to allow an unlimited amount of memory.
  * \param[in] priority The thread priority for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
  * \param[in] stackSize The stack size for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
+ * \param[in] decodeThreads The number of threads used to decode data frames. Set this to 0 to use
+ *            the default of MPX_DEFAULT_DECODE_THREADS.
  */
 medipixDetector::medipixDetector(const char *portName,
         const char *LabviewCommandPort, const char *LabviewDataPort,
         int maxSizeX, int maxSizeY, int detectorType, int maxBuffers,
-        size_t maxMemory, int priority, int stackSize)
+        size_t maxMemory, int priority, int stackSize, int decodeThreads)
 
 :
         ADDriver(portName, 1, NUM_medipix_PARAMS, maxBuffers, maxMemory,
@@ -1390,10 +3105,12 @@ medipixDetector::medipixDetector(const char *portName,
     size_t dims[2];
 
     startingUp = 1;
+    framesPerAcquire = 1;
     strcpy(LabviewCommandPortName, LabviewCommandPort);
     strcpy(LabviewDataPortName, LabviewDataPort);
 
     detType = (medipixDetectorType) detectorType;
+    selectDecoders();
 
     /* Allocate the raw buffer we use to read image files.  Only do this once */
     dims[0] = maxSizeX;
@@ -1414,7 +3131,11 @@ medipixDetector::medipixDetector(const char *portName,
             &this->pasynLabViewData, NULL);
 
     cmdConnection = new mpxConnection(pasynUserSelf, pasynLabViewCmd, this);
-    dataConnection = new mpxConnection(pasynUserSelf, pasynLabViewData, this);
+    dataConnection = new mpxConnection(pasynUserSelf, pasynLabViewData, this,
+            MPX_DATA_READ_AHEAD_LEN);
+
+    // forget the settings cached for labview if the command channel drops
+    cmdConnection->mpxMonitorConnection(LabviewCommandPort);
 
     cmdConnection->mpxCommand(MPXCMD_STOPACQUISITION, Labview_DEFAULT_TIMEOUT);
 
@@ -1474,7 +3195,184 @@ medipixDetector::medipixDetector(const char *portName,
     createParam(medipixSelectGuiString, asynParamOctet,
             &medipixSelectGui);
 
+    createParam(medipixAcquisitionIdString, asynParamInt32,
+            &medipixAcquisitionId);
+    createParam(medipixAcqHeaderModeString, asynParamInt32,
+            &medipixAcqHeaderMode);
+    createParam(medipixCommandWaitString, asynParamInt32,
+            &medipixCommandWait);
+    createParam(medipixCommandsPendingString, asynParamInt32,
+            &medipixCommandsPending);
+    createParam(medipixCaptureFileString, asynParamOctet,
+            &medipixCaptureFile);
+    createParam(medipixCaptureString, asynParamInt32, &medipixCapture);
+    createParam(medipixCaptureBytesString, asynParamFloat64,
+            &medipixCaptureBytes);
+    createParam(medipixReplayFileString, asynParamOctet, &medipixReplayFile);
+    createParam(medipixReplayString, asynParamInt32, &medipixReplay);
+    createParam(medipixReplayBytesString, asynParamFloat64,
+            &medipixReplayBytes);
+    createParam(medipixStackFramesString, asynParamInt32, &medipixStackFrames);
+    createParam(medipixSumFramesString, asynParamInt32, &medipixSumFrames);
+    createParam(medipixSumBinningString, asynParamInt32, &medipixSumBinning);
+    createParam(medipixSumDataTypeString, asynParamInt32,
+            &medipixSumDataType);
+    createParam(medipixFlatFieldFramesString, asynParamInt32,
+            &medipixFlatFieldFrames);
+    createParam(medipixFlatFieldCollectString, asynParamInt32,
+            &medipixFlatFieldCollect);
+    createParam(medipixFlatFieldCorrectString, asynParamInt32,
+            &medipixFlatFieldCorrect);
+    createParam(medipixFlatFieldValidString, asynParamInt32,
+            &medipixFlatFieldValid);
+    createParam(medipixFlatFieldAverageString, asynParamFloat64,
+            &medipixFlatFieldAverage);
+    createParam(medipixBadPixelFileString, asynParamOctet,
+            &medipixBadPixelFile);
+    createParam(medipixBadPixelsString, asynParamOctet, &medipixBadPixels);
+    createParam(medipixBadPixelModeString, asynParamInt32,
+            &medipixBadPixelMode);
+    createParam(medipixBadPixelGapsString, asynParamInt32,
+            &medipixBadPixelGaps);
+    createParam(medipixBadPixelCountString, asynParamInt32,
+            &medipixBadPixelCount);
+    createParam(medipixProjectionsString, asynParamInt32,
+            &medipixProjections);
+    createParam(medipixTotalCountsString, asynParamFloat64,
+            &medipixTotalCounts);
+    createParam(medipixCentroidXString, asynParamFloat64, &medipixCentroidX);
+    createParam(medipixCentroidYString, asynParamFloat64, &medipixCentroidY);
+    createParam(medipixProfileFitString, asynParamInt32, &medipixProfileFit);
+    createParam(medipixProfileFitThresholdString, asynParamFloat64,
+            &medipixProfileFitThreshold);
+    createParam(medipixFitValidString, asynParamInt32, &medipixFitValid);
+    createParam(medipixFitXPositionString, asynParamFloat64,
+            &medipixFitXPosition);
+    createParam(medipixFitXWidthString, asynParamFloat64, &medipixFitXWidth);
+    createParam(medipixFitXIntensityString, asynParamFloat64,
+            &medipixFitXIntensity);
+    createParam(medipixFitYPositionString, asynParamFloat64,
+            &medipixFitYPosition);
+    createParam(medipixFitYWidthString, asynParamFloat64, &medipixFitYWidth);
+    createParam(medipixFitYIntensityString, asynParamFloat64,
+            &medipixFitYIntensity);
+    createParam(medipixSpectrumString, asynParamInt32, &medipixSpectrum);
+    createParam(medipixSpectrumEveryString, asynParamInt32,
+            &medipixSpectrumEvery);
+    createParam(medipixSpectrumSegmentString, asynParamInt32,
+            &medipixSpectrumSegment);
+    createParam(medipixSpectrumResetString, asynParamInt32,
+            &medipixSpectrumReset);
+    createParam(medipixSpectrumRateString, asynParamFloat64,
+            &medipixSpectrumRate);
+    createParam(medipixSpectrumXString, asynParamFloat64Array,
+            &medipixSpectrumX);
+    createParam(medipixSpectrumYString, asynParamFloat64Array,
+            &medipixSpectrumY);
+    createParam(medipixSpectrumFreqString, asynParamFloat64Array,
+            &medipixSpectrumFreq);
+    createParam(medipixHistoryXString, asynParamFloat64Array,
+            &medipixHistoryX);
+    createParam(medipixHistoryYString, asynParamFloat64Array,
+            &medipixHistoryY);
+    createParam(medipixGeometryRemapString, asynParamInt32,
+            &medipixGeometryRemap);
+    createParam(medipixGeometryEdgeWidthString, asynParamInt32,
+            &medipixGeometryEdgeWidth);
+    createParam(medipixGeometryGapString, asynParamInt32,
+            &medipixGeometryGap);
+    createParam(medipixGeometryRotateString, asynParamInt32,
+            &medipixGeometryRotate);
+    createParam(medipixRawFileString, asynParamOctet, &medipixRawFile);
+    createParam(medipixRawFileSizeString, asynParamInt32,
+            &medipixRawFileSize);
+    createParam(medipixRawWriteString, asynParamInt32, &medipixRawWrite);
+    createParam(medipixRawLiveEveryString, asynParamInt32,
+            &medipixRawLiveEvery);
+    createParam(medipixRawFramesString, asynParamInt32, &medipixRawFrames);
+    createParam(medipixRawBytesString, asynParamFloat64, &medipixRawBytes);
+    createParam(medipixFramesMissingString, asynParamInt32,
+            &medipixFramesMissing);
+    createParam(medipixFramesDuplicateString, asynParamInt32,
+            &medipixFramesDuplicate);
+    createParam(medipixFramesOutOfOrderString, asynParamInt32,
+            &medipixFramesOutOfOrder);
+    createParam(medipixLatencyResetString, asynParamInt32,
+            &medipixLatencyReset);
+    createParam(medipixLatencyString, asynParamFloat64Array, &medipixLatency);
+    for (int stage = 0; stage < mpxStageCount; stage++)
+    {
+        char name[MAX_MESSAGE_SIZE];
+
+        epicsSnprintf(name, sizeof(name), "LATENCY_%s_P50",
+                mpxLatencyStageNames[stage]);
+        createParam(name, asynParamFloat64, &medipixLatencyP50[stage]);
+        epicsSnprintf(name, sizeof(name), "LATENCY_%s_P99",
+                mpxLatencyStageNames[stage]);
+        createParam(name, asynParamFloat64, &medipixLatencyP99[stage]);
+        epicsSnprintf(name, sizeof(name), "LATENCY_%s_MAX",
+                mpxLatencyStageNames[stage]);
+        createParam(name, asynParamFloat64, &medipixLatencyMax[stage]);
+    }
+
     setStringParam(medipixSelectGui, "medipixEmbedded.edl");
+    setIntegerParam(medipixAcquisitionId, 0);
+    setIntegerParam(medipixAcqHeaderMode, MPXAcqHeaderFirstFrame);
+    setIntegerParam(medipixCommandWait, 0);
+    setIntegerParam(medipixCommandsPending, 0);
+    setStringParam(medipixCaptureFile, "");
+    setIntegerParam(medipixCapture, 0);
+    setDoubleParam(medipixCaptureBytes, 0);
+    setStringParam(medipixReplayFile, "");
+    setIntegerParam(medipixReplay, mpxReplayOff);
+    setDoubleParam(medipixReplayBytes, 0);
+    setIntegerParam(medipixStackFrames, 0);
+    setIntegerParam(medipixSumFrames, 0);
+    setIntegerParam(medipixSumBinning, 0);
+    setIntegerParam(medipixSumDataType, MPXSumUInt32);
+    setIntegerParam(medipixFlatFieldFrames, 10);
+    setIntegerParam(medipixFlatFieldCollect, 0);
+    setIntegerParam(medipixFlatFieldCorrect, MPXFlatFieldOff);
+    setIntegerParam(medipixFlatFieldValid, 0);
+    setDoubleParam(medipixFlatFieldAverage, 0);
+    setStringParam(medipixBadPixelFile, "");
+    setStringParam(medipixBadPixels, "");
+    setIntegerParam(medipixBadPixelMode, mpxBadPixelOff);
+    setIntegerParam(medipixBadPixelGaps, 0);
+    setIntegerParam(medipixBadPixelCount, 0);
+    setIntegerParam(medipixProjections, 0);
+    setDoubleParam(medipixTotalCounts, 0);
+    setDoubleParam(medipixCentroidX, 0);
+    setDoubleParam(medipixCentroidY, 0);
+    setIntegerParam(medipixProfileFit, mpxFitOff);
+    setDoubleParam(medipixProfileFitThreshold, 0.2);
+    setIntegerParam(medipixFitValid, 0);
+    setDoubleParam(medipixFitXPosition, 0);
+    setDoubleParam(medipixFitXWidth, 0);
+    setDoubleParam(medipixFitXIntensity, 0);
+    setDoubleParam(medipixFitYPosition, 0);
+    setDoubleParam(medipixFitYWidth, 0);
+    setDoubleParam(medipixFitYIntensity, 0);
+    setIntegerParam(medipixSpectrum, 0);
+    setIntegerParam(medipixSpectrumEvery, 1000);
+    setIntegerParam(medipixSpectrumSegment, 1024);
+    setIntegerParam(medipixSpectrumReset, 0);
+    setDoubleParam(medipixSpectrumRate, 0);
+    setIntegerParam(medipixGeometryRemap, 0);
+    setIntegerParam(medipixGeometryEdgeWidth, 2);
+    setIntegerParam(medipixGeometryGap, 0);
+    setIntegerParam(medipixGeometryRotate, 0);
+    setStringParam(medipixRawFile, "");
+    setIntegerParam(medipixRawFileSize, 0);
+    setIntegerParam(medipixRawWrite, 0);
+    setIntegerParam(medipixRawLiveEvery, 100);
+    setIntegerParam(medipixRawFrames, 0);
+    setDoubleParam(medipixRawBytes, 0);
+    setIntegerParam(medipixFramesMissing, 0);
+    setIntegerParam(medipixFramesDuplicate, 0);
+    setIntegerParam(medipixFramesOutOfOrder, 0);
+    setIntegerParam(medipixLatencyReset, 0);
+    updateLatency();
 
     /* Set some default values for parameters */
     switch (detectorType)
@@ -1529,7 +3427,99 @@ medipixDetector::medipixDetector(const char *portName,
         return;
     }
 
-    /* Create the thread that updates the images */
+    // largest non image frame (profiles and acquisition headers) we accept
+    switch (detType)
+    {
+    case UomXBPM:
+        maxBodySize = MAX_BUFF_UOM;
+        break;
+    case Merlin:
+    case MedipixXBPM:
+        maxBodySize = MPX_IMG_FRAME_LEN24;
+        break;
+    case MerlinQuad:
+        maxBodySize = MAX_BUFF_MERLIN_QUAD;
+        break;
+    default:
+        maxBodySize = MAX_BUFF_UOM;
+        break;
+    }
+
+    /* Create the frame pipeline, all frames start on the free list */
+    pAcquisition = NULL;
+    acquisitionCount = 0;
+    publishedAcquisitionId = 0;
+    frameNumberAcquisitionId = 0;
+    expectedFrameNumber = -1;
+    missingFrames = 0;
+    rawImageCount = 0;
+    pStackImage = NULL;
+    stackNext = 0;
+    pPendingArray = NULL;
+    pendingNs = 0;
+    pendingSum = false;
+    pendingFrames = 0;
+    pSumImage = NULL;
+    sumCount = 0;
+    sumLock = epicsMutexMustCreate();
+    pFlatGain = NULL;
+    averageFlatField = 0;
+    flatFramesToTake = 0;
+    flatFramesWanted = 0;
+    flatFramesTaken = 0;
+    flatFieldDims[0] = 0;
+    flatFieldDims[1] = 0;
+    badPixels = NULL;
+    numBadPixels = 0;
+    pBadPixelMap = NULL;
+    pGeometry = NULL;
+    this->decodeThreads = decodeThreads;
+    if (this->decodeThreads <= 0)
+        this->decodeThreads = MPX_DEFAULT_DECODE_THREADS;
+    if (this->decodeThreads > MPX_MAX_DECODE_THREADS)
+        this->decodeThreads = MPX_MAX_DECODE_THREADS;
+
+    freeQueue = epicsMessageQueueCreate(MPX_PIPELINE_DEPTH, sizeof(mpxFrame*));
+    decodeQueue = epicsMessageQueueCreate(MPX_PIPELINE_DEPTH,
+            sizeof(mpxFrame*));
+    publishQueue = epicsMessageQueueCreate(MPX_PIPELINE_DEPTH,
+            sizeof(mpxFrame*));
+    frames = (mpxFrame*) calloc(MPX_PIPELINE_DEPTH, sizeof(mpxFrame));
+    for (int i = 0; i < MPX_PIPELINE_DEPTH; i++)
+    {
+        mpxFrame *pFrame = &frames[i];
+        pFrame->pAttr = new NDAttributeList();
+        epicsMessageQueueSend(freeQueue, &pFrame, sizeof(pFrame));
+    }
+
+    /* Create the thread that publishes the images */
+    status = (epicsThreadCreate("medipixPublish", epicsThreadPriorityMedium,
+            epicsThreadGetStackSize(epicsThreadStackMedium),
+            (EPICSTHREADFUNC) medipixPublishTaskC, this) == NULL);
+    if (status)
+    {
+        printf("%s:%s epicsThreadCreate failure for publish task\n",
+                driverName, functionName);
+        return;
+    }
+
+    /* Create the threads that decode the images */
+    for (int i = 0; i < this->decodeThreads; i++)
+    {
+        char threadName[32];
+        epicsSnprintf(threadName, sizeof(threadName), "medipixDecode%d", i);
+        status = (epicsThreadCreate(threadName, epicsThreadPriorityMedium,
+                epicsThreadGetStackSize(epicsThreadStackMedium),
+                (EPICSTHREADFUNC) medipixDecodeTaskC, this) == NULL);
+        if (status)
+        {
+            printf("%s:%s epicsThreadCreate failure for decode task\n",
+                    driverName, functionName);
+            return;
+        }
+    }
+
+    /* Create the thread that receives the images */
     status = (epicsThreadCreate("medipixDetTask", epicsThreadPriorityMedium,
             epicsThreadGetStackSize(epicsThreadStackMedium),
             (EPICSTHREADFUNC) medipixTaskC, this) == NULL);
@@ -1540,6 +3530,32 @@ medipixDetector::medipixDetector(const char *portName,
         return;
     }
 
+    /* Create the thread that sends commands to labview */
+    this->commandQueue = epicsMessageQueueCreate(MPX_COMMAND_QUEUE_LEN,
+            sizeof(mpxCommandRequest));
+    this->commandDone = epicsEventMustCreate(epicsEventEmpty);
+    status = (epicsThreadCreate("medipixCommand", epicsThreadPriorityMedium,
+            epicsThreadGetStackSize(epicsThreadStackMedium),
+            (EPICSTHREADFUNC) medipixCommandTaskC, this) == NULL);
+    if (status)
+    {
+        printf("%s:%s epicsThreadCreate failure for command task\n",
+                driverName, functionName);
+        return;
+    }
+
+    /* Create the thread that computes the beam position spectrum */
+    this->spectrumEvent = epicsEventMustCreate(epicsEventEmpty);
+    status = (epicsThreadCreate("medipixSpectrum", epicsThreadPriorityLow,
+            epicsThreadGetStackSize(epicsThreadStackMedium),
+            (EPICSTHREADFUNC) medipixSpectrumTaskC, this) == NULL);
+    if (status)
+    {
+        printf("%s:%s epicsThreadCreate failure for spectrum task\n",
+                driverName, functionName);
+        return;
+    }
+
     /* Create the thread that monitors detector status (temperature, humidity, etc). */
     status = (epicsThreadCreate("medipixStatusTask", epicsThreadPriorityMedium,
             epicsThreadGetStackSize(epicsThreadStackMedium),
@@ -1574,19 +3590,22 @@ static const iocshArg medipixDetectorConfigArg8 =
 { "priority", iocshArgInt };
 static const iocshArg medipixDetectorConfigArg9 =
 { "stackSize", iocshArgInt };
+static const iocshArg medipixDetectorConfigArg10 =
+{ "decodeThreads", iocshArgInt };
 static const iocshArg * const medipixDetectorConfigArgs[] =
 { &medipixDetectorConfigArg0, &medipixDetectorConfigArg1,
         &medipixDetectorConfigArg2, &medipixDetectorConfigArg3,
         &medipixDetectorConfigArg4, &medipixDetectorConfigArg5,
         &medipixDetectorConfigArg6, &medipixDetectorConfigArg7,
-        &medipixDetectorConfigArg8, &medipixDetectorConfigArg9 };
+        &medipixDetectorConfigArg8, &medipixDetectorConfigArg9,
+        &medipixDetectorConfigArg10 };
 static const iocshFuncDef configmedipixDetector =
-{ "medipixDetectorConfig", 9, medipixDetectorConfigArgs };
+{ "medipixDetectorConfig", 11, medipixDetectorConfigArgs };
 static void configmedipixDetectorCallFunc(const iocshArgBuf *args)
 {
     medipixDetectorConfig(args[0].sval, args[1].sval, args[2].sval,
             args[3].ival, args[4].ival, args[5].ival, args[6].ival,
-            args[7].ival, args[8].ival, args[9].ival);
+            args[7].ival, args[8].ival, args[9].ival, args[10].ival);
 }
 
 static void medipixDetectorRegister(void)
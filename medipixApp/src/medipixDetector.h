@@ -8,15 +8,39 @@
 #ifndef MEDIPIXDETECTOR_H_
 #define MEDIPIXDETECTOR_H_
 
+#include <epicsMessageQueue.h>
+#include <epicsEvent.h>
+
+#include "mpxConnection.h"
+#include "mpxDecode.h"
+#include "mpxAcquisition.h"
+#include "mpxLatency.h"
+#include "mpxRawWriter.h"
+#include "mpxBadPixels.h"
+#include "mpxGeometry.h"
+#include "mpxProfileFit.h"
+#include "mpxSpectrum.h"
+
 /** Messages to/from Labview command channel */
 #define MAX_MESSAGE_SIZE 256
 #define MAX_FILENAME_LEN 256
-#define MAX_BAD_PIXELS 100
+/** Bad pixels that can be listed, a few percent of a Quad. The wide pixels
+ * over the sensor gaps are added by BAD_PIXEL_GAPS and are not counted */
+#define MAX_BAD_PIXELS 65536
+/** Pixels across each chip, the sensor gaps of a Quad are between chips */
+#define MPX_CHIP_SIZE 256
 /** Time to poll when reading from Labview */
 #define ASYN_POLL_TIME .01
 #define Labview_DEFAULT_TIMEOUT 2.0
 /** Time between checking to see if image file is complete */
 #define FILE_READ_DELAY .01
+/** Size of the read ahead buffer on the Labview data channel */
+#define MPX_DATA_READ_AHEAD_LEN (1024 * 1024)
+/** Number of frames that can be in the receive/decode/publish pipeline */
+#define MPX_PIPELINE_DEPTH 32
+/** Number of decode threads used if none are specified */
+#define MPX_DEFAULT_DECODE_THREADS 2
+#define MPX_MAX_DECODE_THREADS 16
 
 #define DIMS 2
 
@@ -59,6 +83,97 @@ typedef enum
     MPXQuadModeSumming
 } MPXQuadMode_t;
 
+/** When the full acquisition header is attached to frames */
+typedef enum
+{
+    MPXAcqHeaderFirstFrame,
+    MPXAcqHeaderEveryFrame
+} MPXAcqHeaderMode_t;
+
+/** How image frames are flat field corrected */
+typedef enum
+{
+    MPXFlatFieldOff,
+    MPXFlatFieldScaled,     // in place, rounded to the pixel type
+    MPXFlatFieldFloat32     // to a Float32 NDArray
+} MPXFlatFieldMode_t;
+
+/** Type of the NDArrays that frames are summed into */
+typedef enum
+{
+    MPXSumUInt32,
+    MPXSumFloat64       // exact for sums up to 2^53
+} MPXSumDataType_t;
+
+/** A data frame as it passes through the receive/decode/publish pipeline */
+typedef struct mpxFrame
+{
+    epicsUInt32 sequence;       // order in which the frame was received
+    epicsTimeStamp startTime;   // time at which the frame header arrived
+    uint64_t receivedNs;        // mpxLatencyNow() when the frame header arrived
+    uint64_t attributeNs;       // time spent building its attributes so far
+    medipixDataHeader header;
+    int headerSize;             // bytes of the frame body in frameHeader
+    int bodySize;               // total bytes in the frame body
+    int arrayCallbacks;         // NDArrayCallbacks when the frame arrived
+    const mpxImageDecoders *pDecoders;  // decoders for the acquisition
+    char frameHeader[MPX_MAX_DATA_HDR_LEN + 1];
+    mpxFrameHeader fields;      // frameHeader parsed by the receive thread
+    NDArray *pImage;            // image frames have their pixels read into this
+    void *pPixels;              // where in pImage the pixels of the frame go
+    int stackPlane;             // plane of a stacked pImage, -1 if not stacked
+    NDArray *pSum;              // the sum the frame is added to, if summing
+    mpxAccumulator accumulate;  // adds the frame to pSum
+    bool sumLast;               // the frame completes pSum
+    int pixelBytes;             // bytes per pixel of an image as received
+    NDArray *pFlatGain;         // gain of each pixel if flat field corrected
+    mpxFlatCorrector flatCorrect;  // applies pFlatGain to the frame
+    bool flatCollect;           // the frame is added to the flat field
+    mpxBadPixelMap *pBadPixels; // bad pixels replaced when it is decoded
+    mpxBadPixelMode badPixelMode;
+    mpxGeometry *pGeometry;     // remaps pImage into pRemapped when decoded
+    NDArray *pRemapped;         // pImage in the true geometry of the sensor
+    bool projectImage;          // compute the projections of the image
+    epicsFloat64 *pProjection;  // X then Y projections of the image
+    size_t projectionSize;      // room in pProjection
+    size_t projectionDims[2];   // size of the projections, 0 if none
+    epicsFloat64 projectionTotal;  // counts in the image
+    epicsFloat64 centroid[2];   // X and Y centroid in pixels
+    mpxFitMethod fitMethod;     // how the beam is found in the profiles
+    double fitThreshold;
+    mpxFitResult fit[2];        // the beam in the X and Y profiles
+    char *pBody;                // other frames are read into this
+    char *pBodyBuff;            // pBody points here, stays with the frame
+    size_t bodyBuffSize;        // room in pBodyBuff
+    size_t profileDims[2];      // size of the X and Y profiles in profile frames
+    NDAttributeList *pAttr;     // attributes parsed from the header
+    mpxAcquisition *pAcquisition;  // context of the acquisition the frame belongs to
+} mpxFrame;
+
+/** maximum number of requests waiting for the command thread */
+#define MPX_COMMAND_QUEUE_LEN 64
+
+/** Requests for the thread that talks to labview on the command channel */
+typedef enum
+{
+    MPXCmdWriteInt32,
+    MPXCmdWriteFloat64,
+    MPXCmdStartup
+} MPXCmdType_t;
+
+typedef struct mpxCommandRequest
+{
+    MPXCmdType_t type;
+    int function;           // parameter that was written
+    int iValue;             // value written to an integer parameter
+    double dValue;          // value written to a double parameter
+    double dOldValue;       // value it replaced, restored if labview fails
+    int imageMode;          // acquisition settings when ADAcquire was set
+    int imagesToAcquire;
+    int profileMask;
+    asynStatus *pStatus;    // set on completion if the writer is waiting
+} mpxCommandRequest;
+
 /** Medipix Individual Trigger types */
 
 #define TMTrigInternal  (char*)"0"
@@ -107,6 +222,97 @@ typedef enum
 #define medipixQuadMerlinModeString         "QUADMERLINMODE"
 #define medipixSelectGuiString              "SELECTGUI"
 
+// Acquisition header handling
+#define medipixAcquisitionIdString          "ACQUISITION_ID"
+#define medipixAcqHeaderModeString          "ACQ_HEADER_MODE"
+
+// Command thread
+#define medipixCommandWaitString            "CMD_WAIT"
+#define medipixCommandsPendingString        "CMD_PENDING"
+
+// Capture and replay of the data channel
+#define medipixCaptureFileString            "CAPTURE_FILE"
+#define medipixCaptureString                "CAPTURE"
+#define medipixCaptureBytesString           "CAPTURE_BYTES"
+#define medipixReplayFileString             "REPLAY_FILE"
+#define medipixReplayString                 "REPLAY"
+#define medipixReplayBytesString            "REPLAY_BYTES"
+
+// Stack the frames of one exposure in colour and 2 threshold modes
+#define medipixStackFramesString            "STACK_FRAMES"
+
+// Sum (and bin) frames in the driver
+#define medipixSumFramesString              "SUM_FRAMES"
+#define medipixSumBinningString             "SUM_BINNING"
+#define medipixSumDataTypeString            "SUM_DATA_TYPE"
+
+// Flat field correction
+#define medipixFlatFieldFramesString        "FLAT_FIELD_FRAMES"
+#define medipixFlatFieldCollectString       "FLAT_FIELD_COLLECT"
+#define medipixFlatFieldCorrectString       "FLAT_FIELD_CORRECT"
+#define medipixFlatFieldValidString         "FLAT_FIELD_VALID"
+#define medipixFlatFieldAverageString       "FLAT_FIELD_AVERAGE"
+
+// Bad pixels, listed in a file or written as text of "x,y" pairs
+#define medipixBadPixelFileString           "BAD_PIXEL_FILE"
+#define medipixBadPixelsString              "BAD_PIXELS"
+#define medipixBadPixelModeString           "BAD_PIXEL_MODE"
+#define medipixBadPixelGapsString           "BAD_PIXEL_GAPS"
+#define medipixBadPixelCountString          "BAD_PIXEL_COUNT"
+
+// X and Y projections and centroid of each image, computed in the driver
+#define medipixProjectionsString            "PROJECTIONS"
+#define medipixTotalCountsString            "TOTAL_COUNTS"
+#define medipixCentroidXString              "CENTROID_X"
+#define medipixCentroidYString              "CENTROID_Y"
+
+// Beam position fitted to the X and Y profiles or projections
+#define medipixProfileFitString             "PROFILE_FIT"
+#define medipixProfileFitThresholdString    "PROFILE_FIT_THRESHOLD"
+#define medipixFitValidString               "FIT_VALID"
+#define medipixFitXPositionString           "FIT_X_POSITION"
+#define medipixFitXWidthString              "FIT_X_WIDTH"
+#define medipixFitXIntensityString          "FIT_X_INTENSITY"
+#define medipixFitYPositionString           "FIT_Y_POSITION"
+#define medipixFitYWidthString              "FIT_Y_WIDTH"
+#define medipixFitYIntensityString          "FIT_Y_INTENSITY"
+
+// History and spectrum of the fitted beam position for vibration analysis
+#define medipixSpectrumString               "SPECTRUM"
+#define medipixSpectrumEveryString          "SPECTRUM_EVERY"
+#define medipixSpectrumSegmentString        "SPECTRUM_SEGMENT"
+#define medipixSpectrumResetString          "SPECTRUM_RESET"
+#define medipixSpectrumRateString           "SPECTRUM_RATE"
+#define medipixSpectrumXString              "SPECTRUM_X"
+#define medipixSpectrumYString              "SPECTRUM_Y"
+#define medipixSpectrumFreqString           "SPECTRUM_FREQ"
+#define medipixHistoryXString               "HISTORY_X"
+#define medipixHistoryYString               "HISTORY_Y"
+
+// Remapping Merlin Quad frames into the true geometry of the sensor
+#define medipixGeometryRemapString          "GEOMETRY_REMAP"
+#define medipixGeometryEdgeWidthString      "GEOMETRY_EDGE_WIDTH"
+#define medipixGeometryGapString            "GEOMETRY_GAP"
+#define medipixGeometryRotateString         "GEOMETRY_ROTATE"
+
+// Writing the data frames straight to a raw file
+#define medipixRawFileString                "RAW_FILE"
+#define medipixRawFileSizeString            "RAW_FILE_SIZE"
+#define medipixRawWriteString               "RAW_WRITE"
+#define medipixRawLiveEveryString           "RAW_LIVE_EVERY"
+#define medipixRawFramesString              "RAW_FRAMES"
+#define medipixRawBytesString               "RAW_BYTES"
+
+// Frame numbers that were skipped, repeated or went backwards
+#define medipixFramesMissingString          "FRAMES_MISSING"
+#define medipixFramesDuplicateString        "FRAMES_DUPLICATE"
+#define medipixFramesOutOfOrderString       "FRAMES_OUT_OF_ORDER"
+
+// Latency of each stage of the data path. The p50, p99 and max of a stage are
+// LATENCY_<stage>_P50, _P99 and _MAX, see mpxLatencyStageNames
+#define medipixLatencyResetString           "LATENCY_RESET"
+#define medipixLatencyString                "LATENCY"
+
 class mpxConnection;
 
 /** Driver for Dectris medipix pixel array detectors using their Labview server over TCP/IP socket */
@@ -116,16 +322,20 @@ public:
     medipixDetector(const char *portName, const char *LabviewCmdPort,
             const char *LabviewDataPort, int maxSizeX, int maxSizeY,
             int detectorType, int maxBuffers, size_t maxMemory, int priority,
-            int stackSize);
+            int stackSize, int decodeThreads);
 
     /* These are the methods that we override from ADDriver */
     virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
     virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
-//    virtual asynStatus writeOctet(asynUser *pasynUser, const char *value,
-//            size_t nChars, size_t *nActual);
+    virtual asynStatus writeOctet(asynUser *pasynUser, const char *value,
+            size_t nChars, size_t *nActual);
     void report(FILE *fp, int details);
     void medipixTask(); /* This should be private but is called from C so must be public */
     void medipixStatus(); /* This should be private but is called from C so must be public */
+    void medipixDecodeTask(); /* This should be private but is called from C so must be public */
+    void medipixPublishTask(); /* This should be private but is called from C so must be public */
+    void medipixCommandTask(); /* This should be private but is called from C so must be public */
+    void medipixSpectrumTask(); /* This should be private but is called from C so must be public */
 
     void fromLabViewStr(const char *str);
     void toLabViewStr(const char *str);
@@ -162,8 +372,73 @@ protected:
     int medipixEnableImageSum;
     int medipixQuadMerlinMode;
     int medipixSelectGui;
-
-#define LAST_medipix_PARAM medipixSelectGui
+    int medipixAcquisitionId;
+    int medipixAcqHeaderMode;
+    int medipixCommandWait;
+    int medipixCommandsPending;
+    int medipixCaptureFile;
+    int medipixCapture;
+    int medipixCaptureBytes;
+    int medipixReplayFile;
+    int medipixReplay;
+    int medipixReplayBytes;
+    int medipixStackFrames;
+    int medipixSumFrames;
+    int medipixSumBinning;
+    int medipixSumDataType;
+    int medipixFlatFieldFrames;
+    int medipixFlatFieldCollect;
+    int medipixFlatFieldCorrect;
+    int medipixFlatFieldValid;
+    int medipixFlatFieldAverage;
+    int medipixBadPixelFile;
+    int medipixBadPixels;
+    int medipixBadPixelMode;
+    int medipixBadPixelGaps;
+    int medipixBadPixelCount;
+    int medipixProjections;
+    int medipixTotalCounts;
+    int medipixCentroidX;
+    int medipixCentroidY;
+    int medipixProfileFit;
+    int medipixProfileFitThreshold;
+    int medipixFitValid;
+    int medipixFitXPosition;
+    int medipixFitXWidth;
+    int medipixFitXIntensity;
+    int medipixFitYPosition;
+    int medipixFitYWidth;
+    int medipixFitYIntensity;
+    int medipixSpectrum;
+    int medipixSpectrumEvery;
+    int medipixSpectrumSegment;
+    int medipixSpectrumReset;
+    int medipixSpectrumRate;
+    int medipixSpectrumX;
+    int medipixSpectrumY;
+    int medipixSpectrumFreq;
+    int medipixHistoryX;
+    int medipixHistoryY;
+    int medipixGeometryRemap;
+    int medipixGeometryEdgeWidth;
+    int medipixGeometryGap;
+    int medipixGeometryRotate;
+    int medipixRawFile;
+    int medipixRawFileSize;
+    int medipixRawWrite;
+    int medipixRawLiveEvery;
+    int medipixRawFrames;
+    int medipixRawBytes;
+    int medipixFramesMissing;
+    int medipixFramesDuplicate;
+    int medipixFramesOutOfOrder;
+    int medipixLatencyReset;
+    int medipixLatency;
+    int medipixLatencyP50[mpxStageCount];
+    int medipixLatencyP99[mpxStageCount];
+    int medipixLatencyMax[mpxStageCount];
+
+#define LAST_medipix_PARAM medipixLatencyMax[mpxStageCount - 1]
 
 private:
     /* These are the methods that are new to this class */
@@ -174,19 +449,64 @@ private:
     asynStatus getThreshold();
     asynStatus updateThresholdScanParms();
     asynStatus setROI();
+    asynStatus queueCommand(mpxCommandRequest *pRequest);
+    asynStatus runCommandBatch();
+    asynStatus executeInt32(const mpxCommandRequest *pRequest);
+    asynStatus executeFloat64(const mpxCommandRequest *pRequest);
+    asynStatus executeStartup();
+    asynStatus setCapture(int enable);
+    asynStatus setReplay(int mode);
+    asynStatus setRawWrite(int enable);
+    void updateStreamCounts();
+    void updateLatency();
 
     NDArray* copyProfileToNDArray32(size_t *dims, char *buffer,
-            int profileMask);
-    NDArray* copyToNDArray16(size_t *dims, char *buffer, int offset);
-    NDArray* copyToNDArray32(size_t *dims, char *buffer, int offset);
-    inline void endian_swap(unsigned short& x);
-    inline void endian_swap(unsigned int& x);
-    inline void endian_swap(uint64_t& x);
+            const mpxImageDecoders *pDecoders);
+    asynStatus readFrameHeader(char *frameHeader, medipixDataHeader *header,
+            int *headerSize, int *bodySize);
+    void frameDims(const mpxFrameHeader *pHdr, size_t *dims);
+    NDArray* allocateImage(const mpxFrameHeader *pHdr, int depth,
+            bool asFloat);
+    int frameImageBytes(const mpxFrame *pFrame);
+    int planeBytes(NDArray *pImage);
+    void allocateStackPlane(mpxFrame *pFrame, int stackDepth);
+    void finishStack();
+    void attachSum(mpxFrame *pFrame, int sumFrames);
+    void finishSum();
+    int flatFieldMode(mpxFrame *pFrame, bool collected);
+    asynStatus setFlatFieldCollect(int enable);
+    void addFlatFieldFrame(mpxFrame *pFrame);
+    void computeFlatField();
+    asynStatus loadBadPixelFile(const char *fileName);
+    asynStatus setBadPixels(const char *text);
+    void attachBadPixels(mpxFrame *pFrame);
+    void invalidateBadPixelMap();
+    void attachGeometry(mpxFrame *pFrame);
+    void invalidateGeometry();
+    asynStatus readImagePayload(mpxFrame *pFrame, int payloadSize);
+    void decodeFrame(mpxFrame *pFrame);
+    void publishFrame(mpxFrame *pFrame);
+    void publishProfiles(mpxFrame *pFrame);
+    void projectImage(mpxFrame *pFrame);
+    void publishProjections(mpxFrame *pFrame);
+    void addFitAttributes(mpxFrame *pFrame);
+    void publishFit(mpxFrame *pFrame);
+    void publishPending();
+    void doArrayCallbacks(NDArray *pImage, uint64_t receivedNs);
+    void checkFrameNumber(mpxFrame *pFrame);
+    void releaseFrame(mpxFrame *pFrame);
+    bool isRawOnly(medipixDataHeader header, int stackDepth);
+    void commitRawFrame(mpxFrame *pFrame, char *pRaw, int payloadSize);
+    bool reserveBody(mpxFrame *pFrame);
+    bool isImageHeader(medipixDataHeader header);
+    void decodeImage(mpxFrame *pFrame);
+    void addHeaderAttributes(mpxFrame *pFrame);
+    void selectDecoders();
     unsigned int maxSize[2];
 
     /* Our data */
     int imagesRemaining;
-    NDArray *pFlatField;
+    NDArray *pFlatField;        // sum of the frames of the flat field being taken
     int multipleFileNumber;
     asynUser *pasynLabViewCmd;
     asynUser *pasynLabViewData;
@@ -202,9 +522,79 @@ private:
     char LabviewDataPortName[20];
 
     medipixDetectorType detType;
+    const mpxImageDecoders *pImageDecoders;  // chosen at the start of each acquisition
 
-    mpxConnection *cmdConnection;
+    mpxConnection *cmdConnection;  // only used by the command thread
     mpxConnection *dataConnection;
+
+    /* requests for the command thread */
+    epicsMessageQueueId commandQueue;
+    epicsEventId commandDone;
+
+    /* receive/decode/publish pipeline */
+    int decodeThreads;
+    int maxBodySize;  // largest non image frame we accept
+    mpxFrame *frames;
+    epicsMessageQueueId freeQueue;
+    epicsMessageQueueId decodeQueue;
+    epicsMessageQueueId publishQueue;
+
+    /* acquisition contexts - pAcquisition is only used by the receive thread */
+    mpxAcquisition *pAcquisition;
+    int acquisitionCount;
+    int publishedAcquisitionId;
+
+    /* frame number checks - only used by the publish thread */
+    int frameNumberAcquisitionId;
+    int expectedFrameNumber;    // -1 until the first frame of an acquisition
+    int missingFrames;          // lost since the last NDArray was published
+
+    /* stacking the frames of an exposure - the receive thread fills the
+     * planes of pStackImage, the publish thread passes pPendingArray (a
+     * stack or a sum) on */
+    NDArray *pStackImage;
+    int stackNext;              // the plane after the last one filled
+    NDArray *pPendingArray;
+    uint64_t pendingNs;         // when the last frame of it was received
+    bool pendingSum;            // pPendingArray is a sum
+    int pendingFrames;          // frames published into pPendingArray
+
+    /* summing frames - the receive thread adds frames to pSumImage, the
+     * decode threads add the pixels in under sumLock */
+    NDArray *pSumImage;
+    int sumCount;               // frames added to pSumImage
+    epicsMutexId sumLock;
+
+    /* flat field - frames to take are counted down by the receive thread,
+     * the publish thread adds them up and computes pFlatGain */
+    NDArray *pFlatGain;
+    int flatFramesToTake;
+    int flatFramesWanted;
+    int flatFramesTaken;
+    size_t flatFieldDims[2];
+
+    /* bad pixels - the list is compiled into pBadPixelMap for the size of
+     * the frames by the receive thread, both under the driver lock */
+    mpxBadPixel *badPixels;
+    int numBadPixels;
+    mpxBadPixelMap *pBadPixelMap;
+
+    /* geometry of the Merlin Quad layout, compiled by the receive thread */
+    mpxGeometry *pGeometry;
+
+    /* raw file writing - frames go to the file from the receive thread */
+    mpxRawWriter rawWriter;
+    int rawImageCount;          // images written since the file was opened
+
+    /* latency of each stage of the data path, recorded without the lock */
+    mpxLatencyHistogram latency[mpxStageCount];
+    epicsFloat64 latencySummary[mpxStageCount * 3];
+
+    /* beam position history - the publish thread adds the fitted position
+     * of each frame under the lock and wakes the spectrum thread every
+     * SPECTRUM_EVERY frames */
+    mpxHistory positionHistory;
+    epicsEventId spectrumEvent;
 };
 
 #define NUM_medipix_PARAMS (&LAST_medipix_PARAM - &FIRST_medipix_PARAM + 1)
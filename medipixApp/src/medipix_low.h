@@ -37,6 +37,8 @@ extern int mpxDisconnect(void);
 
 #define MPX_MAXLINE 256
 #define MPX_IMG_HDR_LEN 256
+// largest data frame header we accept (MQ1 headers grow with the number of chips)
+#define MPX_MAX_DATA_HDR_LEN 4096
 #define MPX_ACQUISITION_HEADER_LEN 2044
 
 #define MPX_X_SIZE 256
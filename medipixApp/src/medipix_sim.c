@@ -1,7 +1,17 @@
 /**
  * Simple TCP server to simulate a medipix Labview system.
  * Arguments:
- *   port number - port number to listen for connections
+ *   command port number - port number to listen for command connections
+ *   data port number - port number to listen for data connections
+ *   -r - high rate mode, frames are pre-rendered and sent in batches at the
+ *        rate set by ACQUISITIONTIME/ACQUISITIONPERIOD
+ *   -u - with -r, send frames as fast as the client takes them
+ *   -p n - with -r, number of pre-rendered frames (default 16)
+ *   -f format - frames to send: merlin (12B/24B/P12/P24, the default),
+ *        quad (Merlin Quad MQ1) or uom (generic IMG/PRF). quad and uom
+ *        frames are always pre-rendered as in high rate mode
+ *   -c chips - with -f quad, 1 (256x256) or 4 (2x2, 512x512, the default)
+ *   -s WxH - with -f uom, the sensor size (default 256x256)
  * 
  * Matthew Pearson
  * Oct 2011
@@ -22,6 +32,7 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include <time.h>
 
@@ -32,6 +43,16 @@
 #define MPX_SUM_LEN 4
 #define CMDLEN 4
 #define HEADER_LEN 15 // this includes 2 commas + the header and length fields
+#define DATATYPELEN 3
+#define FRAME_NUMBER_LEN 6
+#define SIM_POOL_SIZE 16 // default number of pre-rendered frames in high rate mode
+#define SIM_BATCH 8 // most frames sent by one writev in high rate mode
+#define SIM_MAX_SLEEP 0.1 // longest wait between frames so that a stop is seen
+#define MQ1_HEADER_LEN(chips) (256 + 128 * (chips)) // as sent by a Merlin Quad
+#define MQ1_MAX_HEADER_LEN MQ1_HEADER_LEN(4)
+#define PROFILE_X 2 // bits of the PROFILES mask
+#define PROFILE_Y 4
+#define PROFILE_SUM 8
 /*Function prototypes.*/
 void sig_chld(int signo);
 int echo_request(int socket_fd);
@@ -39,6 +60,7 @@ int produce_data(int socket_fd);
 void *commandThread(void* command_fd);
 void *dataThread(void* data_fd);
 int produce_data(int data_fd);
+int produce_fast(int data_fd, int type);
 
 int frame_count = 0;
 int frames_to_send = 0;
@@ -52,6 +74,42 @@ pthread_cond_t do_data_cond = PTHREAD_COND_INITIALIZER;
 
 int Depth = 12;
 
+/* high rate mode */
+typedef struct sim_frame
+{
+    char *data;
+    int length;
+    int number_offset; // offset of the frame number digits in data
+} sim_frame;
+
+typedef enum
+{
+    SIM_MERLIN, SIM_QUAD, SIM_UOM
+} sim_format;
+
+int high_rate = 0;
+int unthrottled = 0;
+int pool_size = SIM_POOL_SIZE;
+int pool_count = 0;
+sim_frame *frame_pool = NULL;
+
+/* frame format and the detector settings that shape the frames */
+sim_format frame_format = SIM_MERLIN;
+int quad_chips = 4;
+int sensor_x = 256;
+int sensor_y = 256;
+int counter_depth = 12; // 1, 6, 12 or 24
+int enable_counter1 = 0; // 2 = both counters
+int colour_mode = 0;
+int profile_mask = PROFILE_X | PROFILE_Y | PROFILE_SUM;
+int roi[4] = { 0, 0, 0, 0 }; // x, y, width, height - 0 size for the full sensor
+double acquisition_time = 0; // ms
+double acquisition_period = 0; // ms
+volatile int stop_data = 0;
+
+static const char acquisition_header[] =
+        "MPX,0000000433,HDR,dummy acquisition header.0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789END";
+
 int main(int argc, char *argv[])
 {
     int fd, fd2, fd_data, fd2_data;
@@ -60,15 +118,67 @@ int main(int argc, char *argv[])
             client_addr_data;
 
     pthread_t tid, tid_data;
+    int arg;
 
     printf("Started Medipix simulation server...\n");
 
-    if (argc != 3)
+    if (argc < 3)
     {
-        printf("  ERROR: Use: %s {command socket} {data socket}\n", argv[0]);
+        printf("  ERROR: Use: %s {command socket} {data socket} [-r] [-u] [-p pool size]\n",
+                argv[0]);
         exit(EXIT_FAILURE);
     }
 
+    for (arg = 3; arg < argc; arg++)
+    {
+        if (!strcmp(argv[arg], "-r"))
+            high_rate = 1;
+        else if (!strcmp(argv[arg], "-u"))
+            unthrottled = 1;
+        else if (!strcmp(argv[arg], "-p") && arg + 1 < argc)
+            pool_size = atoi(argv[++arg]);
+        else if (!strcmp(argv[arg], "-f") && arg + 1 < argc)
+        {
+            arg++;
+            if (!strcmp(argv[arg], "merlin"))
+                frame_format = SIM_MERLIN;
+            else if (!strcmp(argv[arg], "quad"))
+                frame_format = SIM_QUAD;
+            else if (!strcmp(argv[arg], "uom"))
+                frame_format = SIM_UOM;
+            else
+            {
+                printf("  ERROR: unknown frame format %s\n", argv[arg]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (!strcmp(argv[arg], "-c") && arg + 1 < argc)
+            quad_chips = atoi(argv[++arg]) == 1 ? 1 : 4;
+        else if (!strcmp(argv[arg], "-s") && arg + 1 < argc)
+        {
+            if (sscanf(argv[++arg], "%dx%d", &sensor_x, &sensor_y) != 2
+                    || sensor_x < 1 || sensor_y < 1)
+            {
+                printf("  ERROR: bad sensor size %s\n", argv[arg]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else
+        {
+            printf("  ERROR: unknown option %s\n", argv[arg]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (pool_size < 1)
+        pool_size = 1;
+    if (frame_format == SIM_QUAD)
+        printf("Merlin Quad MQ1 frames, %d chips\n", quad_chips);
+    else if (frame_format == SIM_UOM)
+        printf("Generic IMG/PRF frames, %dx%d sensor\n", sensor_x, sensor_y);
+    if (high_rate)
+        printf("High rate mode, %d frame pool, %s\n", pool_size,
+                unthrottled ? "unthrottled" : "throttled by ACQUISITIONPERIOD");
+
     /* Create a TCP socket.*/
     fd = socket(AF_INET, SOCK_STREAM, 0);
     fd_data = socket(AF_INET, SOCK_STREAM, 0);
@@ -343,7 +453,37 @@ int echo_request(int socket_fd)
                     Depth = 12;
                 else
                     Depth = 24;
-                printf("switching counter depth to %d\n\n", Depth);
+                counter_depth = cmdIntValue;
+                if (counter_depth != 1 && counter_depth != 6
+                        && counter_depth != 12)
+                    counter_depth = 24;
+                printf("switching counter depth to %d\n\n", counter_depth);
+            }
+            else if (!strcmp(cmdName, "ENABLECOUNTER1"))
+            {
+                enable_counter1 = cmdIntValue;
+            }
+            else if (!strcmp(cmdName, "COLOURMODE"))
+            {
+                colour_mode = cmdIntValue;
+            }
+            else if (!strcmp(cmdName, "PROFILES"))
+            {
+                profile_mask = cmdIntValue;
+            }
+            else if (!strcmp(cmdName, "ROI") && cmdValue != NULL)
+            {
+                // "x y width height"
+                sscanf(cmdValue, "%d %d %d %d", &roi[0], &roi[1], &roi[2],
+                        &roi[3]);
+            }
+            else if (!strcmp(cmdName, "ACQUISITIONTIME") && cmdValue != NULL)
+            {
+                acquisition_time = atof(cmdValue);
+            }
+            else if (!strcmp(cmdName, "ACQUISITIONPERIOD") && cmdValue != NULL)
+            {
+                acquisition_period = atof(cmdValue);
             }
 
             // default response
@@ -389,6 +529,7 @@ int echo_request(int socket_fd)
                     frames_to_send = 7;
                 else
                     frames_to_send = frame_count;
+                stop_data = 0;
 
                 /*signal data thread to send some data back.*/
                 printf("***signalling data thread.\n");
@@ -407,6 +548,11 @@ int echo_request(int socket_fd)
                 pthread_mutex_unlock(&do_data_mutex);
                 printf("***data thread singnalled.\n");
             }
+            else if (!strncmp(cmdName, "STOPACQUISITION", 16))
+            {
+                // only the high rate mode sends frames without the mutex held
+                stop_data = 1;
+            }
 
             // construct response
             bodylen = strlen(cmdName) + 7;
@@ -495,10 +641,25 @@ int produce_data(int data_fd)
         {
             printf("starting frame sending with do_data = %d\n", do_data);
 
+            if (high_rate || frame_format != SIM_MERLIN)
+            {
+                // send without the mutex held so that the command thread can
+                // stop the acquisition
+                int type = do_data;
+
+                pthread_mutex_unlock(&do_data_mutex);
+                produce_fast(data_fd, type);
+                pthread_mutex_lock(&do_data_mutex);
+
+                // keep an exit request from the command thread
+                if (!data_exit)
+                    do_data = 0;
+                pthread_mutex_unlock(&do_data_mutex);
+                continue;
+            }
+
             // send a silly acquisition header
-            if (write(data_fd,
-                    "MPX,0000000433,HDR,dummy acquisition header.0123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789012345678901234567890123456789END",
-                    433 + HEADER_LEN - 1) <= 0)
+            if (write(data_fd, acquisition_header, 433 + HEADER_LEN - 1) <= 0)
             {
                 printf("Error writing acquisition header to client.\n");
                 do_data = 0;
@@ -529,7 +690,7 @@ int produce_data(int data_fd)
                         current);
 
                 // ??? getting spurious one byte garbage - so adding 1 to length of data packet ???
-                snprintf(data, HEADER_LEN, "MPX,%010u,",
+                snprintf(data, HEADER_LEN + 1, "MPX,%010u,",
                         thisFrameSize - HEADER_LEN + 1);
                 sprintf(buf2,
                         "%4d,1,%s.007,1.5E-2,6.0,8.01E2,1,2,3,4,5,6,7,8,9,10,1,2,3,4,5,6,7,8,1,20,21,22,23,24,25,00014",
@@ -596,3 +757,440 @@ int produce_data(int data_fd)
 
     return EXIT_SUCCESS;
 }
+
+/**
+ * Stores value in bytes bytes, big endian as a Merlin sends it or little
+ * endian as the UoM detectors send it.
+ */
+static void put_value(char *p, uint64_t value, int bytes, int big_endian)
+{
+    int i;
+
+    for (i = 0; i < bytes; i++)
+    {
+        p[big_endian ? bytes - 1 - i : i] = (char) (value & 0xFF);
+        value >>= 8;
+    }
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/**
+ * Bytes per pixel for a counter depth.
+ */
+static int pixel_bytes(int depth)
+{
+    if (depth <= 8)
+        return 1;
+    if (depth <= 12)
+        return 2;
+    return 4;
+}
+
+/**
+ * Number of frames sent for each acquisition, a Merlin Quad sends one frame
+ * per counter in 2 threshold mode and one per colour in colour mode.
+ */
+static int frames_per_acquire(void)
+{
+    if (frame_format != SIM_QUAD)
+        return 1;
+    if (colour_mode)
+        return 8;
+    if (enable_counter1 == 2)
+        return 2;
+    return 1;
+}
+
+/**
+ * Allocates a frame of headerLen bytes of data header and payloadLen bytes of
+ * payload and fills in the MPX header. The data header is copied in and
+ * padded with spaces to headerLen. Returns a pointer to the payload or NULL if
+ * out of memory.
+ */
+static char *alloc_frame(sim_frame *frame, const char *header, int headerLen,
+        int payloadLen)
+{
+    frame->length = HEADER_LEN + headerLen + payloadLen;
+    frame->data = malloc(frame->length + 1);
+    if (frame->data == NULL)
+        return NULL;
+
+    sprintf(frame->data, "MPX,%010u,", frame->length - HEADER_LEN + 1);
+    memset(frame->data + HEADER_LEN, ' ', headerLen);
+    memcpy(frame->data + HEADER_LEN, header, strlen(header));
+    memset(frame->data + HEADER_LEN + headerLen, 0, payloadLen + 1);
+
+    // the frame number follows the data type, e.g. "MQ1,"
+    frame->number_offset = HEADER_LEN + CMDLEN;
+    return frame->data + HEADER_LEN + headerLen;
+}
+
+/**
+ * Fills a width x height image with a pattern that varies with slot and
+ * counter so that consecutive frames differ.
+ */
+static void fill_image(char *p, int width, int height, int depth,
+        int big_endian, int slot, int counter)
+{
+    int bytes = pixel_bytes(depth);
+    uint64_t mask = ((uint64_t) 1 << depth) - 1;
+    int x, y;
+
+    for (y = 0; y < height; y++)
+        for (x = 0; x < width; x++)
+            put_value(p + ((size_t) y * width + x) * bytes,
+                    (uint64_t) (x + y + slot * 20 + counter * 50) & mask,
+                    bytes, big_endian);
+}
+
+/**
+ * Legacy Merlin 12B/24B image or P12/P24 profile frame.
+ */
+static int render_merlin(sim_frame *frame, int type, int slot,
+        const char *timebuf)
+{
+    char header[MAXLINE + 1];
+    int pixelBytes = Depth == 12 ? 2 : 4;
+    char *p;
+    int x;
+
+    // the frame number is patched in as each frame is sent
+    sprintf(header, "%s%02d%s,%0*d,1,%s.007,1.5E-2,6.0,8.01E2,1,2,3,4,5,6,7,8,"
+            "9,10,1,2,3,4,5,6,7,8,1,20,21,22,23,24,25,00014",
+            type == 2 ? "P" : "", Depth, type == 2 ? "" : "B",
+            FRAME_NUMBER_LEN, 0, timebuf);
+
+    if (type == 2)
+    {
+        p = alloc_frame(frame, header, CMDLEN + DATAHEADERLEN,
+                MPX_PROFILE_LEN * 2 + MPX_SUM_LEN);
+        if (p == NULL)
+            return EXIT_FAILURE;
+        for (x = 0; x < 256 * 2; x++)
+            put_value(p + x * 8, (uint64_t) (x + slot), 8, 1);
+    }
+    else
+    {
+        p = alloc_frame(frame, header, CMDLEN + DATAHEADERLEN,
+                256 * 256 * pixelBytes);
+        if (p == NULL)
+            return EXIT_FAILURE;
+        fill_image(p, 256, 256, Depth, 1, slot, 0);
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Merlin Quad MQ1 image frame. The header length field gives the offset of
+ * the pixels from the start of the frame body and grows with the number of
+ * chips, each of which adds its own DAC section. In colour mode the pixels
+ * are 2x2 binned.
+ */
+static int render_quad(sim_frame *frame, int slot, int counter,
+        const char *timebuf)
+{
+    char header[MQ1_MAX_HEADER_LEN + 1];
+    int headerLen = MQ1_HEADER_LEN(quad_chips);
+    int side = quad_chips == 1 ? 256 : 512;
+    int width = colour_mode ? side / 2 : side;
+    int height = colour_mode ? side / 2 : side;
+    int bits = pixel_bytes(counter_depth) * 8;
+    char *h = header;
+    char *p;
+    int i;
+
+    h += sprintf(h, "MQ1,%0*d,%05d,%02d,%04d,%04d,U%02d,%6s,%02X,"
+            "%s.000000,%.6E,%d,%d,0", FRAME_NUMBER_LEN, 0, headerLen,
+            quad_chips, width, height, bits, quad_chips == 1 ? "1x1" : "2x2",
+            (1 << quad_chips) - 1, timebuf, acquisition_time / 1000, counter,
+            colour_mode);
+    for (i = 0; i < 8; i++)
+        h += sprintf(h, ",%.6E", 10.0 + i);
+    for (i = 0; i < quad_chips; i++)
+        h += sprintf(h, ",3RX,511,000,000,000,000,000,000,000,100,010,"
+                "125,125,255,181,255,000,000,000,100,511,200,250,240,"
+                "240,255");
+
+    p = alloc_frame(frame, header, headerLen,
+            width * height * pixel_bytes(counter_depth));
+    if (p == NULL)
+        return EXIT_FAILURE;
+    fill_image(p, width, height, counter_depth, 1, slot, counter);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Generic IMG image or PRF profile frame, little endian. The size is the ROI
+ * (or the whole sensor) and the profile payload holds the X and Y profiles
+ * and the sum selected by the PROFILES mask.
+ */
+static int render_uom(sim_frame *frame, int type, int slot,
+        const char *timebuf)
+{
+    char header[MAXLINE + 1];
+    int x = roi[0], y = roi[1];
+    int width = roi[2] > 0 ? roi[2] : sensor_x;
+    int height = roi[3] > 0 ? roi[3] : sensor_y;
+    int bytes = pixel_bytes(counter_depth);
+    int payloadLen = 0;
+    char *h = header;
+    char *p;
+    int i;
+
+    if (x < 0 || x >= sensor_x)
+        x = 0;
+    if (y < 0 || y >= sensor_y)
+        y = 0;
+    if (width > sensor_x - x)
+        width = sensor_x - x;
+    if (height > sensor_y - y)
+        height = sensor_y - y;
+
+    h += sprintf(h, "%s,%0*d,000001,%s,%f,%05d,%05d,%05d,%05d,%03d,%03d,"
+            "10.000000,20.000000", type == 2 ? "PRF" : "IMG",
+            FRAME_NUMBER_LEN, 0, timebuf, acquisition_time / 1000, x, y,
+            width, height, counter_depth, bytes * 8);
+    for (i = 1; i <= 25; i++)
+        h += sprintf(h, ",%03d", i * 10);
+
+    if (type == 2)
+    {
+        h += sprintf(h, ",%05d", profile_mask);
+        if (profile_mask & PROFILE_X)
+            payloadLen += width * 8;
+        if (profile_mask & PROFILE_Y)
+            payloadLen += height * 8;
+        if (profile_mask & PROFILE_SUM)
+            payloadLen += 8;
+
+        p = alloc_frame(frame, header, CMDLEN + DATAHEADERLEN, payloadLen);
+        if (p == NULL)
+            return EXIT_FAILURE;
+        if (profile_mask & PROFILE_X)
+            for (i = 0; i < width; i++, p += 8)
+                put_value(p, (uint64_t) (i * 3 + slot), 8, 0);
+        if (profile_mask & PROFILE_Y)
+            for (i = 0; i < height; i++, p += 8)
+                put_value(p, (uint64_t) (i * 5 + slot), 8, 0);
+        if (profile_mask & PROFILE_SUM)
+            put_value(p, (uint64_t) width * height * (slot + 1), 8, 0);
+    }
+    else
+    {
+        p = alloc_frame(frame, header, CMDLEN + DATAHEADERLEN,
+                width * height * bytes);
+        if (p == NULL)
+            return EXIT_FAILURE;
+        fill_image(p, width, height, counter_depth, 0, slot, 0);
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Renders one complete data frame (MPX header, data header and payload) of
+ * the given type (1 = image, 2 = profile) in the current frame format.
+ * counter is the position of the frame in its acquisition. Returns
+ * EXIT_FAILURE if out of memory.
+ */
+static int render_frame(sim_frame *frame, int type, int slot, int counter,
+        const char *timebuf)
+{
+    switch (frame_format)
+    {
+    case SIM_QUAD:
+        // a Merlin Quad has no profile mode
+        return render_quad(frame, slot, counter, timebuf);
+    case SIM_UOM:
+        return render_uom(frame, type, slot, timebuf);
+    default:
+        return render_merlin(frame, type, slot, timebuf);
+    }
+}
+
+static void free_pool(void)
+{
+    int i;
+
+    if (frame_pool == NULL)
+        return;
+    for (i = 0; i < pool_count; i++)
+        free(frame_pool[i].data);
+    free(frame_pool);
+    frame_pool = NULL;
+    pool_count = 0;
+}
+
+/**
+ * Writes all of the iovecs, retrying after partial writes.
+ */
+static int write_all(int data_fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t written;
+
+    while (iovcnt > 0)
+    {
+        written = writev(data_fd, iov, iovcnt);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return EXIT_FAILURE;
+
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * High rate mode. Renders a pool of frames once per acquisition and then
+ * sends them in batches with writev, pacing the frames by
+ * ACQUISITIONTIME/ACQUISITIONPERIOD unless unthrottled. NUMFRAMESTOACQUIRE
+ * of 0 sends until STOPACQUISITION. Reports the achieved rates once a second
+ * and at the end of the acquisition.
+ */
+int produce_fast(int data_fd, int type)
+{
+    struct iovec iov[SIM_BATCH];
+    struct timespec start, pause;
+    char timebuf[32];
+    time_t now;
+    double interval, elapsed, wait;
+    double lastReport = 0;
+    unsigned long lastSent = 0, sent = 0;
+    double bytes = 0, lastBytes = 0;
+    int perAcquire = frames_per_acquire();
+    int total = frames_to_send * perAcquire;
+    int batch, i, digit;
+    unsigned long number;
+    int status = EXIT_SUCCESS;
+
+    // frames are sent every max(exposure, period)
+    interval = acquisition_period > acquisition_time ?
+            acquisition_period : acquisition_time;
+    interval = unthrottled ? 0 : interval / 1000;
+
+    now = time(0);
+    strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S.123",
+            localtime(&now));
+
+    // whole acquisitions fit in the pool so that each slot always holds the
+    // same counter
+    free_pool();
+    pool_count = (pool_size + perAcquire - 1) / perAcquire * perAcquire;
+    frame_pool = calloc(pool_count, sizeof(sim_frame));
+    if (frame_pool == NULL)
+        return EXIT_FAILURE;
+    for (i = 0; i < pool_count; i++)
+    {
+        if (render_frame(&frame_pool[i], type, i, i % perAcquire, timebuf)
+                != EXIT_SUCCESS)
+        {
+            printf("Unable to allocate the frame pool.\n");
+            free_pool();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (total == 0)
+        printf("*** sending %s frames of %d bytes every %g s until stopped\n",
+                type == 2 ? "profile" : "image", frame_pool[0].length, interval);
+    else
+        printf("*** sending %d %s frames of %d bytes every %g s\n", total,
+                type == 2 ? "profile" : "image", frame_pool[0].length, interval);
+
+    if (write(data_fd, acquisition_header, 433 + HEADER_LEN - 1) <= 0)
+    {
+        printf("Error writing acquisition header to client.\n");
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((total == 0 || sent < (unsigned long) total) && !stop_data
+            && !data_exit)
+    {
+        elapsed = elapsed_since(&start);
+
+        // the frames of acquisition n are due at n * interval
+        batch = SIM_BATCH;
+        if (interval > 0)
+        {
+            batch = ((int) (elapsed / interval) + 1) * perAcquire - (int) sent;
+            if (batch <= 0)
+            {
+                wait = (sent / perAcquire) * interval - elapsed;
+                if (wait > SIM_MAX_SLEEP)
+                    wait = SIM_MAX_SLEEP;
+                pause.tv_sec = (time_t) wait;
+                pause.tv_nsec = (long) ((wait - pause.tv_sec) * 1e9);
+                nanosleep(&pause, NULL);
+                continue;
+            }
+            if (batch > SIM_BATCH)
+                batch = SIM_BATCH;
+        }
+        if (batch > pool_count)
+            batch = pool_count;
+        if (total > 0 && sent + batch > (unsigned long) total)
+            batch = total - sent;
+
+        for (i = 0; i < batch; i++)
+        {
+            sim_frame *frame = &frame_pool[(sent + i) % pool_count];
+            char *p = frame->data + frame->number_offset;
+
+            number = sent + i + 1;
+            for (digit = FRAME_NUMBER_LEN - 1; digit >= 0; digit--)
+            {
+                p[digit] = '0' + number % 10;
+                number /= 10;
+            }
+            iov[i].iov_base = frame->data;
+            iov[i].iov_len = frame->length;
+            bytes += frame->length;
+        }
+
+        if (write_all(data_fd, iov, batch) != EXIT_SUCCESS)
+        {
+            printf("Error writing data frames to client.\n");
+            status = EXIT_FAILURE;
+            break;
+        }
+        sent += batch;
+
+        elapsed = elapsed_since(&start);
+        if (elapsed - lastReport >= 1.0)
+        {
+            printf("*** %lu frames, %.1f fps, %.1f MB/s\n", sent,
+                    (sent - lastSent) / (elapsed - lastReport),
+                    (bytes - lastBytes) / (elapsed - lastReport) / 1e6);
+            lastReport = elapsed;
+            lastSent = sent;
+            lastBytes = bytes;
+        }
+    }
+
+    elapsed = elapsed_since(&start);
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+    printf("*** sent %lu frames in %.3f s, %.1f fps, %.1f MB/s%s\n", sent,
+            elapsed, sent / elapsed, bytes / elapsed / 1e6,
+            stop_data ? " (stopped)" : "");
+
+    return status;
+}
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <epicsString.h>
+#include <epicsStdio.h>
+
+#include "ADDriver.h"
+
+#include "medipix_low.h"
+#include "mpxAcquisition.h"
+
+mpxAcquisition::mpxAcquisition(int id, const char *header, int length)
+{
+    this->id = id;
+    this->numFields = 0;
+
+    if (length < 0)
+        length = 0;
+    this->header = (char*) malloc(length + 1);
+    memcpy(this->header, header, length);
+    this->header[length] = 0;
+    this->values = epicsStrDup(this->header);
+
+    parse();
+}
+
+mpxAcquisition::~mpxAcquisition()
+{
+    free(header);
+    free(values);
+}
+
+const mpxAcqField *mpxAcquisition::findField(const char *name) const
+{
+    int i;
+
+    for (i = 0; i < numFields; i++)
+    {
+        // match with or without the "HDR " prefix
+        if (strcmp(fields[i].name, name) == 0
+                || strcmp(fields[i].name + 4, name) == 0)
+            return &fields[i];
+    }
+    return NULL;
+}
+
+/** Splits the header into "name: value" fields. The documented format puts
+ * each value on the line after its name, e.g.
+ *      Chip Type (Medipix3.0, Medipix3.1, Medipix3.2):
+ *      Medipix3.1
+ * and the Merlin software puts them on the same line separated by a tab,
+ * both are accepted. The help text in brackets is dropped from the name.
+ */
+void mpxAcquisition::parse()
+{
+    char *line = values;
+    char *next, *sep;
+    const char *pendingKey = NULL;
+    int pendingKeyLen = 0;
+    int len;
+
+    // skip the frame type
+    if (strncmp(line, MPX_DATA_ACQ_HDR ",", MPX_MSG_DATATYPE_LEN + 1) == 0)
+        line += MPX_MSG_DATATYPE_LEN + 1;
+
+    for (; *line != 0; line = next)
+    {
+        // terminate this line and find the next
+        next = line + strcspn(line, "\r\n");
+        if (*next != 0)
+            *next++ = 0;
+
+        while (*line == ' ' || *line == '\t')
+            line++;
+        len = strlen(line);
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+            line[--len] = 0;
+        if (len == 0)
+            continue;
+
+        if (line[len - 1] == ':')
+        {
+            // the value is on the next line
+            pendingKey = line;
+            pendingKeyLen = len - 1;
+        }
+        else if (pendingKey != NULL)
+        {
+            addField(pendingKey, pendingKeyLen, line);
+            pendingKey = NULL;
+        }
+        else if ((sep = strstr(line, ":\t")) != NULL
+                || (sep = strstr(line, ": ")) != NULL)
+        {
+            addField(line, sep - line, sep + 2);
+        }
+    }
+}
+
+void mpxAcquisition::addField(const char *key, int keyLen, char *value)
+{
+    mpxAcqField *pField;
+    const char *bracket;
+    char *end;
+
+    if (numFields >= MPX_ACQ_MAX_FIELDS)
+        return;
+    pField = &fields[numFields];
+
+    // drop the help text and any space before it
+    bracket = (const char*) memchr(key, '(', keyLen);
+    if (bracket != NULL)
+        keyLen = bracket - key;
+    while (keyLen > 0 && (key[keyLen - 1] == ' ' || key[keyLen - 1] == '\t'))
+        keyLen--;
+    if (keyLen == 0)
+        return;
+    epicsSnprintf(pField->name, MPX_ACQ_MAX_NAME_LEN, "HDR %.*s", keyLen, key);
+
+    while (*value == ' ' || *value == '\t')
+        value++;
+    pField->value = value;
+
+    // infer the type from the value
+    pField->type = mpxAcqFieldString;
+    pField->iValue = 0;
+    pField->dValue = 0;
+    if (*value != 0)
+    {
+        pField->iValue = strtol(value, &end, 10);
+        if (*end == 0)
+        {
+            pField->type = mpxAcqFieldInt;
+            pField->dValue = pField->iValue;
+        }
+        else
+        {
+            pField->dValue = strtod(value, &end);
+            if (*end == 0)
+                pField->type = mpxAcqFieldDouble;
+        }
+    }
+
+    numFields++;
+}
+
+void mpxAcquisition::addAttributes(NDAttributeList *pAttr) const
+{
+    int i;
+
+    pAttr->add("Acquisition Header", "", NDAttrString, header);
+
+    for (i = 0; i < numFields; i++)
+    {
+        const mpxAcqField *pField = &fields[i];
+        int iValue = pField->iValue;
+        double dValue = pField->dValue;
+
+        switch (pField->type)
+        {
+        case mpxAcqFieldInt:
+            pAttr->add(pField->name, "", NDAttrInt32, &iValue);
+            break;
+        case mpxAcqFieldDouble:
+            pAttr->add(pField->name, "", NDAttrFloat64, &dValue);
+            break;
+        default:
+            pAttr->add(pField->name, "", NDAttrString,
+                    (void*) pField->value);
+            break;
+        }
+    }
+}
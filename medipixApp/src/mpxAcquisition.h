@@ -0,0 +1,61 @@
+#ifndef MPXACQUISITION_H_
+#define MPXACQUISITION_H_
+
+#include "mpxRefCounted.h"
+
+class NDAttributeList;
+
+/** maximum number of "name: value" fields kept from an acquisition header */
+#define MPX_ACQ_MAX_FIELDS      64
+#define MPX_ACQ_MAX_NAME_LEN    48
+
+typedef enum
+{
+    mpxAcqFieldString,
+    mpxAcqFieldInt,
+    mpxAcqFieldDouble
+} mpxAcqFieldType;
+
+/** a single field of the acquisition header with its type inferred from
+ * the value */
+typedef struct mpxAcqField
+{
+    char name[MPX_ACQ_MAX_NAME_LEN];    // NDAttribute name, "HDR <key>"
+    const char *value;                  // points into the header copy
+    mpxAcqFieldType type;
+    int iValue;
+    double dValue;
+} mpxAcqField;
+
+/** The context of one acquisition, created from the HDR frame that starts
+ * it. The header is parsed once into typed fields and the context is shared
+ * by reference between all frames of the acquisition, so frames only carry
+ * the acquisition ID rather than a copy of the header.
+ */
+class mpxAcquisition : public mpxRefCounted
+{
+public:
+    mpxAcquisition(int id, const char *header, int length);
+
+    int getId() const { return id; }
+    const char *getHeader() const { return header; }
+    int getNumFields() const { return numFields; }
+    const mpxAcqField *getField(int index) const { return &fields[index]; }
+    const mpxAcqField *findField(const char *name) const;
+
+    /* adds the full header and a typed NDAttribute for each field */
+    void addAttributes(NDAttributeList *pAttr) const;
+
+private:
+    ~mpxAcquisition();
+    void parse();
+    void addField(const char *key, int keyLen, char *value);
+
+    int id;
+    char *header;       // the complete header as received
+    char *values;       // copy of the header that the field values point into
+    int numFields;
+    mpxAcqField fields[MPX_ACQ_MAX_FIELDS];
+};
+
+#endif /* MPXACQUISITION_H_ */
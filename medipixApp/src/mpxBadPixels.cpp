@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "mpxBadPixels.h"
+
+int mpxParseBadPixels(const char *text, mpxBadPixel *pPixels, int maxPixels)
+{
+    const char *p = text;
+    char *pEnd;
+    int count = 0;
+    long x, y;
+
+    while (*p)
+    {
+        if (isspace((unsigned char) *p) || *p == ';')
+        {
+            p++;
+            continue;
+        }
+        if (*p == '#')
+        {
+            while (*p && *p != '\n')
+                p++;
+            continue;
+        }
+
+        x = strtol(p, &pEnd, 10);
+        if (pEnd == p || *pEnd != ',')
+            return -1;
+        p = pEnd + 1;
+        y = strtol(p, &pEnd, 10);
+        if (pEnd == p || x < 0 || y < 0)
+            return -1;
+        p = pEnd;
+
+        if (count == maxPixels)
+            return -1;
+        pPixels[count].x = (int) x;
+        pPixels[count].y = (int) y;
+        count++;
+    }
+    return count;
+}
+
+static int compareIndex(const void *pA, const void *pB)
+{
+    epicsUInt32 a = *(const epicsUInt32 *) pA;
+    epicsUInt32 b = *(const epicsUInt32 *) pB;
+
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+mpxBadPixelMap::mpxBadPixelMap(const mpxBadPixel *pPixels, int numPixels,
+        size_t xsize, size_t ysize, int chipSize)
+{
+    int maxCount = numPixels;
+    int i, n;
+
+    this->xsize = xsize;
+    this->ysize = ysize;
+
+    if (chipSize > 0)
+        maxCount += (int) (2 * (xsize / chipSize) * ysize
+                + 2 * (ysize / chipSize) * xsize);
+    index = (epicsUInt32*) malloc((maxCount + 1) * sizeof(epicsUInt32));
+
+    count = 0;
+    for (i = 0; i < numPixels; i++)
+    {
+        if (pPixels[i].x < (int) xsize && pPixels[i].y < (int) ysize)
+            index[count++] = (epicsUInt32) (pPixels[i].y * xsize
+                    + pPixels[i].x);
+    }
+    if (chipSize > 0)
+        addChipBoundaries(chipSize, &count);
+
+    // sorted and without repeats so that the pixels are visited in memory
+    // order and the neighbours can be found by a binary search
+    qsort(index, count, sizeof(epicsUInt32), compareIndex);
+    for (i = 0, n = 0; i < count; i++)
+    {
+        if (n == 0 || index[i] != index[n - 1])
+            index[n++] = index[i];
+    }
+    count = n;
+
+    neighbours = (epicsUInt32*) malloc(
+            (count + 1) * MPX_BAD_PIXEL_NEIGHBOURS * sizeof(epicsUInt32));
+    numNeighbours = (epicsUInt8*) malloc(count + 1);
+    findNeighbours();
+}
+
+mpxBadPixelMap::~mpxBadPixelMap()
+{
+    free(index);
+    free(neighbours);
+    free(numNeighbours);
+}
+
+/** The last pixel before and the first after each boundary between chips */
+void mpxBadPixelMap::addChipBoundaries(int chipSize, int *pCount)
+{
+    size_t edge, x, y;
+
+    for (edge = chipSize; edge < xsize; edge += chipSize)
+    {
+        for (y = 0; y < ysize; y++)
+        {
+            index[(*pCount)++] = (epicsUInt32) (y * xsize + edge - 1);
+            index[(*pCount)++] = (epicsUInt32) (y * xsize + edge);
+        }
+    }
+    for (edge = chipSize; edge < ysize; edge += chipSize)
+    {
+        for (x = 0; x < xsize; x++)
+        {
+            index[(*pCount)++] = (epicsUInt32) ((edge - 1) * xsize + x);
+            index[(*pCount)++] = (epicsUInt32) (edge * xsize + x);
+        }
+    }
+}
+
+/** Finds the good pixels among the 8 around each bad pixel */
+void mpxBadPixelMap::findNeighbours()
+{
+    int i, dx, dy, n;
+    long x, y, nx, ny;
+    epicsUInt32 offset;
+
+    for (i = 0; i < count; i++)
+    {
+        x = index[i] % xsize;
+        y = index[i] / xsize;
+        n = 0;
+
+        for (dy = -1; dy <= 1; dy++)
+        {
+            for (dx = -1; dx <= 1; dx++)
+            {
+                nx = x + dx;
+                ny = y + dy;
+                if ((dx == 0 && dy == 0) || nx < 0 || ny < 0
+                        || nx >= (long) xsize || ny >= (long) ysize)
+                    continue;
+
+                offset = (epicsUInt32) (ny * xsize + nx);
+                if (bsearch(&offset, index, count, sizeof(epicsUInt32),
+                        compareIndex) == NULL)
+                    neighbours[i * MPX_BAD_PIXEL_NEIGHBOURS + n++] = offset;
+            }
+        }
+        numNeighbours[i] = (epicsUInt8) n;
+    }
+}
+
+template<typename PixelT>
+void mpxBadPixelMap::applyPixels(PixelT *pData, mpxBadPixelMode mode) const
+{
+    const epicsUInt32 *pNeighbours;
+    double total;
+    int i, n;
+
+    if (mode == mpxBadPixelZero)
+    {
+        for (i = 0; i < count; i++)
+            pData[index[i]] = 0;
+        return;
+    }
+
+    // the neighbours are good pixels so none of them has been replaced
+    for (i = 0; i < count; i++)
+    {
+        pNeighbours = neighbours + i * MPX_BAD_PIXEL_NEIGHBOURS;
+        total = 0;
+        for (n = 0; n < numNeighbours[i]; n++)
+            total += pData[pNeighbours[n]];
+        pData[index[i]] = numNeighbours[i] ?
+                (PixelT) (total / numNeighbours[i] + 0.5) : 0;
+    }
+}
+
+void mpxBadPixelMap::apply(void *pData, int pixelBytes,
+        mpxBadPixelMode mode) const
+{
+    if (mode == mpxBadPixelOff)
+        return;
+
+    switch (pixelBytes)
+    {
+    case 1:
+        applyPixels((epicsUInt8 *) pData, mode);
+        break;
+    case 2:
+        applyPixels((epicsUInt16 *) pData, mode);
+        break;
+    case 4:
+        applyPixels((epicsUInt32 *) pData, mode);
+        break;
+    default:
+        break;
+    }
+}
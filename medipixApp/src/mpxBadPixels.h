@@ -0,0 +1,70 @@
+#ifndef MPXBADPIXELS_H_
+#define MPXBADPIXELS_H_
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "mpxRefCounted.h"
+
+/** a pixel listed as bad, in image coordinates after the flip */
+typedef struct mpxBadPixel
+{
+    int x;
+    int y;
+} mpxBadPixel;
+
+/** How bad pixels are replaced */
+typedef enum
+{
+    mpxBadPixelOff,
+    mpxBadPixelZero,        // set to 0
+    mpxBadPixelMean         // the mean of the good pixels around them
+} mpxBadPixelMode;
+
+/** neighbours searched for a replacement value, the 8 around the pixel */
+#define MPX_BAD_PIXEL_NEIGHBOURS 8
+
+/** Parses a list of bad pixels, "x,y" pairs separated by white space or
+ * semicolons. A # starts a comment that runs to the end of the line. Returns
+ * the number of pixels or -1 if the text is not a valid list or has more
+ * than maxPixels */
+int mpxParseBadPixels(const char *text, mpxBadPixel *pPixels, int maxPixels);
+
+/** A list of bad pixels compiled for one image size into sorted pixel
+ * offsets, along with the offsets of the good neighbours of each, so that
+ * applying it costs time in proportion to the number of bad pixels and not
+ * to the size of the image. Pixels outside the image are ignored.
+ *
+ * If chipSize is given the pixels on each side of the boundaries between
+ * chips (the wide pixels over the sensor gaps of a Quad) are added.
+ */
+class mpxBadPixelMap : public mpxRefCounted
+{
+public:
+    mpxBadPixelMap(const mpxBadPixel *pPixels, int numPixels, size_t xsize,
+            size_t ysize, int chipSize);
+
+    size_t getXSize() const { return xsize; }
+    size_t getYSize() const { return ysize; }
+    int getCount() const { return count; }
+
+    /* replaces the bad pixels of a decoded image of pixelBytes per pixel */
+    void apply(void *pData, int pixelBytes, mpxBadPixelMode mode) const;
+
+private:
+    ~mpxBadPixelMap();
+    void addChipBoundaries(int chipSize, int *pCount);
+    void findNeighbours();
+    template<typename PixelT> void applyPixels(PixelT *pData,
+            mpxBadPixelMode mode) const;
+
+    size_t xsize;
+    size_t ysize;
+    int count;
+    epicsUInt32 *index;         // offsets of the bad pixels, sorted
+    epicsUInt32 *neighbours;    // MPX_BAD_PIXEL_NEIGHBOURS per bad pixel
+    epicsUInt8 *numNeighbours;  // good neighbours of each bad pixel
+};
+
+#endif /* MPXBADPIXELS_H_ */
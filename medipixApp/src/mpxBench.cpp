@@ -0,0 +1,387 @@
+/* mpxBench.cpp
+ *
+ * End to end benchmark of the data frame path without an IOC or a detector
+ *
+ * Builds a synthetic frame body (data header followed by the pixel or profile
+ * payload) for every frame type, pixel depth and size the driver handles and
+ * times each stage that the receive and decode threads apply to it:
+ *
+ *  type    mpxHeaderType() - what mpxConnection::parseDataHeader() does
+ *  header  mpxParseFrameHeader() and mpxHeaderPixelSize() - the parse of the
+ *          12B/24B/IMG/PRF and MQ1 headers
+ *  copy    a memcpy of the payload into the image buffer, standing in for
+ *          the socket read into the NDArray
+ *  decode  the byte swap and flip of an image (decodeImage()) or the 64 to
+ *          32 bit conversion of a profile (copyProfileToNDArray32())
+ *
+ * and reports the time per stage, frames/s and GB/s of frame body for each
+ * case. Every decoded frame is checked against the values it was built from.
+ * The kernels and the header parser have their own microbenchmarks in
+ * mpxDecodeBench and mpxHeaderBench.
+ *
+ * usage: mpxBench [seconds per stage] [case name filter]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+
+#include "medipix_low.h"
+#include "mpxHeader.h"
+#include "mpxDecode.h"
+
+#define BENCH_MQ_HDR_LEN 768
+
+typedef struct benchCase
+{
+    const char *name;
+    const char *type;       // frame type at the start of the body
+    size_t xsize;
+    size_t ysize;
+    int pixelBits;          // image pixel size or 64 for a profile
+    bool swap;              // big endian payload (Merlin and MerlinQuad)
+} benchCase;
+
+static const benchCase cases[] =
+{
+{ "12B 256x256", MPX_DATA_12, 256, 256, 16, true },
+{ "24B 256x256", MPX_DATA_24, 256, 256, 32, true },
+{ "IMG 256x256 8 bit", MPX_GENERIC_IMAGE, 256, 256, 8, false },
+{ "IMG 256x256 16 bit", MPX_GENERIC_IMAGE, 256, 256, 16, false },
+{ "IMG 256x256 32 bit", MPX_GENERIC_IMAGE, 256, 256, 32, false },
+{ "IMG 512x512 16 bit", MPX_GENERIC_IMAGE, 512, 512, 16, false },
+{ "IMG 512x512 32 bit", MPX_GENERIC_IMAGE, 512, 512, 32, false },
+{ "MQ1 256x256 U08", MPX_QUAD_DATA, 256, 256, 8, true },
+{ "MQ1 256x256 U16", MPX_QUAD_DATA, 256, 256, 16, true },
+{ "MQ1 256x256 U32", MPX_QUAD_DATA, 256, 256, 32, true },
+{ "MQ1 512x512 U08", MPX_QUAD_DATA, 512, 512, 8, true },
+{ "MQ1 512x512 U16", MPX_QUAD_DATA, 512, 512, 16, true },
+{ "MQ1 512x512 U32", MPX_QUAD_DATA, 512, 512, 32, true },
+{ "P12 256+256", MPX_PROFILE_12, 256, 256, 64, true },
+{ "P24 256+256", MPX_PROFILE_24, 256, 256, 64, true },
+{ "PRF 256+256", MPX_GENERIC_PROFILE, 256, 256, 64, false },
+{ "PRF 512+512", MPX_GENERIC_PROFILE, 512, 512, 64, false } };
+
+/** A frame body and the buffers each stage works on */
+typedef struct benchFrame
+{
+    const benchCase *pCase;
+    medipixDataHeader type;
+    char *body;
+    size_t headerLength;
+    size_t payloadLength;
+    size_t bodyLength;
+    void *pImage;           // image or profile destination
+    size_t imageLength;
+    const mpxImageDecoders *pDecoders;
+    mpxFrameHeader hdr;
+    volatile int sink;
+} benchFrame;
+
+typedef void (*benchStage)(benchFrame *pFrame);
+
+/** The value of the pixel at (x, y) of the decoded image */
+static epicsUInt32 pixelValue(size_t x, size_t y, int pixelBits)
+{
+    epicsUInt32 value = (epicsUInt32) (x * 7 + y * 131 + 0x01020304);
+
+    if (pixelBits < 32)
+        value &= (1u << pixelBits) - 1;
+    return value;
+}
+
+/** The value of element i of a decoded profile */
+static epicsUInt32 profileValue(size_t i)
+{
+    return (epicsUInt32) (i * 3 + 0x00A0B0C0);
+}
+
+/** Stores value in bytes bytes in the byte order of the case */
+static void putValue(char *p, uint64_t value, size_t bytes, bool swap)
+{
+    size_t i;
+
+    for (i = 0; i < bytes; i++)
+    {
+        if (swap)
+            p[bytes - 1 - i] = (char) (value >> (i * 8));
+        else
+            p[i] = (char) (value >> (i * 8));
+    }
+}
+
+/** Formats the data header of the case, padded to its fixed length */
+static size_t makeHeader(const benchCase *pCase, char *p)
+{
+    char *start = p;
+    size_t length = MPX_IMG_HDR_LEN;
+    int i;
+
+    p += sprintf(p, "%s,", pCase->type);
+    if (strcmp(pCase->type, MPX_QUAD_DATA) == 0)
+    {
+        length = BENCH_MQ_HDR_LEN;
+        p += sprintf(p, "000123,%05d,04,%04d,%04d,U%02d,   2x2,0F,"
+                "2013-09-17 13:01:53.744951,1.000000E-3,0,0,2", (int) length,
+                (int) pCase->xsize, (int) pCase->ysize, pCase->pixelBits);
+        for (i = 0; i < MPX_HDR_NUM_THRESHOLDS; i++)
+            p += sprintf(p, ",%f", 10.0 + i);
+        for (i = 0; i < 4; i++)
+            p += sprintf(p, ",3RX,511,000,000,000,000,000,000,000,100,010,"
+                    "125,125,255,181,255,000,000,000,100,511,200,250,240,"
+                    "240,255");
+    }
+    else
+    {
+        p += sprintf(p, "000123,000001,2013-09-17 13:01:53.744,0.001000,");
+        if (strcmp(pCase->type, MPX_GENERIC_IMAGE) == 0
+                || strcmp(pCase->type, MPX_GENERIC_PROFILE) == 0)
+            p += sprintf(p, "00000,00000,%05d,%05d,%03d,%03d,",
+                    (int) pCase->xsize, (int) pCase->ysize,
+                    pCase->pixelBits == 64 ? 32 : pCase->pixelBits,
+                    pCase->pixelBits == 64 ? 32 : pCase->pixelBits);
+        p += sprintf(p, "10.000000,20.000000");
+        for (i = 1; i <= MPX_HDR_NUM_DACS; i++)
+            p += sprintf(p, ",%03d", i * 10);
+        if (strcmp(pCase->type, MPX_GENERIC_PROFILE) == 0)
+            p += sprintf(p, ",00014");
+    }
+
+    while ((size_t) (p - start) < length)
+        *p++ = ' ';
+    return length;
+}
+
+/** Builds the frame body of a case as the detector sends it, i.e. with the
+ * origin at the bottom left and in the byte order of the detector */
+static bool makeFrame(const benchCase *pCase, benchFrame *pFrame)
+{
+    size_t x, y, n;
+    size_t pixelBytes = pCase->pixelBits / 8;
+    char *p;
+
+    memset(pFrame, 0, sizeof(*pFrame));
+    pFrame->pCase = pCase;
+    if (pCase->pixelBits == 64)
+    {
+        n = pCase->xsize + pCase->ysize;
+        pFrame->payloadLength = n * sizeof(uint64_t);
+        pFrame->imageLength = n * sizeof(epicsUInt32);
+    }
+    else
+    {
+        pFrame->payloadLength = pCase->xsize * pCase->ysize * pixelBytes;
+        pFrame->imageLength = pFrame->payloadLength;
+    }
+
+    pFrame->body = (char*) malloc(BENCH_MQ_HDR_LEN + pFrame->payloadLength);
+    pFrame->pImage = malloc(pFrame->imageLength);
+    if (pFrame->body == NULL || pFrame->pImage == NULL)
+        return false;
+
+    pFrame->headerLength = makeHeader(pCase, pFrame->body);
+    pFrame->bodyLength = pFrame->headerLength + pFrame->payloadLength;
+    p = pFrame->body + pFrame->headerLength;
+
+    if (pCase->pixelBits == 64)
+    {
+        for (x = 0; x < n; x++)
+            putValue(p + x * sizeof(uint64_t), profileValue(x),
+                    sizeof(uint64_t), pCase->swap);
+    }
+    else
+    {
+        for (y = 0; y < pCase->ysize; y++)
+            for (x = 0; x < pCase->xsize; x++)
+                putValue(p + ((pCase->ysize - 1 - y) * pCase->xsize + x)
+                        * pixelBytes, pixelValue(x, y, pCase->pixelBits),
+                        pixelBytes, pCase->swap);
+    }
+
+    pFrame->pDecoders = mpxGetImageDecoders(pCase->swap, true);
+    return true;
+}
+
+static void freeFrame(benchFrame *pFrame)
+{
+    free(pFrame->body);
+    free(pFrame->pImage);
+}
+
+// #######################################################################################
+// ##################### Stages                            ###############################
+// #######################################################################################
+
+static void stageType(benchFrame *pFrame)
+{
+    pFrame->type = mpxHeaderType(pFrame->body);
+}
+
+static void stageHeader(benchFrame *pFrame)
+{
+    mpxParseFrameHeader(pFrame->body, pFrame->headerLength, pFrame->type,
+            &pFrame->hdr);
+    pFrame->sink += mpxHeaderPixelSize(&pFrame->hdr);
+}
+
+static void stageCopy(benchFrame *pFrame)
+{
+    // profiles are converted straight out of the receive buffer
+    if (pFrame->pCase->pixelBits != 64)
+        memcpy(pFrame->pImage, pFrame->body + pFrame->headerLength,
+                pFrame->payloadLength);
+}
+
+static void stageDecode(benchFrame *pFrame)
+{
+    const benchCase *pCase = pFrame->pCase;
+
+    switch (pCase->pixelBits)
+    {
+    case 8:
+        pFrame->pDecoders->decode8(pFrame->pImage, pCase->xsize, pCase->ysize);
+        break;
+    case 16:
+        pFrame->pDecoders->decode16(pFrame->pImage, pCase->xsize, pCase->ysize);
+        break;
+    case 32:
+        pFrame->pDecoders->decode32(pFrame->pImage, pCase->xsize, pCase->ysize);
+        break;
+    default:
+        pFrame->pDecoders->decodeProfile((epicsUInt32*) pFrame->pImage,
+                pFrame->body + pFrame->headerLength,
+                pCase->xsize + pCase->ysize);
+        break;
+    }
+}
+
+/** Runs a stage repeatedly for at least minTime seconds and returns the
+ * average time of one run in ns. The clock is read every 64 runs so that the
+ * short stages are not swamped by it. */
+static double timeStage(benchStage stage, benchFrame *pFrame, double minTime)
+{
+    epicsTimeStamp start, now;
+    double elapsed;
+    long runs = 0;
+    int i;
+
+    epicsTimeGetCurrent(&start);
+    do
+    {
+        for (i = 0; i < 64; i++)
+            stage(pFrame);
+        runs += 64;
+        epicsTimeGetCurrent(&now);
+        elapsed = epicsTimeDiffInSeconds(&now, &start);
+    } while (elapsed < minTime);
+
+    return elapsed * 1e9 / runs;
+}
+
+/** Runs every stage once on a fresh copy of the frame and compares the result
+ * with the values the frame was built from. Returns the number of errors. */
+static int checkFrame(benchFrame *pFrame)
+{
+    const benchCase *pCase = pFrame->pCase;
+    const epicsUInt8 *p8 = (const epicsUInt8*) pFrame->pImage;
+    const epicsUInt16 *p16 = (const epicsUInt16*) pFrame->pImage;
+    const epicsUInt32 *p32 = (const epicsUInt32*) pFrame->pImage;
+    size_t x, y, n;
+    epicsUInt32 value;
+    int errors = 0;
+
+    stageType(pFrame);
+    stageHeader(pFrame);
+    stageCopy(pFrame);
+    stageDecode(pFrame);
+
+    if (pFrame->type == MPXUnknownHeader)
+        errors++;
+    if (pCase->pixelBits == 64)
+    {
+        n = pCase->xsize + pCase->ysize;
+        for (x = 0; x < n; x++)
+            if (p32[x] != profileValue(x))
+                errors++;
+        return errors;
+    }
+
+    if (pFrame->hdr.frameNumber != 123
+            || mpxHeaderPixelSize(&pFrame->hdr) != pCase->pixelBits)
+        errors++;
+    for (y = 0; y < pCase->ysize; y++)
+    {
+        for (x = 0; x < pCase->xsize; x++)
+        {
+            n = y * pCase->xsize + x;
+            if (pCase->pixelBits == 8)
+                value = p8[n];
+            else if (pCase->pixelBits == 16)
+                value = p16[n];
+            else
+                value = p32[n];
+            if (value != pixelValue(x, y, pCase->pixelBits))
+                errors++;
+        }
+    }
+    return errors;
+}
+
+int main(int argc, char **argv)
+{
+    double minTime = 0.2;
+    const char *filter = NULL;
+    double tType, tHeader, tCopy, tDecode, total;
+    int failures = 0;
+    benchFrame frame;
+    size_t c;
+
+    if (argc > 1)
+        minTime = atof(argv[1]);
+    if (minTime <= 0)
+        minTime = 0.2;
+    if (argc > 2)
+        filter = argv[2];
+
+    printf("%.2f s per stage\n\n", minTime);
+    printf("%-20s %10s %9s %9s %9s %9s %10s %7s\n", "case", "body bytes",
+            "type ns", "header ns", "copy ns", "decode ns", "frames/s",
+            "GB/s");
+
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        const benchCase *pCase = &cases[c];
+
+        if (filter != NULL && strstr(pCase->name, filter) == NULL)
+            continue;
+
+        if (!makeFrame(pCase, &frame))
+        {
+            printf("%-20s unable to allocate frame\n", pCase->name);
+            freeFrame(&frame);
+            return 1;
+        }
+
+        if (checkFrame(&frame) != 0)
+        {
+            printf("%-20s MISMATCH in decoded frame\n", pCase->name);
+            failures++;
+        }
+
+        tType = timeStage(stageType, &frame, minTime);
+        tHeader = timeStage(stageHeader, &frame, minTime);
+        tCopy = timeStage(stageCopy, &frame, minTime);
+        tDecode = timeStage(stageDecode, &frame, minTime);
+        total = tType + tHeader + tCopy + tDecode;
+
+        printf("%-20s %10lu %9.1f %9.1f %9.1f %9.1f %10.0f %7.2f\n",
+                pCase->name, (unsigned long) frame.bodyLength, tType, tHeader,
+                tCopy, tDecode, 1e9 / total, frame.bodyLength / total);
+
+        freeFrame(&frame);
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,251 @@
+/* capture files may be larger than 2GB */
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "mpxCapture.h"
+
+/* stdio buffer for capture and replay files */
+#define MPX_CAPTURE_BUFFER_LEN (1024 * 1024)
+
+// #######################################################################################
+// ##################### Capture                                  ########################
+// #######################################################################################
+
+mpxCapture::mpxCapture()
+{
+    file = NULL;
+    bytes = 0;
+    numRecords = 0;
+    index = NULL;
+    indexSize = 0;
+}
+
+mpxCapture::~mpxCapture()
+{
+    close();
+}
+
+bool mpxCapture::open(const char *fileName)
+{
+    uint32_t words[4];
+
+    close();
+
+    file = fopen(fileName, "wb");
+    if (file == NULL)
+        return false;
+    setvbuf(file, NULL, _IOFBF, MPX_CAPTURE_BUFFER_LEN);
+
+    epicsTimeGetCurrent(&start);
+    words[0] = MPX_CAPTURE_VERSION;
+    words[1] = start.secPastEpoch;
+    words[2] = start.nsec;
+    words[3] = 0;
+    fwrite(MPX_CAPTURE_MAGIC, 1, MPX_CAPTURE_MAGIC_LEN, file);
+    fwrite(words, sizeof(words), 1, file);
+
+    bytes = 0;
+    numRecords = 0;
+    return true;
+}
+
+/** Appends a record of the bytes just read with the time they arrived */
+void mpxCapture::write(const char *data, size_t length)
+{
+    epicsTimeStamp now;
+    uint64_t timeNs;
+    uint32_t recordLength = length;
+
+    if (file == NULL || length == 0)
+        return;
+
+    if (numRecords == indexSize)
+    {
+        uint64_t *newIndex;
+        uint64_t newSize = indexSize ? indexSize * 2 : 4096;
+
+        newIndex = (uint64_t*) realloc(index, newSize * sizeof(uint64_t));
+        if (newIndex == NULL)
+            return;
+        index = newIndex;
+        indexSize = newSize;
+    }
+    index[numRecords++] = ftello(file);
+
+    epicsTimeGetCurrent(&now);
+    timeNs = (uint64_t) (epicsTimeDiffInSeconds(&now, &start) * 1e9);
+    fwrite(&timeNs, sizeof(timeNs), 1, file);
+    fwrite(&recordLength, sizeof(recordLength), 1, file);
+    fwrite(data, 1, length, file);
+    bytes += length;
+}
+
+/** Writes the index and closes the file */
+void mpxCapture::close()
+{
+    uint64_t trailer[2];
+
+    if (file != NULL)
+    {
+        trailer[0] = ftello(file);
+        trailer[1] = numRecords;
+        fwrite(index, sizeof(uint64_t), numRecords, file);
+        fwrite(MPX_CAPTURE_INDEX_MAGIC, 1, MPX_CAPTURE_MAGIC_LEN, file);
+        fwrite(trailer, sizeof(trailer), 1, file);
+        fclose(file);
+        file = NULL;
+    }
+    free(index);
+    index = NULL;
+    indexSize = 0;
+}
+
+// #######################################################################################
+// ##################### Replay                                   ########################
+// #######################################################################################
+
+mpxReplay::mpxReplay()
+{
+    file = NULL;
+    mode = mpxReplayOff;
+    finished = false;
+    dataEnd = 0;
+    recordTimeNs = 0;
+    recordLeft = 0;
+    recordDue = false;
+    bytes = 0;
+    numRecords = 0;
+}
+
+mpxReplay::~mpxReplay()
+{
+    close();
+}
+
+bool mpxReplay::open(const char *fileName, mpxReplayMode mode)
+{
+    char magic[MPX_CAPTURE_MAGIC_LEN];
+    uint32_t words[4];
+    uint64_t trailer[2];
+    off_t headerEnd;
+
+    close();
+
+    file = fopen(fileName, "rb");
+    if (file == NULL)
+        return false;
+    setvbuf(file, NULL, _IOFBF, MPX_CAPTURE_BUFFER_LEN);
+
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+            || memcmp(magic, MPX_CAPTURE_MAGIC, sizeof(magic)) != 0
+            || fread(words, sizeof(words), 1, file) != 1
+            || words[0] != MPX_CAPTURE_VERSION)
+    {
+        close();
+        return false;
+    }
+    headerEnd = ftello(file);
+
+    // the records end where the index starts, a file without an index is
+    // read to the end
+    dataEnd = (uint64_t) -1;
+    if (fseeko(file, -(off_t) (sizeof(magic) + sizeof(trailer)), SEEK_END) == 0
+            && fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+            && memcmp(magic, MPX_CAPTURE_INDEX_MAGIC, sizeof(magic)) == 0
+            && fread(trailer, sizeof(trailer), 1, file) == 1)
+        dataEnd = trailer[0];
+    fseeko(file, headerEnd, SEEK_SET);
+
+    this->mode = mode;
+    finished = false;
+    recordLeft = 0;
+    recordDue = false;
+    bytes = 0;
+    numRecords = 0;
+    epicsTimeGetCurrent(&start);
+    return true;
+}
+
+void mpxReplay::close()
+{
+    if (file != NULL)
+        fclose(file);
+    file = NULL;
+}
+
+bool mpxReplay::nextRecord()
+{
+    uint64_t timeNs;
+    uint32_t length;
+
+    if ((uint64_t) ftello(file) >= dataEnd
+            || fread(&timeNs, sizeof(timeNs), 1, file) != 1
+            || fread(&length, sizeof(length), 1, file) != 1)
+    {
+        finished = true;
+        return false;
+    }
+
+    recordTimeNs = timeNs;
+    recordLeft = length;
+    recordDue = false;
+    numRecords++;
+    return true;
+}
+
+/** Returns false at the end of the capture. Otherwise sets *pDelay to how
+ * long the caller should wait before reading the next byte - when replaying
+ * with the recorded timing this is the time until the record it belongs to
+ * arrived in the capture, otherwise it is 0.
+ */
+bool mpxReplay::nextDue(double *pDelay)
+{
+    epicsTimeStamp now;
+
+    *pDelay = 0;
+    if (file == NULL || finished)
+        return false;
+    if (recordLeft == 0 && !nextRecord())
+        return false;
+
+    if (mode == mpxReplayRecordedTiming && !recordDue)
+    {
+        epicsTimeGetCurrent(&now);
+        *pDelay = recordTimeNs / 1e9 - epicsTimeDiffInSeconds(&now, &start);
+        if (*pDelay <= 0)
+            recordDue = true;
+    }
+    return true;
+}
+
+/** Reads up to maxBytes of the stream into buffer. Never returns more than
+ * the rest of the current record so that the driver sees the same reads it
+ * saw when the stream was captured. Returns 0 at the end of the capture.
+ */
+size_t mpxReplay::read(char *buffer, size_t maxBytes)
+{
+    size_t length;
+
+    if (file == NULL || finished)
+        return 0;
+    if (recordLeft == 0 && !nextRecord())
+        return 0;
+
+    recordDue = true;
+    length = recordLeft;
+    if (length > maxBytes)
+        length = maxBytes;
+    length = fread(buffer, 1, length, file);
+    if (length == 0)
+    {
+        finished = true;
+        return 0;
+    }
+
+    recordLeft -= length;
+    bytes += length;
+    return length;
+}
@@ -0,0 +1,103 @@
+#ifndef MPXCAPTURE_H_
+#define MPXCAPTURE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <epicsTime.h>
+
+/** Capture files hold the raw byte stream received on a labview channel so
+ * that it can be replayed through the driver later.
+ *
+ * All values are in the byte order of the machine that wrote the file.
+ *
+ *  file header     char magic[8]       "MPXCAP01"
+ *                  uint32_t version    MPX_CAPTURE_VERSION
+ *                  uint32_t startSecs  epics time of the first byte
+ *                  uint32_t startNsec
+ *                  uint32_t reserved
+ *
+ *  records         uint64_t timeNs     arrival time after the start
+ *                  uint32_t length     number of bytes that follow
+ *                  char data[length]   exactly as read from the socket
+ *
+ *  index           uint64_t offset     file offset of each record
+ *
+ *  trailer         char magic[8]       "MPXIDX01"
+ *                  uint64_t indexOffset
+ *                  uint64_t recordCount
+ *
+ * The index and trailer are written when the capture is closed. A file
+ * without them (e.g. the IOC died during a capture) is still replayed by
+ * reading the records until the end of the file.
+ */
+#define MPX_CAPTURE_MAGIC       "MPXCAP01"
+#define MPX_CAPTURE_INDEX_MAGIC "MPXIDX01"
+#define MPX_CAPTURE_MAGIC_LEN   8
+#define MPX_CAPTURE_VERSION     1
+
+/** How a capture is replayed */
+typedef enum
+{
+    mpxReplayOff,
+    mpxReplayRecordedTiming,    // each record is delivered at its arrival time
+    mpxReplayFast               // as fast as the driver can take it
+} mpxReplayMode;
+
+/** Writes a capture file */
+class mpxCapture
+{
+public:
+    mpxCapture();
+    ~mpxCapture();
+
+    bool open(const char *fileName);
+    void write(const char *data, size_t length);
+    void close();
+
+    bool isOpen() const { return file != NULL; }
+    uint64_t getBytes() const { return bytes; }
+    uint64_t getRecords() const { return numRecords; }
+
+private:
+    FILE *file;
+    epicsTimeStamp start;
+    uint64_t bytes;
+    uint64_t numRecords;
+    uint64_t *index;
+    uint64_t indexSize;
+};
+
+/** Reads a capture file back as a stream of bytes */
+class mpxReplay
+{
+public:
+    mpxReplay();
+    ~mpxReplay();
+
+    bool open(const char *fileName, mpxReplayMode mode);
+    bool nextDue(double *pDelay);
+    size_t read(char *buffer, size_t maxBytes);
+    void close();
+
+    bool isOpen() const { return file != NULL; }
+    bool isFinished() const { return finished; }
+    uint64_t getBytes() const { return bytes; }
+    uint64_t getRecords() const { return numRecords; }
+
+private:
+    bool nextRecord();
+
+    FILE *file;
+    mpxReplayMode mode;
+    bool finished;
+    epicsTimeStamp start;       // when the replay started
+    uint64_t dataEnd;           // offset of the index if the file has one
+    uint64_t recordTimeNs;      // arrival time of the current record
+    uint32_t recordLeft;        // bytes of the current record not yet read
+    bool recordDue;             // the current record has been timed
+    uint64_t bytes;
+    uint64_t numRecords;
+};
+
+#endif /* MPXCAPTURE_H_ */
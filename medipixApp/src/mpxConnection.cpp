@@ -6,6 +6,8 @@
 #include <time.h>
 #include <stdint.h>
 
+#include <epicsStdio.h>
+#include <epicsThread.h>
 #include <asynOctetSyncIO.h>
 
 #include "ADDriver.h"
@@ -19,319 +21,212 @@
 
 // Constructor
 mpxConnection::mpxConnection(asynUser* parentUser, asynUser* tcpUser,
-        medipixDetector* parentObj)
+        medipixDetector* parentObj, int readAheadSize)
 {
     this->parentUser = parentUser;
     this->tcpUser = tcpUser;
     this->parentObj = parentObj;
+    toLabview[0] = 0;
+    fromLabview[0] = 0;
+    fromLabviewHeader[0] = 0;
+    fromLabviewBody[0] = 0;
+    fromLabviewValue[0] = 0;
+
+    // must at least hold a complete MPX header
+    if (readAheadSize < MPX_MAXLINE)
+        readAheadSize = MPX_MAXLINE;
+    this->readAheadSize = readAheadSize;
+    this->readAhead = (char*) calloc(readAheadSize, 1);
+    this->readHead = 0;
+    this->readTail = 0;
+    this->batchCount = 0;
+    this->exceptionUser = NULL;
+    this->shadowCount = 0;
+    this->shadowStale = 0;
+    this->streamLock = epicsMutexMustCreate();
+}
+
+mpxConnection::~mpxConnection()
+{
+    free(this->readAhead);
+    epicsMutexDestroy(this->streamLock);
 }
 
 // parses the start of the data header and returns its type
 medipixDataHeader mpxConnection::parseDataHeader(const char* header)
 {
-    char buff[MPX_MSG_DATATYPE_LEN];
-    medipixDataHeader headerType = MPXUnknownHeader;
+    asynPrint(this->parentUser, ASYN_TRACE_MPX, "header type is %.*s\n",
+            MPX_MSG_DATATYPE_LEN, header);
 
-    strncpy(buff, header, MPX_MSG_DATATYPE_LEN);
+    return mpxHeaderType(header);
+}
 
-    if (!strncmp(buff, MPX_DATA_12, MPX_MSG_DATATYPE_LEN))
-        headerType = MPXDataHeader12;
-    else if (!strncmp(buff, MPX_DATA_24, MPX_MSG_DATATYPE_LEN))
-        headerType = MPXDataHeader24;
-    if (!strncmp(buff, MPX_GENERIC_IMAGE, MPX_MSG_DATATYPE_LEN))
-        headerType = MPXGenericImageHeader;
-    if (!strncmp(buff, MPX_PROFILE_12, MPX_MSG_DATATYPE_LEN))
-        headerType = MPXProfileHeader12;
-    else if (!strncmp(buff, MPX_PROFILE_24, MPX_MSG_DATATYPE_LEN))
-        headerType = MPXProfileHeader24;
-    else if (!strncmp(buff, MPX_GENERIC_PROFILE, MPX_MSG_DATATYPE_LEN))
-        headerType = MPXGenericProfileHeader;
-    else if (!strncmp(buff, MPX_QUAD_DATA, MPX_MSG_DATATYPE_LEN))
-        headerType = MPXQuadDataHeader;
-    else if (!strncmp(buff, MPX_DATA_ACQ_HDR, MPX_MSG_DATATYPE_LEN))
-        headerType = MPXAcquisitionHeader;
+// returns the total length of an MQ1 data header (i.e. the offset of the
+// pixel data from the start of the frame body) or -1 if it cannot be parsed
+int mpxConnection::parseMqHeaderLength(const char* header)
+{
+    const char* field;
 
-    asynPrint(this->parentUser, ASYN_TRACE_MPX, "header type is %s\n", buff);
+    // format is MQ1,<frame number>,<header length>,...
+    field = strchr(header, ',');
+    if (field != NULL)
+        field = strchr(field + 1, ',');
+    if (field == NULL)
+        return -1;
 
-    return headerType;
+    return atoi(field + 1);
 }
 
 
-// Data Frame Header Parser for frames from Merlin Quad
-// (This data format intended to extend to future products)
-// parses the data header and adds appropriate attributes to pImage
-void mpxConnection::parseMqDataFrame(NDAttributeList* pAttr, const char* header,
-		size_t *xsize, size_t *ysize, int* pixelDepth, int* offset)
+// parses a data frame header of any type into pHdr
+void mpxConnection::parseDataFrame(mpxFrameHeader* pHdr, const char* header,
+        int length, medipixDataHeader headerType)
 {
+    int numFields;
 
-    char buff[MPX_IMG_HDR_LEN + 1];
-    double dVal;
-    int iVal;
-    //int dacNum;
-    //char dacName[10];
-    char* tok;
-    char* save_ptr = NULL;
+    numFields = mpxParseFrameHeader(header, length, headerType, pHdr);
 
-    // make a copy since strtok_r is destructive
-    strncpy(buff, header, MPX_IMG_HDR_LEN);
-    buff[MPX_IMG_HDR_LEN + 1] = 0;
+    asynPrint(this->parentUser, ASYN_TRACE_MPX,
+            "Image frame Header: %.*s (%d fields)\n\n", length, header,
+            numFields);
+}
 
-    asynPrint(this->parentUser, ASYN_TRACE_MPX, "Image frame Header: %s\n\n",
-            buff);
+// adds NDAttributes for the fields of a parsed data frame header
+// 12B, 24B, P12, P24 - original Merlin frames
+// IMG, PRF - generic Frames (originally developed for UoM XBPM on B21)
+// MQ1 - frames from Merlin Quad (intended to extend to future products)
+void mpxConnection::addHeaderAttributes(NDAttributeList* pAttr,
+        const mpxFrameHeader* pHdr)
+{
+    const char *thresholdNames[MPX_HDR_NUM_THRESHOLDS] = { "Threshold 0",
+            "Threshold 1", "Threshold 2", "Threshold 3", "Threshold 4",
+            "Threshold 5", "Threshold 6", "Threshold 7" };
+    epicsUInt32 secs, msecs;
+    double dVal;
+    int iVal, dacNum, thNum, chip;
 
-    tok = strtok_r(buff, ",", &save_ptr);
-    tok = strtok_r(NULL, ",", &save_ptr);  // skip the (HDR already parsed)
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_FRAME_NUMBER))
     {
-        iVal = atol(tok);
+        iVal = pHdr->frameNumber;
         pAttr->add("Frame Number", "", NDAttrInt32, &iVal);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_COUNTER_NUMBER))
     {
-    	// this needs to be pushed up to caller since it changes depending on no. of chips
-        iVal = atoi(tok);
-        *offset = iVal;
+        iVal = pHdr->counterNumber;
+        pAttr->add("Counter Number", "", NDAttrInt32, &iVal);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_START_TIME))
     {
-        iVal = atoi(tok);
+        /*
+         * NOTE it has been decided that this driver will provide a timestamp and will ignore the value
+         * passed from medipix - this is because the FPGA does not have access to a clock while processing
+         * and hence all frames in a given acquisition are reported as starting at the same microsecond
+         **/
+        secs = (epicsUInt32) time(NULL);
+        msecs = 0;
+
+        pAttr->add("Start Time UTC seconds", "", NDAttrUInt32, &secs);
+        pAttr->add("Start Time millisecs", "", NDAttrUInt32, &msecs);
+    }
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_DURATION))
+    {
+        dVal = pHdr->duration;
+        pAttr->add("Duration", "", NDAttrFloat64, &dVal);
+    }
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_X_OFFSET))
+    {
+        iVal = pHdr->xOffset;
+        pAttr->add("X Offset", "", NDAttrInt32, &iVal);
+    }
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_Y_OFFSET))
+    {
+        iVal = pHdr->yOffset;
+        pAttr->add("Y Offset", "", NDAttrInt32, &iVal);
+    }
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_CHIP_COUNT))
+    {
+        iVal = pHdr->chipCount;
         pAttr->add("Chip Count", "", NDAttrInt8, &iVal);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_X_SIZE))
     {
-        iVal = atoi(tok);
-        *xsize = iVal;
+        iVal = pHdr->xSize;
         pAttr->add("X Size", "", NDAttrInt32, &iVal);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_Y_SIZE))
     {
-        iVal = atoi(tok);
-        *ysize = iVal;
+        iVal = pHdr->ySize;
         pAttr->add("Y Size", "", NDAttrInt32, &iVal);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_PIXEL_DEPTH))
     {
-    	tok++; // skip the leading U (on this strangely represented field)
-    	iVal = atoi(tok);
+        iVal = pHdr->pixelDepth;
         pAttr->add("Pixel Depth", "", NDAttrInt32, &iVal);
-        *pixelDepth = iVal;
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_PIXEL_SIZE))
     {
-        pAttr->add("Sensor Layout", "", NDAttrString, tok);
+        iVal = pHdr->pixelSize;
+        pAttr->add("Pixel Size", "", NDAttrInt32, &iVal);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_SENSOR_LAYOUT))
     {
-        iVal = strtoul(tok, NULL, 16);
+        pAttr->add("Sensor Layout", "", NDAttrString,
+                (void*) pHdr->sensorLayout);
+    }
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_CHIP_SELECT))
+    {
+        iVal = pHdr->chipSelect;
         pAttr->add("Chip Select", "", NDAttrInt8, &iVal);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_TIME_STAMP))
     {
-    	// TODO - need to convert time to useful (numeric) format
+        // TODO - need to convert time to useful (numeric) format
         pAttr->add("Time stamp", "", NDAttrInt32, 0);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_SHUTTER_TIME))
     {
-        dVal = atof(tok);
+        dVal = pHdr->shutterTime;
         pAttr->add("Shutter Time", "", NDAttrFloat64, &dVal);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_COUNTER))
     {
-        iVal = atoi(tok);
+        iVal = pHdr->counter;
         pAttr->add("Counter", "", NDAttrInt8, &iVal);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_COLOUR_MODE))
     {
-        iVal = atoi(tok);
+        iVal = pHdr->colourMode;
         pAttr->add("Colour Mode", "", NDAttrInt8, &iVal);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_GAIN_MODE))
     {
-        iVal = atoi(tok);
+        iVal = pHdr->gainMode;
         pAttr->add("Gain Mode", "", NDAttrInt8, &iVal);
     }
 
-
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    for (thNum = 0; thNum < pHdr->numThresholds; thNum++)
     {
-        dVal = atof(tok);
-        pAttr->add("Threshold 0", "", NDAttrFloat64, &dVal);
+        dVal = pHdr->threshold[thNum];
+        pAttr->add(thresholdNames[thNum], "", NDAttrFloat64, &dVal);
     }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
+    for (dacNum = 0; dacNum < pHdr->numDacs; dacNum++)
     {
-        dVal = atof(tok);
-        pAttr->add("Threshold 1", "", NDAttrFloat64, &dVal);
+        iVal = pHdr->dac[dacNum];
+        pAttr->add(mpxDacNames[dacNum], "", NDAttrInt32, &iVal);
     }
 
-    // TODO - rest of Thresholds and DACS (need to come up with naming convention for
-    // NDAttributes in repeating DACS block
-/*
-    for (dacNum = 1; dacNum <= 25; dacNum++ && tok != NULL)
+    for (chip = 0; chip < pHdr->numChips; chip++)
     {
-        tok = strtok_r(NULL, ",");
-        if (tok != NULL)
+        for (dacNum = 0; dacNum < pHdr->numChipDacs[chip]; dacNum++)
         {
-            iVal = atoi(tok);
-            sprintf(dacName, "DAC %03d", dacNum);
-            asynPrint(this->parentUser, ASYN_TRACE_MPX_VERBOSE, "dac %d = %d\n", dacNum, iVal);
-            pAttr->add(dacName, "", NDAttrInt32, &iVal);
+            iVal = pHdr->chipDac[chip][dacNum];
+            pAttr->add(mpxChipDacNames[chip][dacNum], "", NDAttrInt32, &iVal);
         }
     }
-*/
-}
-
-// Data Frame Header Parser for original Frames of type 12B and 24B
-// Also parses generic Frames of type IMG (originally developed for UoM XBPM
-//    on B21)
-// parses the data header and adds appropriate attributes to pImage
-void mpxConnection::parseDataFrame(NDAttributeList* pAttr, const char* header,
-        medipixDataHeader headerType, size_t *xsize, size_t *ysize,
-        int* pixelSize, int* profileMask)
-{
-    char buff[MPX_IMG_HDR_LEN + 1];
-    unsigned long lVal;
-    double dVal;
-    int iVal, dacNum;
-    char dacName[10];
-    char* tok;
-    char* save_ptr = NULL;
-
-    // initialise member variables that should be set during this parse
-    *profileMask = 0;
-
-    // make a copy since strtok_r is destructive
-    strncpy(buff, header, MPX_IMG_HDR_LEN);
-    buff[MPX_IMG_HDR_LEN + 1] = 0;
-
-    asynPrint(this->parentUser, ASYN_TRACE_MPX, "Image frame Header: %s\n\n",
-            buff);
 
-    tok = strtok_r(buff, ",", &save_ptr);
-    tok = strtok_r(NULL, ",", &save_ptr);  // skip the (HDR already parsed)
-    if (tok != NULL)
+    if (MPXHDR_PRESENT(pHdr, MPXHDR_PROFILE_MASK))
     {
-        iVal = atoi(tok);
-        pAttr->add("Frame Number", "", NDAttrInt32, &iVal);
-    }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        iVal = atoi(tok);
-        pAttr->add("Counter Number", "", NDAttrInt32, &iVal);
-    }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        time_t rawtime;
-        unsigned long msecs;
-
-        // Covert string representation to EPICS Time and store in attributes as
-        // a unsigned long
-        // format is 2012-02-01 11:26:00.000
-
-        /*
-         * NOTE it has been decided that this driver will provide a timestamp and will ignore the value
-         * passed from medipix - this is because the FPGA does not have access to a clock while processing
-         * and hence all frames in a given acquisition are reported as starting at the same microsecond
-         **/
-        rawtime = time(NULL);
-        lVal = (unsigned long) rawtime;
-        msecs = 0;
-
-        pAttr->add("Start Time UTC seconds", "", NDAttrUInt32, &lVal);
-        pAttr->add("Start Time millisecs", "", NDAttrUInt32, &msecs);
-    }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        dVal = atof(tok);
-        pAttr->add("Duration", "", NDAttrFloat64, &dVal);
-    }
-    if (headerType == MPXGenericImageHeader
-            || headerType == MPXGenericProfileHeader)
-    {
-        tok = strtok_r(NULL, ",", &save_ptr);
-        if (tok != NULL)
-        {
-            iVal = atoi(tok);
-            pAttr->add("X Offset", "", NDAttrInt32, &iVal);
-        }
-        tok = strtok_r(NULL, ",", &save_ptr);
-        if (tok != NULL)
-        {
-            iVal = atoi(tok);
-            pAttr->add("Y Offset", "", NDAttrInt32, &iVal);
-        }
-        tok = strtok_r(NULL, ",", &save_ptr);
-        if (tok != NULL)
-        {
-            iVal = atoi(tok);
-            *xsize = iVal;
-            pAttr->add("X Size", "", NDAttrInt32, &iVal);
-        }
-        tok = strtok_r(NULL, ",", &save_ptr);
-        if (tok != NULL)
-        {
-            iVal = atoi(tok);
-            *ysize = iVal;
-            pAttr->add("Y Size", "", NDAttrInt32, &iVal);
-        }
-        tok = strtok_r(NULL, ",", &save_ptr);
-        if (tok != NULL)
-        {
-            iVal = atoi(tok);
-            pAttr->add("Pixel Depth", "", NDAttrInt32, &iVal);
-        }
-        tok = strtok_r(NULL, ",", &save_ptr);
-        if (tok != NULL)
-        {
-            iVal = atoi(tok);
-            *pixelSize = iVal;
-            pAttr->add("Pixel Size", "", NDAttrInt32, &iVal);
-        }
-    }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        dVal = atof(tok);
-        pAttr->add("Threshold 0", "", NDAttrFloat64, &dVal);
-    }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        dVal = atof(tok);
-        pAttr->add("Threshold 1", "", NDAttrFloat64, &dVal);
-    }
-    for (dacNum = 1; dacNum <= 25; dacNum++ && tok != NULL)
-    {
-        tok = strtok_r(NULL, ",", &save_ptr);
-        if (tok != NULL)
-        {
-            iVal = atoi(tok);
-            sprintf(dacName, "DAC %03d", dacNum);
-            asynPrint(this->parentUser, ASYN_TRACE_MPX_VERBOSE, "dac %d = %d\n", dacNum, iVal);
-            pAttr->add(dacName, "", NDAttrInt32, &iVal);
-        }
-    }
-    tok = strtok_r(NULL, ",", &save_ptr);
-    if (tok != NULL)
-    {
-        iVal = atoi(tok);
-        *profileMask = iVal;
+        iVal = pHdr->profileMask;
         pAttr->add("Profile Mask", "", NDAttrInt32, &iVal);
     }
 }
@@ -367,6 +262,9 @@ asynStatus mpxConnection::mpxSet(char* valueId, char* value, double timeout)
     sprintf(toLabview, "%s,%010u,%s,%s,%s", MPX_HEADER, msg_len, MPX_SET,
             valueId, value);
 
+    // labview's value is unknown until it acknowledges the new one
+    shadowRemove(valueId);
+
     if ((status = mpxWriteRead(MPX_SET, valueId, timeout)) != asynSuccess)
     {
         return status;
@@ -385,6 +283,8 @@ asynStatus mpxConnection::mpxSet(char* valueId, char* value, double timeout)
     if (fromLabviewError != MPX_OK)
         return asynError;
 
+    shadowUpdate(valueId, value);
+    shadowRemoveCoupled(valueId);
     return asynSuccess;
 }
 
@@ -416,6 +316,10 @@ asynStatus mpxConnection::mpxCommand(char* commandId, double timeout)
     sprintf(toLabview, "%s,%010u,%s,%s", MPX_HEADER, msg_len, MPX_CMD,
             commandId);
 
+    // a reset returns all of the variables to their defaults
+    if (!strcmp(commandId, MPXCMD_RESET))
+        mpxShadowInvalidate();
+
     if ((status = mpxWriteRead(MPX_CMD, commandId, timeout)) != asynSuccess)
     {
         return status;
@@ -494,6 +398,7 @@ asynStatus mpxConnection::mpxGet(char* valueId, double timeout)
     if (fromLabviewError != MPX_OK)
         return asynError;
 
+    shadowUpdate(valueId, fromLabviewValue);
     return asynSuccess;
 }
 
@@ -540,46 +445,106 @@ asynStatus mpxConnection::mpxWrite(double timeout)
 asynStatus mpxConnection::mpxRead(asynUser* pasynUser, char* bodyBuf,
         int bufSize, int* bytesRead, double timeout)
 {
-    size_t nread = 0;
     asynStatus status = asynSuccess;
-    int eomReason;
     const char *functionName = "mpxRead";
+    int bodySize;
+
+    // clear previous contents of buffer in case of error
+    bodyBuf[0] = 0;
+    *bytesRead = 0;
+
+    status = mpxReadHeader(pasynUser, &bodySize, timeout);
+    if (status != asynSuccess)
+        return status;
+
+    if (bodySize >= bufSize)
+    {
+        asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                "%s:%s, frame size %d not supported\n",
+                driverName, functionName, bodySize);
+        return asynError;
+    }
+
+    // now read the rest of the message (the body)
+    status = mpxReadBody(pasynUser, bodyBuf, bodySize, timeout);
+    if (status != asynSuccess)
+        return status;
+
+    *bytesRead = bodySize;
+    return status;
+}
+
+/**
+ * Reads in the header of a raw MPX frame from a pasynOctetSyncIO handle
+ *
+ * This function skips any leading data, looking for the pattern
+ * MPX,0000000000,
+ *
+ * and returns the number of bytes in the body of the frame which follows
+ * (not including the comma after 0000000000). The caller is then free to
+ * read the body in as many pieces as it likes using mpxReadBody - this
+ * allows the data channel to read the pixel payload of an image frame
+ * directly into an NDArray.
+ *
+ * The search for the header and the parsing of the header are done in the
+ * read ahead buffer so that resynchronising after garbage on the channel
+ * does not require a socket read per byte.
+ */
+asynStatus mpxConnection::mpxReadHeader(asynUser* pasynUser, int* bodySize,
+        double timeout)
+{
+    asynStatus status = asynSuccess;
+    const char *functionName = "mpxReadHeader";
     int headerSize = strlen(MPX_HEADER) + MPX_MSG_LEN_DIGITS + 2;
     int mpxLen = strlen(MPX_HEADER);
-    int bodySize;
-    int readCount = 0;
     int leadingJunk = 0;
-    int headerChar = 0;
-
-    char headerStr[] = MPX_HEADER;
-    char* tok;
-    char* save_ptr = NULL;
-    char header[MPX_MAXLINE];
+    int digit;
+    char *start, *found;
 
     // default to this error for any following parsing issues
     fromLabviewError = MPX_ERR_UNEXPECTED;
-    // clear previous contents of buffer in case of error
-    bodyBuf[0] = 0;
-    *bytesRead = 0;
+    *bodySize = 0;
 
     // look for MPX in the stream, throw away any preceding data
     // this is to re-synch with server after an error or reboot
-    while (headerChar < mpxLen)
+    while (1)
     {
-        status = pasynOctetSyncIO->read(pasynUser, header + headerChar, 1,
-                timeout, &nread, &eomReason);
+        status = fillReadAhead(pasynUser, headerSize, timeout);
         if (status != asynSuccess)
             return status;
 
-        if (header[headerChar] == headerStr[headerChar])
+        start = readAhead + readHead;
+        found = (char*) memchr(start, MPX_HEADER[0], readTail - readHead);
+        if (found == NULL)
         {
-            headerChar++;
+            leadingJunk += readTail - readHead;
+            readHead = readTail;
+            continue;
         }
-        else
+        leadingJunk += found - start;
+        readHead += found - start;
+
+        // make sure the whole header is in the buffer before checking it
+        status = fillReadAhead(pasynUser, headerSize, timeout);
+        if (status != asynSuccess)
+            return status;
+        start = readAhead + readHead;
+
+        // verify the header is MPX,0000000000, otherwise skip the 'M' and
+        // keep looking
+        bool valid = !strncmp(start, MPX_HEADER, mpxLen)
+                && start[mpxLen] == ','
+                && start[headerSize - 1] == ',';
+        for (digit = mpxLen + 1; valid && digit < headerSize - 1; digit++)
         {
-            leadingJunk++;
-            headerChar = 0;
+            if (start[digit] < '0' || start[digit] > '9')
+                valid = false;
         }
+        if (valid)
+            break;
+
+        leadingJunk++;
+        readHead++;
     }
 
     if (leadingJunk > 0)
@@ -590,86 +555,203 @@ asynStatus mpxConnection::mpxRead(asynUser* pasynUser, char* bodyBuf,
                 this->fromLabview);
     }
 
-    // read the rest of the header block including message length
-    readCount = 0;
-    do
-    {
-        status = pasynOctetSyncIO->read(pasynUser, header + mpxLen + readCount,
-                (headerSize - mpxLen) - readCount, timeout, &nread, &eomReason);
-        if (status == asynSuccess)
-            readCount += nread;
-    } while (nread != 0 && readCount < (headerSize - mpxLen)
-            && status == asynSuccess);
+    // take a copy of the header for reporting
+    memcpy(fromLabviewHeader, start, headerSize);
+    fromLabviewHeader[headerSize] = (char) NULL;
+    readHead += headerSize;
 
-    if (status != asynSuccess)
+    asynPrint(this->parentUser, ASYN_TRACE_MPX,
+            "mpxRead: Response Header: %s\n", fromLabviewHeader);
+
+    // subtract one from bodySize since we already read the 1st comma
+    *bodySize = atoi(fromLabviewHeader + mpxLen + 1) - 1;
+
+    if (*bodySize <= 0)
     {
         asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                "%s:%s, timeout=%f, status=%d received %d bytes\n%s\n",
-                driverName, functionName, timeout, status, readCount,
-                this->fromLabview);
+                "%s:%s, frame size %d not supported\n",
+                driverName, functionName, *bodySize);
+        return asynError;
     }
-    else
+
+    fromLabviewError = MPX_OK;
+    return status;
+}
+
+/**
+ * Reads exactly size bytes of the body of an MPX frame into bodyBuf.
+ * Must be preceded by a call to mpxReadHeader.
+ *
+ * Bytes already in the read ahead buffer are copied out of it, remainders
+ * of MPX_DIRECT_READ_MIN or more are read from the socket directly into
+ * bodyBuf
+ */
+asynStatus mpxConnection::mpxReadBody(asynUser* pasynUser, char* bodyBuf,
+        int size, double timeout)
+{
+    size_t nread = 0;
+    asynStatus status = asynSuccess;
+    const char *functionName = "mpxReadBody";
+    int readCount = 0;
+    int chunk;
+
+    while (readCount < size && status == asynSuccess)
     {
-        if (readCount != (headerSize - mpxLen))
+        if (readTail > readHead)
         {
-            asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                    "%s:%s, Header too short\n",
-                    driverName, functionName);
-            return asynError;
+            chunk = readTail - readHead;
+            if (chunk > size - readCount)
+                chunk = size - readCount;
+            memcpy(bodyBuf + readCount, readAhead + readHead, chunk);
+            readHead += chunk;
+            readCount += chunk;
+        }
+        else if (size - readCount >= MPX_DIRECT_READ_MIN)
+        {
+            status = readStream(pasynUser, bodyBuf + readCount,
+                    size - readCount, timeout, &nread);
+            if (status == asynSuccess)
+            {
+                if (nread == 0)
+                    break;
+                readCount += nread;
+            }
+        }
+        else
+        {
+            status = fillReadAhead(pasynUser, 1, timeout);
         }
+    }
 
-        // terminate the response for string handling
-        header[readCount + mpxLen] = (char) NULL;
-        strncpy(fromLabviewHeader, header, MPX_MAXLINE);
+    if (readCount < size)
+    {
+        asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                "%s:%s, timeout=%f, status=%d received %d bytes in MPX command body, expected %d\n",
+                driverName, functionName, timeout, status, readCount,
+                size);
+        fromLabviewError = MPX_ERR_LEN;
+        return status == asynSuccess ? asynError : status;
+    }
 
-        asynPrint(this->parentUser, ASYN_TRACE_MPX,
-                "mpxRead: Response Header: %s\n", header);
+    fromLabviewError = MPX_OK;
+    return asynSuccess;
+}
 
-        // parse the header
-        tok = strtok_r(header, ",", &save_ptr); // this first element already verified above
+/**
+ * Reads and throws away size bytes of the body of an MPX frame
+ */
+asynStatus mpxConnection::mpxDiscardBody(asynUser* pasynUser, int size,
+        double timeout)
+{
+    asynStatus status = asynSuccess;
+    int chunk;
 
-        tok = strtok_r(NULL, ",", &save_ptr);
-        if (tok == NULL)
+    while (size > 0 && status == asynSuccess)
+    {
+        status = fillReadAhead(pasynUser, 1, timeout);
+        if (status == asynSuccess)
         {
-            asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                    "%s:%s, Header missing first comma\n",
-                    driverName, functionName);
-            return asynError;
+            chunk = readTail - readHead;
+            if (chunk > size)
+                chunk = size;
+            readHead += chunk;
+            size -= chunk;
         }
-        // subtract one from bodySize since we already read the 1st comma
-        bodySize = atoi(tok) - 1;
+    }
 
-        if (bodySize == 0 || bodySize >= bufSize)
+    return status;
+}
+
+/**
+ * Makes sure that there are at least minBytes of unread data in the read
+ * ahead buffer. Each read takes whatever the socket has available but no
+ * more than MPX_DIRECT_READ_MIN beyond minBytes, so that the pixel payload
+ * that follows a header is left for mpxReadBody to read directly
+ */
+asynStatus mpxConnection::fillReadAhead(asynUser* pasynUser, int minBytes,
+        double timeout)
+{
+    size_t nread = 0;
+    asynStatus status = asynSuccess;
+    int maxBytes;
+
+    while (readTail - readHead < minBytes)
+    {
+        // move any unread data to the start of the buffer to make room
+        if (readHead == readTail)
         {
-            asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                    "%s:%s, frame size %d not supported\n",
-                    driverName, functionName, bodySize);
-            return asynError;
+            readHead = readTail = 0;
         }
-        // now read the rest of the message (the body)
-        readCount = 0;
-        do
+        else if (readAheadSize - readHead < minBytes
+                || readTail == readAheadSize)
         {
-            status = pasynOctetSyncIO->read(pasynUser, bodyBuf + readCount,
-                    bodySize - readCount, timeout, &nread, &eomReason);
-            if (status == asynSuccess)
-                readCount += nread;
-        } while (nread != 0 && readCount < bodySize && status == asynSuccess);
+            memmove(readAhead, readAhead + readHead, readTail - readHead);
+            readTail -= readHead;
+            readHead = 0;
+        }
+
+        maxBytes = minBytes - (readTail - readHead) + MPX_DIRECT_READ_MIN;
+        if (maxBytes > readAheadSize - readTail)
+            maxBytes = readAheadSize - readTail;
+        status = readStream(pasynUser, readAhead + readTail, maxBytes,
+                timeout, &nread);
+        if (status != asynSuccess)
+            return status;
+        if (nread == 0)
+            return asynTimeout;
+        readTail += nread;
+    }
+
+    return status;
+}
+
+/**
+ * All reads from the socket go through here. Data read is appended to the
+ * capture file if one is open. While a capture is being replayed the data
+ * comes from the capture instead of the socket, and the end of the capture
+ * looks like a channel with nothing to send.
+ */
+asynStatus mpxConnection::readStream(asynUser* pasynUser, char* buffer,
+        int maxBytes, double timeout, size_t* nread)
+{
+    asynStatus status;
+    int eomReason;
+    double delay = 0;
+    bool replaying, due;
+
+    *nread = 0;
+
+    epicsMutexLock(streamLock);
+    replaying = replay.isOpen();
+    due = replaying && replay.nextDue(&delay);
+    epicsMutexUnlock(streamLock);
 
-        if (readCount < bodySize)
+    if (replaying)
+    {
+        // wait for the data to be due but no longer than the timeout
+        if (!due || delay > timeout)
         {
-            asynPrint(pasynUser, ASYN_TRACE_ERROR,
-                    "%s:%s, timeout=%f, status=%d received %d bytes in MPX command body, expected %d\n",
-                    driverName, functionName, timeout, status, readCount,
-                    bodySize);
-            fromLabviewError = MPX_ERR_LEN;
-            return status = asynSuccess ? asynError : status;
+            epicsThreadSleep(timeout);
+            return asynTimeout;
         }
+        if (delay > 0)
+            epicsThreadSleep(delay);
 
-        *bytesRead = readCount;
+        epicsMutexLock(streamLock);
+        *nread = replay.read(buffer, maxBytes);
+        epicsMutexUnlock(streamLock);
+        return *nread > 0 ? asynSuccess : asynTimeout;
     }
 
-    fromLabviewError = MPX_OK;
+    status = pasynOctetSyncIO->read(pasynUser, buffer, maxBytes, timeout,
+            nread, &eomReason);
+
+    if (status == asynSuccess && *nread > 0)
+    {
+        epicsMutexLock(streamLock);
+        capture.write(buffer, *nread);
+        epicsMutexUnlock(streamLock);
+    }
     return status;
 }
 
@@ -757,11 +839,14 @@ asynStatus mpxConnection::mpxWriteRead(char* cmdType, char* cmdName,
 
     if ((status = mpxWrite(timeout)) != asynSuccess)
     {
+        mpxShadowInvalidate();
         return status;
     }
 
     if ((status = mpxReadCmd(cmdType, cmdName, timeout)) != asynSuccess)
     {
+        // labview may have restarted
+        mpxShadowInvalidate();
         return status;
     }
 
@@ -771,6 +856,576 @@ asynStatus mpxConnection::mpxWriteRead(char* cmdType, char* cmdName,
     return asynSuccess;
 }
 
+// #######################################################################################
+// ##################### Batched requests                         ########################
+// #######################################################################################
+
+/**
+ * Starts a new batch of requests.
+ *
+ * A batch is filled with mpxBatchSet, mpxBatchGet and mpxBatchCommand and
+ * sent with mpxBatchRun which writes all of the requests in one go and then
+ * reads the replies, so that N settings cost about one round trip to
+ * labview instead of N. Labview processes the requests and replies in the
+ * order they are sent. The result of each request is available from
+ * mpxBatchResult afterwards.
+ *
+ * Unlike a sequence of mpxSet calls every request in a batch is sent even if
+ * an earlier one fails.
+ *
+ * mpxBatchRun does not touch the driver's parameters so it may be called
+ * without the driver lock, toLabview and fromLabview are left holding the
+ * last request and reply for the caller to report.
+ *
+ * A SET of the value labview last acknowledged for a variable is not sent,
+ * it is marked as cached in its result and succeeds without a round trip.
+ */
+void mpxConnection::mpxBatchBegin()
+{
+    batchCount = 0;
+}
+
+/**
+ * Adds a SET to the batch, returns its index or -1 if the batch is full or
+ * the request is too long
+ */
+int mpxConnection::mpxBatchSet(const char* valueId, const char* value)
+{
+    return batchAdd(MPX_SET, valueId, value);
+}
+
+/**
+ * Adds a GET to the batch, returns its index or -1 if the batch is full.
+ * The value is returned in the value member of the result
+ */
+int mpxConnection::mpxBatchGet(const char* valueId)
+{
+    return batchAdd(MPX_GET, valueId, NULL);
+}
+
+/**
+ * Adds a CMD to the batch, returns its index or -1 if the batch is full
+ */
+int mpxConnection::mpxBatchCommand(const char* commandId)
+{
+    return batchAdd(MPX_CMD, commandId, NULL);
+}
+
+int mpxConnection::batchAdd(char* cmdType, const char* name,
+        const char* value)
+{
+    const char *functionName = "batchAdd";
+    mpxBatchItem *pItem;
+
+    if (name == NULL || batchCount >= MPX_BATCH_MAX
+            || strlen(name) >= MPX_MAXLINE
+            || (value != NULL && strlen(value) >= MPX_MAXLINE))
+    {
+        asynPrint(this->parentUser, ASYN_TRACE_ERROR,
+                "%s:%s, cannot add %s %s to batch of %d\n", driverName,
+                functionName, cmdType, name ? name : "", batchCount);
+        return -1;
+    }
+
+    pItem = &batch[batchCount];
+    pItem->cmdType = cmdType;
+    strcpy(pItem->name, name);
+    if (value != NULL)
+        strcpy(pItem->value, value);
+    else
+        pItem->value[0] = 0;
+    pItem->status = asynError;
+    pItem->error = MPX_ERR_UNEXPECTED;
+    pItem->cached = false;
+
+    return batchCount++;
+}
+
+/**
+ * Returns the request and its reply at index in the last batch run
+ */
+const mpxBatchItem* mpxConnection::mpxBatchResult(int index)
+{
+    if (index < 0 || index >= batchCount)
+        return NULL;
+    return &batch[index];
+}
+
+/**
+ * Writes all of the requests in the batch and then reads their replies.
+ *
+ * Replies are matched to requests in order by command type and name. A
+ * reply that matches a later request means that labview did not answer the
+ * requests in between, they are marked as failed and matching carries on
+ * from the later request. Replies that do not match any outstanding request
+ * are reported and discarded as in mpxReadCmd.
+ *
+ * Returns asynSuccess if every request succeeded, otherwise the status of
+ * the first that failed. fromLabviewError holds the first labview error.
+ */
+asynStatus mpxConnection::mpxBatchRun(double timeout)
+{
+    const char *functionName = "mpxBatchRun";
+    char requests[MPX_BATCH_MAX * MPX_MAXLINE];
+    char body[MPX_MAXLINE];
+    char buff[MPX_MAXLINE];
+    char *cmdType, *cmdName;
+    char *save_ptr = NULL;
+    int length = 0;
+    int msg_len;
+    int next, match;
+    int nread;
+    int sent = 0;
+    size_t nwrite;
+    asynStatus status = asynSuccess;
+
+    fromLabviewError = MPX_OK;
+    if (batchCount == 0)
+        return asynSuccess;
+
+    // a request too long to send fails the whole batch before any of it is
+    // sent, as the requests after it may depend on it
+    for (next = 0; next < batchCount; next++)
+    {
+        mpxBatchItem *pItem = &batch[next];
+
+        // the message length includes the ',' after the length specifier
+        msg_len = strlen(pItem->cmdType) + 1 + strlen(pItem->name) + 1;
+        if (!strcmp(pItem->cmdType, MPX_SET))
+            msg_len += 1 + strlen(pItem->value);
+        if (strlen(MPX_HEADER) + MPX_MSG_LEN_DIGITS + msg_len + 1
+                > MPX_MAXLINE)
+        {
+            asynPrint(this->parentUser, ASYN_TRACE_ERROR,
+                    "%s:%s, request %s %s too long, batch of %d not sent\n",
+                    driverName, functionName, pItem->cmdType, pItem->name,
+                    batchCount);
+            for (match = 0; match < batchCount; match++)
+            {
+                batch[match].status = asynError;
+                batch[match].error = MPX_ERR_LEN;
+            }
+            fromLabviewError = MPX_ERR_LEN;
+            return asynError;
+        }
+    }
+
+    // format all of the requests into one buffer
+    for (next = 0; next < batchCount; next++)
+    {
+        mpxBatchItem *pItem = &batch[next];
+
+        if (!strcmp(pItem->cmdType, MPX_SET)
+                && shadowMatches(pItem->name, pItem->value))
+        {
+            asynPrint(this->parentUser, ASYN_TRACE_MPX,
+                    "mpxBatchRun: %s unchanged at %s\n", pItem->name,
+                    pItem->value);
+            pItem->cached = true;
+            pItem->status = asynSuccess;
+            pItem->error = MPX_OK;
+            continue;
+        }
+        // labview may change the variables coupled to a SET that is sent,
+        // so later SETs of them in this batch are sent too
+        if (!strcmp(pItem->cmdType, MPX_SET))
+        {
+            shadowRemove(pItem->name);
+            shadowRemoveCoupled(pItem->name);
+        }
+        else if (!strcmp(pItem->cmdType, MPX_CMD)
+                && !strcmp(pItem->name, MPXCMD_RESET))
+            mpxShadowInvalidate();
+
+        if (!strcmp(pItem->cmdType, MPX_SET))
+            epicsSnprintf(body, MPX_MAXLINE, "%s,%s,%s", pItem->cmdType,
+                    pItem->name, pItem->value);
+        else
+            epicsSnprintf(body, MPX_MAXLINE, "%s,%s", pItem->cmdType,
+                    pItem->name);
+
+        msg_len = strlen(body) + 1;
+        sprintf(toLabview, "%s,%010u,%s", MPX_HEADER, msg_len, body);
+        asynPrint(this->parentUser, ASYN_TRACE_MPX,
+                "mpxBatchRun: Request: %s\n", toLabview);
+
+        strcpy(requests + length, toLabview);
+        length += strlen(toLabview);
+        sent++;
+    }
+
+    if (sent == 0)
+        return asynSuccess;
+
+    status = pasynOctetSyncIO->write(this->tcpUser, requests, length,
+            timeout, &nwrite);
+    if (status != asynSuccess)
+    {
+        asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                "%s:%s, status=%d, sent\n%s\n", driverName, functionName,
+                status, requests);
+        fromLabviewError = MPX_ERR_WRITE;
+        for (next = 0; next < batchCount; next++)
+        {
+            if (!batch[next].cached)
+                batch[next].error = MPX_ERR_WRITE;
+        }
+        mpxShadowInvalidate();
+        return status;
+    }
+
+    // match the replies to the requests in order
+    next = 0;
+    while (next < batchCount)
+    {
+        if (batch[next].cached)
+        {
+            next++;
+            continue;
+        }
+
+        status = mpxRead(this->tcpUser, buff, MPX_MAXLINE, &nread, timeout);
+        if (status != asynSuccess)
+        {
+            asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                    "%s:%s, status=%d, no reply to %d of %d requests\n",
+                    driverName, functionName, status, batchCount - next,
+                    batchCount);
+            for (; next < batchCount; next++)
+            {
+                if (batch[next].cached)
+                    continue;
+                batch[next].status = status;
+                batch[next].error = MPX_ERR_READ;
+            }
+            // labview may have restarted
+            mpxShadowInvalidate();
+            break;
+        }
+
+        buff[nread] = 0;
+        strncpy(fromLabviewBody, buff, MPX_MAXLINE);
+        strncpy(fromLabview, fromLabviewHeader, MPX_MAXLINE);
+        strncat(fromLabview, fromLabviewBody, MPX_MAXLINE);
+
+        // items in the response are comma delimited -
+        // command type then the command (or variable) name
+        cmdType = strtok_r(buff, ",", &save_ptr);
+        cmdName = strtok_r(NULL, ",", &save_ptr);
+        for (match = next; cmdType != NULL && cmdName != NULL
+                && match < batchCount; match++)
+        {
+            if (!batch[match].cached
+                    && !strncmp(batch[match].cmdType, cmdType, MPX_MAXLINE)
+                    && !strncmp(batch[match].name, cmdName, MPX_MAXLINE))
+                break;
+        }
+
+        if (cmdType == NULL || cmdName == NULL || match == batchCount)
+        {
+            asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                    "%s:%s error, unexpected response from labview: '%s'\n",
+                    driverName, functionName, fromLabview);
+            continue;
+        }
+
+        for (; next < match; next++)
+        {
+            if (batch[next].cached)
+                continue;
+            asynPrint(this->tcpUser, ASYN_TRACE_ERROR,
+                    "%s:%s error, no response from labview to %s %s\n",
+                    driverName, functionName, batch[next].cmdType,
+                    batch[next].name);
+        }
+
+        batchReply(&batch[match], save_ptr);
+        next = match + 1;
+    }
+
+    // report the first failure
+    status = asynSuccess;
+    for (next = 0; next < batchCount; next++)
+    {
+        if (batch[next].status != asynSuccess)
+        {
+            status = batch[next].status;
+            fromLabviewError = batch[next].error;
+            break;
+        }
+    }
+
+    asynPrint(this->parentUser, ASYN_TRACE_MPX,
+            "mpxBatchRun: %d requests, status=%d\n", batchCount, status);
+
+    return status;
+}
+
+/**
+ * Parses the rest of a reply after the command type and name into pItem -
+ * the value for a GET and then the error number
+ */
+void mpxConnection::batchReply(mpxBatchItem* pItem, char* body)
+{
+    char *tok;
+    char *save_ptr = NULL;
+
+    pItem->status = asynError;
+    pItem->error = MPX_ERR_UNEXPECTED;
+
+    tok = strtok_r(body, ",", &save_ptr);
+    if (tok != NULL && !strcmp(pItem->cmdType, MPX_GET))
+    {
+        strncpy(pItem->value, tok, MPX_MAXLINE - 1);
+        pItem->value[MPX_MAXLINE - 1] = 0;
+        tok = strtok_r(NULL, ",", &save_ptr);
+    }
+    if (tok == NULL)
+        return;
+
+    pItem->error = atoi(tok);
+    if (pItem->error == MPX_OK)
+    {
+        pItem->status = asynSuccess;
+        if (!strcmp(pItem->cmdType, MPX_SET))
+        {
+            shadowUpdate(pItem->name, pItem->value);
+            shadowRemoveCoupled(pItem->name);
+        }
+        else if (!strcmp(pItem->cmdType, MPX_GET))
+            shadowUpdate(pItem->name, pItem->value);
+    }
+}
+
+// #######################################################################################
+// ##################### Shadow cache of labview variables        ########################
+// #######################################################################################
+
+/**
+ * Watches the asyn port of this connection so that the shadow cache is
+ * invalidated when the port disconnects or reconnects - labview may have
+ * been restarted with different settings in the meantime
+ */
+asynStatus mpxConnection::mpxMonitorConnection(const char* portName)
+{
+    const char *functionName = "mpxMonitorConnection";
+    asynStatus status;
+
+    exceptionUser = pasynManager->createAsynUser(NULL, NULL);
+    exceptionUser->userPvt = this;
+    status = pasynManager->connectDevice(exceptionUser, portName, 0);
+    if (status == asynSuccess)
+        status = pasynManager->exceptionCallbackAdd(exceptionUser,
+                exceptionCallbackC);
+    if (status != asynSuccess)
+        asynPrint(this->parentUser, ASYN_TRACE_ERROR,
+                "%s:%s, cannot monitor port %s, status=%d\n", driverName,
+                functionName, portName, status);
+    return status;
+}
+
+void mpxConnection::exceptionCallbackC(asynUser* pasynUser,
+        asynException exception)
+{
+    mpxConnection *pConnection = (mpxConnection*) pasynUser->userPvt;
+
+    if (exception == asynExceptionConnect)
+        pConnection->mpxShadowInvalidate();
+}
+
+/**
+ * Forgets every cached value so that the next batch sends all of them
+ */
+void mpxConnection::mpxShadowInvalidate()
+{
+    shadowStale = 1;
+}
+
+mpxShadowEntry* mpxConnection::shadowFind(const char* name)
+{
+    int i;
+
+    if (shadowStale)
+    {
+        shadowStale = 0;
+        shadowCount = 0;
+        asynPrint(this->parentUser, ASYN_TRACE_MPX,
+                "mpxConnection: shadow cache invalidated\n");
+    }
+
+    for (i = 0; i < shadowCount; i++)
+    {
+        if (!strcmp(shadow[i].name, name))
+            return &shadow[i];
+    }
+    return NULL;
+}
+
+bool mpxConnection::shadowMatches(const char* name, const char* value)
+{
+    mpxShadowEntry *pEntry = shadowFind(name);
+
+    return pEntry != NULL && !strcmp(pEntry->value, value);
+}
+
+void mpxConnection::shadowUpdate(const char* name, const char* value)
+{
+    mpxShadowEntry *pEntry;
+
+    // values too long to cache are always sent
+    if (strlen(name) >= MPX_SHADOW_NAME_LEN
+            || strlen(value) >= MPX_SHADOW_VALUE_LEN)
+    {
+        shadowRemove(name);
+        return;
+    }
+
+    pEntry = shadowFind(name);
+    if (pEntry == NULL)
+    {
+        if (shadowCount >= MPX_SHADOW_MAX)
+            return;
+        pEntry = &shadow[shadowCount++];
+        strcpy(pEntry->name, name);
+    }
+    strcpy(pEntry->value, value);
+}
+
+void mpxConnection::shadowRemove(const char* name)
+{
+    mpxShadowEntry *pEntry = shadowFind(name);
+
+    if (pEntry != NULL)
+        *pEntry = shadow[--shadowCount];
+}
+
+/**
+ * Variables that labview changes itself when another is SET. Each list
+ * starts with the variable that is SET and ends with NULL, and a variable
+ * may have more than one list. A SET that labview adjusts itself, such as
+ * ACQUISITIONPERIOD, is put right by the GET that reads it back
+ */
+static const char* shadowCoupled[][6] =
+{
+    // labview keeps the counter and readout modes consistent
+    { MPXVAR_ENABLECOUNTER1, MPXVAR_CONTINUOUSRW, MPXVAR_COLOURMODE,
+            MPXVAR_CHARGESUMMING, MPXVAR_COUNTERDEPTH, NULL },
+    { MPXVAR_CONTINUOUSRW, MPXVAR_ENABLECOUNTER1, MPXVAR_COLOURMODE,
+            MPXVAR_CHARGESUMMING, MPXVAR_COUNTERDEPTH, NULL },
+    { MPXVAR_COLOURMODE, MPXVAR_ENABLECOUNTER1, MPXVAR_CONTINUOUSRW,
+            MPXVAR_CHARGESUMMING, MPXVAR_COUNTERDEPTH, NULL },
+    { MPXVAR_CHARGESUMMING, MPXVAR_ENABLECOUNTER1, MPXVAR_CONTINUOUSRW,
+            MPXVAR_COLOURMODE, MPXVAR_COUNTERDEPTH, NULL },
+    { MPXVAR_COUNTERDEPTH, MPXVAR_ENABLECOUNTER1, MPXVAR_CONTINUOUSRW,
+            MPXVAR_COLOURMODE, MPXVAR_CHARGESUMMING, NULL },
+    // the period is lengthened to fit the exposure and readout
+    { MPXVAR_ACQUISITIONTIME, MPXVAR_ACQUISITIONPERIOD, NULL },
+    { MPXVAR_COUNTERDEPTH, MPXVAR_ACQUISITIONPERIOD, NULL }
+};
+
+/**
+ * Forgets the variables that labview may have changed along with a
+ * successful SET of name, so that the next SET of them is always sent
+ */
+void mpxConnection::shadowRemoveCoupled(const char* name)
+{
+    size_t i;
+    int j;
+
+    for (i = 0; i < sizeof(shadowCoupled) / sizeof(shadowCoupled[0]); i++)
+    {
+        if (strcmp(shadowCoupled[i][0], name))
+            continue;
+        for (j = 1; j < 6 && shadowCoupled[i][j] != NULL; j++)
+            shadowRemove(shadowCoupled[i][j]);
+    }
+}
+
+// #######################################################################################
+// ##################### Capture and replay                       ########################
+// #######################################################################################
+
+/**
+ * Starts writing everything received on this connection to a capture file
+ * (see mpxCapture.h for the format)
+ */
+asynStatus mpxConnection::mpxStartCapture(const char* fileName)
+{
+    const char *functionName = "mpxStartCapture";
+    bool ok;
+
+    epicsMutexLock(streamLock);
+    ok = capture.open(fileName);
+    epicsMutexUnlock(streamLock);
+
+    if (!ok)
+    {
+        asynPrint(this->parentUser, ASYN_TRACE_ERROR,
+                "%s:%s, cannot create capture file %s\n", driverName,
+                functionName, fileName);
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+void mpxConnection::mpxStopCapture()
+{
+    epicsMutexLock(streamLock);
+    capture.close();
+    epicsMutexUnlock(streamLock);
+}
+
+/**
+ * Starts feeding a capture file to the readers of this connection in place
+ * of the socket, either with the timing it was recorded with or as fast as
+ * possible. Any data buffered from the socket is discarded by the readers
+ * resynchronising on the next MPX header.
+ */
+asynStatus mpxConnection::mpxStartReplay(const char* fileName,
+        mpxReplayMode mode)
+{
+    const char *functionName = "mpxStartReplay";
+    bool ok;
+
+    epicsMutexLock(streamLock);
+    ok = replay.open(fileName, mode);
+    epicsMutexUnlock(streamLock);
+
+    if (!ok)
+    {
+        asynPrint(this->parentUser, ASYN_TRACE_ERROR,
+                "%s:%s, cannot open capture file %s\n", driverName,
+                functionName, fileName);
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+void mpxConnection::mpxStopReplay()
+{
+    epicsMutexLock(streamLock);
+    replay.close();
+    epicsMutexUnlock(streamLock);
+}
+
+bool mpxConnection::mpxReplayFinished()
+{
+    bool finished;
+
+    epicsMutexLock(streamLock);
+    finished = replay.isOpen() && replay.isFinished();
+    epicsMutexUnlock(streamLock);
+    return finished;
+}
+
+void mpxConnection::mpxStreamCounts(double* captureBytes, double* replayBytes)
+{
+    epicsMutexLock(streamLock);
+    *captureBytes = (double) capture.getBytes();
+    *replayBytes = (double) replay.getBytes();
+    epicsMutexUnlock(streamLock);
+}
+
 // #######################################################################################
 // ##################### Helper functions                         ########################
 // #######################################################################################
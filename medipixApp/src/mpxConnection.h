@@ -4,22 +4,46 @@
 #define ASYN_TRACE_MPX          0x0100
 #define ASYN_TRACE_MPX_VERBOSE  0x0200
 
+#include <epicsMutex.h>
+
 #include "medipix_low.h"
+#include "mpxHeader.h"
+#include "mpxCapture.h"
+
+/** default size of the per connection read ahead buffer */
+#define MPX_READ_AHEAD_LEN 65536
+
+/** the rest of a frame body is read straight into the caller's buffer
+ * when at least this many bytes are left, so that only headers and short
+ * tails go through the read ahead buffer */
+#define MPX_DIRECT_READ_MIN 4096
+
+/** maximum number of requests in one batch */
+#define MPX_BATCH_MAX 16
 
-/** data header types */
-typedef enum
+/** A request in a batch and the reply it received */
+typedef struct mpxBatchItem
 {
-    MPXDataHeaderNone,
-    MPXDataHeader12,
-    MPXDataHeader24,
-    MPXGenericImageHeader,
-    MPXProfileHeader12,
-    MPXProfileHeader24,
-    MPXGenericProfileHeader,
-    MPXAcquisitionHeader,
-    MPXQuadDataHeader,
-    MPXUnknownHeader
-} medipixDataHeader;
+    char* cmdType;              // MPX_SET, MPX_GET or MPX_CMD
+    char name[MPX_MAXLINE];     // variable or command name
+    char value[MPX_MAXLINE];    // value to SET or value returned by GET
+    asynStatus status;          // asynSuccess if labview replied MPX_OK
+    int error;                  // error number returned by labview
+    bool cached;                // SET not sent as labview already has value
+} mpxBatchItem;
+
+/** size of the cache of values acknowledged by labview */
+#define MPX_SHADOW_MAX          64
+#define MPX_SHADOW_NAME_LEN     32
+#define MPX_SHADOW_VALUE_LEN    64
+
+/** The last value labview acknowledged for a variable */
+typedef struct mpxShadowEntry
+{
+    char name[MPX_SHADOW_NAME_LEN];
+    char value[MPX_SHADOW_VALUE_LEN];
+} mpxShadowEntry;
+
 
 class medipixDetector;
 
@@ -37,7 +61,8 @@ public:
 public:
     // Constructor
     mpxConnection(asynUser* parentUser, asynUser* tcpUser,
-            medipixDetector* parentObj);
+            medipixDetector* parentObj, int readAheadSize = MPX_READ_AHEAD_LEN);
+    ~mpxConnection();
 
     /* The labview communication primitives */
     asynStatus mpxGet(char* valueId, double timeout);
@@ -48,14 +73,39 @@ public:
     asynStatus mpxWriteRead(char* cmdType, char* cmdName, double timeout);
     asynStatus mpxRead(asynUser* pasynUser, char* bodyBuf, int bufSize,
             int* bytesRead, double timeout);
+    asynStatus mpxReadHeader(asynUser* pasynUser, int* bodySize,
+            double timeout);
+    asynStatus mpxReadBody(asynUser* pasynUser, char* bodyBuf, int size,
+            double timeout);
+    asynStatus mpxDiscardBody(asynUser* pasynUser, int size, double timeout);
+
+    /* Batches of requests written in one go with the replies matched in order */
+    void mpxBatchBegin();
+    int mpxBatchSet(const char* valueId, const char* value);
+    int mpxBatchGet(const char* valueId);
+    int mpxBatchCommand(const char* commandId);
+    asynStatus mpxBatchRun(double timeout);
+    const mpxBatchItem* mpxBatchResult(int index);
+
+    /* Cache of the values labview has acknowledged for each variable */
+    asynStatus mpxMonitorConnection(const char* portName);
+    void mpxShadowInvalidate();
+
+    /* Capture of the received byte stream and replay of captures */
+    asynStatus mpxStartCapture(const char* fileName);
+    void mpxStopCapture();
+    asynStatus mpxStartReplay(const char* fileName, mpxReplayMode mode);
+    void mpxStopReplay();
+    bool mpxReplayFinished();
+    void mpxStreamCounts(double* captureBytes, double* replayBytes);
 
     /* Helper functions */
     medipixDataHeader parseDataHeader(const char* header);
-    void parseDataFrame(NDAttributeList* pAttr, const char* header,
-            medipixDataHeader headerType, size_t *xsize, size_t *ysize,
-            int* pixelSize, int* profileMask);
-    void parseMqDataFrame(NDAttributeList* pAttr, const char* header,
-    		size_t *xsize, size_t *ysize, int* pixelDepth, int* offset);
+    int parseMqHeaderLength(const char* header);
+    void parseDataFrame(mpxFrameHeader* pHdr, const char* header,
+            int length, medipixDataHeader headerType);
+    void addHeaderAttributes(NDAttributeList* pAttr,
+            const mpxFrameHeader* pHdr);
 
     void dumpData(char* sdata, int size);
 
@@ -63,6 +113,40 @@ private:
     asynUser* parentUser;
     asynUser* tcpUser;
     medipixDetector* parentObj;
+
+    /* read ahead buffer - unread data lies between readHead and readTail */
+    asynStatus fillReadAhead(asynUser* pasynUser, int minBytes, double timeout);
+    asynStatus readStream(asynUser* pasynUser, char* buffer, int maxBytes,
+            double timeout, size_t* nread);
+    char* readAhead;
+    int readAheadSize;
+    int readHead;
+    int readTail;
+
+    /* the current batch */
+    int batchAdd(char* cmdType, const char* name, const char* value);
+    void batchReply(mpxBatchItem* pItem, char* body);
+    mpxBatchItem batch[MPX_BATCH_MAX];
+    int batchCount;
+
+    /* the shadow cache - shadowStale is set from the asyn exception callback
+     * and the cache is cleared by the thread that next uses it */
+    static void exceptionCallbackC(asynUser* pasynUser, asynException exception);
+    mpxShadowEntry* shadowFind(const char* name);
+    bool shadowMatches(const char* name, const char* value);
+    void shadowUpdate(const char* name, const char* value);
+    void shadowRemove(const char* name);
+    void shadowRemoveCoupled(const char* name);
+    asynUser* exceptionUser;
+    mpxShadowEntry shadow[MPX_SHADOW_MAX];
+    int shadowCount;
+    volatile int shadowStale;
+
+    /* capture and replay - streamLock protects them against being started
+     * and stopped by another thread while the receiving thread uses them */
+    epicsMutexId streamLock;
+    mpxCapture capture;
+    mpxReplay replay;
 };
 
 #endif
@@ -0,0 +1,448 @@
+#include <string.h>
+#include <stdint.h>
+
+#include <epicsThread.h>
+
+#include "mpxDecode.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#define MPX_X86_CPUID
+#endif
+
+// #######################################################################################
+// ##################### Scalar Kernels                    ###############################
+// #######################################################################################
+
+static inline epicsUInt16 swap16(epicsUInt16 x)
+{
+    return (epicsUInt16) ((x >> 8) | (x << 8));
+}
+
+static inline epicsUInt32 swap32(epicsUInt32 x)
+{
+    return (x >> 24) | ((x << 8) & 0x00FF0000) | ((x >> 8) & 0x0000FF00)
+            | (x << 24);
+}
+
+static void scalarSwapRows16(epicsUInt16 *pTop, epicsUInt16 *pBottom, size_t n)
+{
+    epicsUInt16 top, bottom;
+    size_t x;
+
+    for (x = 0; x < n; x++)
+    {
+        top = pTop[x];
+        bottom = pBottom[x];
+        pTop[x] = swap16(bottom);
+        pBottom[x] = swap16(top);
+    }
+}
+
+static void scalarSwapRows32(epicsUInt32 *pTop, epicsUInt32 *pBottom, size_t n)
+{
+    epicsUInt32 top, bottom;
+    size_t x;
+
+    for (x = 0; x < n; x++)
+    {
+        top = pTop[x];
+        bottom = pBottom[x];
+        pTop[x] = swap32(bottom);
+        pBottom[x] = swap32(top);
+    }
+}
+
+static const mpxDecodeKernels scalarKernels =
+{ "scalar", scalarSwapRows16, scalarSwapRows32 };
+
+const mpxDecodeKernels *mpxScalarKernels()
+{
+    return &scalarKernels;
+}
+
+// #######################################################################################
+// ##################### Runtime Kernel Selection          ###############################
+// #######################################################################################
+
+static bool cpuHasSSSE3()
+{
+#ifdef MPX_X86_CPUID
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & (1 << 9)) != 0;
+#else
+    return false;
+#endif
+}
+
+static bool cpuHasAVX2()
+{
+#ifdef MPX_X86_CPUID
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int xcr0, xcr0High;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+
+    // the OS must save the YMM registers on a context switch (OSXSAVE + AVX)
+    if ((ecx & (1 << 27)) == 0 || (ecx & (1 << 28)) == 0)
+        return false;
+    // xgetbv - as opcode bytes for older assemblers
+    __asm__ __volatile__(".byte 0x0f, 0x01, 0xd0"
+            : "=a" (xcr0), "=d" (xcr0High) : "c" (0));
+    if ((xcr0 & 0x6) != 0x6)
+        return false;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+
+static const mpxDecodeKernels *pAutoKernels = NULL;
+static epicsThreadOnceId autoKernelsOnce = EPICS_THREAD_ONCE_INIT;
+
+static void selectKernels(void *)
+{
+    pAutoKernels = mpxGetDecodeKernels(mpxKernelAVX2);
+    if (pAutoKernels == NULL)
+        pAutoKernels = mpxGetDecodeKernels(mpxKernelSSSE3);
+    if (pAutoKernels == NULL)
+        pAutoKernels = mpxScalarKernels();
+}
+
+const mpxDecodeKernels *mpxGetDecodeKernels(mpxKernelType type)
+{
+    switch (type)
+    {
+    case mpxKernelScalar:
+        return mpxScalarKernels();
+    case mpxKernelSSSE3:
+        return cpuHasSSSE3() ? mpxSSSE3Kernels() : NULL;
+    case mpxKernelAVX2:
+        return cpuHasAVX2() ? mpxAVX2Kernels() : NULL;
+    case mpxKernelAuto:
+    default:
+        epicsThreadOnce(&autoKernelsOnce, selectKernels, NULL);
+        return pAutoKernels;
+    }
+}
+
+// #######################################################################################
+// ##################### Image Conversion                  ###############################
+// #######################################################################################
+
+/** exchange two rows without any byte swapping */
+static void exchangeRows(char *pTop, char *pBottom, size_t bytes)
+{
+    char tmp[4096];
+    size_t chunk;
+
+    while (bytes > 0)
+    {
+        chunk = bytes < sizeof(tmp) ? bytes : sizeof(tmp);
+        memcpy(tmp, pTop, chunk);
+        memcpy(pTop, pBottom, chunk);
+        memcpy(pBottom, tmp, chunk);
+        pTop += chunk;
+        pBottom += chunk;
+        bytes -= chunk;
+    }
+}
+
+/** per pixel width access to the byte swapping row kernels */
+template<typename PixelT> struct pixelKernel;
+
+template<> struct pixelKernel<epicsUInt8>
+{
+    // single bytes have no byte order so this is only used to flip
+    static void swapRows(const mpxDecodeKernels *, epicsUInt8 *pTop,
+            epicsUInt8 *pBottom, size_t n)
+    {
+        if (pTop != pBottom)
+            exchangeRows((char*) pTop, (char*) pBottom, n);
+    }
+};
+
+template<> struct pixelKernel<epicsUInt16>
+{
+    static void swapRows(const mpxDecodeKernels *pKernels, epicsUInt16 *pTop,
+            epicsUInt16 *pBottom, size_t n)
+    {
+        pKernels->swapRows16(pTop, pBottom, n);
+    }
+};
+
+template<> struct pixelKernel<epicsUInt32>
+{
+    static void swapRows(const mpxDecodeKernels *pKernels, epicsUInt32 *pTop,
+            epicsUInt32 *pBottom, size_t n)
+    {
+        pKernels->swapRows32(pTop, pBottom, n);
+    }
+};
+
+/** Converts an image in place. Swap and Flip are compile time constants so
+ * each instance reduces to a single loop with no tests inside it */
+template<typename PixelT, bool Swap, bool Flip>
+static void flipSwap(PixelT *pData, size_t xsize, size_t ysize,
+        const mpxDecodeKernels *pKernels)
+{
+    size_t y;
+
+    if (Flip)
+    {
+        // swap the rows from the top and bottom of the image, meeting in the middle
+        for (y = 0; y < (ysize + 1) / 2; y++)
+        {
+            PixelT *pTop = pData + y * xsize;
+            PixelT *pBottom = pData + (ysize - 1 - y) * xsize;
+
+            if (Swap)
+                pixelKernel<PixelT>::swapRows(pKernels, pTop, pBottom, xsize);
+            else if (pTop != pBottom)
+                exchangeRows((char*) pTop, (char*) pBottom,
+                        xsize * sizeof(PixelT));
+        }
+    }
+    else if (Swap)
+    {
+        // the whole image is byte swapped as a single row in place
+        pixelKernel<PixelT>::swapRows(pKernels, pData, pData, xsize * ysize);
+    }
+}
+
+template<typename PixelT, bool Swap, bool Flip>
+static void decodeImage(void *pData, size_t xsize, size_t ysize)
+{
+    flipSwap<PixelT, Swap, Flip>((PixelT *) pData, xsize, ysize,
+            mpxGetDecodeKernels());
+}
+
+/** Profiles are sent as 64 bit values and are published as 32 bit */
+template<bool Swap>
+static void decodeProfile(epicsUInt32 *pDest, const char *pSrc, size_t n)
+{
+    size_t x;
+    uint64_t value;
+
+    for (x = 0; x < n; x++)
+    {
+        memcpy(&value, pSrc + x * sizeof(value), sizeof(value));
+        if (Swap)
+            value = ((uint64_t) swap32((epicsUInt32) value) << 32)
+                    | swap32((epicsUInt32) (value >> 32));
+        pDest[x] = (epicsUInt32) value;
+    }
+}
+
+#define MPX_DECODERS(swap, flip) \
+    { decodeImage<epicsUInt8, swap, flip>, \
+      decodeImage<epicsUInt16, swap, flip>, \
+      decodeImage<epicsUInt32, swap, flip>, \
+      decodeProfile<swap> }
+
+/** dispatch table indexed by [swap][flip] */
+static const mpxImageDecoders imageDecoders[2][2] =
+{
+{ MPX_DECODERS(false, false), MPX_DECODERS(false, true) },
+{ MPX_DECODERS(true, false), MPX_DECODERS(true, true) } };
+
+const mpxImageDecoders *mpxGetImageDecoders(bool swap, bool flip)
+{
+    return &imageDecoders[swap ? 1 : 0][flip ? 1 : 0];
+}
+
+/** Sums an image into a binned image. Bin is a compile time constant so the
+ * inner loop is fully unrolled, and with no binning it is a single loop over
+ * the image that the compiler can vectorise */
+template<typename PixelT, typename SumT, int Bin>
+static void accumulate(void *pSum, const void *pImage, size_t xsize,
+        size_t ysize)
+{
+    SumT *pOut = (SumT *) pSum;
+    const PixelT *pIn = (const PixelT *) pImage;
+    size_t sumX = xsize / Bin;
+    size_t sumY = ysize / Bin;
+    size_t x, y;
+    int dx;
+
+    if (Bin == 1)
+    {
+        for (x = 0; x < xsize * ysize; x++)
+            pOut[x] += pIn[x];
+        return;
+    }
+
+    for (y = 0; y < sumY * Bin; y++)
+    {
+        const PixelT *pRow = pIn + y * xsize;
+        SumT *pSumRow = pOut + (y / Bin) * sumX;
+
+        for (x = 0; x < sumX; x++)
+        {
+            SumT total = 0;
+
+            for (dx = 0; dx < Bin; dx++)
+                total += pRow[x * Bin + dx];
+            pSumRow[x] += total;
+        }
+    }
+}
+
+#define MPX_ACCUMULATORS(pixel, sum) \
+    { accumulate<pixel, sum, 1>, \
+      accumulate<pixel, sum, 2>, \
+      accumulate<pixel, sum, 4> }
+
+/** dispatch table indexed by [pixel width][wide][bin] */
+static const mpxAccumulator accumulators[3][2][3] =
+{
+{ MPX_ACCUMULATORS(epicsUInt8, epicsUInt32),
+  MPX_ACCUMULATORS(epicsUInt8, epicsFloat64) },
+{ MPX_ACCUMULATORS(epicsUInt16, epicsUInt32),
+  MPX_ACCUMULATORS(epicsUInt16, epicsFloat64) },
+{ MPX_ACCUMULATORS(epicsUInt32, epicsUInt32),
+  MPX_ACCUMULATORS(epicsUInt32, epicsFloat64) } };
+
+mpxAccumulator mpxGetAccumulator(int pixelBytes, bool wide, int bin)
+{
+    int pixelIndex, binIndex;
+
+    switch (pixelBytes)
+    {
+    case 1: pixelIndex = 0; break;
+    case 2: pixelIndex = 1; break;
+    case 4: pixelIndex = 2; break;
+    default: return NULL;
+    }
+
+    switch (bin)
+    {
+    case 1: binIndex = 0; break;
+    case 2: binIndex = 1; break;
+    case 4: binIndex = 2; break;
+    default: return NULL;
+    }
+
+    return accumulators[pixelIndex][wide ? 1 : 0][binIndex];
+}
+
+/** Corrects in place keeping the pixel type. The loop has no dependencies
+ * between pixels so the compiler can vectorise it */
+template<typename PixelT>
+static void flatCorrectScaled(void *pData, const epicsFloat32 *pGain, size_t n)
+{
+    PixelT *pPixels = (PixelT *) pData;
+    const epicsFloat32 maxValue = (epicsFloat32) (PixelT) -1;
+    epicsFloat32 value;
+    size_t i;
+
+    // 2^32 - 1 rounds up to 2^32 as a float, so the clip compares with >=
+    for (i = 0; i < n; i++)
+    {
+        value = pPixels[i] * pGain[i] + 0.5f;
+        pPixels[i] = value >= maxValue ? (PixelT) -1 : (PixelT) value;
+    }
+}
+
+/** Widens to epicsFloat32 in place, which must run from the end */
+template<typename PixelT>
+static void flatCorrectFloat(void *pData, const epicsFloat32 *pGain, size_t n)
+{
+    const PixelT *pPixels = (const PixelT *) pData;
+    epicsFloat32 *pOut = (epicsFloat32 *) pData;
+    size_t i;
+
+    for (i = n; i-- > 0;)
+        pOut[i] = pPixels[i] * pGain[i];
+}
+
+mpxFlatCorrector mpxGetFlatCorrector(int pixelBytes, bool toFloat)
+{
+    switch (pixelBytes)
+    {
+    case 1:
+        return toFloat ? flatCorrectFloat<epicsUInt8>
+                : flatCorrectScaled<epicsUInt8>;
+    case 2:
+        return toFloat ? flatCorrectFloat<epicsUInt16>
+                : flatCorrectScaled<epicsUInt16>;
+    case 4:
+        return toFloat ? flatCorrectFloat<epicsUInt32>
+                : flatCorrectScaled<epicsUInt32>;
+    default:
+        return NULL;
+    }
+}
+
+/** The columns are added as the rows go by, so the image is only read once.
+ * Integer rows are added up as integers which keeps them exact */
+template<typename PixelT, typename RowT>
+static void project(const void *pImage, size_t xsize, size_t ysize,
+        epicsFloat64 *pX, epicsFloat64 *pY)
+{
+    const PixelT *pRow = (const PixelT *) pImage;
+    RowT rowTotal;
+    size_t x, y;
+
+    for (x = 0; x < xsize; x++)
+        pX[x] = 0;
+
+    for (y = 0; y < ysize; y++, pRow += xsize)
+    {
+        rowTotal = 0;
+        for (x = 0; x < xsize; x++)
+        {
+            pX[x] += pRow[x];
+            rowTotal += pRow[x];
+        }
+        pY[y] = (epicsFloat64) rowTotal;
+    }
+}
+
+mpxProjector mpxGetProjector(int pixelBytes, bool isFloat)
+{
+    switch (pixelBytes)
+    {
+    case 1:
+        return project<epicsUInt8, uint64_t>;
+    case 2:
+        return project<epicsUInt16, uint64_t>;
+    case 4:
+        return isFloat ? project<epicsFloat32, epicsFloat64>
+                : project<epicsUInt32, uint64_t>;
+    default:
+        return NULL;
+    }
+}
+
+void mpxFlipSwap16(epicsUInt16 *pData, size_t xsize, size_t ysize, bool swap,
+        const mpxDecodeKernels *pKernels)
+{
+    if (pKernels == NULL)
+        pKernels = mpxGetDecodeKernels();
+
+    if (swap)
+        flipSwap<epicsUInt16, true, true>(pData, xsize, ysize, pKernels);
+    else
+        flipSwap<epicsUInt16, false, true>(pData, xsize, ysize, pKernels);
+}
+
+void mpxFlipSwap32(epicsUInt32 *pData, size_t xsize, size_t ysize, bool swap,
+        const mpxDecodeKernels *pKernels)
+{
+    if (pKernels == NULL)
+        pKernels = mpxGetDecodeKernels();
+
+    if (swap)
+        flipSwap<epicsUInt32, true, true>(pData, xsize, ysize, pKernels);
+    else
+        flipSwap<epicsUInt32, false, true>(pData, xsize, ysize, pKernels);
+}
@@ -0,0 +1,107 @@
+#ifndef MPXDECODE_H_
+#define MPXDECODE_H_
+
+#include <stddef.h>
+#include <epicsTypes.h>
+
+/** Pixel conversion kernels for medipix image frames
+ *
+ * Images arrive with the origin at the bottom left and, for Merlin and
+ * MerlinQuad, with big endian pixels. The kernels flip the image in Y and
+ * swap the pixel byte order in a single pass over the data, in place.
+ *
+ * Each set of kernels exchanges a pair of rows of n pixels, byte swapping
+ * every pixel on the way. pTop and pBottom may point at the same row (the
+ * middle row of an image with an odd number of rows).
+ */
+typedef void (*mpxSwapRows16Func)(epicsUInt16 *pTop, epicsUInt16 *pBottom,
+        size_t n);
+typedef void (*mpxSwapRows32Func)(epicsUInt32 *pTop, epicsUInt32 *pBottom,
+        size_t n);
+
+typedef struct mpxDecodeKernels
+{
+    const char *name;
+    mpxSwapRows16Func swapRows16;
+    mpxSwapRows32Func swapRows32;
+} mpxDecodeKernels;
+
+typedef enum
+{
+    mpxKernelAuto,
+    mpxKernelScalar,
+    mpxKernelSSSE3,
+    mpxKernelAVX2
+} mpxKernelType;
+
+/** Returns the requested set of kernels or NULL if it is not supported by
+ * this build or this CPU. mpxKernelAuto returns the fastest supported set,
+ * which is selected once on first use */
+const mpxDecodeKernels *mpxGetDecodeKernels(mpxKernelType type = mpxKernelAuto);
+
+/** Decoders for a complete frame. These are specialised at compile time on
+ * the pixel width, byte order and orientation of the data so that a set can
+ * be chosen once per acquisition rather than testing for every frame */
+typedef void (*mpxImageDecoder)(void *pData, size_t xsize, size_t ysize);
+typedef void (*mpxProfileDecoder)(epicsUInt32 *pDest, const char *pSrc,
+        size_t n);
+
+typedef struct mpxImageDecoders
+{
+    mpxImageDecoder decode8;
+    mpxImageDecoder decode16;
+    mpxImageDecoder decode32;
+    mpxProfileDecoder decodeProfile;
+} mpxImageDecoders;
+
+/** Returns the decoders for frames that are big endian (swap) and/or have
+ * their origin at the bottom left (flip) */
+const mpxImageDecoders *mpxGetImageDecoders(bool swap, bool flip);
+
+/** Accumulators add a decoded image of xsize by ysize pixels into a sum
+ * image, binning bin by bin pixels of the image into each pixel of the sum.
+ * The sum is xsize / bin by ysize / bin, pixels left over at the edges of
+ * the image are dropped */
+typedef void (*mpxAccumulator)(void *pSum, const void *pImage, size_t xsize,
+        size_t ysize);
+
+/** Returns the accumulator for images of pixelBytes (1, 2 or 4) per pixel
+ * into epicsUInt32 sums, or epicsFloat64 sums if wide, with bin of 1, 2 or
+ * 4. Returns NULL for any other combination */
+mpxAccumulator mpxGetAccumulator(int pixelBytes, bool wide, int bin);
+
+/** Flat field correctors multiply each of the n pixels of a decoded image by
+ * its gain. The scaled correctors write the result over the image rounded
+ * and clipped to the pixel type. The float correctors write epicsFloat32
+ * pixels over the image, which must have room for them: they work back from
+ * the last pixel so that narrower pixels are widened in place */
+typedef void (*mpxFlatCorrector)(void *pData, const epicsFloat32 *pGain,
+        size_t n);
+
+/** Returns the corrector for images of pixelBytes (1, 2 or 4) per pixel, or
+ * NULL for any other size */
+mpxFlatCorrector mpxGetFlatCorrector(int pixelBytes, bool toFloat);
+
+/** Projectors add up each column of a decoded image into pX (xsize values)
+ * and each row into pY (ysize values) in a single pass, both are zeroed
+ * first */
+typedef void (*mpxProjector)(const void *pImage, size_t xsize, size_t ysize,
+        epicsFloat64 *pX, epicsFloat64 *pY);
+
+/** Returns the projector for images of pixelBytes (1, 2 or 4) per pixel, or
+ * epicsFloat32 pixels if isFloat. Returns NULL for any other size */
+mpxProjector mpxGetProjector(int pixelBytes, bool isFloat);
+
+/** flip an image in Y, optionally swapping the byte order of each pixel */
+void mpxFlipSwap16(epicsUInt16 *pData, size_t xsize, size_t ysize, bool swap,
+        const mpxDecodeKernels *pKernels = NULL);
+void mpxFlipSwap32(epicsUInt32 *pData, size_t xsize, size_t ysize, bool swap,
+        const mpxDecodeKernels *pKernels = NULL);
+
+/* instruction set specific kernels - these return NULL when the file was
+ * not compiled with support for the instruction set */
+const mpxDecodeKernels *mpxScalarKernels();
+const mpxDecodeKernels *mpxSSSE3Kernels();
+const mpxDecodeKernels *mpxAVX2Kernels();
+
+#endif /* MPXDECODE_H_ */
@@ -0,0 +1,65 @@
+/* AVX2 row kernels - this file is compiled with -mavx2 (see Makefile) and
+ * the kernels are only used when the CPU and OS report AVX2 at runtime */
+#include "mpxDecode.h"
+
+#ifdef __AVX2__
+
+#include <immintrin.h>
+
+static void avx2SwapRows16(epicsUInt16 *pTop, epicsUInt16 *pBottom, size_t n)
+{
+    // vpshufb works within each 128 bit lane so the mask is repeated
+    const __m256i mask = _mm256_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7,
+            4, 5, 2, 3, 0, 1, 14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3,
+            0, 1);
+    size_t x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m256i top = _mm256_loadu_si256((__m256i *) (pTop + x));
+        __m256i bottom = _mm256_loadu_si256((__m256i *) (pBottom + x));
+        _mm256_storeu_si256((__m256i *) (pTop + x),
+                _mm256_shuffle_epi8(bottom, mask));
+        _mm256_storeu_si256((__m256i *) (pBottom + x),
+                _mm256_shuffle_epi8(top, mask));
+    }
+    if (x < n)
+        mpxScalarKernels()->swapRows16(pTop + x, pBottom + x, n - x);
+}
+
+static void avx2SwapRows32(epicsUInt32 *pTop, epicsUInt32 *pBottom, size_t n)
+{
+    const __m256i mask = _mm256_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5,
+            6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1,
+            2, 3);
+    size_t x = 0;
+
+    for (; x + 8 <= n; x += 8)
+    {
+        __m256i top = _mm256_loadu_si256((__m256i *) (pTop + x));
+        __m256i bottom = _mm256_loadu_si256((__m256i *) (pBottom + x));
+        _mm256_storeu_si256((__m256i *) (pTop + x),
+                _mm256_shuffle_epi8(bottom, mask));
+        _mm256_storeu_si256((__m256i *) (pBottom + x),
+                _mm256_shuffle_epi8(top, mask));
+    }
+    if (x < n)
+        mpxScalarKernels()->swapRows32(pTop + x, pBottom + x, n - x);
+}
+
+static const mpxDecodeKernels avx2Kernels =
+{ "AVX2", avx2SwapRows16, avx2SwapRows32 };
+
+const mpxDecodeKernels *mpxAVX2Kernels()
+{
+    return &avx2Kernels;
+}
+
+#else
+
+const mpxDecodeKernels *mpxAVX2Kernels()
+{
+    return NULL;
+}
+
+#endif
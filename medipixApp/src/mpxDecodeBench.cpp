@@ -0,0 +1,201 @@
+/* mpxDecodeBench.cpp
+ *
+ * Microbenchmark for the image conversion kernels in mpxDecode.cpp
+ *
+ * Compares the per pixel copy loop that the driver used to use (copy out of
+ * the receive buffer, flipping in Y and calling endian_swap() for every
+ * pixel) with the in place flip/swap using each set of kernels supported by
+ * this CPU. The output of every kernel is checked against a reference.
+ *
+ * usage: mpxDecodeBench [iterations]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <epicsTypes.h>
+#include <epicsTime.h>
+
+#include "mpxDecode.h"
+
+typedef struct benchCase
+{
+    const char *name;
+    size_t xsize;
+    size_t ysize;
+    int pixelBits;
+} benchCase;
+
+static const benchCase cases[] =
+{
+{ "256x256 12 bit", 256, 256, 16 },
+{ "256x256 24 bit", 256, 256, 32 },
+{ "512x512 Quad 12 bit", 512, 512, 16 },
+{ "512x512 Quad 24 bit", 512, 512, 32 } };
+
+/** A copy of the previous conversion, including the detector type test that
+ * endian_swap() makes on every pixel */
+class legacyCopy
+{
+public:
+    volatile int detType;
+
+    legacyCopy() : detType(0) {}
+
+    inline void endian_swap(unsigned short& x)
+    {
+        if (detType == 0 || detType == 3)
+            x = (x >> 8) | (x << 8);
+    }
+
+    inline void endian_swap(unsigned int& x)
+    {
+        if (detType == 0 || detType == 3)
+            x = (x >> 24) | ((x << 8) & 0x00FF0000) | ((x >> 8) & 0x0000FF00)
+                    | (x << 24);
+    }
+
+    void copy16(epicsUInt16 *pDest, const char *buffer, size_t *dims)
+    {
+        epicsUInt16 *pData, *pSrc;
+        size_t x, y;
+
+        for (y = 0; y < dims[1]; y++)
+        {
+            for (x = 0, pData = pDest + y * dims[0], pSrc = (epicsUInt16 *) buffer
+                    + (dims[1] - 1 - y) * dims[0]; x < dims[0];
+                    x++, pData++, pSrc++)
+            {
+                *pData = *pSrc;
+                endian_swap(*pData);
+            }
+        }
+    }
+
+    void copy32(epicsUInt32 *pDest, const char *buffer, size_t *dims)
+    {
+        epicsUInt32 *pData, *pSrc;
+        size_t x, y;
+
+        for (y = 0; y < dims[1]; y++)
+        {
+            for (x = 0, pData = pDest + y * dims[0], pSrc = (epicsUInt32 *) buffer
+                    + (dims[1] - 1 - y) * dims[0]; x < dims[0];
+                    x++, pData++, pSrc++)
+            {
+                *pData = *pSrc;
+                endian_swap(*pData);
+            }
+        }
+    }
+};
+
+static double elapsed(epicsTimeStamp *pStart)
+{
+    epicsTimeStamp now;
+
+    epicsTimeGetCurrent(&now);
+    return epicsTimeDiffInSeconds(&now, pStart);
+}
+
+static void report(const char *caseName, const char *kernelName,
+        double seconds, int iterations, size_t frameBytes, double baseline)
+{
+    double perFrame = seconds / iterations;
+
+    printf("%-22s %-8s %10.2f us/frame %10.1f MB/s", caseName, kernelName,
+            perFrame * 1e6, frameBytes / perFrame / 1e6);
+    if (baseline > 0)
+        printf(" %6.2fx", baseline / perFrame);
+    printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const mpxKernelType types[] =
+    { mpxKernelScalar, mpxKernelSSSE3, mpxKernelAVX2 };
+    int iterations = 1000;
+    int failures = 0;
+    legacyCopy legacy;
+    size_t c, t, i;
+    int n;
+
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (iterations <= 0)
+        iterations = 1;
+
+    printf("auto selected kernels: %s, %d iterations\n\n",
+            mpxGetDecodeKernels()->name, iterations);
+
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        const benchCase *pCase = &cases[c];
+        size_t dims[2] = { pCase->xsize, pCase->ysize };
+        size_t pixels = pCase->xsize * pCase->ysize;
+        size_t frameBytes = pixels * pCase->pixelBits / 8;
+        char *pRaw = (char*) malloc(frameBytes);
+        char *pExpected = (char*) malloc(frameBytes);
+        char *pWork = (char*) malloc(frameBytes);
+        epicsTimeStamp start;
+        double baseline;
+
+        // random big endian frame
+        srand(c + 1);
+        for (i = 0; i < frameBytes; i++)
+            pRaw[i] = (char) rand();
+
+        // the legacy copy gives the reference result
+        epicsTimeGetCurrent(&start);
+        for (n = 0; n < iterations; n++)
+        {
+            if (pCase->pixelBits == 16)
+                legacy.copy16((epicsUInt16 *) pExpected, pRaw, dims);
+            else
+                legacy.copy32((epicsUInt32 *) pExpected, pRaw, dims);
+        }
+        baseline = elapsed(&start) / iterations;
+        report(pCase->name, "legacy", baseline * iterations, iterations,
+                frameBytes, 0);
+
+        for (t = 0; t < sizeof(types) / sizeof(types[0]); t++)
+        {
+            const mpxDecodeKernels *pKernels = mpxGetDecodeKernels(types[t]);
+            double seconds = 0;
+
+            if (pKernels == NULL)
+                continue;
+
+            // the kernels work in place so each iteration starts from a
+            // fresh copy of the received frame, as the driver does
+            for (n = 0; n < iterations; n++)
+            {
+                memcpy(pWork, pRaw, frameBytes);
+                epicsTimeGetCurrent(&start);
+                if (pCase->pixelBits == 16)
+                    mpxFlipSwap16((epicsUInt16 *) pWork, pCase->xsize,
+                            pCase->ysize, true, pKernels);
+                else
+                    mpxFlipSwap32((epicsUInt32 *) pWork, pCase->xsize,
+                            pCase->ysize, true, pKernels);
+                seconds += elapsed(&start);
+            }
+            report(pCase->name, pKernels->name, seconds, iterations,
+                    frameBytes, baseline);
+
+            if (memcmp(pWork, pExpected, frameBytes) != 0)
+            {
+                printf("%-22s %-8s MISMATCH against legacy conversion\n",
+                        pCase->name, pKernels->name);
+                failures++;
+            }
+        }
+        printf("\n");
+
+        free(pRaw);
+        free(pExpected);
+        free(pWork);
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,58 @@
+/* SSSE3 row kernels - this file is compiled with -mssse3 (see Makefile) and
+ * the kernels are only used when the CPU reports SSSE3 at runtime */
+#include "mpxDecode.h"
+
+#ifdef __SSSE3__
+
+#include <tmmintrin.h>
+
+static void ssse3SwapRows16(epicsUInt16 *pTop, epicsUInt16 *pBottom, size_t n)
+{
+    const __m128i mask = _mm_set_epi8(14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4,
+            5, 2, 3, 0, 1);
+    size_t x = 0;
+
+    for (; x + 8 <= n; x += 8)
+    {
+        __m128i top = _mm_loadu_si128((__m128i *) (pTop + x));
+        __m128i bottom = _mm_loadu_si128((__m128i *) (pBottom + x));
+        _mm_storeu_si128((__m128i *) (pTop + x), _mm_shuffle_epi8(bottom, mask));
+        _mm_storeu_si128((__m128i *) (pBottom + x), _mm_shuffle_epi8(top, mask));
+    }
+    if (x < n)
+        mpxScalarKernels()->swapRows16(pTop + x, pBottom + x, n - x);
+}
+
+static void ssse3SwapRows32(epicsUInt32 *pTop, epicsUInt32 *pBottom, size_t n)
+{
+    const __m128i mask = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6,
+            7, 0, 1, 2, 3);
+    size_t x = 0;
+
+    for (; x + 4 <= n; x += 4)
+    {
+        __m128i top = _mm_loadu_si128((__m128i *) (pTop + x));
+        __m128i bottom = _mm_loadu_si128((__m128i *) (pBottom + x));
+        _mm_storeu_si128((__m128i *) (pTop + x), _mm_shuffle_epi8(bottom, mask));
+        _mm_storeu_si128((__m128i *) (pBottom + x), _mm_shuffle_epi8(top, mask));
+    }
+    if (x < n)
+        mpxScalarKernels()->swapRows32(pTop + x, pBottom + x, n - x);
+}
+
+static const mpxDecodeKernels ssse3Kernels =
+{ "SSSE3", ssse3SwapRows16, ssse3SwapRows32 };
+
+const mpxDecodeKernels *mpxSSSE3Kernels()
+{
+    return &ssse3Kernels;
+}
+
+#else
+
+const mpxDecodeKernels *mpxSSSE3Kernels()
+{
+    return NULL;
+}
+
+#endif
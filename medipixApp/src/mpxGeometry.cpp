@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpxGeometry.h"
+
+/** Compiles the geometry of a frame, or returns NULL if the frame does not
+ * need remapping: it has no layout, the server has already put in the gaps
+ * ("2x2G" and "Nx1G") or its size does not match the layout */
+mpxGeometry *mpxGeometry::create(const char *sensorLayout, size_t xsize,
+        size_t ysize, int chipSize, int chipSelect, int rotateMask,
+        int edgeWidth, int gap)
+{
+    const char *layout = sensorLayout;
+    int columns, rows;
+    size_t len;
+    mpxGeometry *pGeometry;
+
+    while (*layout == ' ')
+        layout++;
+    len = strlen(layout);
+    if (len == 0 || layout[len - 1] == 'G' || chipSize <= 0)
+        return NULL;
+
+    if (layout[0] == 'N')
+    {
+        columns = (int) (xsize / chipSize);
+        if (sscanf(layout, "Nx%d", &rows) != 1)
+            return NULL;
+    }
+    else if (sscanf(layout, "%dx%d", &columns, &rows) != 2)
+        return NULL;
+
+    if (columns <= 0 || rows <= 0 || xsize != (size_t) columns * chipSize
+            || ysize != (size_t) rows * chipSize || columns * rows > 32)
+        return NULL;
+
+    if (edgeWidth < 1)
+        edgeWidth = 1;
+    if (edgeWidth > 16)
+        edgeWidth = 16;
+    if (gap < 0)
+        gap = 0;
+
+    pGeometry = new mpxGeometry();
+    strncpy(pGeometry->sensorLayout, sensorLayout,
+            sizeof(pGeometry->sensorLayout) - 1);
+    pGeometry->inSize[0] = xsize;
+    pGeometry->inSize[1] = ysize;
+    pGeometry->chipSelect = chipSelect;
+    pGeometry->compile(chipSize, columns, rotateMask, edgeWidth, gap);
+    return pGeometry;
+}
+
+mpxGeometry::mpxGeometry()
+{
+    memset(sensorLayout, 0, sizeof(sensorLayout));
+    inSize[0] = inSize[1] = 0;
+    outSize[0] = outSize[1] = 0;
+    chipSelect = 0;
+    runs = NULL;
+    numRuns = 0;
+    widePixels = NULL;
+    numWidePixels = 0;
+}
+
+mpxGeometry::~mpxGeometry()
+{
+    free(runs);
+    free(widePixels);
+}
+
+bool mpxGeometry::matches(const char *sensorLayout, size_t xsize,
+        size_t ysize, int chipSelect) const
+{
+    return strncmp(this->sensorLayout, sensorLayout,
+            sizeof(this->sensorLayout) - 1) == 0 && inSize[0] == xsize
+            && inSize[1] == ysize && this->chipSelect == chipSelect;
+}
+
+/** Where each column (or row) of the chip grid goes in the remapped image
+ * and how wide it is. Returns the size of the remapped image */
+static size_t layoutAxis(size_t size, int chipSize, int edgeWidth, int gap,
+        epicsUInt32 *start, epicsUInt16 *width)
+{
+    size_t pos = 0;
+    size_t i, chip, chips = size / chipSize;
+    int local;
+
+    for (i = 0; i < size; i++)
+    {
+        chip = i / chipSize;
+        local = (int) (i % chipSize);
+        width[i] = 1;
+        if ((local == 0 && chip > 0)
+                || (local == chipSize - 1 && chip < chips - 1))
+            width[i] = (epicsUInt16) edgeWidth;
+
+        start[i] = (epicsUInt32) pos;
+        pos += width[i];
+        if (local == chipSize - 1 && chip < chips - 1)
+            pos += gap;
+    }
+    return pos;
+}
+
+/** Appends a run, extending the last one if it carries straight on */
+static void addRun(mpxGeometryRun **pRuns, int *pCount, int *pSize,
+        epicsUInt32 src, epicsUInt32 dst, int step)
+{
+    mpxGeometryRun *pLast = *pCount ? *pRuns + *pCount - 1 : NULL;
+
+    if (pLast != NULL && pLast->step == step
+            && pLast->dstOffset + pLast->length == dst
+            && (long) pLast->srcOffset + step * (long) pLast->length
+                    == (long) src)
+    {
+        pLast->length++;
+        return;
+    }
+
+    if (*pCount == *pSize)
+    {
+        *pSize = *pSize ? *pSize * 2 : 1024;
+        *pRuns = (mpxGeometryRun*) realloc(*pRuns,
+                *pSize * sizeof(mpxGeometryRun));
+    }
+    pLast = *pRuns + (*pCount)++;
+    pLast->srcOffset = src;
+    pLast->dstOffset = dst;
+    pLast->length = 1;
+    pLast->step = step;
+}
+
+/** Builds the runs and wide pixels, a pixel at a time as this is only done
+ * once for each layout */
+void mpxGeometry::compile(int chipSize, int columns, int rotateMask,
+        int edgeWidth, int gap)
+{
+    size_t xsize = inSize[0];
+    size_t ysize = inSize[1];
+    epicsUInt32 *colStart = (epicsUInt32*) malloc(xsize * sizeof(epicsUInt32));
+    epicsUInt32 *rowStart = (epicsUInt32*) malloc(ysize * sizeof(epicsUInt32));
+    epicsUInt16 *colWidth = (epicsUInt16*) malloc(xsize * sizeof(epicsUInt16));
+    epicsUInt16 *rowWidth = (epicsUInt16*) malloc(ysize * sizeof(epicsUInt16));
+    char *covered;
+    int runsSize = 0, wideSize = 0;
+    size_t x, y, srcX, srcY, i, j;
+    epicsUInt32 src, dst;
+    int chip, cx, cy;
+    bool rotated;
+
+    outSize[0] = layoutAxis(xsize, chipSize, edgeWidth, gap, colStart,
+            colWidth);
+    outSize[1] = layoutAxis(ysize, chipSize, edgeWidth, gap, rowStart,
+            rowWidth);
+    covered = (char*) calloc(outSize[0] * outSize[1], 1);
+
+    for (y = 0; y < ysize; y++)
+    {
+        for (x = 0; x < xsize; x++)
+        {
+            cx = (int) (x / chipSize);
+            cy = (int) (y / chipSize);
+            chip = cy * columns + cx;
+            if (!(chipSelect & (1 << chip)))
+                continue;
+
+            // a rotated chip has its pixels the other way round in the frame
+            rotated = (rotateMask & (1 << chip)) != 0;
+            srcX = rotated ? (2 * cx + 1) * chipSize - 1 - x : x;
+            srcY = rotated ? (2 * cy + 1) * chipSize - 1 - y : y;
+            src = (epicsUInt32) (srcY * xsize + srcX);
+            dst = (epicsUInt32) (rowStart[y] * outSize[0] + colStart[x]);
+
+            if (colWidth[x] == 1 && rowWidth[y] == 1)
+            {
+                addRun(&runs, &numRuns, &runsSize, src, dst,
+                        rotated ? -1 : 1);
+                covered[dst] = 1;
+                continue;
+            }
+
+            if (numWidePixels == wideSize)
+            {
+                wideSize = wideSize ? wideSize * 2 : 1024;
+                widePixels = (mpxGeometryWidePixel*) realloc(widePixels,
+                        wideSize * sizeof(mpxGeometryWidePixel));
+            }
+            widePixels[numWidePixels].srcOffset = src;
+            widePixels[numWidePixels].dstOffset = dst;
+            widePixels[numWidePixels].width = colWidth[x];
+            widePixels[numWidePixels].height = rowWidth[y];
+            numWidePixels++;
+            for (j = 0; j < rowWidth[y]; j++)
+                for (i = 0; i < colWidth[x]; i++)
+                    covered[dst + j * outSize[0] + i] = 1;
+        }
+    }
+
+    // the gaps and the chips that are not selected
+    for (i = 0; i < outSize[0] * outSize[1]; i++)
+    {
+        if (!covered[i])
+            addRun(&runs, &numRuns, &runsSize, 0, (epicsUInt32) i, 0);
+    }
+
+    free(covered);
+    free(colStart);
+    free(rowStart);
+    free(colWidth);
+    free(rowWidth);
+}
+
+template<typename PixelT>
+void mpxGeometry::copyRuns(const PixelT *pSrc, PixelT *pDst) const
+{
+    const mpxGeometryRun *pRun;
+    const PixelT *pFrom;
+    PixelT *pTo;
+    epicsUInt32 i;
+
+    for (pRun = runs; pRun < runs + numRuns; pRun++)
+    {
+        pTo = pDst + pRun->dstOffset;
+        if (pRun->step > 0)
+        {
+            memcpy(pTo, pSrc + pRun->srcOffset,
+                    pRun->length * sizeof(PixelT));
+        }
+        else if (pRun->step < 0)
+        {
+            pFrom = pSrc + pRun->srcOffset;
+            for (i = 0; i < pRun->length; i++)
+                pTo[i] = *(pFrom - i);
+        }
+        else
+            memset(pTo, 0, pRun->length * sizeof(PixelT));
+    }
+}
+
+/** The share of the counts of a wide pixel in each of the area pixels it
+ * covers. Integer counts are shared out so that none are lost */
+template<typename PixelT>
+static inline PixelT sharePixel(PixelT value, int area, int i)
+{
+    return (PixelT) (value / area + (i < (int) (value % area) ? 1 : 0));
+}
+
+static inline epicsFloat32 sharePixel(epicsFloat32 value, int area, int)
+{
+    return value / area;
+}
+
+template<typename PixelT>
+void mpxGeometry::shareWidePixels(const PixelT *pSrc, PixelT *pDst) const
+{
+    const mpxGeometryWidePixel *pWide;
+    PixelT value;
+    PixelT *pTo;
+    int i, j, area;
+
+    for (pWide = widePixels; pWide < widePixels + numWidePixels; pWide++)
+    {
+        value = pSrc[pWide->srcOffset];
+        area = pWide->width * pWide->height;
+        for (j = 0; j < pWide->height; j++)
+        {
+            pTo = pDst + pWide->dstOffset + j * outSize[0];
+            for (i = 0; i < pWide->width; i++)
+                pTo[i] = sharePixel(value, area, j * pWide->width + i);
+        }
+    }
+}
+
+void mpxGeometry::remap(const void *pSrc, void *pDst, int pixelBytes,
+        bool isFloat) const
+{
+    switch (pixelBytes)
+    {
+    case 1:
+        copyRuns((const epicsUInt8 *) pSrc, (epicsUInt8 *) pDst);
+        shareWidePixels((const epicsUInt8 *) pSrc, (epicsUInt8 *) pDst);
+        break;
+    case 2:
+        copyRuns((const epicsUInt16 *) pSrc, (epicsUInt16 *) pDst);
+        shareWidePixels((const epicsUInt16 *) pSrc, (epicsUInt16 *) pDst);
+        break;
+    case 4:
+        if (isFloat)
+        {
+            copyRuns((const epicsFloat32 *) pSrc, (epicsFloat32 *) pDst);
+            shareWidePixels((const epicsFloat32 *) pSrc,
+                    (epicsFloat32 *) pDst);
+        }
+        else
+        {
+            copyRuns((const epicsUInt32 *) pSrc, (epicsUInt32 *) pDst);
+            shareWidePixels((const epicsUInt32 *) pSrc,
+                    (epicsUInt32 *) pDst);
+        }
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,85 @@
+#ifndef MPXGEOMETRY_H_
+#define MPXGEOMETRY_H_
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "mpxRefCounted.h"
+
+/** A run of pixels of the remapped image. step is 1 to copy length pixels
+ * from srcOffset, -1 to copy them backwards from srcOffset (a rotated chip)
+ * and 0 to zero them (a gap or a chip that is not selected) */
+typedef struct mpxGeometryRun
+{
+    epicsUInt32 srcOffset;
+    epicsUInt32 dstOffset;
+    epicsUInt32 length;
+    int step;
+} mpxGeometryRun;
+
+/** A wide pixel at the edge of a chip, its counts are shared between the
+ * width x height pixels it covers in the remapped image */
+typedef struct mpxGeometryWidePixel
+{
+    epicsUInt32 srcOffset;
+    epicsUInt32 dstOffset;
+    epicsUInt16 width;
+    epicsUInt16 height;
+} mpxGeometryWidePixel;
+
+/** Remaps the chips of a Merlin Quad frame into the true geometry of the
+ * sensor.
+ *
+ * The frame is a grid of square chips of chipSize pixels as given by the
+ * Sensor Layout of its header ("2x2" or "Nx1"). Chips are numbered from 1
+ * left to right and then top to bottom of the decoded image, as in the Chip
+ * Select mask. In the remapped image:
+ *  - the pixels on each side of a boundary between chips are edgeWidth
+ *    pixels wide, their counts shared out between them
+ *  - gap pixels of 0 are added between chips
+ *  - the chips in rotateMask are turned through 180 degrees
+ *  - the chips that are not in chipSelect are 0
+ *
+ * The remap is compiled into runs of pixels that are copied with memcpy,
+ * copied backwards or zeroed, and the list of wide pixels, once for each
+ * layout.
+ */
+class mpxGeometry : public mpxRefCounted
+{
+public:
+    static mpxGeometry *create(const char *sensorLayout, size_t xsize,
+            size_t ysize, int chipSize, int chipSelect, int rotateMask,
+            int edgeWidth, int gap);
+
+    /* true if this was compiled for a frame with these settings */
+    bool matches(const char *sensorLayout, size_t xsize, size_t ysize,
+            int chipSelect) const;
+    size_t getXSize() const { return outSize[0]; }
+    size_t getYSize() const { return outSize[1]; }
+
+    /* remaps a decoded frame of pixelBytes per pixel into pDst */
+    void remap(const void *pSrc, void *pDst, int pixelBytes,
+            bool isFloat) const;
+
+private:
+    mpxGeometry();
+    ~mpxGeometry();
+    void compile(int chipSize, int columns, int rotateMask, int edgeWidth,
+            int gap);
+    template<typename PixelT> void copyRuns(const PixelT *pSrc,
+            PixelT *pDst) const;
+    template<typename PixelT> void shareWidePixels(const PixelT *pSrc,
+            PixelT *pDst) const;
+
+    char sensorLayout[8];
+    size_t inSize[2];
+    size_t outSize[2];
+    int chipSelect;
+    mpxGeometryRun *runs;
+    int numRuns;
+    mpxGeometryWidePixel *widePixels;
+    int numWidePixels;
+};
+
+#endif /* MPXGEOMETRY_H_ */
@@ -0,0 +1,459 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "medipix_low.h"
+#include "mpxHeader.h"
+
+// #######################################################################################
+// ##################### Frame Header Layouts              ###############################
+// #######################################################################################
+
+typedef struct fieldLayout
+{
+    mpxHeaderField field;
+    int count;
+} fieldLayout;
+
+// 12B,24B,P12,P24: frame,counter,time,duration,Th0,Th1,DAC001..DAC025[,profiles]
+static const fieldLayout singleLayout[] =
+{
+{ MPXHDR_FRAME_NUMBER, 1 },
+{ MPXHDR_COUNTER_NUMBER, 1 },
+{ MPXHDR_START_TIME, 1 },
+{ MPXHDR_DURATION, 1 },
+{ MPXHDR_THRESHOLD, 2 },
+{ MPXHDR_DAC, MPX_HDR_NUM_DACS },
+{ MPXHDR_PROFILE_MASK, 1 } };
+
+// IMG,PRF: as above with x,y,width,height,depth,pixel_size after the duration
+static const fieldLayout genericLayout[] =
+{
+{ MPXHDR_FRAME_NUMBER, 1 },
+{ MPXHDR_COUNTER_NUMBER, 1 },
+{ MPXHDR_START_TIME, 1 },
+{ MPXHDR_DURATION, 1 },
+{ MPXHDR_X_OFFSET, 1 },
+{ MPXHDR_Y_OFFSET, 1 },
+{ MPXHDR_X_SIZE, 1 },
+{ MPXHDR_Y_SIZE, 1 },
+{ MPXHDR_PIXEL_DEPTH, 1 },
+{ MPXHDR_PIXEL_SIZE, 1 },
+{ MPXHDR_THRESHOLD, 2 },
+{ MPXHDR_DAC, MPX_HDR_NUM_DACS },
+{ MPXHDR_PROFILE_MASK, 1 } };
+
+// MQ1: frame,offset,chips,x,y,Udepth,layout,chip select,time stamp,shutter,
+//      counter,colour,gain,Th0..Th7 followed by the per chip DAC sections,
+//      which are parsed by parseChipDacs
+static const fieldLayout quadLayout[] =
+{
+{ MPXHDR_FRAME_NUMBER, 1 },
+{ MPXHDR_HEADER_LENGTH, 1 },
+{ MPXHDR_CHIP_COUNT, 1 },
+{ MPXHDR_X_SIZE, 1 },
+{ MPXHDR_Y_SIZE, 1 },
+{ MPXHDR_PIXEL_DEPTH, 1 },
+{ MPXHDR_SENSOR_LAYOUT, 1 },
+{ MPXHDR_CHIP_SELECT, 1 },
+{ MPXHDR_TIME_STAMP, 1 },
+{ MPXHDR_SHUTTER_TIME, 1 },
+{ MPXHDR_COUNTER, 1 },
+{ MPXHDR_COLOUR_MODE, 1 },
+{ MPXHDR_GAIN_MODE, 1 },
+{ MPXHDR_THRESHOLD, MPX_HDR_NUM_THRESHOLDS } };
+
+#define LAYOUT_LEN(layout) (sizeof(layout) / sizeof(layout[0]))
+
+const char * const mpxDacNames[MPX_HDR_NUM_DACS] =
+{ "DAC 001", "DAC 002", "DAC 003", "DAC 004", "DAC 005", "DAC 006",
+        "DAC 007", "DAC 008", "DAC 009", "DAC 010", "DAC 011", "DAC 012",
+        "DAC 013", "DAC 014", "DAC 015", "DAC 016", "DAC 017", "DAC 018",
+        "DAC 019", "DAC 020", "DAC 021", "DAC 022", "DAC 023", "DAC 024",
+        "DAC 025" };
+
+#define CHIP_DAC_NAMES(chip) \
+{ "Chip " chip " DAC 001", "Chip " chip " DAC 002", "Chip " chip " DAC 003", \
+  "Chip " chip " DAC 004", "Chip " chip " DAC 005", "Chip " chip " DAC 006", \
+  "Chip " chip " DAC 007", "Chip " chip " DAC 008", "Chip " chip " DAC 009", \
+  "Chip " chip " DAC 010", "Chip " chip " DAC 011", "Chip " chip " DAC 012", \
+  "Chip " chip " DAC 013", "Chip " chip " DAC 014", "Chip " chip " DAC 015", \
+  "Chip " chip " DAC 016", "Chip " chip " DAC 017", "Chip " chip " DAC 018", \
+  "Chip " chip " DAC 019", "Chip " chip " DAC 020", "Chip " chip " DAC 021", \
+  "Chip " chip " DAC 022", "Chip " chip " DAC 023", "Chip " chip " DAC 024", \
+  "Chip " chip " DAC 025", "Chip " chip " DAC 026", "Chip " chip " DAC 027", \
+  "Chip " chip " DAC 028", "Chip " chip " DAC 029", "Chip " chip " DAC 030", \
+  "Chip " chip " DAC 031", "Chip " chip " DAC 032" }
+
+const char * const mpxChipDacNames[MPX_HDR_MAX_CHIPS][MPX_HDR_NUM_CHIP_DACS] =
+{ CHIP_DAC_NAMES("1"), CHIP_DAC_NAMES("2"), CHIP_DAC_NAMES("3"),
+        CHIP_DAC_NAMES("4") };
+
+// #######################################################################################
+// ##################### Field Conversion                  ###############################
+// #######################################################################################
+
+// each of these converts the field [p, end) and returns false if the field
+// holds no number
+
+static bool parseInt(const char *p, const char *end, int *value)
+{
+    bool negative = false;
+    int result = 0;
+    const char *digits;
+
+    while (p < end && *p == ' ')
+        p++;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+    for (digits = p; p < end && *p >= '0' && *p <= '9'; p++)
+        result = result * 10 + (*p - '0');
+    if (p == digits)
+        return false;
+
+    *value = negative ? -result : result;
+    return true;
+}
+
+static bool parseHex(const char *p, const char *end, int *value)
+{
+    unsigned int result = 0;
+    const char *digits;
+    int digit;
+
+    while (p < end && *p == ' ')
+        p++;
+    for (digits = p; p < end; p++)
+    {
+        if (*p >= '0' && *p <= '9')
+            digit = *p - '0';
+        else if (*p >= 'a' && *p <= 'f')
+            digit = *p - 'a' + 10;
+        else if (*p >= 'A' && *p <= 'F')
+            digit = *p - 'A' + 10;
+        else
+            break;
+        result = (result << 4) | digit;
+    }
+    if (p == digits)
+        return false;
+
+    *value = (int) result;
+    return true;
+}
+
+// powers of 10 that are exactly representable as doubles
+static const double powersOf10[] =
+{ 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+        1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+#define MAX_EXACT_POWER 22
+
+static bool parseDouble(const char *p, const char *end, double *value)
+{
+    const char *start = p;
+    bool negative = false;
+    unsigned long long mantissa = 0;
+    int numDigits = 0, exponent = 0;
+    bool fraction = false, negativeExponent = false;
+    char buff[40];
+    size_t len;
+
+    while (p < end && *p == ' ')
+        p++;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+    for (; p < end; p++)
+    {
+        if (*p >= '0' && *p <= '9')
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            numDigits++;
+            if (fraction)
+                exponent--;
+        }
+        else if (*p == '.' && !fraction)
+            fraction = true;
+        else
+            break;
+    }
+    if (numDigits == 0)
+        return false;
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        int value = 0;
+
+        p++;
+        if (p < end && (*p == '-' || *p == '+'))
+            negativeExponent = (*p++ == '-');
+        for (; p < end && *p >= '0' && *p <= '9' && value < 1000; p++)
+            value = value * 10 + (*p - '0');
+        exponent += negativeExponent ? -value : value;
+    }
+
+    // a mantissa of up to 15 digits scaled by an exact power of 10 gives
+    // the correctly rounded result - anything else goes through strtod
+    if (numDigits > 15 || exponent > MAX_EXACT_POWER
+            || exponent < -MAX_EXACT_POWER)
+    {
+        len = end - start;
+        if (len > sizeof(buff) - 1)
+            len = sizeof(buff) - 1;
+        memcpy(buff, start, len);
+        buff[len] = 0;
+        *value = strtod(buff, NULL);
+        return true;
+    }
+
+    if (exponent < 0)
+        *value = (double) mantissa / powersOf10[-exponent];
+    else
+        *value = (double) mantissa * powersOf10[exponent];
+    if (negative)
+        *value = -*value;
+    return true;
+}
+
+// #######################################################################################
+// ##################### Frame Header Parser               ###############################
+// #######################################################################################
+
+// parses the DAC sections that follow the thresholds of an MQ1 header - for
+// each chip the DAC format (e.g. 3RX) and then as many DACs as the format
+// has, up to the padding at the end of the header. Returns the number of
+// DACs parsed
+static int parseChipDacs(mpxFrameHeader *pHdr, const char *p,
+        const char *end)
+{
+    const char *digits;
+    int chip = -1;
+    int numFields = 0;
+    int value, count;
+
+    // each field is converted as it is scanned, as there are around 25
+    // DACs for each chip
+    while (p < end && *p == ',')
+    {
+        p++;
+        while (p < end && *p == ' ')
+            p++;
+        value = 0;
+        for (digits = p; p < end && *p >= '0' && *p <= '9'; p++)
+            value = value * 10 + (*p - '0');
+        if (p > digits)
+        {
+            while (p < end && *p == ' ')
+                p++;
+        }
+
+        if (p > digits && (p == end || *p == ',' || *p == 0))
+        {
+            if (chip < 0)
+                break;
+            count = pHdr->numChipDacs[chip];
+            if (count < MPX_HDR_NUM_CHIP_DACS)
+            {
+                pHdr->chipDac[chip][count] = value;
+                pHdr->numChipDacs[chip] = count + 1;
+                numFields++;
+            }
+        }
+        else
+        {
+            // anything else is the format that starts the next section
+            if (chip + 1 >= MPX_HDR_MAX_CHIPS)
+                break;
+            chip++;
+            pHdr->numChipDacs[chip] = 0;
+            while (p < end && *p != ',' && *p != 0)
+                p++;
+        }
+    }
+
+    pHdr->numChips = chip + 1;
+    if (numFields > 0)
+        pHdr->present |= 1u << MPXHDR_CHIP_DAC;
+    return numFields;
+}
+
+// converts a single field into the header structure
+static bool parseField(mpxFrameHeader *pHdr, mpxHeaderField field,
+        const char *p, const char *end)
+{
+    switch (field)
+    {
+    case MPXHDR_FRAME_NUMBER:
+        return parseInt(p, end, &pHdr->frameNumber);
+    case MPXHDR_HEADER_LENGTH:
+        return parseInt(p, end, &pHdr->headerLength);
+    case MPXHDR_COUNTER_NUMBER:
+        return parseInt(p, end, &pHdr->counterNumber);
+    case MPXHDR_START_TIME:
+    case MPXHDR_TIME_STAMP:
+        // the driver time stamps frames itself so only note that it was sent
+        return p < end;
+    case MPXHDR_DURATION:
+        return parseDouble(p, end, &pHdr->duration);
+    case MPXHDR_X_OFFSET:
+        return parseInt(p, end, &pHdr->xOffset);
+    case MPXHDR_Y_OFFSET:
+        return parseInt(p, end, &pHdr->yOffset);
+    case MPXHDR_X_SIZE:
+        return parseInt(p, end, &pHdr->xSize);
+    case MPXHDR_Y_SIZE:
+        return parseInt(p, end, &pHdr->ySize);
+    case MPXHDR_PIXEL_DEPTH:
+        // MQ1 writes the depth as U01, U08, U16 ...
+        if (pHdr->type == MPXQuadDataHeader && p < end && *p == 'U')
+            p++;
+        return parseInt(p, end, &pHdr->pixelDepth);
+    case MPXHDR_PIXEL_SIZE:
+        return parseInt(p, end, &pHdr->pixelSize);
+    case MPXHDR_CHIP_COUNT:
+        return parseInt(p, end, &pHdr->chipCount);
+    case MPXHDR_SENSOR_LAYOUT:
+    {
+        size_t len = end - p;
+        if (len >= MPX_HDR_LAYOUT_LEN)
+            len = MPX_HDR_LAYOUT_LEN - 1;
+        memcpy(pHdr->sensorLayout, p, len);
+        pHdr->sensorLayout[len] = 0;
+        return len > 0;
+    }
+    case MPXHDR_CHIP_SELECT:
+        return parseHex(p, end, &pHdr->chipSelect);
+    case MPXHDR_SHUTTER_TIME:
+        return parseDouble(p, end, &pHdr->shutterTime);
+    case MPXHDR_COUNTER:
+        return parseInt(p, end, &pHdr->counter);
+    case MPXHDR_COLOUR_MODE:
+        return parseInt(p, end, &pHdr->colourMode);
+    case MPXHDR_GAIN_MODE:
+        return parseInt(p, end, &pHdr->gainMode);
+    case MPXHDR_THRESHOLD:
+        if (!parseDouble(p, end, &pHdr->threshold[pHdr->numThresholds]))
+            return false;
+        pHdr->numThresholds++;
+        return true;
+    case MPXHDR_DAC:
+        if (!parseInt(p, end, &pHdr->dac[pHdr->numDacs]))
+            return false;
+        pHdr->numDacs++;
+        return true;
+    case MPXHDR_PROFILE_MASK:
+        return parseInt(p, end, &pHdr->profileMask);
+    case MPXHDR_CHIP_DAC:
+        // parsed by parseChipDacs as the number of them is not fixed
+        return false;
+    }
+    return false;
+}
+
+int mpxParseFrameHeader(const char *header, size_t length,
+        medipixDataHeader type, mpxFrameHeader *pHdr)
+{
+    const fieldLayout *layout;
+    size_t layoutLen, i;
+    const char *p = header;
+    const char *end = header + length;
+    const char *fieldEnd;
+    int count, numFields = 0;
+
+    pHdr->type = type;
+    pHdr->present = 0;
+    pHdr->numThresholds = 0;
+    pHdr->numDacs = 0;
+    pHdr->profileMask = 0;
+    pHdr->numChips = 0;
+
+    switch (type)
+    {
+    case MPXDataHeader12:
+    case MPXDataHeader24:
+    case MPXProfileHeader12:
+    case MPXProfileHeader24:
+        layout = singleLayout;
+        layoutLen = LAYOUT_LEN(singleLayout);
+        break;
+    case MPXGenericImageHeader:
+    case MPXGenericProfileHeader:
+        layout = genericLayout;
+        layoutLen = LAYOUT_LEN(genericLayout);
+        break;
+    case MPXQuadDataHeader:
+        layout = quadLayout;
+        layoutLen = LAYOUT_LEN(quadLayout);
+        break;
+    default:
+        return 0;
+    }
+
+    // skip the frame type
+    while (p < end && *p != ',' && *p != 0)
+        p++;
+
+    for (i = 0; i < layoutLen; i++)
+    {
+        for (count = 0; count < layout[i].count; count++)
+        {
+            if (p >= end || *p != ',')
+                return numFields;
+            p++;
+            for (fieldEnd = p; fieldEnd < end && *fieldEnd != ','
+                    && *fieldEnd != 0; fieldEnd++)
+                ;
+
+            if (parseField(pHdr, layout[i].field, p, fieldEnd))
+            {
+                pHdr->present |= 1u << layout[i].field;
+                numFields++;
+            }
+            p = fieldEnd;
+        }
+    }
+
+    if (type == MPXQuadDataHeader)
+        numFields += parseChipDacs(pHdr, p, end);
+
+    return numFields;
+}
+
+medipixDataHeader mpxHeaderType(const char *header)
+{
+    if (!strncmp(header, MPX_DATA_12, MPX_MSG_DATATYPE_LEN))
+        return MPXDataHeader12;
+    if (!strncmp(header, MPX_DATA_24, MPX_MSG_DATATYPE_LEN))
+        return MPXDataHeader24;
+    if (!strncmp(header, MPX_GENERIC_IMAGE, MPX_MSG_DATATYPE_LEN))
+        return MPXGenericImageHeader;
+    if (!strncmp(header, MPX_QUAD_DATA, MPX_MSG_DATATYPE_LEN))
+        return MPXQuadDataHeader;
+    if (!strncmp(header, MPX_PROFILE_12, MPX_MSG_DATATYPE_LEN))
+        return MPXProfileHeader12;
+    if (!strncmp(header, MPX_PROFILE_24, MPX_MSG_DATATYPE_LEN))
+        return MPXProfileHeader24;
+    if (!strncmp(header, MPX_GENERIC_PROFILE, MPX_MSG_DATATYPE_LEN))
+        return MPXGenericProfileHeader;
+    if (!strncmp(header, MPX_DATA_ACQ_HDR, MPX_MSG_DATATYPE_LEN))
+        return MPXAcquisitionHeader;
+    return MPXUnknownHeader;
+}
+
+int mpxHeaderPixelSize(const mpxFrameHeader *pHdr)
+{
+    switch (pHdr->type)
+    {
+    case MPXDataHeader12:
+    case MPXProfileHeader12:
+        return 16;
+    case MPXDataHeader24:
+    case MPXProfileHeader24:
+        return 32;
+    case MPXGenericImageHeader:
+    case MPXGenericProfileHeader:
+        return MPXHDR_PRESENT(pHdr, MPXHDR_PIXEL_SIZE) ? pHdr->pixelSize : 0;
+    case MPXQuadDataHeader:
+        return MPXHDR_PRESENT(pHdr, MPXHDR_PIXEL_DEPTH) ? pHdr->pixelDepth : 0;
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef MPXHEADER_H_
+#define MPXHEADER_H_
+
+#include <stddef.h>
+
+/** data header types */
+typedef enum
+{
+    MPXDataHeaderNone,
+    MPXDataHeader12,
+    MPXDataHeader24,
+    MPXGenericImageHeader,
+    MPXProfileHeader12,
+    MPXProfileHeader24,
+    MPXGenericProfileHeader,
+    MPXAcquisitionHeader,
+    MPXQuadDataHeader,
+    MPXUnknownHeader
+} medipixDataHeader;
+
+#define MPX_HDR_NUM_DACS        25
+#define MPX_HDR_NUM_THRESHOLDS  8
+#define MPX_HDR_LAYOUT_LEN      8
+/** MQ1 headers have a DAC section for each chip */
+#define MPX_HDR_MAX_CHIPS       4
+#define MPX_HDR_NUM_CHIP_DACS   32
+
+/** The fields of a data frame header. Each bit in the present mask of
+ * mpxFrameHeader says whether the corresponding field was in the header */
+typedef enum
+{
+    MPXHDR_FRAME_NUMBER,
+    MPXHDR_HEADER_LENGTH,
+    MPXHDR_COUNTER_NUMBER,
+    MPXHDR_START_TIME,
+    MPXHDR_DURATION,
+    MPXHDR_X_OFFSET,
+    MPXHDR_Y_OFFSET,
+    MPXHDR_X_SIZE,
+    MPXHDR_Y_SIZE,
+    MPXHDR_PIXEL_DEPTH,
+    MPXHDR_PIXEL_SIZE,
+    MPXHDR_CHIP_COUNT,
+    MPXHDR_SENSOR_LAYOUT,
+    MPXHDR_CHIP_SELECT,
+    MPXHDR_TIME_STAMP,
+    MPXHDR_SHUTTER_TIME,
+    MPXHDR_COUNTER,
+    MPXHDR_COLOUR_MODE,
+    MPXHDR_GAIN_MODE,
+    MPXHDR_THRESHOLD,       // repeated - see numThresholds
+    MPXHDR_DAC,             // repeated - see numDacs
+    MPXHDR_PROFILE_MASK,
+    MPXHDR_CHIP_DAC         // MQ1 - repeated - see numChips and numChipDacs
+} mpxHeaderField;
+
+#define MPXHDR_PRESENT(pHdr, field) (((pHdr)->present & (1u << (field))) != 0)
+
+/** A parsed data frame header. Only the fields used by the frame type are
+ * filled in */
+typedef struct mpxFrameHeader
+{
+    medipixDataHeader type;
+    unsigned int present;
+    int frameNumber;
+    int headerLength;       // MQ1 - offset of the pixel data
+    int counterNumber;
+    double duration;
+    int xOffset;
+    int yOffset;
+    int xSize;
+    int ySize;
+    int pixelDepth;         // IMG/PRF - significant bits, MQ1 - bits per pixel
+    int pixelSize;          // IMG/PRF - bits per pixel
+    int chipCount;
+    char sensorLayout[MPX_HDR_LAYOUT_LEN];
+    int chipSelect;
+    double shutterTime;
+    int counter;
+    int colourMode;
+    int gainMode;
+    int numThresholds;
+    double threshold[MPX_HDR_NUM_THRESHOLDS];
+    int numDacs;
+    int dac[MPX_HDR_NUM_DACS];
+    int profileMask;
+    int numChips;           // MQ1 - chips with a DAC section
+    int numChipDacs[MPX_HDR_MAX_CHIPS];
+    int chipDac[MPX_HDR_MAX_CHIPS][MPX_HDR_NUM_CHIP_DACS];
+} mpxFrameHeader;
+
+/** Returns the type of a data frame from the 3 character type at the start
+ * of its body */
+medipixDataHeader mpxHeaderType(const char *header);
+
+/** Parses a data frame header in a single pass without modifying or copying
+ * it. header points at the frame type (e.g. "12B,") and at most length
+ * characters are read. Returns the number of fields parsed. */
+int mpxParseFrameHeader(const char *header, size_t length,
+        medipixDataHeader type, mpxFrameHeader *pHdr);
+
+/** Returns the number of bits per pixel of an image frame or 0 if unknown */
+int mpxHeaderPixelSize(const mpxFrameHeader *pHdr);
+
+/** Attribute names for the DACs, "DAC 001" to "DAC 025" */
+extern const char * const mpxDacNames[MPX_HDR_NUM_DACS];
+
+/** Attribute names for the MQ1 DACs of each chip, "Chip 1 DAC 001" to
+ * "Chip 4 DAC 032" */
+extern const char * const
+        mpxChipDacNames[MPX_HDR_MAX_CHIPS][MPX_HDR_NUM_CHIP_DACS];
+
+#endif /* MPXHEADER_H_ */
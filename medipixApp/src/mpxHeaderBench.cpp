@@ -0,0 +1,306 @@
+/* mpxHeaderBench.cpp
+ *
+ * Benchmark for the data frame header parser in mpxHeader.cpp
+ *
+ * Compares mpxParseFrameHeader() with the strtok_r/atoi/atof/sprintf parser
+ * that the driver used to use for each of the 12B, 24B, IMG, PRF and MQ1
+ * header formats and reports headers per second. NDAttributes are not
+ * created by either so that only the parsing is measured. The fields parsed
+ * by the new parser are checked against the values used to build each header.
+ * The old MQ1 parser stopped after two thresholds, whereas the new one also
+ * reads the other six and the DAC section of each chip, so MQ1 does not
+ * compare like with like.
+ *
+ * usage: mpxHeaderBench [iterations]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <epicsTime.h>
+
+#include "medipix_low.h"
+#include "mpxHeader.h"
+
+#define BENCH_HDR_LEN 768
+
+typedef struct benchCase
+{
+    const char *name;
+    medipixDataHeader type;
+    char header[BENCH_HDR_LEN + 1];
+    size_t length;
+} benchCase;
+
+/* the legacy parser writes here so that the compiler keeps its work */
+typedef struct legacySink
+{
+    int iVal;
+    double dVal;
+    char dacName[10];
+} legacySink;
+
+static volatile int sinkCount;
+
+static void sink(legacySink *pSink)
+{
+    sinkCount += pSink->iVal + (int) pSink->dVal + pSink->dacName[6];
+}
+
+/** The previous parser for 12B, 24B, P12, P24, IMG and PRF headers */
+static void legacyParseDataFrame(const char* header,
+        medipixDataHeader headerType, legacySink *pSink)
+{
+    char buff[MPX_IMG_HDR_LEN + 1];
+    int dacNum, i;
+    char* tok;
+    char* save_ptr = NULL;
+
+    strncpy(buff, header, MPX_IMG_HDR_LEN);
+    buff[MPX_IMG_HDR_LEN] = 0;
+
+    tok = strtok_r(buff, ",", &save_ptr);
+    tok = strtok_r(NULL, ",", &save_ptr);  // frame number
+    if (tok != NULL)
+        pSink->iVal = atoi(tok);
+    tok = strtok_r(NULL, ",", &save_ptr);  // counter number
+    if (tok != NULL)
+        pSink->iVal = atoi(tok);
+    tok = strtok_r(NULL, ",", &save_ptr);  // start time (ignored)
+    tok = strtok_r(NULL, ",", &save_ptr);  // duration
+    if (tok != NULL)
+        pSink->dVal = atof(tok);
+    if (headerType == MPXGenericImageHeader
+            || headerType == MPXGenericProfileHeader)
+    {
+        for (i = 0; i < 6; i++)
+        {
+            tok = strtok_r(NULL, ",", &save_ptr);
+            if (tok != NULL)
+                pSink->iVal = atoi(tok);
+        }
+    }
+    for (i = 0; i < 2; i++)  // thresholds
+    {
+        tok = strtok_r(NULL, ",", &save_ptr);
+        if (tok != NULL)
+            pSink->dVal = atof(tok);
+    }
+    for (dacNum = 1; dacNum <= 25; dacNum++)
+    {
+        tok = strtok_r(NULL, ",", &save_ptr);
+        if (tok != NULL)
+        {
+            pSink->iVal = atoi(tok);
+            sprintf(pSink->dacName, "DAC %03d", dacNum);
+        }
+    }
+    tok = strtok_r(NULL, ",", &save_ptr);  // profile mask
+    if (tok != NULL)
+        pSink->iVal = atoi(tok);
+    sink(pSink);
+}
+
+/** The previous parser for MQ1 headers */
+static void legacyParseMqDataFrame(const char* header, legacySink *pSink)
+{
+    char buff[MPX_IMG_HDR_LEN + 1];
+    int i;
+    char* tok;
+    char* save_ptr = NULL;
+
+    strncpy(buff, header, MPX_IMG_HDR_LEN);
+    buff[MPX_IMG_HDR_LEN] = 0;
+
+    tok = strtok_r(buff, ",", &save_ptr);
+    for (i = 0; i < 5; i++)  // frame, offset, chips, x, y
+    {
+        tok = strtok_r(NULL, ",", &save_ptr);
+        if (tok != NULL)
+            pSink->iVal = atoi(tok);
+    }
+    tok = strtok_r(NULL, ",", &save_ptr);  // Udepth
+    if (tok != NULL)
+        pSink->iVal = atoi(tok + 1);
+    tok = strtok_r(NULL, ",", &save_ptr);  // layout
+    tok = strtok_r(NULL, ",", &save_ptr);  // chip select
+    if (tok != NULL)
+        pSink->iVal = strtoul(tok, NULL, 16);
+    tok = strtok_r(NULL, ",", &save_ptr);  // time stamp
+    tok = strtok_r(NULL, ",", &save_ptr);  // shutter time
+    if (tok != NULL)
+        pSink->dVal = atof(tok);
+    for (i = 0; i < 3; i++)  // counter, colour, gain
+    {
+        tok = strtok_r(NULL, ",", &save_ptr);
+        if (tok != NULL)
+            pSink->iVal = atoi(tok);
+    }
+    for (i = 0; i < 2; i++)  // thresholds
+    {
+        tok = strtok_r(NULL, ",", &save_ptr);
+        if (tok != NULL)
+            pSink->dVal = atof(tok);
+    }
+    sink(pSink);
+}
+
+/** Formats a header with known field values, padded to its fixed length */
+static void makeHeader(benchCase *pCase, const char *type, size_t length)
+{
+    char *p = pCase->header;
+    int i;
+
+    p += sprintf(p, "%s,", type);
+    if (pCase->type == MPXQuadDataHeader)
+    {
+        p += sprintf(p, "000123,%05d,04,0512,0512,U16,   2x2,0F,"
+                "2013-09-17 13:01:53.744951,1.000000E-3,0,0,2", (int) length);
+        for (i = 0; i < MPX_HDR_NUM_THRESHOLDS; i++)
+            p += sprintf(p, ",%f", 10.0 + i);
+        for (i = 0; i < 4; i++)
+            p += sprintf(p, ",3RX,511,000,000,000,000,000,000,000,100,010,"
+                    "125,125,255,181,255,000,000,000,100,511,200,250,240,"
+                    "240,255");
+    }
+    else
+    {
+        p += sprintf(p, "000123,000001,2013-09-17 13:01:53.744,0.001000,");
+        if (pCase->type == MPXGenericImageHeader
+                || pCase->type == MPXGenericProfileHeader)
+            p += sprintf(p, "00000,00000,00256,00256,012,016,");
+        p += sprintf(p, "10.000000,20.000000");
+        for (i = 1; i <= MPX_HDR_NUM_DACS; i++)
+            p += sprintf(p, ",%03d", i * 10);
+        if (pCase->type == MPXGenericProfileHeader)
+            p += sprintf(p, ",00014");
+    }
+
+    // pad to the fixed header length
+    while ((size_t) (p - pCase->header) < length)
+        *p++ = ' ';
+    *p = 0;
+    pCase->length = length;
+}
+
+static int checkHeader(const benchCase *pCase, const mpxFrameHeader *pHdr)
+{
+    int errors = 0;
+    int i;
+
+    if (pHdr->frameNumber != 123)
+        errors++;
+    if (pCase->type == MPXQuadDataHeader)
+    {
+        if (pHdr->headerLength != (int) pCase->length || pHdr->xSize != 512
+                || pHdr->ySize != 512 || mpxHeaderPixelSize(pHdr) != 16
+                || pHdr->chipSelect != 0x0F || pHdr->gainMode != 2
+                || fabs(pHdr->shutterTime - 0.001) > 1e-12
+                || strcmp(pHdr->sensorLayout, "   2x2") != 0
+                || pHdr->numThresholds != MPX_HDR_NUM_THRESHOLDS)
+            errors++;
+        for (i = 0; i < pHdr->numThresholds; i++)
+            if (pHdr->threshold[i] != 10.0 + i)
+                errors++;
+        if (pHdr->numChips != 4)
+            errors++;
+        for (i = 0; i < pHdr->numChips; i++)
+            if (pHdr->numChipDacs[i] != 25 || pHdr->chipDac[i][0] != 511
+                    || pHdr->chipDac[i][24] != 255)
+                errors++;
+    }
+    else
+    {
+        if (fabs(pHdr->duration - 0.001) > 1e-12 || pHdr->threshold[0] != 10.0
+                || pHdr->threshold[1] != 20.0
+                || pHdr->numDacs != MPX_HDR_NUM_DACS)
+            errors++;
+        for (i = 0; i < pHdr->numDacs; i++)
+            if (pHdr->dac[i] != (i + 1) * 10)
+                errors++;
+        if (pCase->type == MPXGenericImageHeader
+                && (pHdr->xSize != 256 || mpxHeaderPixelSize(pHdr) != 16))
+            errors++;
+        if (pCase->type == MPXGenericProfileHeader && pHdr->profileMask != 14)
+            errors++;
+        if (pCase->type != MPXGenericProfileHeader
+                && MPXHDR_PRESENT(pHdr, MPXHDR_PROFILE_MASK))
+            errors++;
+    }
+    return errors;
+}
+
+static double elapsed(epicsTimeStamp *pStart)
+{
+    epicsTimeStamp now;
+
+    epicsTimeGetCurrent(&now);
+    return epicsTimeDiffInSeconds(&now, pStart);
+}
+
+int main(int argc, char **argv)
+{
+    static benchCase cases[] =
+    {
+    { "12B", MPXDataHeader12, "", 0 },
+    { "24B", MPXDataHeader24, "", 0 },
+    { "IMG", MPXGenericImageHeader, "", 0 },
+    { "PRF", MPXGenericProfileHeader, "", 0 },
+    { "MQ1", MPXQuadDataHeader, "", 0 } };
+    int iterations = 200000;
+    int failures = 0;
+    legacySink legacy;
+    mpxFrameHeader hdr;
+    epicsTimeStamp start;
+    double legacyTime, newTime;
+    size_t c;
+    int n;
+
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (iterations <= 0)
+        iterations = 1;
+
+    printf("%d iterations\n\n", iterations);
+    printf("%-6s %16s %16s %8s\n", "format", "legacy hdr/s", "new hdr/s",
+            "speedup");
+
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        benchCase *pCase = &cases[c];
+
+        makeHeader(pCase, pCase->name,
+                pCase->type == MPXQuadDataHeader ? BENCH_HDR_LEN : MPX_IMG_HDR_LEN);
+
+        epicsTimeGetCurrent(&start);
+        for (n = 0; n < iterations; n++)
+        {
+            if (pCase->type == MPXQuadDataHeader)
+                legacyParseMqDataFrame(pCase->header, &legacy);
+            else
+                legacyParseDataFrame(pCase->header, pCase->type, &legacy);
+        }
+        legacyTime = elapsed(&start);
+
+        epicsTimeGetCurrent(&start);
+        for (n = 0; n < iterations; n++)
+        {
+            mpxParseFrameHeader(pCase->header, pCase->length, pCase->type, &hdr);
+            sinkCount += hdr.numDacs;
+        }
+        newTime = elapsed(&start);
+
+        printf("%-6s %16.0f %16.0f %7.2fx\n", pCase->name,
+                iterations / legacyTime, iterations / newTime,
+                legacyTime / newTime);
+
+        if (checkHeader(pCase, &hdr) != 0)
+        {
+            printf("%-6s MISMATCH in parsed fields\n", pCase->name);
+            failures++;
+        }
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,144 @@
+#include <string.h>
+#include <time.h>
+
+#include <epicsTime.h>
+
+#include "mpxLatency.h"
+
+/* lock free updates - gcc builtins, other compilers fall back to plain
+ * updates which may lose the odd sample between decode threads */
+#if defined(__GNUC__)
+#define ATOMIC_INCREMENT(p) __sync_fetch_and_add((p), 1)
+#define ATOMIC_CAS(p, old, val) __sync_bool_compare_and_swap((p), (old), (val))
+#else
+#define ATOMIC_INCREMENT(p) ((*(p))++)
+#define ATOMIC_CAS(p, old, val) (*(p) = (val), true)
+#endif
+
+const char * const mpxLatencyStageNames[mpxStageCount] =
+{ "WAIT", "PARSE", "COPY", "DECODE", "ATTR", "CALLBACK", "TOTAL" };
+
+uint64_t mpxLatencyNow()
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+    epicsTimeStamp now;
+
+    epicsTimeGetCurrent(&now);
+    return (uint64_t) now.secPastEpoch * 1000000000 + now.nsec;
+#endif
+}
+
+mpxLatencyHistogram::mpxLatencyHistogram()
+{
+    reset();
+}
+
+void mpxLatencyHistogram::reset()
+{
+    memset((void*) counts, 0, sizeof(counts));
+    count = 0;
+    maxNs = 0;
+}
+
+/** Values below MPX_LATENCY_SUB_BUCKETS have a bucket each, above that each
+ * power of two is split into MPX_LATENCY_SUB_BUCKETS buckets */
+int mpxLatencyHistogram::bucketIndex(uint64_t ns)
+{
+    int exponent;
+
+    if (ns < MPX_LATENCY_SUB_BUCKETS)
+        return (int) ns;
+    if (ns >> MPX_LATENCY_MAX_BITS)
+        return MPX_LATENCY_BUCKETS - 1;
+
+#if defined(__GNUC__)
+    exponent = 63 - __builtin_clzll(ns);
+#else
+    for (exponent = MPX_LATENCY_SUB_BITS; (ns >> (exponent + 1)) != 0;
+            exponent++)
+        ;
+#endif
+    return MPX_LATENCY_SUB_BUCKETS * (exponent - MPX_LATENCY_SUB_BITS + 1)
+            + (int) ((ns >> (exponent - MPX_LATENCY_SUB_BITS))
+                    & (MPX_LATENCY_SUB_BUCKETS - 1));
+}
+
+/** The middle of a bucket in ns */
+double mpxLatencyHistogram::bucketValue(int index)
+{
+    int shift;
+    int sub;
+
+    if (index < MPX_LATENCY_SUB_BUCKETS)
+        return index;
+
+    shift = index / MPX_LATENCY_SUB_BUCKETS - 1;
+    sub = index % MPX_LATENCY_SUB_BUCKETS;
+    return (double) ((uint64_t) (MPX_LATENCY_SUB_BUCKETS + sub) << shift)
+            + (double) ((uint64_t) 1 << shift) / 2;
+}
+
+void mpxLatencyHistogram::record(uint64_t ns)
+{
+    unsigned long value = (unsigned long) ns;
+    unsigned long oldMax;
+
+    if ((uint64_t) value != ns)
+        value = (unsigned long) -1;
+
+    ATOMIC_INCREMENT(&counts[bucketIndex(ns)]);
+    ATOMIC_INCREMENT(&count);
+
+    oldMax = maxNs;
+    while (value > oldMax && !ATOMIC_CAS(&maxNs, oldMax, value))
+        oldMax = maxNs;
+}
+
+epicsUInt32 mpxLatencyHistogram::getCount() const
+{
+    return count;
+}
+
+/** Returns the latency in ns below which fraction of the samples fall, or 0
+ * if there are none */
+double mpxLatencyHistogram::getPercentile(double fraction) const
+{
+    epicsUInt32 total = 0;
+    epicsUInt32 target;
+    double value;
+    int i;
+
+    for (i = 0; i < MPX_LATENCY_BUCKETS; i++)
+        total += counts[i];
+    if (total == 0)
+        return 0;
+
+    target = (epicsUInt32) (fraction * total + 0.5);
+    if (target < 1)
+        target = 1;
+    if (target > total)
+        target = total;
+
+    for (i = 0, total = 0; i < MPX_LATENCY_BUCKETS; i++)
+    {
+        total += counts[i];
+        if (total >= target)
+            break;
+    }
+
+    // the middle of the bucket may be past the largest sample
+    value = bucketValue(i);
+    if (value > getMax())
+        value = getMax();
+    return value;
+}
+
+double mpxLatencyHistogram::getMax() const
+{
+    return maxNs;
+}
@@ -0,0 +1,59 @@
+#ifndef MPXLATENCY_H_
+#define MPXLATENCY_H_
+
+#include <stdint.h>
+
+#include <epicsTypes.h>
+
+/** The stages of the data path that are timed for every frame */
+typedef enum
+{
+    mpxStageSocketWait,     // waiting for the next frame header on the socket
+    mpxStageHeaderParse,    // parsing the data header
+    mpxStagePixelCopy,      // reading the payload into the NDArray
+    mpxStageDecode,         // byte swap and flip of the pixels
+    mpxStageAttributes,     // building the NDAttributes of the frame
+    mpxStageCallback,       // NDArray callbacks to the plugins
+    mpxStageTotal,          // from the header arriving to the end of the callbacks
+    mpxStageCount
+} mpxLatencyStage;
+
+/** Short names of the stages, used to name the parameters */
+extern const char * const mpxLatencyStageNames[mpxStageCount];
+
+/** Sub buckets per power of two, the values are resolved to 1/16 (6%) */
+#define MPX_LATENCY_SUB_BITS    4
+#define MPX_LATENCY_SUB_BUCKETS (1 << MPX_LATENCY_SUB_BITS)
+/** Covers up to 2^40 ns (18 minutes), longer times go in the last bucket */
+#define MPX_LATENCY_MAX_BITS    40
+#define MPX_LATENCY_BUCKETS     (MPX_LATENCY_SUB_BUCKETS \
+        * (MPX_LATENCY_MAX_BITS - MPX_LATENCY_SUB_BITS + 1))
+
+/** Returns a monotonic time in ns for timing the stages */
+uint64_t mpxLatencyNow();
+
+/** A histogram of latencies with log-linear buckets in the style of
+ * HdrHistogram. Any number of threads may record into it without a lock, a
+ * reset that races with a record may lose that sample. */
+class mpxLatencyHistogram
+{
+public:
+    mpxLatencyHistogram();
+
+    void record(uint64_t ns);
+    void reset();
+
+    epicsUInt32 getCount() const;
+    double getPercentile(double fraction) const;
+    double getMax() const;
+
+private:
+    static int bucketIndex(uint64_t ns);
+    static double bucketValue(int index);
+
+    volatile epicsUInt32 counts[MPX_LATENCY_BUCKETS];
+    volatile epicsUInt32 count;
+    volatile unsigned long maxNs;   // saturates at 4.3 s on 32 bit hosts
+};
+
+#endif /* MPXLATENCY_H_ */
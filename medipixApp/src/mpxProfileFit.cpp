@@ -0,0 +1,152 @@
+#include <math.h>
+
+#include "mpxProfileFit.h"
+
+/** Solves the 3x3 normal equations m * coef = v by Cramer's rule */
+static bool solve3(const double m[3][3], const double v[3], double coef[3])
+{
+    double det, d[3];
+    int i;
+
+    det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+            - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+            + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    if (det == 0)
+        return false;
+
+    for (i = 0; i < 3; i++)
+    {
+        double a[3][3];
+        int r, c;
+
+        for (r = 0; r < 3; r++)
+            for (c = 0; c < 3; c++)
+                a[r][c] = c == i ? v[r] : m[r][c];
+        d[i] = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1])
+                - a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0])
+                + a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+        coef[i] = d[i] / det;
+    }
+    return true;
+}
+
+template<typename ValueT>
+static bool fitProfile(const ValueT *pProfile, size_t n, mpxFitMethod method,
+        double threshold, mpxFitResult *pResult)
+{
+    double minValue, maxValue, level, y, x;
+    double m[3][3] = { { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 } };
+    double v[3] = { 0, 0, 0 };
+    double coef[3], w, l, xx, mu, sigma;
+    size_t i, peak = 0, lo, hi;
+
+    pResult->valid = false;
+    pResult->position = 0;
+    pResult->width = 0;
+    pResult->intensity = 0;
+    if (method == mpxFitOff || n < 3)
+        return false;
+
+    minValue = maxValue = pProfile[0];
+    for (i = 1; i < n; i++)
+    {
+        if (pProfile[i] > maxValue)
+        {
+            maxValue = pProfile[i];
+            peak = i;
+        }
+        if (pProfile[i] < minValue)
+            minValue = pProfile[i];
+    }
+    if (maxValue <= minValue)
+        return false;
+
+    if (threshold < 0)
+        threshold = 0;
+    if (threshold > 0.99)
+        threshold = 0.99;
+    level = minValue + threshold * (maxValue - minValue);
+
+    // the points around the highest that are above the threshold
+    lo = hi = peak;
+    while (lo > 0 && pProfile[lo - 1] > level)
+        lo--;
+    while (hi < n - 1 && pProfile[hi + 1] > level)
+        hi++;
+
+    // offsets from the peak keep the sums well conditioned
+    if (method == mpxFitCentroid)
+    {
+        double sumW = 0, sumWX = 0, sumWXX = 0, total = 0, mean, variance;
+
+        for (i = lo; i <= hi; i++)
+        {
+            y = pProfile[i] - level;
+            x = (double) i - (double) peak;
+            sumW += y;
+            sumWX += y * x;
+            sumWXX += y * x * x;
+            total += pProfile[i] - minValue;
+        }
+        mean = sumWX / sumW;
+        variance = sumWXX / sumW - mean * mean;
+        pResult->position = peak + mean;
+        pResult->width = variance > 0 ? sqrt(variance) : 0;
+        pResult->intensity = total;
+        pResult->valid = true;
+        return true;
+    }
+
+    // ln(y) = a + b x + c x^2 weighted by y^2
+    if (hi - lo < 2)
+        return false;
+    for (i = lo; i <= hi; i++)
+    {
+        y = pProfile[i] - minValue;
+        if (y <= 0)
+            continue;
+        x = (double) i - (double) peak;
+        xx = x * x;
+        w = y * y;
+        l = log(y);
+        m[0][0] += w;
+        m[0][1] += w * x;
+        m[0][2] += w * xx;
+        m[1][2] += w * xx * x;
+        m[2][2] += w * xx * xx;
+        v[0] += w * l;
+        v[1] += w * x * l;
+        v[2] += w * xx * l;
+    }
+    m[1][0] = m[0][1];
+    m[1][1] = m[0][2];
+    m[2][0] = m[0][2];
+    m[2][1] = m[1][2];
+
+    if (!solve3(m, v, coef) || coef[2] >= 0)
+        return false;
+
+    mu = -coef[1] / (2 * coef[2]);
+    sigma = sqrt(-1 / (2 * coef[2]));
+    if (peak + mu < 0 || peak + mu > n - 1)
+        return false;
+
+    pResult->position = peak + mu;
+    pResult->width = sigma;
+    pResult->intensity = exp(coef[0] - coef[1] * coef[1] / (4 * coef[2]))
+            * sigma * sqrt(2 * M_PI);
+    pResult->valid = true;
+    return true;
+}
+
+bool mpxFitProfile(const epicsUInt32 *pProfile, size_t n, mpxFitMethod method,
+        double threshold, mpxFitResult *pResult)
+{
+    return fitProfile(pProfile, n, method, threshold, pResult);
+}
+
+bool mpxFitProfile(const epicsFloat64 *pProfile, size_t n,
+        mpxFitMethod method, double threshold, mpxFitResult *pResult)
+{
+    return fitProfile(pProfile, n, method, threshold, pResult);
+}
@@ -0,0 +1,44 @@
+#ifndef MPXPROFILEFIT_H_
+#define MPXPROFILEFIT_H_
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+/** How the beam position is found from a profile */
+typedef enum
+{
+    mpxFitOff,
+    mpxFitCentroid,     // centroid of the counts above the threshold
+    mpxFitGaussian      // Gaussian fitted to the points above the threshold
+} mpxFitMethod;
+
+/** The beam in one profile, in pixels and counts */
+typedef struct mpxFitResult
+{
+    bool valid;         // false if the profile has no peak or the fit failed
+    double position;    // centre of the peak
+    double width;       // RMS width (the sigma of a Gaussian)
+    double intensity;   // counts in the peak above the background
+} mpxFitResult;
+
+/** Finds the beam in a profile of n points.
+ *
+ * The background is taken as the lowest point and the peak as the points
+ * around the highest that are more than threshold (0 to 1) of the way from
+ * the background to the highest. Only that peak is used, so other peaks
+ * and noise further out do not pull the position.
+ *
+ * The Gaussian is fitted by weighted linear least squares to the log of
+ * the counts (Caruana's method with Guo's weights), which needs no
+ * iteration and no starting guess, so it takes a time in proportion to the
+ * width of the peak.
+ *
+ * Returns pResult->valid.
+ */
+bool mpxFitProfile(const epicsUInt32 *pProfile, size_t n, mpxFitMethod method,
+        double threshold, mpxFitResult *pResult);
+bool mpxFitProfile(const epicsFloat64 *pProfile, size_t n,
+        mpxFitMethod method, double threshold, mpxFitResult *pResult);
+
+#endif /* MPXPROFILEFIT_H_ */
@@ -0,0 +1,317 @@
+/* raw files are usually much larger than 2GB */
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "mpxRawWriter.h"
+
+mpxRawWriter::mpxRawWriter()
+{
+    mutex = epicsMutexMustCreate();
+    fd = -1;
+    fileSize = 0;
+    window = NULL;
+    windowOffset = 0;
+    windowLength = 0;
+    dataEnd = 0;
+    full = false;
+    numFrames = 0;
+    index = NULL;
+    indexSize = 0;
+    generation = 0;
+    reserved = false;
+    reservedGeneration = 0;
+    detached = NULL;
+    detachedLength = 0;
+}
+
+mpxRawWriter::~mpxRawWriter()
+{
+    close();
+    epicsMutexDestroy(mutex);
+}
+
+/** Creates the file and preallocates fileSize bytes for it, or a window if
+ * that is less, so that the frames are not held up by the file system
+ * allocating blocks */
+bool mpxRawWriter::open(const char *fileName, uint64_t fileSize)
+{
+    char header[MPX_RAW_HEADER_LEN];
+    uint32_t words[4];
+    epicsTimeStamp start;
+
+    close();
+
+    if (fileSize < MPX_RAW_HEADER_LEN + MPX_RAW_WINDOW_LEN)
+        fileSize = MPX_RAW_HEADER_LEN + MPX_RAW_WINDOW_LEN;
+
+    epicsMutexLock(mutex);
+    fd = ::open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0664);
+    if (fd < 0)
+    {
+        epicsMutexUnlock(mutex);
+        return false;
+    }
+    if (posix_fallocate(fd, 0, fileSize) != 0)
+    {
+        ::close(fd);
+        fd = -1;
+        unlink(fileName);
+        epicsMutexUnlock(mutex);
+        return false;
+    }
+
+    epicsTimeGetCurrent(&start);
+    memset(header, 0, sizeof(header));
+    memcpy(header, MPX_RAW_MAGIC, MPX_RAW_MAGIC_LEN);
+    words[0] = MPX_RAW_VERSION;
+    words[1] = start.secPastEpoch;
+    words[2] = start.nsec;
+    words[3] = 0;
+    memcpy(header + MPX_RAW_MAGIC_LEN, words, sizeof(words));
+    if (pwrite(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header))
+    {
+        ::close(fd);
+        fd = -1;
+        epicsMutexUnlock(mutex);
+        return false;
+    }
+
+    this->fileSize = fileSize;
+    dataEnd = MPX_RAW_HEADER_LEN;
+    full = false;
+    numFrames = 0;
+    epicsMutexUnlock(mutex);
+    return true;
+}
+
+/** Extends the preallocation so that need more bytes fit after the last
+ * frame, by at least a window so that this is not done for every frame */
+bool mpxRawWriter::grow(uint64_t need)
+{
+    uint64_t newSize = dataEnd + need;
+
+    if (newSize < fileSize + MPX_RAW_WINDOW_LEN)
+        newSize = fileSize + MPX_RAW_WINDOW_LEN;
+    if (posix_fallocate(fd, (off_t) fileSize, (off_t) (newSize - fileSize))
+            != 0)
+        return false;
+    fileSize = newSize;
+    return true;
+}
+
+/** Maps length bytes of the file from offset, which is rounded down to a
+ * page */
+bool mpxRawWriter::mapWindow(uint64_t offset, size_t length)
+{
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    void *pMap;
+
+    unmapWindow();
+
+    windowOffset = offset - offset % pageSize;
+    windowLength = length + (size_t) (offset - windowOffset);
+    if (windowOffset + windowLength > fileSize)
+        windowLength = (size_t) (fileSize - windowOffset);
+
+    pMap = mmap(NULL, windowLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+            (off_t) windowOffset);
+    if (pMap == MAP_FAILED)
+    {
+        windowLength = 0;
+        return false;
+    }
+    window = (char*) pMap;
+    madvise(window, windowLength, MADV_SEQUENTIAL);
+    return true;
+}
+
+/** The pages written are left to the kernel to write back */
+void mpxRawWriter::unmapWindow()
+{
+    if (window != NULL)
+    {
+        msync(window, windowLength, MS_ASYNC);
+        munmap(window, windowLength);
+        window = NULL;
+    }
+    windowOffset = 0;
+    windowLength = 0;
+}
+
+/** Closes the window while a frame is still being received into it. The
+ * pages written so far are already in the file, and anonymous memory is
+ * mapped in their place so that the rest of the frame goes nowhere, and
+ * can neither land in the index nor fault beyond the truncated end */
+void mpxRawWriter::detachWindow()
+{
+    if (window == NULL)
+        return;
+
+    // if the scratch memory cannot be had the file is left mapped until
+    // the frame is done, rather than pulled out from under it
+    msync(window, windowLength, MS_ASYNC);
+    mmap(window, windowLength, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    detached = window;
+    detachedLength = windowLength;
+    window = NULL;
+    windowOffset = 0;
+    windowLength = 0;
+}
+
+/** Ends the reservation of the frame being received and frees the scratch
+ * memory it went into if its file was closed. Called with the writer locked */
+void mpxRawWriter::endReservation()
+{
+    reserved = false;
+    if (detached != NULL)
+    {
+        munmap(detached, detachedLength);
+        detached = NULL;
+        detachedLength = 0;
+    }
+}
+
+/** Returns where the body of a frame of up to maxLength bytes is to be put,
+ * or NULL if the file is not open or cannot grow to fit it. On success it
+ * must be followed by commit() or cancel() */
+char *mpxRawWriter::reserve(size_t maxLength)
+{
+    uint64_t need = MPX_RAW_PREFIX_LEN + (uint64_t) maxLength;
+    uint64_t room;
+
+    epicsMutexLock(mutex);
+    if (fd < 0 || full)
+    {
+        epicsMutexUnlock(mutex);
+        return NULL;
+    }
+
+    // leave room for the index and trailer when the file is closed
+    room = need + (numFrames + 1) * sizeof(uint64_t) + MPX_RAW_MAGIC_LEN
+            + 2 * sizeof(uint64_t);
+    if (dataEnd + room > fileSize && !grow(room))
+    {
+        full = true;
+        epicsMutexUnlock(mutex);
+        return NULL;
+    }
+
+    if (numFrames == indexSize)
+    {
+        uint64_t *newIndex;
+        uint64_t newSize = indexSize ? indexSize * 2 : 65536;
+
+        newIndex = (uint64_t*) realloc(index, newSize * sizeof(uint64_t));
+        if (newIndex == NULL)
+        {
+            epicsMutexUnlock(mutex);
+            return NULL;
+        }
+        index = newIndex;
+        indexSize = newSize;
+    }
+
+    if (window == NULL || dataEnd < windowOffset
+            || dataEnd + need > windowOffset + windowLength)
+    {
+        if (!mapWindow(dataEnd, need > MPX_RAW_WINDOW_LEN ?
+                (size_t) need : MPX_RAW_WINDOW_LEN))
+        {
+            full = true;
+            epicsMutexUnlock(mutex);
+            return NULL;
+        }
+    }
+
+    reserved = true;
+    reservedGeneration = generation;
+    epicsMutexUnlock(mutex);
+    return window + (dataEnd - windowOffset) + MPX_RAW_PREFIX_LEN;
+}
+
+/** Completes the frame returned by reserve() with length bytes of body, or
+ * drops it if the file was closed while it was being received */
+void mpxRawWriter::commit(size_t length)
+{
+    char prefix[MPX_RAW_PREFIX_LEN + 1];
+
+    epicsMutexLock(mutex);
+    if (!reserved || reservedGeneration != generation)
+    {
+        endReservation();
+        epicsMutexUnlock(mutex);
+        return;
+    }
+    endReservation();
+
+    // as on the data channel the count includes the ',' after itself
+    snprintf(prefix, sizeof(prefix), "MPX,%010u,", (unsigned) length + 1);
+    memcpy(window + (dataEnd - windowOffset), prefix, MPX_RAW_PREFIX_LEN);
+
+    index[numFrames] = dataEnd;
+    dataEnd = dataEnd + MPX_RAW_PREFIX_LEN + length;
+    numFrames = numFrames + 1;
+    epicsMutexUnlock(mutex);
+}
+
+/** Abandons the frame returned by reserve() */
+void mpxRawWriter::cancel()
+{
+    epicsMutexLock(mutex);
+    endReservation();
+    epicsMutexUnlock(mutex);
+}
+
+/** Writes the index and trailer after the last frame and gives back the
+ * rest of the preallocation. Returns false if they could not be written */
+bool mpxRawWriter::close()
+{
+    uint64_t trailer[2];
+    size_t indexBytes;
+    off_t offset;
+    bool ok = true;
+
+    epicsMutexLock(mutex);
+    if (fd >= 0)
+    {
+        // a frame being received into the window is dropped
+        if (reserved && reservedGeneration == generation)
+            detachWindow();
+        unmapWindow();
+        generation++;
+
+        offset = (off_t) dataEnd;
+        indexBytes = numFrames * sizeof(uint64_t);
+        trailer[0] = dataEnd;
+        trailer[1] = numFrames;
+        if (pwrite(fd, index, indexBytes, offset) != (ssize_t) indexBytes)
+            ok = false;
+        offset += indexBytes;
+        if (pwrite(fd, MPX_RAW_INDEX_MAGIC, MPX_RAW_MAGIC_LEN, offset)
+                != MPX_RAW_MAGIC_LEN)
+            ok = false;
+        offset += MPX_RAW_MAGIC_LEN;
+        if (pwrite(fd, trailer, sizeof(trailer), offset)
+                != (ssize_t) sizeof(trailer))
+            ok = false;
+        offset += sizeof(trailer);
+        if (ftruncate(fd, offset) != 0)
+            ok = false;
+
+        ::close(fd);
+        fd = -1;
+    }
+    free(index);
+    index = NULL;
+    indexSize = 0;
+    epicsMutexUnlock(mutex);
+    return ok;
+}
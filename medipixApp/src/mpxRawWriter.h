@@ -0,0 +1,102 @@
+#ifndef MPXRAWWRITER_H_
+#define MPXRAWWRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <epicsMutex.h>
+#include <epicsTime.h>
+
+/** Raw files hold the data frames exactly as they arrived on the data channel
+ * so that they can be converted to HDF5 offline. The file is preallocated
+ * when it is opened, and grows MPX_RAW_WINDOW_LEN at a time when that is
+ * used up. The frames are received straight into a mapping of it, so
+ * writing them costs no more than receiving them.
+ *
+ * All values are in the byte order of the machine that wrote the file.
+ *
+ *  file header     char magic[8]       "MPXRAW01"
+ *                  uint32_t version    MPX_RAW_VERSION
+ *                  uint32_t startSecs  epics time the file was opened
+ *                  uint32_t startNsec
+ *                  uint32_t reserved
+ *                  zero padding to MPX_RAW_HEADER_LEN
+ *
+ *  frames          "MPX,%010d," and the frame body, as on the data channel,
+ *                  so the count is the length of the body plus one for the
+ *                  ',' after the count
+ *
+ *  index           uint64_t offset     file offset of each frame
+ *
+ *  trailer         char magic[8]       "MPXIDX01"
+ *                  uint64_t indexOffset
+ *                  uint64_t frameCount
+ *
+ * The index and trailer are written when the file is closed and the unused
+ * preallocation is truncated. A file without them (e.g. the IOC died while
+ * writing) can still be read frame by frame from the MPX headers, as the
+ * data channel is, up to the unused preallocation which is all zero.
+ */
+#define MPX_RAW_MAGIC           "MPXRAW01"
+#define MPX_RAW_INDEX_MAGIC     "MPXIDX01"
+#define MPX_RAW_MAGIC_LEN       8
+#define MPX_RAW_VERSION         1
+#define MPX_RAW_HEADER_LEN      4096
+/** length of the "MPX,%010d," prefix of each frame */
+#define MPX_RAW_PREFIX_LEN      15
+/** size of the part of the file that is mapped at a time, and the least
+ * the file grows by */
+#define MPX_RAW_WINDOW_LEN      (64 * 1024 * 1024)
+
+/** Writes the frames of the data channel to a preallocated raw file.
+ *
+ * Each frame is written by a reserve() that returns where its body goes,
+ * followed by a commit() with the length of the body or a cancel(). The
+ * writer is not locked while the frame is received, so a close() in the
+ * meantime does not wait for it. The close() puts scratch memory in place
+ * of the mapping the frame is going into and moves on to the next
+ * generation, and the commit() or cancel() then drops the frame.
+ */
+class mpxRawWriter
+{
+public:
+    mpxRawWriter();
+    ~mpxRawWriter();
+
+    bool open(const char *fileName, uint64_t fileSize);
+    char *reserve(size_t maxLength);
+    void commit(size_t length);
+    void cancel();
+    bool close();
+
+    bool isOpen() const { return fd >= 0; }
+    bool isFull() const { return full; }
+    uint64_t getBytes() const { return dataEnd; }
+    uint64_t getFrames() const { return numFrames; }
+
+private:
+    bool grow(uint64_t need);
+    bool mapWindow(uint64_t offset, size_t length);
+    void unmapWindow();
+    void detachWindow();
+    void endReservation();
+
+    epicsMutexId mutex;
+    int fd;
+    uint64_t fileSize;
+    char *window;               // the mapped part of the file
+    uint64_t windowOffset;      // file offset of window
+    size_t windowLength;
+    volatile uint64_t dataEnd;  // file offset after the last frame
+    volatile bool full;         // the file could not grow to fit a frame
+    volatile uint64_t numFrames;
+    uint64_t *index;
+    uint64_t indexSize;
+    int generation;             // counts the files closed
+    bool reserved;              // a frame is being received
+    int reservedGeneration;     // generation of the frame being received
+    char *detached;             // scratch memory the frame is going into
+    size_t detachedLength;      // after the file was closed under it
+};
+
+#endif /* MPXRAWWRITER_H_ */
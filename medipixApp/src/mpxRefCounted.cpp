@@ -0,0 +1,31 @@
+#include "mpxRefCounted.h"
+
+mpxRefCounted::mpxRefCounted()
+{
+    refCount = 1;
+    refLock = epicsMutexMustCreate();
+}
+
+mpxRefCounted::~mpxRefCounted()
+{
+    epicsMutexDestroy(refLock);
+}
+
+void mpxRefCounted::reserve()
+{
+    epicsMutexLock(refLock);
+    refCount++;
+    epicsMutexUnlock(refLock);
+}
+
+void mpxRefCounted::release()
+{
+    int remaining;
+
+    epicsMutexLock(refLock);
+    remaining = --refCount;
+    epicsMutexUnlock(refLock);
+
+    if (remaining == 0)
+        delete this;
+}
@@ -0,0 +1,31 @@
+#ifndef MPXREFCOUNTED_H_
+#define MPXREFCOUNTED_H_
+
+#include <epicsMutex.h>
+
+/** Base of the objects that are shared by the frames in flight, such as the
+ * acquisition context, the bad pixel map and the geometry of a frame. The
+ * driver keeps the current object for the settings it was made with and
+ * each frame that uses it reserves a reference, so the driver can replace
+ * it at any time without waiting for the decode and publish threads.
+ *
+ * The creator holds the first reference and the object is deleted when the
+ * last reference is released, so objects are only created with new and are
+ * never deleted directly.
+ */
+class mpxRefCounted
+{
+public:
+    void reserve();
+    void release();
+
+protected:
+    mpxRefCounted();
+    virtual ~mpxRefCounted();
+
+private:
+    int refCount;
+    epicsMutexId refLock;
+};
+
+#endif /* MPXREFCOUNTED_H_ */
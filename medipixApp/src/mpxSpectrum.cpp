@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mpxSpectrum.h"
+
+mpxHistory::mpxHistory()
+{
+    historyX = (double*) calloc(MPX_HISTORY_LEN, sizeof(double));
+    historyY = (double*) calloc(MPX_HISTORY_LEN, sizeof(double));
+    historyNs = (uint64_t*) calloc(MPX_HISTORY_LEN, sizeof(uint64_t));
+    reset();
+}
+
+mpxHistory::~mpxHistory()
+{
+    free(historyX);
+    free(historyY);
+    free(historyNs);
+}
+
+void mpxHistory::add(double x, double y, uint64_t timeNs)
+{
+    historyX[next] = x;
+    historyY[next] = y;
+    historyNs[next] = timeNs;
+    next = (next + 1) % MPX_HISTORY_LEN;
+    if (count < MPX_HISTORY_LEN)
+        count++;
+    total++;
+}
+
+void mpxHistory::reset()
+{
+    next = 0;
+    count = 0;
+    total = 0;
+}
+
+size_t mpxHistory::copy(double *pX, double *pY, double *pRate) const
+{
+    size_t first = (next + MPX_HISTORY_LEN - count) % MPX_HISTORY_LEN;
+    size_t last = (next + MPX_HISTORY_LEN - 1) % MPX_HISTORY_LEN;
+    size_t part = MPX_HISTORY_LEN - first;
+
+    if (part > count)
+        part = count;
+    memcpy(pX, historyX + first, part * sizeof(double));
+    memcpy(pY, historyY + first, part * sizeof(double));
+    memcpy(pX + part, historyX, (count - part) * sizeof(double));
+    memcpy(pY + part, historyY, (count - part) * sizeof(double));
+
+    *pRate = 0;
+    if (count > 1 && historyNs[last] > historyNs[first])
+        *pRate = (count - 1) * 1e9 / (historyNs[last] - historyNs[first]);
+    return count;
+}
+
+void mpxFFT(double *pRe, double *pIm, size_t n)
+{
+    size_t i, j, k, len, half;
+    double angle, wRe, wIm, stepRe, stepIm, tRe, tIm, tmp;
+
+    // bit reversed order
+    for (i = 1, j = 0; i < n; i++)
+    {
+        for (k = n >> 1; j & k; k >>= 1)
+            j ^= k;
+        j ^= k;
+        if (i < j)
+        {
+            tmp = pRe[i]; pRe[i] = pRe[j]; pRe[j] = tmp;
+            tmp = pIm[i]; pIm[i] = pIm[j]; pIm[j] = tmp;
+        }
+    }
+
+    // the twiddle factors of each stage by recurrence from one sin and cos
+    for (len = 2; len <= n; len <<= 1)
+    {
+        half = len >> 1;
+        angle = -2 * M_PI / len;
+        stepRe = cos(angle);
+        stepIm = sin(angle);
+        for (i = 0; i < n; i += len)
+        {
+            wRe = 1;
+            wIm = 0;
+            for (k = 0; k < half; k++)
+            {
+                double *pRe1 = pRe + i + k, *pIm1 = pIm + i + k;
+                double *pRe2 = pRe1 + half, *pIm2 = pIm1 + half;
+
+                tRe = *pRe2 * wRe - *pIm2 * wIm;
+                tIm = *pRe2 * wIm + *pIm2 * wRe;
+                *pRe2 = *pRe1 - tRe;
+                *pIm2 = *pIm1 - tIm;
+                *pRe1 += tRe;
+                *pIm1 += tIm;
+
+                tmp = wRe * stepRe - wIm * stepIm;
+                wIm = wRe * stepIm + wIm * stepRe;
+                wRe = tmp;
+            }
+        }
+    }
+}
+
+int mpxWelchPSD(const double *pData, size_t n, size_t segment,
+        double sampleRate, double *pPsd, double *pWork)
+{
+    double *pRe = pWork;
+    double *pIm = pWork + segment;
+    double window, windowPower = 0, mean, scale;
+    size_t start, i, bins = segment / 2 + 1;
+    int segments = 0;
+
+    if (n < segment || segment < 2 || sampleRate <= 0)
+        return 0;
+
+    for (i = 0; i < bins; i++)
+        pPsd[i] = 0;
+    for (i = 0; i < segment; i++)
+    {
+        window = 0.5 - 0.5 * cos(2 * M_PI * i / segment);
+        windowPower += window * window;
+    }
+
+    // the segments end at the newest sample
+    for (start = (n - segment) % (segment / 2); start + segment <= n;
+            start += segment / 2)
+    {
+        mean = 0;
+        for (i = 0; i < segment; i++)
+            mean += pData[start + i];
+        mean /= segment;
+
+        for (i = 0; i < segment; i++)
+        {
+            window = 0.5 - 0.5 * cos(2 * M_PI * i / segment);
+            pRe[i] = (pData[start + i] - mean) * window;
+            pIm[i] = 0;
+        }
+        mpxFFT(pRe, pIm, segment);
+
+        for (i = 0; i < bins; i++)
+            pPsd[i] += pRe[i] * pRe[i] + pIm[i] * pIm[i];
+        segments++;
+    }
+
+    // one sided, so all but the DC and Nyquist bins are doubled
+    scale = 1 / (sampleRate * windowPower * segments);
+    for (i = 0; i < bins; i++)
+        pPsd[i] *= (i == 0 || i == bins - 1) ? scale : 2 * scale;
+    return segments;
+}
@@ -0,0 +1,53 @@
+#ifndef MPXSPECTRUM_H_
+#define MPXSPECTRUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** samples of the beam position kept for the spectrum */
+#define MPX_HISTORY_LEN         8192
+/** longest FFT segment of the Welch PSD, a power of 2 */
+#define MPX_MAX_SEGMENT_LEN     4096
+/** shortest FFT segment worth computing */
+#define MPX_MIN_SEGMENT_LEN     16
+
+/** A ring buffer of the X and Y beam position of each frame and the time
+ * at which it arrived. It has no lock of its own, the driver lock is held
+ * while it is used */
+class mpxHistory
+{
+public:
+    mpxHistory();
+    ~mpxHistory();
+
+    void add(double x, double y, uint64_t timeNs);
+    void reset();
+    size_t getCount() const { return count; }
+    uint64_t getTotal() const { return total; }
+
+    /* copies the samples held into pX and pY, oldest first, and returns
+     * how many there were and the mean sample rate in Hz */
+    size_t copy(double *pX, double *pY, double *pRate) const;
+
+private:
+    double *historyX;
+    double *historyY;
+    uint64_t *historyNs;
+    size_t next;        // where the next sample goes
+    size_t count;       // samples held, up to MPX_HISTORY_LEN
+    uint64_t total;     // samples added since the last reset
+};
+
+/** In place radix 2 FFT of n complex values, n a power of 2 */
+void mpxFFT(double *pRe, double *pIm, size_t n);
+
+/** One sided power spectral density of n samples by Welch's method: the
+ * mean of the spectra of Hann windowed segments of segment samples (a power
+ * of 2) overlapping by half, each with its mean removed. pPsd has
+ * segment / 2 + 1 values in units^2/Hz from 0 to sampleRate / 2. pWork has
+ * room for 2 * segment values. Returns the number of segments averaged, 0
+ * if n is shorter than segment */
+int mpxWelchPSD(const double *pData, size_t n, size_t segment,
+        double sampleRate, double *pPsd, double *pWork);
+
+#endif /* MPXSPECTRUM_H_ */